@@ -7,6 +7,18 @@
 #ifndef SAVVY_SAV_CONCAT_HPP
 #define SAVVY_SAV_CONCAT_HPP
 
+#include <string>
+#include <vector>
+
+/**
+ * Concatenates SAV files with identical headers and samples, merging their S1R indexes, zone maps and ID indexes.
+ * @param input_paths Paths of input files in output order
+ * @param output_path Output path
+ * @param threads Number of threads used to copy inputs when output is a regular file
+ * @return False on error
+ */
+bool concat_sav_files(const std::vector<std::string>& input_paths, const std::string& output_path, std::size_t threads);
+
 int concat_main(int argc, char **argv);
 
 #endif //SAVVY_SAV_CONCAT_HPP
\ No newline at end of file
@@ -7,6 +7,14 @@
 #ifndef SAVVY_SAV_EXPORT_HPP
 #define SAVVY_SAV_EXPORT_HPP
 
+#include "savvy/site_info.hpp"
+
 int export_main(int argc, char** argv);
 
+/**
+ * Recomputes AC, AN, AF, MAC and MAF INFO fields from GT values. Only fields already present in the record are updated.
+ * @param var Record to update
+ */
+void update_standard_info_fields(savvy::variant& var);
+
 #endif //SAVVY_SAV_EXPORT_HPP
\ No newline at end of file
@@ -8,6 +8,7 @@
 #define SAVVY_SAV_FILTER_HPP
 
 #include "savvy/site_info.hpp"
+#include "savvy/zone_map.hpp"
 #include "savvy/utility.hpp"
 #include "sav/utility.hpp"
 
@@ -16,46 +17,46 @@
 #include <tuple>
 #include <algorithm>
 #include <regex>
-
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <sstream>
+#include <vector>
+
+/**
+ * Filter expression over FILTER, QUAL, and INFO fields (eg, 'AC>=10 & (AF<0.1 | FILTER=="PASS")').
+ *
+ * The expression is compiled once into a flat program of comparisons joined by short-circuit jumps. Literal operands
+ * are parsed up front, regular expressions are compiled once (or lowered to substring searches when they contain no
+ * metacharacters), and INFO values are compared in their binary form rather than being formatted to text for every
+ * record. Results are identical to comparing the VCF text of each field.
+ */
 class filter
 {
 public:
-  filter(std::string filter_expression = "") :
-    expression_tree_(savvy::detail::make_unique<boolean_expression>(true))
+  filter(std::string filter_expression = "")
   {
     if (!filter_expression.empty())
     {
       auto beg = filter_expression.begin();
-      std::tie(expression_tree_, good_) = parse(beg, filter_expression.end());
+      good_ = parse(beg, filter_expression.end());
     }
   }
 
   bool operator()(const savvy::site_info& site) const
   {
-    return (*expression_tree_)(site);
+    return run([this, &site](const comparison& c) { return this->evaluate(c, site); });
   }
 
-//  filter& operator+=(const filter& other)
-//  {
-//    if (&other != this)
-//    {
-//      if (!other.good_)
-//        good_ = false;
-//      expression_list_.insert(expression_list_.end(), other.expression_list_.begin(), other.expression_list_.end());
-//    }
-//    return *this;
-//  }
-//
-//  filter& operator+=(filter&& other)
-//  {
-//    if (&other != this)
-//    {
-//      if (!other.good_)
-//        good_ = false;
-//      expression_list_.insert(expression_list_.end(), std::make_move_iterator(other.expression_list_.begin()), std::make_move_iterator(other.expression_list_.end()));
-//    }
-//    return *this;
-//  }
+  /**
+   * Checks whether any record in a SAV block could pass the filter based on the block's zone map.
+   * @param block Zone map of block
+   * @return False if no record in block can pass the filter
+   */
+  bool may_match(const savvy::zone_map::block& block) const
+  {
+    return run([&block](const comparison& c) { return comparison_may_match(c, block); });
+  }
 
   operator bool() const { return good_; }
 private:
@@ -72,148 +73,369 @@ private:
     regex_not_match
   };
 
-  class expression
+  enum class operand_kind
+  {
+    literal,
+    filter,
+    qual,
+    info
+  };
+
+  struct operand
+  {
+    operand_kind kind = operand_kind::literal;
+    std::string value; // Unquoted literal or field name
+    double number = 0.; // Numeric value of literal
+    bool is_integer = false; // Literal is the canonical text of an integer
+    std::int64_t integer = 0;
+  };
+
+  struct comparison
+  {
+    operand left;
+    cmpr op = cmpr::invalid;
+    operand right;
+    bool literal_pattern = false; // Regex without metacharacters, matched with std::string::find()
+    std::regex pattern;
+  };
+
+  enum class opcode
+  {
+    constant,
+    compare,
+    jump_if_false,
+    jump_if_true
+  };
+
+  struct instruction
   {
-  public:
-    virtual bool operator()(const savvy::site_info& site) const = 0;
-    virtual ~expression(){}
+    opcode code;
+    std::size_t arg; // Constant value, comparison index, or jump target
   };
 
-  class boolean_expression : public expression
+  template <typename Fn>
+  bool run(Fn eval) const
+  {
+    bool acc = true;
+    std::size_t pc = 0;
+    while (pc < program_.size())
+    {
+      const instruction& ins = program_[pc++];
+      switch (ins.code)
+      {
+      case opcode::constant: acc = ins.arg != 0; break;
+      case opcode::compare: acc = eval(comparisons_[ins.arg]); break;
+      case opcode::jump_if_false: if (!acc) pc = ins.arg; break;
+      case opcode::jump_if_true: if (acc) pc = ins.arg; break;
+      }
+    }
+    return acc;
+  }
+
+  //~~~~~~~~ Record evaluation ~~~~~~~~//
+  static double stream_rounded(double v)
   {
-  public:
-    boolean_expression(bool val) :
-      val_(val)
+    // Matches a value written with std::ostream's default precision and read back with atof().
+    char buf[32];
+    std::snprintf(buf, sizeof(buf), "%g", v);
+    return std::atof(buf);
+  }
+
+  struct leading_number_fn
+  {
+    double* dest;
+
+    template <typename T>
+    void operator()(const T* beg, const T* end) const
     {
+      // Text of the first element, unless the vector starts with a separator or is empty.
+      *dest = 0.;
+      if (beg != end && !savvy::typed_value::is_end_of_vector(*beg) && !savvy::typed_value::is_missing(*beg))
+        *dest = std::is_floating_point<T>::value ? stream_rounded(*beg) : static_cast<double>(*beg);
     }
 
-    bool operator()(const savvy::site_info& /*site*/) const
+    void operator()(const char* beg, const char* end) const
     {
-      return val_;
+      *dest = std::atof(std::string(beg, end).c_str());
     }
-  private:
-    bool val_;
   };
 
-  class comparison_expression : public expression
+  struct literal_equals_fn
   {
-  public:
-    std::string left;
-    cmpr comparison;
-    std::string right;
-
-    comparison_expression(std::string l, cmpr c, std::string r) :
-      left(std::move(l)),
-      comparison(c),
-      right(std::move(r))
+    const operand* lit;
+    bool* handled;
+    bool* dest;
+
+    template <typename T>
+    typename std::enable_if<std::is_integral<T>::value, void>::type
+    operator()(const T* beg, const T* end) const
     {
+      if (end - beg != 1) return;
+      *handled = true;
+      if (savvy::typed_value::is_end_of_vector(*beg))
+        *dest = lit->value.empty();
+      else if (savvy::typed_value::is_missing(*beg))
+        *dest = lit->value == ".";
+      else
+        *dest = lit->is_integer && lit->integer == *beg;
     }
 
-    static std::string get_value_from_operand(const std::string& operand, const savvy::site_info& site)
+    void operator()(const float* beg, const float* end) const
     {
-      if (operand.empty())
-        return {operand.cend(), operand.cend()};
+      if (end - beg != 1 || savvy::typed_value::is_end_of_vector(*beg) || savvy::typed_value::is_missing(*beg)) return;
+      char buf[32];
+      int len = std::snprintf(buf, sizeof(buf), "%g", *beg);
+      *handled = true;
+      *dest = len >= 0 && lit->value.size() == std::size_t(len) && std::equal(buf, buf + len, lit->value.begin());
+    }
 
-      if (!is_string_delim(operand.front()) && !isdigit(operand.front()) && operand.front() != '+' && operand.front() != '-')
-      {
-        if (operand == "FILTER")
-          return join_vector_to_string(site.filters(), ";");
+    void operator()(const char* beg, const char* end) const
+    {
+      *handled = true;
+      *dest = lit->value.size() == std::size_t(end - beg) && std::equal(beg, end, lit->value.begin());
+    }
+  };
 
-        if (operand == "QUAL")
-        {
-          std::stringstream ss;
-          ss << site.qual();
-          return ss.str();
-        }
+  static const savvy::typed_value* find_info(const operand& o, const savvy::site_info& site)
+  {
+    for (auto it = site.info_fields().begin(); it != site.info_fields().end(); ++it)
+    {
+      if (it->first == o.value)
+        return &it->second;
+    }
+    return nullptr;
+  }
 
-        auto res = std::find_if(site.info_fields().begin(), site.info_fields().end(), [&operand](const std::pair<std::string, savvy::typed_value>& v) { return v.first == operand; });
-        if (res != site.info_fields().end())
-        {
-          std::stringstream ss;
-          ss << res->second;
-          return ss.str();
-        }
-        return "";
+  static std::string text_value(const operand& o, const savvy::site_info& site)
+  {
+    std::stringstream ss;
+    switch (o.kind)
+    {
+    case operand_kind::literal:
+      return o.value;
+    case operand_kind::filter:
+      return join_vector_to_string(site.filters(), ";");
+    case operand_kind::qual:
+      ss << site.qual();
+      return ss.str();
+    case operand_kind::info:
+      if (const savvy::typed_value* v = find_info(o, site))
+        ss << *v;
+      return ss.str();
+    }
+    return "";
+  }
 
-        //const std::string& tmp = site.prop(operand);
-        //return {tmp.cbegin(), tmp.cend()};
+  static double numeric_value(const operand& o, const savvy::site_info& site)
+  {
+    double ret = 0.;
+    switch (o.kind)
+    {
+    case operand_kind::literal:
+      return o.number;
+    case operand_kind::qual:
+      return stream_rounded(site.qual());
+    case operand_kind::info:
+      if (const savvy::typed_value* v = find_info(o, site))
+      {
+        if (v->size() == 0 || !v->capply_dense(leading_number_fn{&ret}))
+          return 0.;
       }
+      return ret;
+    default:
+      return std::atof(text_value(o, site).c_str());
+    }
+  }
 
-      auto beg = operand.begin();
-      auto end = operand.begin() + operand.size();
-
-      if (is_string_delim(*beg))
-        ++beg;
-      if (beg != end && is_string_delim(*std::prev(end)))
-        --end;
+  static bool values_equal(const operand& l, const operand& r, const savvy::site_info& site)
+  {
+    const operand* field = &l;
+    const operand* lit = &r;
+    if (field->kind == operand_kind::literal)
+      std::swap(field, lit);
 
-      return {beg, end};
+    if (field->kind == operand_kind::info && lit->kind == operand_kind::literal)
+    {
+      const savvy::typed_value* v = find_info(*field, site);
+      if (!v)
+        return lit->value.empty();
+      if (v->size() == 0)
+        return lit->value == ".";
+
+      bool handled = false, res = false;
+      if (v->capply_dense(literal_equals_fn{lit, &handled, &res}) && handled)
+        return res;
     }
 
-    bool operator()(const savvy::site_info& site) const
+    return text_value(l, site) == text_value(r, site);
+  }
+
+  static bool evaluate(const comparison& c, const savvy::site_info& site)
+  {
+    switch (c.op)
     {
-//      auto left_range = get_value_from_operand(left, site);
-//      auto right_range = get_value_from_operand(right, site);
-//      std::size_t left_sz = std::distance(left_range.first, left_range.second);
-//      std::size_t right_sz = std::distance(right_range.first, right_range.second);
-//
-//      if (comparison == cmpr::equals) return  left_sz == right_sz && std::equal(left_range.first, left_range.second, right_range.first);
-//      if (comparison == cmpr::not_equals) return left_sz != right_sz || !std::equal(left_range.first, left_range.second, right_range.first);
-//
-//      double numeric_left = std::atof(std::string(left_range.first, left_range.second).c_str());
-//      double numeric_right = std::atof(std::string(right_range.first, right_range.second).c_str());
-
-      auto left_str = get_value_from_operand(left, site);
-      auto right_str = get_value_from_operand(right, site);
-
-      if (comparison == cmpr::equals) return  left_str == right_str;
-      if (comparison == cmpr::not_equals) return left_str != right_str;
-
-      if (comparison == cmpr::regex_match || comparison == cmpr::regex_not_match)
+    case cmpr::equals: return values_equal(c.left, c.right, site);
+    case cmpr::not_equals: return !values_equal(c.left, c.right, site);
+    case cmpr::regex_match:
+    case cmpr::regex_not_match:
+    {
+      std::string subject = text_value(c.left, site);
+      bool match = false;
+      if (c.literal_pattern)
+        match = subject.find(c.right.value) != std::string::npos;
+      else if (c.right.kind == operand_kind::literal)
+        match = std::regex_search(subject, c.pattern);
+      else
       {
-        bool match = std::regex_search(left_str, std::regex(right_str));
-        return comparison == cmpr::regex_match ? match : !match;
+        try { match = std::regex_search(subject, std::regex(text_value(c.right, site))); }
+        catch (const std::regex_error&) { match = false; }
       }
+      return c.op == cmpr::regex_match ? match : !match;
+    }
+    default:
+      break;
+    }
 
-      double numeric_left = std::atof(left_str.c_str());
-      double numeric_right = std::atof(right_str.c_str());
+    double numeric_left = numeric_value(c.left, site);
+    double numeric_right = numeric_value(c.right, site);
 
-      if (comparison == cmpr::less_than ) return numeric_left < numeric_right;
-      if (comparison == cmpr::greater_than ) return numeric_left > numeric_right;
-      if (comparison == cmpr::less_than_equals ) return numeric_left <= numeric_right;
-      if (comparison == cmpr::greater_than_equals ) return numeric_left >= numeric_right;
+    if (c.op == cmpr::less_than) return numeric_left < numeric_right;
+    if (c.op == cmpr::greater_than) return numeric_left > numeric_right;
+    if (c.op == cmpr::less_than_equals) return numeric_left <= numeric_right;
+    if (c.op == cmpr::greater_than_equals) return numeric_left >= numeric_right;
 
-      return false;
+    return false;
+  }
+
+  //~~~~~~~~ Block evaluation ~~~~~~~~//
+  static bool comparison_may_match(const comparison& c, const savvy::zone_map::block& block)
+  {
+    bool field_on_left = c.left.kind != operand_kind::literal;
+    if (field_on_left == (c.right.kind != operand_kind::literal))
+      return true;
+
+    const operand& field = field_on_left ? c.left : c.right;
+    if (field.kind != operand_kind::info)
+      return true;
+
+    const savvy::zone_map::range* r = block.get(field.value);
+    if (!r || !r->bounded)
+      return true;
+
+    // Absent or missing values are compared as zero.
+    double min_val = r->has_missing ? std::min(r->min, 0.) : r->min;
+    double max_val = r->has_missing ? std::max(r->max, 0.) : r->max;
+    // Values are compared after being formatted with 6 significant digits.
+    min_val -= std::abs(min_val) * 1e-5;
+    max_val += std::abs(max_val) * 1e-5;
+
+    cmpr op = c.op;
+    if (!field_on_left)
+    {
+      if (op == cmpr::less_than) op = cmpr::greater_than;
+      else if (op == cmpr::greater_than) op = cmpr::less_than;
+      else if (op == cmpr::less_than_equals) op = cmpr::greater_than_equals;
+      else if (op == cmpr::greater_than_equals) op = cmpr::less_than_equals;
     }
-  };
 
-  enum class logical
+    double literal = field_on_left ? c.right.number : c.left.number;
+    if (op == cmpr::less_than) return min_val < literal;
+    if (op == cmpr::greater_than) return max_val > literal;
+    if (op == cmpr::less_than_equals) return min_val <= literal;
+    if (op == cmpr::greater_than_equals) return max_val >= literal;
+
+    return true;
+  }
+
+  //~~~~~~~~ Compilation ~~~~~~~~//
+  static bool is_field_operand(const std::string& operand)
   {
-    op_and,
-    op_or
-  };
+    return !operand.empty() && !is_string_delim(operand.front()) && !isdigit(operand.front()) && operand.front() != '+' && operand.front() != '-';
+  }
 
-  class logical_expression : public expression
+  static operand compile_operand(const std::string& text)
   {
-  public:
-    std::unique_ptr<expression> left;
-    logical op;
-    std::unique_ptr<expression> right;
-    logical_expression(std::unique_ptr<expression>&& l, logical o, std::unique_ptr<expression>&& r) :
-      left(std::move(l)),
-      op(o),
-      right(std::move(r))
+    operand ret;
+    if (is_field_operand(text))
     {
+      ret.kind = text == "FILTER" ? operand_kind::filter : (text == "QUAL" ? operand_kind::qual : operand_kind::info);
+      ret.value = text;
+      return ret;
     }
 
-    bool operator()(const savvy::site_info& site) const
+    auto beg = text.begin();
+    auto end = text.end();
+    if (beg != end && is_string_delim(*beg))
+      ++beg;
+    if (beg != end && is_string_delim(*std::prev(end)))
+      --end;
+
+    ret.value.assign(beg, end);
+    ret.number = std::atof(ret.value.c_str());
+    if (!ret.value.empty())
     {
-      if (op == logical::op_or)
-        return (*left)(site) || (*right)(site);
-      else
-        return (*left)(site) && (*right)(site);
+      char* parse_end = nullptr;
+      ret.integer = std::strtoll(ret.value.c_str(), &parse_end, 10);
+      ret.is_integer = *parse_end == '\0' && std::to_string(ret.integer) == ret.value;
+    }
+    return ret;
+  }
+
+  static bool compile_comparison(comparison& c)
+  {
+    if (c.op != cmpr::regex_match && c.op != cmpr::regex_not_match)
+      return true;
+
+    if (c.right.kind != operand_kind::literal)
+      return true;
+
+    static const std::string metacharacters = "\\^$.|?*+()[]{}";
+    if (c.right.value.find_first_of(metacharacters) == std::string::npos)
+    {
+      c.literal_pattern = true;
+      return true;
     }
-  };
+
+    try
+    {
+      c.pattern = std::regex(c.right.value, std::regex::ECMAScript | std::regex::optimize);
+    }
+    catch (const std::regex_error&)
+    {
+      return false;
+    }
+    return true;
+  }
+
+  bool emit_comparison(const std::string& left, cmpr op, const std::string& right)
+  {
+    comparison c;
+    c.left = compile_operand(left);
+    c.op = op;
+    c.right = compile_operand(right);
+    if (!compile_comparison(c))
+      return false;
+
+    comparisons_.emplace_back(std::move(c));
+    program_.push_back({opcode::compare, comparisons_.size() - 1});
+    return true;
+  }
+
+  bool emit_logical(char op, std::string::iterator& cur, const std::string::iterator& end)
+  {
+    // Right operand is evaluated only when the left operand does not already decide the result.
+    std::size_t jump_idx = program_.size();
+    if (op == '&') // || op == ';')
+      program_.push_back({opcode::jump_if_false, 0});
+    else if (op == '|') // || op == ',')
+      program_.push_back({opcode::jump_if_true, 0});
+    else
+      return false;
+
+    bool res = parse(cur, end);
+    program_[jump_idx].arg = program_.size();
+    return res;
+  }
 
   static cmpr parse_comparison(const std::string& cmpr_str)
   {
@@ -290,10 +512,8 @@ private:
     return true;
   }
 
-  static std::tuple<std::unique_ptr<expression>, bool> parse(std::string::iterator& cur, const std::string::iterator& end)
+  bool parse(std::string::iterator& cur, const std::string::iterator& end)
   {
-    using namespace ::savvy::detail;
-
     static const std::string selector_delims = "=<>!";
     static const std::string comparison_characters = "=<>!~";
     static const std::string argument_delims = ")&|"; //");,&|";
@@ -302,33 +522,23 @@ private:
       ++cur;
 
     if (cur == end)
-      return std::make_tuple(make_unique<boolean_expression>(false), false);
+      return false;
 
     std::string::iterator delim;
     if (*cur == '(')
     {
       ++cur;
-      auto sub_expr = parse(cur, end);
-      if (!std::get<1>(sub_expr))
-        return sub_expr;
+      if (!parse(cur, end))
+        return false;
 
       while (cur != end && std::isspace(*cur))
         ++cur;
 
       if (cur == end)
-        return sub_expr;
-
-      logical log_op;
-      if (*cur == '&') // || *cur == ';')
-        log_op = logical::op_and;
-      else if (*cur == '|') // || *cur == ',')
-        log_op = logical::op_or;
-      else
-        return std::make_tuple(make_unique<boolean_expression>(false), false);
+        return true;
 
-      ++cur;
-      auto tmp = parse(cur, end);
-      return std::make_tuple(::savvy::detail::make_unique<logical_expression>(std::move(std::get<0>(sub_expr)), log_op, std::move(std::get<0>(tmp))), std::get<1>(tmp));
+      char log_op = *(cur++);
+      return emit_logical(log_op, cur, end);
     }
     else
     {
@@ -342,7 +552,7 @@ private:
 
 
       if (delim == end || !is_valid_operand(left_operand))
-        return std::make_tuple(make_unique<boolean_expression>(false), false);
+        return false;
 
       cur = delim;
 
@@ -350,14 +560,14 @@ private:
 
       cmpr comparison = parse_comparison(std::string(cur, delim));
       if (comparison == cmpr::invalid || delim == end)
-        return std::make_tuple(make_unique<boolean_expression>(false), false);
+        return false;
 
       cur = delim;
       while (cur != end && std::isspace(*cur))
         ++cur;
 
       if (cur == end)
-        return std::make_tuple(make_unique<boolean_expression>(false), false);
+        return false;
 
       if (*cur == '\'' || *cur == '"')
         delim = parse_string(cur, end);
@@ -367,40 +577,29 @@ private:
       std::string right_operand(cur, delim);
       right_operand.erase(right_operand.find_last_not_of(' ') + 1);
 
-      if (!is_valid_operand(right_operand))
-        return std::make_tuple(make_unique<boolean_expression>(false), false);
-
-      auto cmpr_expr = ::savvy::detail::make_unique<comparison_expression>(left_operand, comparison, right_operand);
+      if (!is_valid_operand(right_operand) || !emit_comparison(left_operand, comparison, right_operand))
+        return false;
 
       if (delim == end)
       {
         cur = delim;
-        return std::make_tuple(std::move(cmpr_expr), true);
+        return true;
       }
 
       if (*delim == ')')
       {
         cur = delim + 1;
-        return std::make_tuple(std::move(cmpr_expr), true);
+        return true;
       }
 
-      logical log_op;
-      if (*delim == '&') // || *delim == ';')
-        log_op = logical::op_and;
-      else if (*delim == '|') // || *delim == ',')
-        log_op = logical::op_or;
-      else
-        return std::make_tuple(make_unique<boolean_expression>(false), false);
-
       cur = delim + 1;
-      auto tmp = parse(cur, end);
-      return std::make_tuple(::savvy::detail::make_unique<logical_expression>(std::move(cmpr_expr), log_op, std::move(std::get<0>(tmp))), std::get<1>(tmp));
+      return emit_logical(*delim, cur, end);
     }
   }
 private:
-  //std::list<comparison_expression> expression_list_;
-  std::unique_ptr<expression> expression_tree_;
+  std::vector<comparison> comparisons_;
+  std::vector<instruction> program_; // Empty program accepts every record
   bool good_ = true;
 };
 
-#endif //SAVVY_SAV_FILTER_HPP
\ No newline at end of file
+#endif //SAVVY_SAV_FILTER_HPP
@@ -0,0 +1,12 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef SAVVY_SAV_SIMULATE_HPP
+#define SAVVY_SAV_SIMULATE_HPP
+
+int simulate_main(int argc, char** argv);
+
+#endif //SAVVY_SAV_SIMULATE_HPP
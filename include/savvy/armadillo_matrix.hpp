@@ -0,0 +1,92 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef LIBSAVVY_ARMADILLO_MATRIX_HPP
+#define LIBSAVVY_ARMADILLO_MATRIX_HPP
+
+#include "reader.hpp"
+
+#include <armadillo>
+#include <algorithm>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+namespace savvy
+{
+  namespace armadillo
+  {
+    /**
+     * CSC destination for reader::read_csc_matrix() that fills Armadillo row index, column pointer and value vectors.
+     * Armadillo has no public interface for writing into the storage of an existing sp_mat, so the matrix is built
+     * from these vectors with the batch CSC constructor in end().
+     */
+    template <typename T>
+    class csc_destination
+    {
+    public:
+      typedef arma::uword index_type;
+      typedef T value_type;
+
+      csc_destination(arma::SpMat<T>& mat) : mat_(mat) {}
+
+      void begin()
+      {
+        col_ptrs_.assign(1, 0);
+      }
+
+      void reserve(std::size_t nnz)
+      {
+        if (nnz > row_indices_.n_elem)
+        {
+          nnz = std::max<std::size_t>(nnz, row_indices_.n_elem * 2);
+          row_indices_.resize(nnz);
+          values_.resize(nnz);
+        }
+      }
+
+      index_type* row_indices() { return row_indices_.memptr(); }
+      value_type* values() { return values_.memptr(); }
+
+      void end_column(std::size_t col, std::size_t nnz)
+      {
+        col_ptrs_.resize(col + 2, index_type(nnz));
+      }
+
+      void end(std::size_t rows, std::size_t cols, std::size_t nnz)
+      {
+        if (nnz == 0)
+          mat_.zeros(rows, cols);
+        else
+          mat_ = arma::SpMat<T>(row_indices_.head(nnz), arma::uvec(col_ptrs_), values_.head(nnz), rows, cols, false);
+      }
+    private:
+      arma::SpMat<T>& mat_;
+      arma::uvec row_indices_;
+      std::vector<index_type> col_ptrs_;
+      arma::Col<T> values_;
+    };
+
+    /**
+     * Reads up to max_records records into a sparse matrix with one column per record (see reader::read_csc_matrix()).
+     *
+     * @param rdr Reader
+     * @param fmt_key FORMAT field key
+     * @param max_records Maximum number of records (columns) to read
+     * @param dest Destination matrix, which is resized to the number of rows and records read
+     * @param mean_impute Whether to replace missing values with the mean of the record's non-missing values
+     * @return Number of records read
+     */
+    template <typename T>
+    std::size_t read_sparse_matrix(reader& rdr, const std::string& fmt_key, std::size_t max_records, arma::SpMat<T>& dest, bool mean_impute = false)
+    {
+      csc_destination<T> csc(dest);
+      return rdr.read_csc_matrix(fmt_key, max_records, csc, mean_impute);
+    }
+  }
+}
+
+#endif // LIBSAVVY_ARMADILLO_MATRIX_HPP
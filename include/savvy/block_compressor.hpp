@@ -0,0 +1,184 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef LIBSAVVY_BLOCK_COMPRESSOR_HPP
+#define LIBSAVVY_BLOCK_COMPRESSOR_HPP
+
+#include <zstd.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace savvy
+{
+  /**
+   * Compresses blocks of serialized records into independent zstd frames on worker threads. Frames are retrieved in
+   * the order that blocks were submitted.
+   */
+  class block_compressor
+  {
+  private:
+    struct job
+    {
+      std::vector<char> data;
+      std::vector<char> frame;
+      bool done = false;
+    };
+  public:
+    /**
+     * Starts worker threads.
+     * @param n_threads Number of worker threads
+     * @param compression_level zstd compression level
+     */
+    block_compressor(std::size_t n_threads, int compression_level);
+
+    /**
+     * Waits for pending blocks to be compressed and stops worker threads.
+     */
+    ~block_compressor();
+
+    /**
+     * Queues block for compression.
+     * @param data Serialized block, which is swapped with an empty buffer whose capacity is reused from a retrieved
+     * block
+     */
+    void submit(std::vector<char>& data);
+
+    /**
+     * Gets frame of oldest pending block.
+     * @param frame Destination of compressed frame (left empty if compression failed)
+     * @param wait Whether to wait for the block to be compressed
+     * @return False if no block is pending or if wait is false and the oldest block is not compressed yet
+     */
+    bool next_frame(std::vector<char>& frame, bool wait);
+
+    /**
+     * @return Number of submitted blocks whose frames have not been retrieved
+     */
+    std::size_t pending() const;
+
+    /**
+     * @return Total time spent compressing blocks by all worker threads (only measured when compiled with SAVVY_PROFILE)
+     */
+    std::uint64_t compression_nanoseconds() const;
+  private:
+    void run();
+  private:
+    mutable std::mutex mtx_;
+    std::condition_variable task_cv_;
+    std::condition_variable done_cv_;
+    std::deque<job> jobs_; // Pending blocks in submission order (elements are not moved by push_back() or pop_front())
+    std::size_t next_job_ = 0; // Index in jobs_ of first block not yet claimed by a worker
+    std::vector<char> spare_;
+    std::vector<std::thread> threads_;
+    int compression_level_;
+    std::uint64_t compression_ns_ = 0;
+    bool stop_ = false;
+  };
+
+  inline
+  block_compressor::block_compressor(std::size_t n_threads, int compression_level) :
+    compression_level_(compression_level)
+  {
+    threads_.reserve(n_threads);
+    for (std::size_t i = 0; i < n_threads; ++i)
+      threads_.emplace_back(&block_compressor::run, this);
+  }
+
+  inline
+  block_compressor::~block_compressor()
+  {
+    {
+      std::unique_lock<std::mutex> lk(mtx_);
+      stop_ = true;
+    }
+    task_cv_.notify_all();
+    for (auto it = threads_.begin(); it != threads_.end(); ++it)
+      it->join();
+  }
+
+  inline
+  void block_compressor::submit(std::vector<char>& data)
+  {
+    {
+      std::unique_lock<std::mutex> lk(mtx_);
+      jobs_.emplace_back();
+      jobs_.back().data.swap(data);
+      data.swap(spare_);
+      data.clear();
+    }
+    task_cv_.notify_one();
+  }
+
+  inline
+  bool block_compressor::next_frame(std::vector<char>& frame, bool wait)
+  {
+    std::unique_lock<std::mutex> lk(mtx_);
+    if (jobs_.empty())
+      return false;
+
+    if (!jobs_.front().done)
+    {
+      if (!wait)
+        return false;
+      done_cv_.wait(lk, [this]() { return jobs_.front().done; });
+    }
+
+    frame.swap(jobs_.front().frame);
+    spare_.swap(jobs_.front().data);
+    jobs_.pop_front();
+    --next_job_;
+    return true;
+  }
+
+  inline
+  std::size_t block_compressor::pending() const
+  {
+    std::unique_lock<std::mutex> lk(mtx_);
+    return jobs_.size();
+  }
+
+  inline
+  std::uint64_t block_compressor::compression_nanoseconds() const
+  {
+    std::unique_lock<std::mutex> lk(mtx_);
+    return compression_ns_;
+  }
+
+  inline
+  void block_compressor::run()
+  {
+    std::unique_lock<std::mutex> lk(mtx_);
+    while (true)
+    {
+      task_cv_.wait(lk, [this]() { return stop_ || next_job_ < jobs_.size(); });
+      if (next_job_ == jobs_.size())
+        break;
+
+      job& j = jobs_[next_job_++];
+      lk.unlock();
+#ifdef SAVVY_PROFILE
+      auto start = std::chrono::steady_clock::now();
+#endif
+      j.frame.resize(ZSTD_compressBound(j.data.size()));
+      std::size_t sz = ZSTD_compress(j.frame.data(), j.frame.size(), j.data.data(), j.data.size(), compression_level_);
+      j.frame.resize(ZSTD_isError(sz) ? 0 : sz);
+      lk.lock();
+#ifdef SAVVY_PROFILE
+      compression_ns_ += std::uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+#endif
+      j.done = true;
+      done_cv_.notify_all();
+    }
+  }
+}
+
+#endif // LIBSAVVY_BLOCK_COMPRESSOR_HPP
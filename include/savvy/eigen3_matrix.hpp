@@ -0,0 +1,87 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef LIBSAVVY_EIGEN3_MATRIX_HPP
+#define LIBSAVVY_EIGEN3_MATRIX_HPP
+
+#include "reader.hpp"
+
+#include <Eigen/Sparse>
+#include <algorithm>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+namespace savvy
+{
+  namespace eigen3
+  {
+    /**
+     * CSC destination for reader::read_csc_matrix() that writes row indices and values into the compressed storage of
+     * an Eigen sparse matrix. Column pointers are copied into the matrix once all records are read.
+     */
+    template <typename T, typename IdxT>
+    class csc_destination
+    {
+    public:
+      typedef IdxT index_type;
+      typedef T value_type;
+
+      csc_destination(::Eigen::SparseMatrix<T, ::Eigen::ColMajor, IdxT>& mat) : mat_(mat) {}
+
+      void begin()
+      {
+        mat_.resize(0, 0);
+        col_ptrs_.assign(1, 0);
+      }
+
+      void reserve(std::size_t nnz)
+      {
+        // Storage size is kept at the reserved size so that reallocation copies all entries written so far.
+        if (nnz > std::size_t(mat_.data().size()))
+          mat_.data().resize(nnz, 1.);
+      }
+
+      index_type* row_indices() { return mat_.innerIndexPtr(); }
+      value_type* values() { return mat_.valuePtr(); }
+
+      void end_column(std::size_t col, std::size_t nnz)
+      {
+        col_ptrs_.resize(col + 2, index_type(nnz));
+      }
+
+      void end(std::size_t rows, std::size_t cols, std::size_t nnz)
+      {
+        // Written entries are kept by conservativeResize() since the matrix was empty in begin().
+        mat_.data().resize(nnz);
+        mat_.conservativeResize(rows, cols);
+        std::copy(col_ptrs_.begin(), col_ptrs_.begin() + cols + 1, mat_.outerIndexPtr());
+      }
+    private:
+      ::Eigen::SparseMatrix<T, ::Eigen::ColMajor, IdxT>& mat_;
+      std::vector<index_type> col_ptrs_;
+    };
+
+    /**
+     * Reads up to max_records records into a sparse matrix with one column per record (see reader::read_csc_matrix()).
+     *
+     * @param rdr Reader
+     * @param fmt_key FORMAT field key
+     * @param max_records Maximum number of records (columns) to read
+     * @param dest Destination matrix, which is resized to the number of rows and records read
+     * @param mean_impute Whether to replace missing values with the mean of the record's non-missing values
+     * @return Number of records read
+     */
+    template <typename T, typename IdxT>
+    std::size_t read_sparse_matrix(reader& rdr, const std::string& fmt_key, std::size_t max_records, ::Eigen::SparseMatrix<T, ::Eigen::ColMajor, IdxT>& dest, bool mean_impute = false)
+    {
+      csc_destination<T, IdxT> csc(dest);
+      return rdr.read_csc_matrix(fmt_key, max_records, csc, mean_impute);
+    }
+  }
+}
+
+#endif // LIBSAVVY_EIGEN3_MATRIX_HPP
@@ -0,0 +1,344 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef LIBSAVVY_HAPLOTYPE_MATCHER_HPP
+#define LIBSAVVY_HAPLOTYPE_MATCHER_HPP
+
+#include "utility.hpp"
+
+#include <cstdint>
+#include <vector>
+#include <string>
+#include <unordered_map>
+#include <algorithm>
+#include <numeric>
+
+namespace savvy
+{
+  /**
+   * Finds haplotype matches between query haplotypes and a reference panel using the positional Burrows-Wheeler
+   * transform (Durbin 2014). Markers are added one at a time in panel order. Queries are carried through the panel's
+   * prefix and divergence arrays, so the work for each query at a marker is proportional to the size of its current
+   * best-match block rather than the panel size.
+   */
+  class haplotype_matcher
+  {
+  public:
+    enum class mode
+    {
+      set_maximal = 1, ///< Reports every set-maximal match.
+      longest          ///< Reports only the longest set-maximal match(es) for each query.
+    };
+
+    struct match
+    {
+      std::size_t query;     ///< Index of query haplotype
+      std::size_t haplotype; ///< Index of panel haplotype
+      std::size_t begin;     ///< Index of first matching marker
+      std::size_t end;       ///< One past the index of last matching marker
+    };
+  private:
+    std::vector<std::uint32_t> prefix_;
+    std::vector<std::uint32_t> divergence_;
+    std::vector<std::uint32_t> prefix_tmp_;
+    std::vector<std::uint32_t> divergence_tmp_;
+    std::vector<std::uint32_t> query_pos_;
+    std::vector<std::int32_t> alleles_;
+    std::vector<std::int32_t> allele_values_;
+    std::vector<std::uint32_t> allele_counts_;
+    std::vector<std::uint32_t> allele_p_;
+    std::vector<match> matches_;
+    std::vector<std::size_t> longest_;
+    std::size_t n_panel_;
+    std::size_t n_queries_;
+    std::size_t min_length_;
+    std::size_t marker_count_ = 0;
+    mode mode_;
+    bool finalized_ = false;
+  public:
+    /**
+     * Constructs matcher.
+     * @param n_panel_haplotypes Number of haplotypes in reference panel
+     * @param n_query_haplotypes Number of query haplotypes
+     * @param m Reporting mode
+     * @param min_length Minimum match length (in markers) to report
+     */
+    haplotype_matcher(std::size_t n_panel_haplotypes, std::size_t n_query_haplotypes, mode m = mode::set_maximal, std::size_t min_length = 1);
+
+    /**
+     * Adds next marker. Missing values are treated as a distinct allele.
+     * @param panel_alleles Alleles of panel haplotypes (size must equal n_panel_haplotypes)
+     * @param query_alleles Alleles of query haplotypes (size must equal n_query_haplotypes)
+     * @return False if vector sizes are invalid or finalize() has already been called
+     */
+    template <typename PanelVecT, typename QueryVecT>
+    bool add_marker(const PanelVecT& panel_alleles, const QueryVecT& query_alleles);
+
+    /**
+     * Reports matches that extend to the last marker. No markers can be added afterward.
+     */
+    void finalize();
+
+    /**
+     * Gets matches found so far. Set-maximal matches are available as soon as they terminate, while longest matches
+     * are only complete after finalize().
+     * @return Vector of matches
+     */
+    const std::vector<match>& matches() const { return matches_; }
+
+    /**
+     * Clears matches found so far (e.g., after they have been written out). Has no effect on matching state.
+     */
+    void clear_matches() { matches_.clear(); }
+
+    /**
+     * Gets number of markers added.
+     * @return Marker count
+     */
+    std::size_t marker_count() const { return marker_count_; }
+  private:
+    std::size_t allele_index(std::int32_t v);
+    void report_matches(std::size_t k, bool at_end);
+    void report(std::size_t query, std::size_t hap, std::size_t begin, std::size_t end);
+  };
+
+  inline
+  haplotype_matcher::haplotype_matcher(std::size_t n_panel_haplotypes, std::size_t n_query_haplotypes, mode m, std::size_t min_length) :
+    prefix_(n_panel_haplotypes + n_query_haplotypes),
+    divergence_(n_panel_haplotypes + n_query_haplotypes, 0),
+    query_pos_(n_query_haplotypes),
+    alleles_(n_panel_haplotypes + n_query_haplotypes),
+    longest_(n_query_haplotypes, 0),
+    n_panel_(n_panel_haplotypes),
+    n_queries_(n_query_haplotypes),
+    min_length_(std::max<std::size_t>(1, min_length)),
+    mode_(m)
+  {
+    std::iota(prefix_.begin(), prefix_.end(), 0);
+    for (std::size_t q = 0; q < n_queries_; ++q)
+      query_pos_[q] = std::uint32_t(n_panel_ + q);
+  }
+
+  inline
+  std::size_t haplotype_matcher::allele_index(std::int32_t v)
+  {
+    for (std::size_t i = 0; i < allele_values_.size(); ++i)
+    {
+      if (allele_values_[i] == v)
+        return i;
+    }
+    allele_values_.emplace_back(v);
+    return allele_values_.size() - 1;
+  }
+
+  inline
+  void haplotype_matcher::report(std::size_t query, std::size_t hap, std::size_t begin, std::size_t end)
+  {
+    if (mode_ == mode::longest)
+    {
+      if (end - begin < longest_[query])
+        return;
+
+      if (end - begin > longest_[query])
+      {
+        longest_[query] = end - begin;
+        matches_.erase(std::remove_if(matches_.begin(), matches_.end(), [query](const match& m) { return m.query == query; }), matches_.end());
+      }
+    }
+
+    matches_.push_back({query, hap, begin, end});
+  }
+
+  inline
+  void haplotype_matcher::report_matches(std::size_t k, bool at_end)
+  {
+    // Divergence at position i is the first marker of the match between prefix_[i - 1] and prefix_[i].
+    const std::size_t n = prefix_.size();
+    for (std::size_t q = 0; q < n_queries_; ++q)
+    {
+      const std::size_t p = query_pos_[q];
+
+      // Start of longest match with a panel haplotype above and below query (walking past other queries).
+      std::size_t up_start = k, down_start = k;
+      std::size_t run = 0;
+      for (std::size_t i = p; i > 0; --i)
+      {
+        run = std::max<std::size_t>(run, divergence_[i]);
+        if (run >= k) break;
+        if (prefix_[i - 1] < n_panel_) { up_start = run; break; }
+      }
+      run = 0;
+      for (std::size_t i = p + 1; i < n; ++i)
+      {
+        run = std::max<std::size_t>(run, divergence_[i]);
+        if (run >= k) break;
+        if (prefix_[i] < n_panel_) { down_start = run; break; }
+      }
+
+      const std::size_t start = std::min(up_start, down_start);
+      if (k - start < min_length_ || (mode_ == mode::longest && k - start < longest_[q]))
+        continue;
+
+      // Block of haplotypes sharing the longest match.
+      std::size_t beg_pos = p, end_pos = p + 1;
+      while (beg_pos > 0 && divergence_[beg_pos] <= start) --beg_pos;
+      while (end_pos < n && divergence_[end_pos] <= start) ++end_pos;
+
+      if (!at_end)
+      {
+        const std::int32_t query_allele = alleles_[n_panel_ + q];
+        bool extends = false;
+        for (std::size_t i = beg_pos; i < end_pos && !extends; ++i)
+          extends = prefix_[i] < n_panel_ && alleles_[prefix_[i]] == query_allele;
+        if (extends)
+          continue;
+      }
+
+      for (std::size_t i = beg_pos; i < end_pos; ++i)
+      {
+        if (prefix_[i] < n_panel_)
+          report(q, prefix_[i], start, k);
+      }
+    }
+  }
+
+  template <typename PanelVecT, typename QueryVecT>
+  bool haplotype_matcher::add_marker(const PanelVecT& panel_alleles, const QueryVecT& query_alleles)
+  {
+    if (finalized_ || panel_alleles.size() != n_panel_ || query_alleles.size() != n_queries_)
+      return false;
+
+    std::copy(panel_alleles.begin(), panel_alleles.end(), alleles_.begin());
+    std::copy(query_alleles.begin(), query_alleles.end(), alleles_.begin() + n_panel_);
+
+    const std::size_t k = marker_count_;
+    if (k > 0)
+      report_matches(k, false);
+
+    // Stable counting sort of prefix array by allele, updating divergence (Durbin 2014, algorithm 2).
+    const std::size_t n = prefix_.size();
+    allele_values_.clear();
+    allele_counts_.clear();
+    for (std::size_t i = 0; i < n; ++i)
+    {
+      std::size_t a = allele_index(alleles_[i]);
+      if (a >= allele_counts_.size())
+        allele_counts_.resize(a + 1, 0);
+      ++allele_counts_[a];
+    }
+
+    std::vector<std::uint32_t> offsets(allele_counts_.size() + 1, 0);
+    for (std::size_t a = 0; a < allele_counts_.size(); ++a)
+      offsets[a + 1] = offsets[a] + allele_counts_[a];
+
+    prefix_tmp_.resize(n);
+    divergence_tmp_.resize(n);
+    allele_p_.assign(allele_counts_.size(), std::uint32_t(k + 1));
+    for (std::size_t i = 0; i < n; ++i)
+    {
+      const std::uint32_t h = prefix_[i];
+      for (std::size_t a = 0; a < allele_p_.size(); ++a)
+        allele_p_[a] = std::max(allele_p_[a], i ? divergence_[i] : std::uint32_t(k + 1));
+
+      const std::size_t a = allele_index(alleles_[h]);
+      const std::uint32_t dest = offsets[a]++;
+      prefix_tmp_[dest] = h;
+      divergence_tmp_[dest] = allele_p_[a];
+      allele_p_[a] = 0;
+      if (h >= n_panel_)
+        query_pos_[h - n_panel_] = dest;
+    }
+
+    std::swap(prefix_, prefix_tmp_);
+    std::swap(divergence_, divergence_tmp_);
+    ++marker_count_;
+    return true;
+  }
+
+  inline
+  void haplotype_matcher::finalize()
+  {
+    if (!finalized_ && marker_count_ > 0)
+      report_matches(marker_count_, true);
+    finalized_ = true;
+  }
+
+  /**
+   * Walks a panel reader forward to the records of a query file. Contigs are ordered as they appear in the contig
+   * headers and then in the order they are first encountered, so a query marker that is absent from the panel never
+   * causes the panel to be read past its next contig.
+   */
+  template <typename ReaderT, typename RecordT>
+  class marker_cursor
+  {
+  private:
+    ReaderT& panel_;
+    RecordT record_;
+    std::unordered_map<std::string, std::size_t> contig_order_;
+    bool good_ = false;
+  public:
+    /**
+     * Constructs cursor and reads first panel record.
+     * @param panel Panel reader
+     * @param headers Headers whose contig lines determine contig order (e.g., panel headers followed by query headers)
+     */
+    template <typename HeaderVecT>
+    marker_cursor(ReaderT& panel, const HeaderVecT& headers) :
+      panel_(panel)
+    {
+      for (auto it = headers.begin(); it != headers.end(); ++it)
+      {
+        if (it->first == "contig")
+          contig_rank(parse_header_sub_field(it->second, "ID"));
+      }
+      next();
+    }
+
+    /**
+     * Seeks to the panel record matching a query marker (same position and alleles). Panel records that precede the
+     * marker are skipped. The panel is left in place if it has already moved past the marker.
+     * @param site Query marker
+     * @return True if the current panel record matches the marker
+     */
+    template <typename SiteT>
+    bool seek(const SiteT& site)
+    {
+      std::size_t target = contig_rank(site.chrom());
+      while (good_)
+      {
+        std::size_t rank = contig_rank(record_.chrom());
+        if (rank > target || (rank == target && record_.pos() > site.pos()))
+          return false;
+        if (rank == target && record_.pos() == site.pos() && record_.ref() == site.ref() && record_.alts() == site.alts())
+          return true;
+        next();
+      }
+      return false;
+    }
+
+    /**
+     * Reads next panel record.
+     */
+    void next() { good_ = bool(panel_ >> record_); }
+
+    /**
+     * @return False once the panel has been exhausted or has failed
+     */
+    bool good() const { return good_; }
+
+    /**
+     * @return Current panel record
+     */
+    RecordT& record() { return record_; }
+  private:
+    std::size_t contig_rank(const std::string& chrom)
+    {
+      return contig_order_.emplace(chrom, contig_order_.size()).first->second;
+    }
+  };
+}
+
+#endif // LIBSAVVY_HAPLOTYPE_MATCHER_HPP
@@ -0,0 +1,464 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef LIBSAVVY_ID_INDEX_HPP
+#define LIBSAVVY_ID_INDEX_HPP
+
+#include "site_info.hpp"
+#include "utility.hpp"
+#include "portable_endian.hpp"
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <istream>
+#include <limits>
+#include <ostream>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+namespace savvy
+{
+  /**
+   * Maps variant IDs (e.g., rsIDs) to the SAV blocks containing them. SAV writers append the ID index as a skippable
+   * zstd frame preceding the S1R index. The frame stores a table of (ID hash, block) pairs sorted by hash and fronted
+   * by a Bloom filter, so that lookups only read a few pages of the file and absent IDs are usually rejected without
+   * searching the table. Records in the returned blocks still need to be checked since hashes can collide.
+   */
+  class id_index
+  {
+  public:
+    static const std::uint32_t bloom_hash_count = 7;
+    static const std::uint32_t bloom_bits_per_id = 10;
+  private:
+    struct entry
+    {
+      std::uint64_t hash;
+      std::uint32_t block;
+      bool operator<(const entry& other) const { return hash < other.hash || (hash == other.hash && block < other.block); }
+      bool operator==(const entry& other) const { return hash == other.hash && block == other.block; }
+    };
+
+    std::vector<std::uint64_t> block_values_; // Same encoding as S1R entry values: (file_pos << 16) | (record_count - 1)
+    std::vector<entry> entries_;
+  public:
+    /**
+     * Hashes variant ID.
+     * @param id Variant ID
+     * @return 64-bit hash
+     */
+    static std::uint64_t hash(const std::string& id);
+
+    /**
+     * Splits semicolon-separated ID column into IDs, skipping missing values.
+     * @param id_column Value of ID column
+     * @param fn Callable invoked with each ID (as const char* and length)
+     */
+    template <typename Fn>
+    static void for_each_id(const std::string& id_column, Fn fn);
+
+    std::size_t block_count() const { return block_values_.size(); }
+
+    /**
+     * Adds record's IDs to current block.
+     * @param site Record
+     */
+    void update(const site_info& site);
+
+    /**
+     * Ends current block.
+     * @param s1r_value Value of block's S1R entry
+     */
+    void end_block(std::uint64_t s1r_value);
+
+    /**
+     * Sets the file position of a block that was ended before its position was known (e.g., when blocks are
+     * compressed in parallel).
+     * @param block Block index
+     * @param file_pos File position of block's zstd frame
+     */
+    void set_block_file_pos(std::size_t block, std::uint64_t file_pos);
+
+    /**
+     * Appends blocks of another ID index (e.g., when concatenating files).
+     * @param other Source ID index
+     * @param file_pos_delta Offset added to file positions of appended blocks
+     */
+    void append(const id_index& other, std::int64_t file_pos_delta);
+
+    /**
+     * Writes ID index as skippable zstd frame. Sorts the in-memory table.
+     * @param os Output stream
+     * @param uuid UUID of SAV file
+     * @return False on write error
+     */
+    bool serialize(std::ostream& os, const std::array<std::uint8_t, 16>& uuid);
+
+    /**
+     * Locates ID index frame preceding the appended S1R index.
+     * @param is Input stream of SAV file
+     * @param s1r_offset File offset of S1R index (see s1r::reader::file_offset())
+     * @param uuid UUID of SAV file (see s1r::reader::uuid()). Frames with a different UUID are ignored.
+     * @return File position of skippable frame or -1 if file has no ID index
+     */
+    static std::int64_t find_frame(std::istream& is, std::int64_t s1r_offset, const std::array<std::uint8_t, 16>& uuid);
+
+    /**
+     * Reads entire ID index preceding the appended S1R index.
+     * @param is Input stream of SAV file
+     * @param s1r_offset File offset of S1R index (see s1r::reader::file_offset())
+     * @param uuid UUID of SAV file (see s1r::reader::uuid()). Frames with a different UUID are ignored.
+     * @return False if file has no ID index or it is corrupt
+     */
+    bool deserialize(std::istream& is, std::int64_t s1r_offset, const std::array<std::uint8_t, 16>& uuid);
+
+    /**
+     * Looks up blocks that may contain IDs without loading the index into memory.
+     * @param is Input stream of SAV file
+     * @param s1r_offset File offset of S1R index (see s1r::reader::file_offset())
+     * @param uuid UUID of SAV file (see s1r::reader::uuid()). Frames with a different UUID are ignored.
+     * @param ids Variant IDs to look up
+     * @param block_values Destination for sorted S1R entry values of matching blocks
+     * @return False if file has no ID index or it is corrupt
+     */
+    static bool find_blocks(std::istream& is, std::int64_t s1r_offset, const std::array<std::uint8_t, 16>& uuid, const std::vector<std::string>& ids, std::vector<std::uint64_t>& block_values);
+  private:
+    struct header
+    {
+      std::uint64_t n_blocks;
+      std::uint64_t bloom_bits;
+      std::uint32_t k;
+      std::uint64_t n_entries;
+    };
+
+    static const std::size_t header_size = 8 + 8 + 4 + 8;
+    static const std::size_t entry_size = 8 + 4;
+
+    static std::uint64_t bloom_bit(std::uint64_t h, std::uint32_t i, std::uint64_t n_bits)
+    {
+      // Kirsch-Mitzenmacher double hashing: g_i(x) = h1(x) + i * h2(x)
+      return ((h & 0xFFFFFFFF) + i * ((h >> 32u) | 1u)) % n_bits;
+    }
+
+    static bool read_header(std::istream& is, std::int64_t frame_pos, std::int64_t s1r_offset, header& hdr);
+
+    static void write_u64(std::ostream& os, std::uint64_t v)
+    {
+      v = htole64(v);
+      os.write((char*)&v, sizeof(v));
+    }
+
+    static void write_u32(std::ostream& os, std::uint32_t v)
+    {
+      v = htole32(v);
+      os.write((char*)&v, sizeof(v));
+    }
+
+    static bool read_u64(std::istream& is, std::uint64_t& v)
+    {
+      is.read((char*)&v, sizeof(v));
+      v = le64toh(v);
+      return is.good();
+    }
+
+    static bool read_u32(std::istream& is, std::uint32_t& v)
+    {
+      is.read((char*)&v, sizeof(v));
+      v = le32toh(v);
+      return is.good();
+    }
+  };
+
+  inline
+  std::uint64_t id_index::hash(const std::string& id)
+  {
+    // FNV-1a followed by MurmurHash3's finalizer so that both halves are usable as independent Bloom hashes.
+    std::uint64_t h = 0xcbf29ce484222325ull;
+    for (auto it = id.begin(); it != id.end(); ++it)
+    {
+      h ^= std::uint8_t(*it);
+      h *= 0x100000001b3ull;
+    }
+
+    h ^= h >> 33u;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33u;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33u;
+    return h;
+  }
+
+  template <typename Fn>
+  void id_index::for_each_id(const std::string& id_column, Fn fn)
+  {
+    std::size_t beg = 0;
+    while (beg <= id_column.size())
+    {
+      std::size_t end = id_column.find(';', beg);
+      if (end == std::string::npos)
+        end = id_column.size();
+      if (end > beg && !(end - beg == 1 && id_column[beg] == '.'))
+        fn(id_column.data() + beg, end - beg);
+      beg = end + 1;
+    }
+  }
+
+  inline
+  void id_index::update(const site_info& site)
+  {
+    std::uint32_t block = std::uint32_t(block_values_.size());
+    for_each_id(site.id(), [this, block](const char* s, std::size_t len)
+    {
+      entries_.push_back({hash(std::string(s, len)), block});
+    });
+  }
+
+  inline
+  void id_index::end_block(std::uint64_t s1r_value)
+  {
+    block_values_.push_back(s1r_value);
+  }
+
+  inline
+  void id_index::set_block_file_pos(std::size_t block, std::uint64_t file_pos)
+  {
+    block_values_[block] = file_pos << 16u | (block_values_[block] & 0xFFFF);
+  }
+
+  inline
+  void id_index::append(const id_index& other, std::int64_t file_pos_delta)
+  {
+    std::uint32_t block_offset = std::uint32_t(block_values_.size());
+    for (auto it = other.block_values_.begin(); it != other.block_values_.end(); ++it)
+      block_values_.push_back(std::uint64_t(std::int64_t(*it >> 16u) + file_pos_delta) << 16u | (*it & 0xFFFF));
+    entries_.reserve(entries_.size() + other.entries_.size());
+    for (auto it = other.entries_.begin(); it != other.entries_.end(); ++it)
+      entries_.push_back({it->hash, it->block + block_offset});
+  }
+
+  inline
+  bool id_index::serialize(std::ostream& os, const std::array<std::uint8_t, 16>& uuid)
+  {
+    std::sort(entries_.begin(), entries_.end());
+    entries_.erase(std::unique(entries_.begin(), entries_.end()), entries_.end());
+
+    std::size_t n_distinct = 0;
+    for (std::size_t i = 0; i < entries_.size(); ++i)
+      n_distinct += (i == 0 || entries_[i].hash != entries_[i - 1].hash);
+
+    std::uint64_t bloom_bits = std::max<std::uint64_t>(64, (n_distinct * bloom_bits_per_id + 63) / 64 * 64);
+    std::vector<std::uint64_t> bloom(bloom_bits / 64, 0);
+    for (auto it = entries_.begin(); it != entries_.end(); ++it)
+    {
+      for (std::uint32_t i = 0; i < bloom_hash_count; ++i)
+      {
+        std::uint64_t bit = bloom_bit(it->hash, i, bloom_bits);
+        bloom[bit / 64] |= std::uint64_t(1) << (bit % 64);
+      }
+    }
+
+    // Layout: header (block count, Bloom filter size in bits, Bloom hash count and entry count), S1R entry value of
+    // each block, Bloom filter words, then (hash, block index) entries sorted by hash. The footer (payload size, UUID
+    // and version string) allows the frame to be located from the start of the S1R frame.
+    std::uint64_t payload_size = header_size + block_values_.size() * 8 + bloom.size() * 8 + entries_.size() * entry_size + ::savvy::detail::footer_frame_footer_size;
+    if (payload_size > std::numeric_limits<std::uint32_t>::max())
+    {
+      std::cerr << "Error: ID index too big for skippable zstd frame" << std::endl;
+      return false;
+    }
+
+    os.write("\x52\x2A\x4D\x18", 4);
+    write_u32(os, std::uint32_t(payload_size));
+
+    write_u64(os, block_values_.size());
+    write_u64(os, bloom_bits);
+    write_u32(os, bloom_hash_count);
+    write_u64(os, entries_.size());
+
+    for (auto it = block_values_.begin(); it != block_values_.end(); ++it)
+      write_u64(os, *it);
+
+    for (auto it = bloom.begin(); it != bloom.end(); ++it)
+      write_u64(os, *it);
+
+    for (auto it = entries_.begin(); it != entries_.end(); ++it)
+    {
+      write_u64(os, it->hash);
+      write_u32(os, it->block);
+    }
+
+    write_u32(os, std::uint32_t(payload_size));
+    os.write((const char*)uuid.data(), uuid.size());
+    os.write("vid\x00\x01\x00\x00", 7);
+
+    return os.good();
+  }
+
+  inline
+  std::int64_t id_index::find_frame(std::istream& is, std::int64_t s1r_offset, const std::array<std::uint8_t, 16>& uuid)
+  {
+    return ::savvy::detail::find_footer_frame(is, s1r_offset, "vid", uuid);
+  }
+
+  inline
+  bool id_index::read_header(std::istream& is, std::int64_t frame_pos, std::int64_t s1r_offset, header& hdr)
+  {
+    is.seekg(frame_pos + 8);
+    if (!read_u64(is, hdr.n_blocks) || !read_u64(is, hdr.bloom_bits) || !read_u32(is, hdr.k) || !read_u64(is, hdr.n_entries))
+    {
+      is.clear();
+      return false;
+    }
+
+    std::uint64_t frame_size = std::uint64_t(s1r_offset - 8 - frame_pos);
+    if (hdr.bloom_bits == 0 || hdr.bloom_bits % 64 || hdr.n_blocks > frame_size / 8 || hdr.bloom_bits / 8 > frame_size || hdr.n_entries > frame_size / entry_size)
+      return false;
+
+    return 8 + header_size + hdr.n_blocks * 8 + hdr.bloom_bits / 8 + hdr.n_entries * entry_size + ::savvy::detail::footer_frame_footer_size <= frame_size;
+  }
+
+  inline
+  bool id_index::deserialize(std::istream& is, std::int64_t s1r_offset, const std::array<std::uint8_t, 16>& uuid)
+  {
+    block_values_.clear();
+    entries_.clear();
+
+    std::int64_t frame_pos = find_frame(is, s1r_offset, uuid);
+    header hdr;
+    if (frame_pos < 0 || !read_header(is, frame_pos, s1r_offset, hdr))
+      return false;
+
+    block_values_.resize(hdr.n_blocks);
+    for (std::size_t i = 0; i < hdr.n_blocks && is; ++i)
+      read_u64(is, block_values_[i]);
+
+    is.seekg(hdr.bloom_bits / 8, std::ios::cur);
+
+    entries_.resize(hdr.n_entries);
+    for (std::size_t i = 0; i < hdr.n_entries && is; ++i)
+    {
+      read_u64(is, entries_[i].hash);
+      read_u32(is, entries_[i].block);
+    }
+
+    if (!is || std::any_of(entries_.begin(), entries_.end(), [&hdr](const entry& e) { return e.block >= hdr.n_blocks; }))
+    {
+      is.clear();
+      block_values_.clear();
+      entries_.clear();
+      return false;
+    }
+
+    return true;
+  }
+
+  inline
+  bool id_index::find_blocks(std::istream& is, std::int64_t s1r_offset, const std::array<std::uint8_t, 16>& uuid, const std::vector<std::string>& ids, std::vector<std::uint64_t>& block_values)
+  {
+    block_values.clear();
+
+    std::int64_t frame_pos = find_frame(is, s1r_offset, uuid);
+    header hdr;
+    if (frame_pos < 0 || !read_header(is, frame_pos, s1r_offset, hdr))
+      return false;
+
+    const std::int64_t blocks_pos = frame_pos + 8 + header_size;
+    const std::int64_t bloom_pos = blocks_pos + std::int64_t(hdr.n_blocks * 8);
+    const std::int64_t entries_pos = bloom_pos + std::int64_t(hdr.bloom_bits / 8);
+
+    // Load the whole Bloom filter when it would otherwise be probed more times than it has words.
+    std::vector<std::uint64_t> bloom;
+    if (ids.size() * hdr.k >= hdr.bloom_bits / 64)
+    {
+      bloom.resize(hdr.bloom_bits / 64);
+      is.seekg(bloom_pos);
+      for (auto it = bloom.begin(); it != bloom.end() && is; ++it)
+        read_u64(is, *it);
+    }
+
+    auto read_bloom_word = [&](std::uint64_t word_idx, std::uint64_t& word)
+    {
+      if (!bloom.empty())
+      {
+        word = bloom[word_idx];
+        return true;
+      }
+      is.seekg(bloom_pos + std::int64_t(word_idx * 8));
+      return read_u64(is, word);
+    };
+
+    auto read_entry = [&](std::uint64_t idx, std::uint64_t& h, std::uint32_t& block)
+    {
+      is.seekg(entries_pos + std::int64_t(idx * entry_size));
+      return read_u64(is, h) && read_u32(is, block);
+    };
+
+    std::vector<std::uint32_t> blocks;
+    for (auto id = ids.begin(); id != ids.end() && is; ++id)
+    {
+      const std::uint64_t h = hash(*id);
+
+      bool maybe_present = true;
+      for (std::uint32_t i = 0; i < hdr.k && maybe_present; ++i)
+      {
+        std::uint64_t bit = bloom_bit(h, i, hdr.bloom_bits);
+        std::uint64_t word;
+        if (!read_bloom_word(bit / 64, word))
+          break;
+        maybe_present = (word >> (bit % 64)) & 1u;
+      }
+
+      if (!maybe_present)
+        continue;
+
+      // Binary search for first entry with hash h.
+      std::uint64_t lo = 0, hi = hdr.n_entries;
+      std::uint64_t entry_hash;
+      std::uint32_t block;
+      while (lo < hi && is)
+      {
+        std::uint64_t mid = lo + (hi - lo) / 2;
+        read_entry(mid, entry_hash, block);
+        if (entry_hash < h)
+          lo = mid + 1;
+        else
+          hi = mid;
+      }
+
+      for ( ; lo < hdr.n_entries && read_entry(lo, entry_hash, block) && entry_hash == h; ++lo)
+      {
+        if (block < hdr.n_blocks)
+          blocks.push_back(block);
+      }
+    }
+
+    if (is.bad())
+      return false;
+    is.clear();
+
+    std::sort(blocks.begin(), blocks.end());
+    blocks.erase(std::unique(blocks.begin(), blocks.end()), blocks.end());
+
+    block_values.reserve(blocks.size());
+    for (auto it = blocks.begin(); it != blocks.end(); ++it)
+    {
+      std::uint64_t v;
+      is.seekg(blocks_pos + std::int64_t(*it) * 8);
+      if (!read_u64(is, v))
+      {
+        is.clear();
+        block_values.clear();
+        return false;
+      }
+      block_values.push_back(v);
+    }
+
+    return true;
+  }
+}
+
+#endif // LIBSAVVY_ID_INDEX_HPP
@@ -10,7 +10,6 @@
 #include <cstdint>
 #include <string>
 #include <vector>
-#include <unordered_map>
 
 namespace savvy
 {
@@ -19,27 +18,60 @@ namespace savvy
     // PBWT
 
 
-    typedef std::vector<std::size_t> pbwt_sort_map;
+    typedef std::vector<std::uint32_t> pbwt_sort_map;
+
+    /**
+     * Sort state for a single FORMAT field and stride (vector size). When identity is set, sort_mapping is stale and
+     * the permutation is treated as the identity, which allows block resets to avoid touching the mapping.
+     */
+    struct pbwt_sort_format_context
+    {
+      pbwt_sort_map sort_mapping;
+      std::size_t stride = 0;
+      bool identity = true;
+    };
 
     struct pbwt_sort_context
     {
-      std::vector<std::size_t> prev_sort_mapping;
-      std::vector<std::size_t> counts;
-      std::unordered_map<std::string, std::unordered_map<std::size_t, pbwt_sort_map>> format_contexts;
+      pbwt_sort_map prev_sort_mapping;
+      std::vector<std::uint32_t> counts;
+      std::vector<char> sorted_data; // serialized column prior to choosing raw or run-length encoding
+      std::vector<std::vector<pbwt_sort_format_context>> format_contexts; // indexed by FORMAT dictionary id
+      bool run_length_encode = false; // see writer::set_pbwt_rle()
+
+      /**
+       * Gets sort state for FORMAT field, creating it if it does not yet exist.
+       * @param fmt_id Dictionary id of FORMAT field
+       * @param stride Size of FORMAT field data vector
+       * @return Reference to sort state
+       */
+      pbwt_sort_format_context& get(std::size_t fmt_id, std::size_t stride)
+      {
+        if (fmt_id >= format_contexts.size())
+          format_contexts.resize(fmt_id + 1);
+
+        auto& strides = format_contexts[fmt_id];
+        for (auto it = strides.begin(); it != strides.end(); ++it)
+        {
+          if (it->stride == stride)
+            return *it;
+        }
+
+        strides.emplace_back();
+        strides.back().stride = stride;
+        return strides.back();
+      }
 
       void reset()
       {
         for (auto it = format_contexts.begin(); it != format_contexts.end(); ++it)
         {
-          for (auto jt = it->second.begin(); jt != it->second.end(); ++jt)
-          {
-            for (std::size_t i = 0; i < jt->second.size(); ++i)
-              jt->second[i] = i;
-          }
+          for (auto jt = it->begin(); jt != it->end(); ++jt)
+            jt->identity = true;
         }
       }
     };
   }
 }
 
-#endif // LIBSAVVY_PBWT_HPP
\ No newline at end of file
+#endif // LIBSAVVY_PBWT_HPP
@@ -12,6 +12,9 @@
 #include "file.hpp"
 #include "csi.hpp"
 #include "s1r.hpp"
+#include "zone_map.hpp"
+#include "id_index.hpp"
+#include "stage_stats.hpp"
 
 #include <shrinkwrap/zstd.hpp>
 #include <shrinkwrap/gz.hpp>
@@ -21,6 +24,7 @@
 #include <string>
 #include <memory>
 #include <stdexcept>
+#include <functional>
 
 namespace savvy
 {
@@ -29,14 +33,17 @@ namespace savvy
     class reader : public file
     {
     private:
+      std::unique_ptr<detail::owned_stage_stats> stats_ = ::savvy::detail::make_unique<detail::owned_stage_stats>(); // Heap allocated so that the reference held by a profiled sbuf_ survives moves
       std::unique_ptr<std::streambuf> sbuf_;
       std::unique_ptr<std::istream> input_stream_;
       std::vector<std::pair<std::string, std::string>> headers_;
       std::vector<std::string> ids_;
       typed_value extra_typed_value_;
 
-      std::vector<std::size_t> subset_map_;
+      detail::subset_index subset_index_;
       std::size_t subset_size_;
+      bool restore_pbwt_order_ = true;
+      bool expand_pbwt_runs_ = true;
 
       // Random access
       struct s1r_query_context
@@ -80,10 +87,32 @@ namespace savvy
         }
       };
 
+      struct id_query_context
+      {
+        std::unordered_set<std::string> ids;
+        std::vector<std::uint64_t> block_values;
+        std::size_t next_block = 0;
+        std::uint32_t records_left_in_block = 0;
+      };
+
       std::unique_ptr<s1r::reader> s1r_index_;
       std::unique_ptr<s1r_query_context> s1r_query_;
       std::unique_ptr<csi_index> csi_index_;
       std::unique_ptr<csi_query_context> csi_query_;
+      std::unique_ptr<id_query_context> id_query_;
+
+      // Block skipping
+      std::string file_path_;
+      zone_map zone_map_;
+      std::function<bool(const zone_map::block&)> block_filter_;
+      std::size_t next_zone_block_ = 0;
+      std::uint32_t records_left_in_zone_block_ = 0;
+
+      // Site filtering
+      std::function<bool(const site_info&)> site_filter_;
+      std::vector<char> rejected_indiv_buf_;
+      bool site_rejected_ = false;
+      bool sites_only_ = false;
     public:
       /**
        * Default constuctor.
@@ -150,6 +179,66 @@ namespace savvy
        */
       reader& reset_bounds(slice_bounds reg);
 
+      /**
+       * Uses ID index (see writer::set_id_index()) to query records by variant ID. Records are returned in file order.
+       * A record matches if any of its semicolon-separated IDs is in ids.
+       *
+       * @param ids Variant IDs to query
+       * @return *this (failbit is set if file does not contain an ID index)
+       */
+      reader& reset_bounds(std::vector<std::string> ids);
+
+      /**
+       * Enables or disables restoring the sample order of PBWT-sorted FORMAT fields. When disabled, these fields are
+       * left in sorted order with pbwt_flag() set, which is sufficient for order-independent summaries (e.g., allele
+       * counts) and avoids unsorting each column. Run-length encoded fields are converted to sparse vectors unless
+       * expand_pbwt_runs(false) is also set. Sample order is always restored when a sample subset is active. Must be
+       * set before reading the first record.
+       *
+       * @param enabled Whether to restore sample order (default: true)
+       */
+      void restore_pbwt_order(bool enabled) { restore_pbwt_order_ = enabled; }
+
+      /**
+       * Enables or disables expanding run-length encoded PBWT fields when sample order is not restored (see
+       * restore_pbwt_order()). When disabled, these fields are left as runs with pbwt_runs() set, so summaries can be
+       * computed in time proportional to the number of runs with typed_value::for_each_pbwt_run(). Such fields cannot
+       * be converted with get() or written to another file. Has no effect while sample order is restored. Must be set
+       * before reading the first record.
+       *
+       * @param enabled Whether to expand runs to sparse vectors (default: true)
+       */
+      void expand_pbwt_runs(bool enabled) { expand_pbwt_runs_ = enabled; }
+
+      /**
+       * Enables or disables skipping individual data, in which case records are returned without FORMAT fields. For
+       * SAV and BCF files, the individual data is skipped without being decoded. Must be set before reading the first
+       * record.
+       *
+       * @param enabled Whether to skip individual data (default: false)
+       */
+      void sites_only(bool enabled) { sites_only_ = enabled; }
+
+      /**
+       * Skips SAV blocks for which pred returns false without decompressing them. The predicate is given the block's
+       * zone map (see writer::set_zone_map_fields()) and must only return false if no record in the block can be of
+       * interest, so records from the remaining blocks still need to be filtered. Blocks are not skipped during
+       * slice queries. Must be set before reading the first record.
+       *
+       * @param pred Callable taking a const zone_map::block& and returning bool
+       * @return False if file does not contain zone maps, in which case no blocks are skipped
+       */
+      bool set_block_filter(std::function<bool(const zone_map::block&)> pred);
+
+      /**
+       * Skips records for which pred returns false. For SAV files, the predicate is evaluated as soon as the shared
+       * (site) data of a record is read, and the individual data of rejected records is not decoded unless it is needed
+       * to restore the sample order of later PBWT-sorted records. Must be set before reading the first record.
+       *
+       * @param pred Callable taking a const site_info& and returning bool (nullptr disables filtering)
+       */
+      void set_site_filter(std::function<bool(const site_info&)> pred) { site_filter_ = std::move(pred); }
+
       /**
        * Getter for file's phasing status.
        *
@@ -171,6 +260,12 @@ namespace savvy
        */
       bool good() const { return this->input_stream_->good(); }
 
+      /**
+       * Per-stage timers and counters. These are only updated when compiled with SAVVY_PROFILE.
+       * @return Counters accumulated since file was opened
+       */
+      const stage_stats& stats() const { return *stats_; }
+
       /**
        * Checks for read error.
        *
@@ -194,6 +289,23 @@ namespace savvy
        */
       reader& operator>>(variant& r) { return read(r); }
 
+      /**
+       * Reads up to max_records records and stores one FORMAT field as the columns of a compressed sparse column (CSC)
+       * matrix. Row indices and values are written by each record's typed_value straight into the destination arrays
+       * without an intermediate vector. Records without the field are stored as empty columns. The number of rows is
+       * the size of the field (e.g., samples for DS or haplotypes for GT), which must be the same for all records.
+       *
+       * See eigen3::read_sparse_matrix() and armadillo::read_sparse_matrix() for ready-made destinations.
+       *
+       * @param fmt_key FORMAT field key
+       * @param max_records Maximum number of records (columns) to read
+       * @param dest CSC destination providing index_type, value_type, begin(), reserve(nnz), row_indices(), values(), end_column(col, nnz) and end(rows, cols, nnz). reserve() must preserve existing entries.
+       * @param mean_impute Whether to replace missing values with the mean of the record's non-missing values
+       * @return Number of records read
+       */
+      template <typename CscT>
+      std::size_t read_csc_matrix(const std::string& fmt_key, std::size_t max_records, CscT& dest, bool mean_impute = false);
+
       /**
        * Shorthand for good().
        *
@@ -207,6 +319,15 @@ namespace savvy
        * @return File position
        */
       std::streampos tellg() { return this->input_stream_->tellg(); }
+
+      /**
+       * For SAV files, moves to the beginning of the zstd block at the given file position (e.g., a position returned
+       * by tellg()). Any region, slice or ID query is ended.
+       *
+       * @param pos File position of zstd block
+       * @return *this
+       */
+      reader& seekg(std::streampos pos);
     private:
 //      void process_header_pair(const std::string& key, const std::string& val);
       bool read_header();
@@ -217,12 +338,17 @@ namespace savvy
       reader& read_sav1_record(variant& r);
       reader& read_indexed_record(variant& r);
       reader& read_csi_indexed_record(variant& r);
+      reader& read_id_indexed_record(variant& r);
+      bool block_may_match(std::uint64_t file_pos);
+      bool skip_filtered_blocks();
+      void skip_rejected_indiv(variant& r, std::uint32_t indiv_sz);
     };
 
     //================================================================//
     // Reader definitions
     inline
-    reader::reader(const std::string& file_path)
+    reader::reader(const std::string& file_path) :
+      file_path_(file_path)
     {
       FILE* fp = fopen(file_path.c_str(), "rb");
       if (!fp)
@@ -236,6 +362,17 @@ namespace savvy
 
       switch (char(first_byte))
       {
+#ifdef SAVVY_PROFILE
+      case '\x1F':
+        sbuf_ = ::savvy::detail::make_unique<detail::profiled_ibuf<::shrinkwrap::bgzf::ibuf>>(*stats_, fp);
+        break;
+      case '\x28':
+        sbuf_ = ::savvy::detail::make_unique<detail::profiled_ibuf<::shrinkwrap::zstd::ibuf>>(*stats_, fp);
+        break;
+      default:
+        sbuf_ = ::savvy::detail::make_unique<detail::profiled_ibuf<::shrinkwrap::stdio::filebuf>>(*stats_, fp);
+        break;
+#else
       case '\x1F':
         sbuf_ = ::savvy::detail::make_unique<::shrinkwrap::bgzf::ibuf>(fp);
         break;
@@ -245,6 +382,7 @@ namespace savvy
       default:
         sbuf_ = ::savvy::detail::make_unique<::shrinkwrap::stdio::filebuf>(fp);
         break;
+#endif
       }
 
       input_stream_ = savvy::detail::make_unique<std::istream>(sbuf_.get());
@@ -287,30 +425,67 @@ namespace savvy
       std::vector<std::string> ret;
       ret.reserve(std::min(subset.size(), ids_.size()));
 
-      subset_map_.clear();
-      subset_map_.resize(ids_.size(), std::numeric_limits<std::uint64_t>::max());
+      std::vector<std::size_t> subset_map(ids_.size(), std::numeric_limits<std::size_t>::max());
       std::uint64_t subset_index = 0;
       for (auto it = ids_.begin(); it != ids_.end(); ++it)
       {
         if (subset.find(*it) != subset.end())
         {
-          subset_map_[std::distance(ids_.begin(), it)] = subset_index;
+          subset_map[std::distance(ids_.begin(), it)] = subset_index;
           ret.push_back(*it);
           ++subset_index;
         }
       }
 
       subset_size_ = subset_index;
+      subset_index_.assign(subset_map, subset_size_);
 
       return ret;
     }
 
+    template <typename CscT>
+    std::size_t reader::read_csc_matrix(const std::string& fmt_key, std::size_t max_records, CscT& dest, bool mean_impute)
+    {
+      std::size_t rows = 0, cols = 0, nnz = 0;
+      bool rows_set = false;
+      variant var;
+      dest.begin();
+      while (cols < max_records && read(var))
+      {
+        auto it = std::find_if(var.format_fields().begin(), var.format_fields().end(), [&fmt_key](const std::pair<std::string, typed_value>& f) { return f.first == fmt_key; });
+        if (it != var.format_fields().end())
+        {
+          const typed_value& val = it->second;
+          if (!rows_set)
+          {
+            rows = val.size();
+            rows_set = true;
+          }
+          else if (val.size() != rows)
+          {
+            std::fprintf(stderr, "Error: size of FORMAT field %s changes from %zu to %zu\n", fmt_key.c_str(), rows, val.size());
+            input_stream_->setstate(std::ios::failbit);
+            break;
+          }
+
+          dest.reserve(nnz + (val.is_sparse() ? val.non_zero_size() : val.size()));
+          std::size_t written = 0;
+          if (val.get_csc_column(dest.row_indices() + nnz, dest.values() + nnz, mean_impute, written))
+            nnz += written;
+        }
+        dest.end_column(cols++, nnz);
+      }
+      dest.end(rows, cols, nnz);
+      return cols;
+    }
+
     inline
     reader& reader::reset_bounds(genomic_region reg, bounding_point bp)
     {
       input_stream_->clear();
       s1r_query_.reset(nullptr);
       csi_query_.reset(nullptr);
+      id_query_.reset(nullptr);
 
       if (s1r_index_ && s1r_index_->good()) //file_format_ == format::sav1 || file_format_ == format::sav2)
       {
@@ -394,6 +569,48 @@ namespace savvy
       return *this;
     }
 
+    inline
+    reader& reader::reset_bounds(std::vector<std::string> ids)
+    {
+      input_stream_->clear();
+      s1r_query_.reset(nullptr);
+      csi_query_.reset(nullptr);
+      id_query_.reset(nullptr);
+
+      if (file_format_ == format::sav2 && s1r_index_ && s1r_index_->good() && !::savvy::detail::file_exists(file_path_ + ".s1r"))
+      {
+        auto ctx = ::savvy::detail::make_unique<id_query_context>();
+        std::ifstream ifs(file_path_, std::ios::binary);
+        if (id_index::find_blocks(ifs, s1r_index_->file_offset(), s1r_index_->uuid(), ids, ctx->block_values))
+        {
+          ctx->ids.insert(std::make_move_iterator(ids.begin()), std::make_move_iterator(ids.end()));
+          id_query_ = std::move(ctx);
+          return *this;
+        }
+      }
+
+      input_stream_->setstate(std::ios::failbit); //TODO: error message
+      return *this;
+    }
+
+    inline
+    reader& reader::seekg(std::streampos pos)
+    {
+      input_stream_->clear();
+      s1r_query_.reset(nullptr);
+      csi_query_.reset(nullptr);
+      id_query_.reset(nullptr);
+
+      if (block_filter_)
+      {
+        next_zone_block_ = zone_map_.find_block(std::uint64_t(pos));
+        records_left_in_zone_block_ = 0;
+      }
+
+      input_stream_->seekg(pos);
+      return *this;
+    }
+
     inline
     reader& reader::read_indexed_record(variant& r)
     {
@@ -414,6 +631,18 @@ namespace savvy
           }
           else
           {
+            if (block_filter_ && s1r_query_->max_records_to_read == std::numeric_limits<std::uint64_t>::max())
+            {
+              while (s1r_query_->iter != s1r_query_->query.end() && !block_may_match((s1r_query_->iter->value() >> 16) & 0x0000FFFFFFFFFFFF))
+                ++(s1r_query_->iter);
+
+              if (s1r_query_->iter == s1r_query_->query.end())
+              {
+                this->input_stream_->setstate(std::ios::eofbit);
+                break;
+              }
+            }
+
             s1r_query_->total_in_block = std::uint32_t(0x000000000000FFFF & s1r_query_->iter->value()) + 1;
             s1r_query_->current_offset_in_block = 0;
             this->input_stream_->seekg(std::streampos((s1r_query_->iter->value() >> 16) & 0x0000FFFFFFFFFFFF));
@@ -436,7 +665,7 @@ namespace savvy
         {
           ++(s1r_query_->current_offset_in_block);
           ++(s1r_query_->total_records_read);
-          if (region_compare(s1r_query_->bounding_type, r, s1r_query_->reg))
+          if (!site_rejected_ && region_compare(s1r_query_->bounding_type, r, s1r_query_->reg))
           {
             //this->read_genotypes(annotations, destination);
             break;
@@ -487,7 +716,7 @@ namespace savvy
 
         //assert(r.pos() >= pos_before);
 
-        if (region_compare(csi_query_->bounding_type, r, csi_query_->reg))
+        if (!site_rejected_ && region_compare(csi_query_->bounding_type, r, csi_query_->reg))
         {
           //this->read_genotypes(annotations, destination);
           break;
@@ -500,6 +729,55 @@ namespace savvy
       return *this; //TODO: clear site info before returning if not good
     }
 
+    inline
+    reader& reader::read_id_indexed_record(variant& r)
+    {
+      while (input_stream_->good())
+      {
+        if (id_query_->records_left_in_block == 0)
+        {
+          std::uint64_t v = 0;
+          while (id_query_->next_block < id_query_->block_values.size())
+          {
+            v = id_query_->block_values[id_query_->next_block++];
+            if (!block_filter_ || block_may_match((v >> 16) & 0x0000FFFFFFFFFFFF))
+              break;
+            v = 0;
+          }
+
+          if (v == 0)
+          {
+            input_stream_->setstate(std::ios::eofbit);
+            break;
+          }
+
+          id_query_->records_left_in_block = std::uint32_t(0x000000000000FFFF & v) + 1;
+          input_stream_->seekg(std::streampos((v >> 16) & 0x0000FFFFFFFFFFFF));
+        }
+
+        if (!read_record(r))
+        {
+          assert(!"Truncated block");
+          input_stream_->setstate(input_stream_->rdstate() | std::ios::badbit);
+          break;
+        }
+
+        --(id_query_->records_left_in_block);
+        if (site_rejected_)
+          continue;
+
+        bool found = false;
+        id_index::for_each_id(r.id(), [this, &found](const char* s, std::size_t len)
+        {
+          found = found || id_query_->ids.find(std::string(s, len)) != id_query_->ids.end();
+        });
+
+        if (found)
+          break;
+      }
+      return *this; //TODO: clear site info before returning if not good
+    }
+
     inline
     reader& reader::read(variant& r)
     {
@@ -511,16 +789,112 @@ namespace savvy
         if (csi_query_)
           return read_csi_indexed_record(r);
 
-        if (!read_record(r) && input_stream_->good())
-          input_stream_->setstate(std::ios::badbit);
+        if (id_query_)
+          return read_id_indexed_record(r);
+
+        do
+        {
+          if (block_filter_ && !skip_filtered_blocks())
+            return *this;
+
+          if (!read_record(r) && input_stream_->good())
+            input_stream_->setstate(std::ios::badbit);
+          else if (records_left_in_zone_block_)
+            --records_left_in_zone_block_;
+        } while (site_rejected_ && good());
       }
 
       return *this;
     }
 
+    inline
+    bool reader::set_block_filter(std::function<bool(const zone_map::block&)> pred)
+    {
+      block_filter_ = nullptr;
+      if (file_format_ != format::sav2 || !s1r_index_ || !s1r_index_->good() || ::savvy::detail::file_exists(file_path_ + ".s1r"))
+        return false;
+
+      std::ifstream ifs(file_path_, std::ios::binary);
+      if (!zone_map_.deserialize(ifs, s1r_index_->file_offset(), s1r_index_->uuid()))
+        return false;
+
+      block_filter_ = std::move(pred);
+      next_zone_block_ = 0;
+      records_left_in_zone_block_ = 0;
+      return true;
+    }
+
+    inline
+    bool reader::block_may_match(std::uint64_t file_pos)
+    {
+      std::size_t idx = zone_map_.find_block(file_pos);
+      return idx == zone_map_.block_count() || block_filter_(zone_map_[idx]);
+    }
+
+    inline
+    bool reader::skip_filtered_blocks()
+    {
+      if (records_left_in_zone_block_ == 0 && next_zone_block_ < zone_map_.block_count())
+      {
+        bool skipped = false;
+        while (next_zone_block_ < zone_map_.block_count())
+        {
+          auto b = zone_map_[next_zone_block_++];
+          if (block_filter_(b))
+          {
+            if (skipped)
+              input_stream_->seekg(std::streampos(b.file_position()));
+            records_left_in_zone_block_ = b.record_count();
+            return true;
+          }
+          skipped = true;
+        }
+
+        input_stream_->setstate(std::ios::eofbit);
+        return false;
+      }
+
+      return true;
+    }
+
+    inline
+    void reader::skip_rejected_indiv(variant& r, std::uint32_t indiv_sz)
+    {
+      if (file_format_ == format::bcf)
+      {
+        input_stream_->ignore(indiv_sz);
+        return;
+      }
+
+      rejected_indiv_buf_.resize(indiv_sz);
+      if (!input_stream_->read(rejected_indiv_buf_.data(), rejected_indiv_buf_.size()))
+      {
+        std::fprintf(stderr, "Error: Invalid individual data\n");
+        input_stream_->setstate(input_stream_->rdstate() | std::ios::badbit);
+        return;
+      }
+
+      // PBWT sort state carries over from record to record within a block, so PBWT-sorted fields must still be
+      // unsorted when sample order is being restored.
+      if ((!restore_pbwt_order_ && subset_size_ == ids_.size()) || !variant::indiv_has_pbwt_fields(rejected_indiv_buf_, r.n_fmt_))
+        return;
+
+      ::savvy::detail::memory_istreambuf sbuf(rejected_indiv_buf_.data(), rejected_indiv_buf_.data() + rejected_indiv_buf_.size());
+      std::istream is(&sbuf);
+      if (variant::deserialize_indiv(r, is, dict_, ids_.size(), false, phasing_) != indiv_sz)
+      {
+        std::fprintf(stderr, "Error: Invalid individual data\n");
+        input_stream_->setstate(input_stream_->rdstate() | std::ios::badbit);
+        return;
+      }
+
+      variant::pbwt_unsort_typed_values(r, dict_, extra_typed_value_, sort_context_);
+    }
+
     inline
     reader& reader::read_vcf_record(variant& r)
     {
+      detail::stage_timer timer(*stats_, stage_stats::stage::vcf_parse);
       if (input_stream_->peek() < 0)
         input_stream_->setstate(input_stream_->rdstate() | std::ios::eofbit);
       else if (!site_info::deserialize_vcf(r, *input_stream_, dict_))
@@ -568,6 +942,7 @@ namespace savvy
     inline
     reader& reader::read_record(variant& r)
     {
+      site_rejected_ = false;
       if (good())
       {
 
@@ -608,7 +983,13 @@ namespace savvy
 //          }
 
           std::uint32_t shared_n_samples{};
-          if (site_info::deserialize_shared(r, *input_stream_, dict_, shared_n_samples) != shared_sz)
+          std::int64_t shared_bytes_read;
+          {
+            detail::stage_timer timer(*stats_, stage_stats::stage::deserialize_shared, shared_sz);
+            shared_bytes_read = site_info::deserialize_shared(r, *input_stream_, dict_, shared_n_samples);
+          }
+
+          if (shared_bytes_read != shared_sz)
           {
             std::fprintf(stderr, "Error: Invalid shared data\n");
             input_stream_->setstate(input_stream_->rdstate() | std::ios::badbit);
@@ -619,7 +1000,35 @@ namespace savvy
           if (pbwt_reset)
             sort_context_.reset();
 
-          if (variant::deserialize_indiv(r, *input_stream_, dict_, ids_.size(), file_format_ == format::bcf, phasing_) != indiv_sz)
+          if (sites_only_)
+          {
+            // PBWT sort state is not maintained, so individual data cannot be decoded until the next block.
+            r.format_fields_.clear();
+            if (!input_stream_->ignore(indiv_sz) || input_stream_->gcount() != std::streamsize(indiv_sz))
+            {
+              std::fprintf(stderr, "Error: Invalid individual data\n");
+              input_stream_->setstate(input_stream_->rdstate() | std::ios::badbit);
+              return *this;
+            }
+            input_stream_->clear(input_stream_->rdstate() & ~std::ios::eofbit); // ignore() peeks past the last record
+            site_rejected_ = site_filter_ && !site_filter_(r);
+            return *this;
+          }
+
+          if (site_filter_ && !site_filter_(r))
+          {
+            site_rejected_ = true;
+            skip_rejected_indiv(r, indiv_sz);
+            return *this;
+          }
+
+          std::int64_t indiv_bytes_read;
+          {
+            detail::stage_timer timer(*stats_, stage_stats::stage::deserialize_indiv, indiv_sz);
+            indiv_bytes_read = variant::deserialize_indiv(r, *input_stream_, dict_, ids_.size(), file_format_ == format::bcf, phasing_);
+          }
+
+          if (indiv_bytes_read != indiv_sz)
           {
             std::fprintf(stderr, "Error: Invalid individual data\n");
             input_stream_->setstate(input_stream_->rdstate() | std::ios::badbit);
@@ -627,19 +1036,35 @@ namespace savvy
           }
 
           if (file_format_ != format::bcf)
-            variant::pbwt_unsort_typed_values(r, extra_typed_value_, sort_context_);
+          {
+            detail::stage_timer timer(*stats_, stage_stats::stage::pbwt_unsort);
+            if (restore_pbwt_order_ || subset_size_ != ids_.size())
+              variant::pbwt_unsort_typed_values(r, dict_, extra_typed_value_, sort_context_);
+            else if (expand_pbwt_runs_)
+              variant::pbwt_expand_runs_to_sparse(r, extra_typed_value_);
+          }
           //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~//
         }
 
+        if (good() && site_filter_ && (file_format_ == format::vcf || file_format_ == format::sav1) && !site_filter_(r))
+        {
+          site_rejected_ = true;
+          return *this;
+        }
+
         if (good())
         {
+          if (sites_only_)
+            r.format_fields_.clear();
+
           //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~//
           // Apply sample subset
           if (subset_size_ != ids_.size()) // TODO: maybe do this after region_compare.
           {
+            detail::stage_timer timer(*stats_, stage_stats::stage::subset);
             for (auto it = r.format_fields_.begin(); it != r.format_fields_.end(); ++it)
             {
-              it->second.subset(subset_map_, subset_size_, extra_typed_value_);
+              it->second.subset(subset_index_, extra_typed_value_);
               it->second.minimize(); // TODO: Set not_minimized flag and move minimize routine to writer.
             }
           }
@@ -576,6 +576,16 @@ namespace savvy
       query create_query(std::vector<genomic_region> regs);
       std::streampos file_offset() const { return index_file_offset_; }
       std::streampos size_on_disk() const { return size_on_disk_; }
+
+      /**
+       * @return UUID stored in index footer, which matches the UUID of the indexed file
+       */
+      std::array<std::uint8_t, 16> uuid() const
+      {
+        std::array<std::uint8_t, 16> ret;
+        std::copy(uuid_.begin(), uuid_.end(), ret.begin());
+        return ret;
+      }
     private:
       void init()
       {
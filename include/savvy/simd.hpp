@@ -0,0 +1,477 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef LIBSAVVY_SIMD_HPP
+#define LIBSAVVY_SIMD_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+// Vectorized kernels are used on x86 with GCC or Clang. SSE2 is part of the x86-64 baseline, and AVX2 versions are
+// compiled with function-level target attributes and selected at runtime, so no extra compiler flags are needed.
+// Define SAVVY_NO_SIMD to use the scalar loops everywhere.
+#if !defined(SAVVY_NO_SIMD) && defined(__GNUC__) && defined(__SSE2__) && (defined(__x86_64__) || defined(__i386__))
+#define SAVVY_SIMD_X86 1
+#include <immintrin.h>
+#define SAVVY_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+namespace savvy
+{
+  namespace detail
+  {
+    namespace simd
+    {
+      /**
+       * @return Whether the CPU supports AVX2 (always false when not compiled for x86)
+       */
+      inline bool has_avx2()
+      {
+#ifdef SAVVY_SIMD_X86
+        static const bool ret = __builtin_cpu_supports("avx2");
+        return ret;
+#else
+        return false;
+#endif
+      }
+
+      template <typename T>
+      struct has_nonzero_kernel
+      {
+        static const bool value = std::is_same<T, std::int8_t>::value || std::is_same<T, std::int16_t>::value || std::is_same<T, float>::value;
+      };
+
+#ifdef SAVVY_SIMD_X86
+      // Each mask function returns a bit mask where bit i is set when p[i] != 0. Float comparisons are unordered, so
+      // NaN (missing and end-of-vector values) is non-zero and -0.0 is zero, matching the scalar test.
+
+      inline std::uint32_t nonzero_mask16_sse2(const std::int8_t* p)
+      {
+        __m128i eq = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)p), _mm_setzero_si128());
+        return ~std::uint32_t(_mm_movemask_epi8(eq)) & 0xFFFFu;
+      }
+
+      inline std::uint32_t nonzero_mask16_sse2(const std::int16_t* p)
+      {
+        __m128i zero = _mm_setzero_si128();
+        __m128i a = _mm_cmpeq_epi16(_mm_loadu_si128((const __m128i*)p), zero);
+        __m128i b = _mm_cmpeq_epi16(_mm_loadu_si128((const __m128i*)(p + 8)), zero);
+        return ~std::uint32_t(_mm_movemask_epi8(_mm_packs_epi16(a, b))) & 0xFFFFu;
+      }
+
+      inline std::uint32_t nonzero_mask16_sse2(const float* p)
+      {
+        __m128 zero = _mm_setzero_ps();
+        std::uint32_t ret = std::uint32_t(_mm_movemask_ps(_mm_cmpneq_ps(_mm_loadu_ps(p), zero)));
+        ret |= std::uint32_t(_mm_movemask_ps(_mm_cmpneq_ps(_mm_loadu_ps(p + 4), zero))) << 4u;
+        ret |= std::uint32_t(_mm_movemask_ps(_mm_cmpneq_ps(_mm_loadu_ps(p + 8), zero))) << 8u;
+        ret |= std::uint32_t(_mm_movemask_ps(_mm_cmpneq_ps(_mm_loadu_ps(p + 12), zero))) << 12u;
+        return ret;
+      }
+
+      SAVVY_TARGET_AVX2 inline std::uint32_t nonzero_mask32_avx2(const std::int8_t* p)
+      {
+        __m256i eq = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)p), _mm256_setzero_si256());
+        return ~std::uint32_t(_mm256_movemask_epi8(eq));
+      }
+
+      SAVVY_TARGET_AVX2 inline std::uint32_t nonzero_mask32_avx2(const std::int16_t* p)
+      {
+        __m256i zero = _mm256_setzero_si256();
+        __m256i a = _mm256_cmpeq_epi16(_mm256_loadu_si256((const __m256i*)p), zero);
+        __m256i b = _mm256_cmpeq_epi16(_mm256_loadu_si256((const __m256i*)(p + 16)), zero);
+        // packs interleaves 128-bit lanes (a0 b0 a1 b1), so lanes are reordered before extracting the mask.
+        __m256i packed = _mm256_permute4x64_epi64(_mm256_packs_epi16(a, b), 0xD8);
+        return ~std::uint32_t(_mm256_movemask_epi8(packed));
+      }
+
+      SAVVY_TARGET_AVX2 inline std::uint32_t nonzero_mask32_avx2(const float* p)
+      {
+        __m256 zero = _mm256_setzero_ps();
+        std::uint32_t ret = std::uint32_t(_mm256_movemask_ps(_mm256_cmp_ps(_mm256_loadu_ps(p), zero, _CMP_NEQ_UQ)));
+        ret |= std::uint32_t(_mm256_movemask_ps(_mm256_cmp_ps(_mm256_loadu_ps(p + 8), zero, _CMP_NEQ_UQ))) << 8u;
+        ret |= std::uint32_t(_mm256_movemask_ps(_mm256_cmp_ps(_mm256_loadu_ps(p + 16), zero, _CMP_NEQ_UQ))) << 16u;
+        ret |= std::uint32_t(_mm256_movemask_ps(_mm256_cmp_ps(_mm256_loadu_ps(p + 24), zero, _CMP_NEQ_UQ))) << 24u;
+        return ret;
+      }
+
+      template <typename T, typename Fn>
+      std::size_t for_each_nonzero_sse2(const T* p, std::size_t n, Fn& fn)
+      {
+        std::size_t i = 0;
+        for ( ; i + 16 <= n; i += 16)
+        {
+          for (std::uint32_t m = nonzero_mask16_sse2(p + i); m; m &= m - 1)
+            fn(i + std::size_t(__builtin_ctz(m)));
+        }
+        return i;
+      }
+
+      template <typename T, typename Fn>
+      SAVVY_TARGET_AVX2 std::size_t for_each_nonzero_avx2(const T* p, std::size_t n, Fn& fn)
+      {
+        std::size_t i = 0;
+        for ( ; i + 32 <= n; i += 32)
+        {
+          for (std::uint32_t m = nonzero_mask32_avx2(p + i); m; m &= m - 1)
+            fn(i + std::size_t(__builtin_ctz(m)));
+        }
+        return i;
+      }
+#endif
+
+      template <typename T, typename Fn>
+      void for_each_nonzero(const T* p, std::size_t n, Fn& fn, std::true_type /*has_kernel*/)
+      {
+        std::size_t i = 0;
+#ifdef SAVVY_SIMD_X86
+        i = has_avx2() ? for_each_nonzero_avx2(p, n, fn) : for_each_nonzero_sse2(p, n, fn);
+#endif
+        for ( ; i < n; ++i)
+        {
+          if (p[i])
+            fn(i);
+        }
+      }
+
+      template <typename T, typename Fn>
+      void for_each_nonzero(const T* p, std::size_t n, Fn& fn, std::false_type /*has_kernel*/)
+      {
+        for (std::size_t i = 0; i < n; ++i)
+        {
+          if (p[i])
+            fn(i);
+        }
+      }
+
+#ifdef SAVVY_SIMD_X86
+      // Min/max reductions ignore BCF reserved values (missing, end-of-vector, etc.), which are the eight smallest
+      // values of each integer type. Reserved lanes are replaced with zero, which is the initial value of the
+      // scalar reduction in typed_value.
+
+      template <typename T>
+      std::size_t minmax_sse2(const T*, std::size_t, T&, T&) { return 0; }
+
+      inline std::size_t minmax_sse2(const std::int16_t* p, std::size_t n, std::int16_t& min_val, std::int16_t& max_val)
+      {
+        if (n < 8)
+          return 0;
+        const __m128i max_reserved = _mm_set1_epi16(std::int16_t(0x8007));
+        __m128i vmin = _mm_setzero_si128(), vmax = _mm_setzero_si128();
+        std::size_t i = 0;
+        for ( ; i + 8 <= n; i += 8)
+        {
+          __m128i v = _mm_loadu_si128((const __m128i*)(p + i));
+          v = _mm_and_si128(v, _mm_cmpgt_epi16(v, max_reserved));
+          vmin = _mm_min_epi16(vmin, v);
+          vmax = _mm_max_epi16(vmax, v);
+        }
+
+        std::int16_t mins[8], maxs[8];
+        _mm_storeu_si128((__m128i*)mins, vmin);
+        _mm_storeu_si128((__m128i*)maxs, vmax);
+        for (int j = 0; j < 8; ++j)
+        {
+          min_val = std::min(min_val, mins[j]);
+          max_val = std::max(max_val, maxs[j]);
+        }
+        return i;
+      }
+
+      inline std::size_t minmax_sse2(const std::int32_t* p, std::size_t n, std::int32_t& min_val, std::int32_t& max_val)
+      {
+        if (n < 4)
+          return 0;
+        const __m128i max_reserved = _mm_set1_epi32(std::int32_t(0x80000007));
+        __m128i vmin = _mm_setzero_si128(), vmax = _mm_setzero_si128();
+        std::size_t i = 0;
+        for ( ; i + 4 <= n; i += 4)
+        {
+          __m128i v = _mm_loadu_si128((const __m128i*)(p + i));
+          v = _mm_and_si128(v, _mm_cmpgt_epi32(v, max_reserved));
+          __m128i lt = _mm_cmplt_epi32(v, vmin); // SSE2 has no 32-bit min/max, so select with compare masks.
+          vmin = _mm_or_si128(_mm_and_si128(lt, v), _mm_andnot_si128(lt, vmin));
+          __m128i gt = _mm_cmpgt_epi32(v, vmax);
+          vmax = _mm_or_si128(_mm_and_si128(gt, v), _mm_andnot_si128(gt, vmax));
+        }
+
+        std::int32_t mins[4], maxs[4];
+        _mm_storeu_si128((__m128i*)mins, vmin);
+        _mm_storeu_si128((__m128i*)maxs, vmax);
+        for (int j = 0; j < 4; ++j)
+        {
+          min_val = std::min(min_val, mins[j]);
+          max_val = std::max(max_val, maxs[j]);
+        }
+        return i;
+      }
+
+      template <typename T>
+      std::size_t minmax_avx2(const T* p, std::size_t n, T& min_val, T& max_val) { return minmax_sse2(p, n, min_val, max_val); }
+
+      SAVVY_TARGET_AVX2 inline std::size_t minmax_avx2(const std::int16_t* p, std::size_t n, std::int16_t& min_val, std::int16_t& max_val)
+      {
+        if (n < 16)
+          return 0;
+        const __m256i max_reserved = _mm256_set1_epi16(std::int16_t(0x8007));
+        __m256i vmin = _mm256_setzero_si256(), vmax = _mm256_setzero_si256();
+        std::size_t i = 0;
+        for ( ; i + 16 <= n; i += 16)
+        {
+          __m256i v = _mm256_loadu_si256((const __m256i*)(p + i));
+          v = _mm256_and_si256(v, _mm256_cmpgt_epi16(v, max_reserved));
+          vmin = _mm256_min_epi16(vmin, v);
+          vmax = _mm256_max_epi16(vmax, v);
+        }
+
+        std::int16_t mins[16], maxs[16];
+        _mm256_storeu_si256((__m256i*)mins, vmin);
+        _mm256_storeu_si256((__m256i*)maxs, vmax);
+        for (int j = 0; j < 16; ++j)
+        {
+          min_val = std::min(min_val, mins[j]);
+          max_val = std::max(max_val, maxs[j]);
+        }
+        return i;
+      }
+
+      SAVVY_TARGET_AVX2 inline std::size_t minmax_avx2(const std::int32_t* p, std::size_t n, std::int32_t& min_val, std::int32_t& max_val)
+      {
+        if (n < 8)
+          return 0;
+        const __m256i max_reserved = _mm256_set1_epi32(std::int32_t(0x80000007));
+        __m256i vmin = _mm256_setzero_si256(), vmax = _mm256_setzero_si256();
+        std::size_t i = 0;
+        for ( ; i + 8 <= n; i += 8)
+        {
+          __m256i v = _mm256_loadu_si256((const __m256i*)(p + i));
+          v = _mm256_and_si256(v, _mm256_cmpgt_epi32(v, max_reserved));
+          vmin = _mm256_min_epi32(vmin, v);
+          vmax = _mm256_max_epi32(vmax, v);
+        }
+
+        std::int32_t mins[8], maxs[8];
+        _mm256_storeu_si256((__m256i*)mins, vmin);
+        _mm256_storeu_si256((__m256i*)maxs, vmax);
+        for (int j = 0; j < 8; ++j)
+        {
+          min_val = std::min(min_val, mins[j]);
+          max_val = std::max(max_val, maxs[j]);
+        }
+        return i;
+      }
+
+      SAVVY_TARGET_AVX2 inline std::size_t minmax_avx2(const std::int64_t* p, std::size_t n, std::int64_t& min_val, std::int64_t& max_val)
+      {
+        if (n < 4)
+          return 0;
+        const __m256i max_reserved = _mm256_set1_epi64x(std::int64_t(0x8000000000000007));
+        __m256i vmin = _mm256_setzero_si256(), vmax = _mm256_setzero_si256();
+        std::size_t i = 0;
+        for ( ; i + 4 <= n; i += 4)
+        {
+          __m256i v = _mm256_loadu_si256((const __m256i*)(p + i));
+          v = _mm256_and_si256(v, _mm256_cmpgt_epi64(v, max_reserved));
+          vmin = _mm256_blendv_epi8(vmin, v, _mm256_cmpgt_epi64(vmin, v));
+          vmax = _mm256_blendv_epi8(vmax, v, _mm256_cmpgt_epi64(v, vmax));
+        }
+
+        std::int64_t mins[4], maxs[4];
+        _mm256_storeu_si256((__m256i*)mins, vmin);
+        _mm256_storeu_si256((__m256i*)maxs, vmax);
+        for (int j = 0; j < 4; ++j)
+        {
+          min_val = std::min(min_val, mins[j]);
+          max_val = std::max(max_val, maxs[j]);
+        }
+        return i;
+      }
+
+      // Narrowing copies assume that every non-reserved value fits in the destination type, which is how minimize()
+      // and init() choose it. Saturating packs then map non-reserved values exactly and all reserved values to the
+      // destination's missing value, after which end-of-vector lanes are restored. The destination may alias the
+      // source since each vector is loaded before any output overlapping it is stored.
+
+      template <typename SrcT, typename DestT>
+      std::size_t narrow_sse2(const SrcT*, std::size_t, DestT*) { return 0; }
+
+      inline std::size_t narrow_sse2(const std::int16_t* src, std::size_t n, std::int8_t* dest)
+      {
+        const __m128i src_eov = _mm_set1_epi16(std::int16_t(0x8001));
+        const __m128i dest_eov = _mm_set1_epi8(std::int8_t(0x81));
+        std::size_t i = 0;
+        for ( ; i + 16 <= n; i += 16)
+        {
+          __m128i a = _mm_loadu_si128((const __m128i*)(src + i));
+          __m128i b = _mm_loadu_si128((const __m128i*)(src + i + 8));
+          __m128i eov = _mm_packs_epi16(_mm_cmpeq_epi16(a, src_eov), _mm_cmpeq_epi16(b, src_eov));
+          __m128i res = _mm_packs_epi16(a, b);
+          res = _mm_or_si128(_mm_andnot_si128(eov, res), _mm_and_si128(eov, dest_eov));
+          _mm_storeu_si128((__m128i*)(dest + i), res);
+        }
+        return i;
+      }
+
+      inline std::size_t narrow_sse2(const std::int32_t* src, std::size_t n, std::int16_t* dest)
+      {
+        const __m128i src_eov = _mm_set1_epi32(std::int32_t(0x80000001));
+        const __m128i dest_eov = _mm_set1_epi16(std::int16_t(0x8001));
+        std::size_t i = 0;
+        for ( ; i + 8 <= n; i += 8)
+        {
+          __m128i a = _mm_loadu_si128((const __m128i*)(src + i));
+          __m128i b = _mm_loadu_si128((const __m128i*)(src + i + 4));
+          __m128i eov = _mm_packs_epi32(_mm_cmpeq_epi32(a, src_eov), _mm_cmpeq_epi32(b, src_eov));
+          __m128i res = _mm_packs_epi32(a, b);
+          res = _mm_or_si128(_mm_andnot_si128(eov, res), _mm_and_si128(eov, dest_eov));
+          _mm_storeu_si128((__m128i*)(dest + i), res);
+        }
+        return i;
+      }
+
+      inline std::size_t narrow_sse2(const std::int32_t* src, std::size_t n, std::int8_t* dest)
+      {
+        const __m128i src_eov = _mm_set1_epi32(std::int32_t(0x80000001));
+        const __m128i dest_eov = _mm_set1_epi8(std::int8_t(0x81));
+        std::size_t i = 0;
+        for ( ; i + 16 <= n; i += 16)
+        {
+          __m128i a = _mm_loadu_si128((const __m128i*)(src + i));
+          __m128i b = _mm_loadu_si128((const __m128i*)(src + i + 4));
+          __m128i c = _mm_loadu_si128((const __m128i*)(src + i + 8));
+          __m128i d = _mm_loadu_si128((const __m128i*)(src + i + 12));
+          __m128i eov = _mm_packs_epi16(
+            _mm_packs_epi32(_mm_cmpeq_epi32(a, src_eov), _mm_cmpeq_epi32(b, src_eov)),
+            _mm_packs_epi32(_mm_cmpeq_epi32(c, src_eov), _mm_cmpeq_epi32(d, src_eov)));
+          __m128i res = _mm_packs_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, d));
+          res = _mm_or_si128(_mm_andnot_si128(eov, res), _mm_and_si128(eov, dest_eov));
+          _mm_storeu_si128((__m128i*)(dest + i), res);
+        }
+        return i;
+      }
+
+      // Packed genotype codes above the largest allele code are the missing and end-of-vector codes, which are made
+      // reserved int8 values by adding the distance from the missing code to 0x80.
+      inline __m128i packed_codes_to_int8_sse2(__m128i codes, __m128i max_allele, __m128i reserved_delta)
+      {
+        return _mm_add_epi8(codes, _mm_and_si128(_mm_cmpgt_epi8(codes, max_allele), reserved_delta));
+      }
+
+      inline std::size_t unpack2_sse2(const std::uint8_t* src, std::size_t n, std::int8_t* dest)
+      {
+        const __m128i mask = _mm_set1_epi8(0x03);
+        const __m128i max_allele = _mm_set1_epi8(0x01);
+        const __m128i delta = _mm_set1_epi8(std::int8_t(0x80 - 0x02));
+        std::size_t i = 0;
+        for ( ; i + 64 <= n; i += 64, src += 16)
+        {
+          __m128i b = _mm_loadu_si128((const __m128i*)src);
+          __m128i c0 = _mm_and_si128(b, mask);
+          __m128i c1 = _mm_and_si128(_mm_srli_epi16(b, 2), mask);
+          __m128i c2 = _mm_and_si128(_mm_srli_epi16(b, 4), mask);
+          __m128i c3 = _mm_and_si128(_mm_srli_epi16(b, 6), mask);
+          __m128i lo01 = _mm_unpacklo_epi8(c0, c1), hi01 = _mm_unpackhi_epi8(c0, c1);
+          __m128i lo23 = _mm_unpacklo_epi8(c2, c3), hi23 = _mm_unpackhi_epi8(c2, c3);
+          _mm_storeu_si128((__m128i*)(dest + i), packed_codes_to_int8_sse2(_mm_unpacklo_epi16(lo01, lo23), max_allele, delta));
+          _mm_storeu_si128((__m128i*)(dest + i + 16), packed_codes_to_int8_sse2(_mm_unpackhi_epi16(lo01, lo23), max_allele, delta));
+          _mm_storeu_si128((__m128i*)(dest + i + 32), packed_codes_to_int8_sse2(_mm_unpacklo_epi16(hi01, hi23), max_allele, delta));
+          _mm_storeu_si128((__m128i*)(dest + i + 48), packed_codes_to_int8_sse2(_mm_unpackhi_epi16(hi01, hi23), max_allele, delta));
+        }
+        return i;
+      }
+
+      inline std::size_t unpack4_sse2(const std::uint8_t* src, std::size_t n, std::int8_t* dest)
+      {
+        const __m128i mask = _mm_set1_epi8(0x0F);
+        const __m128i max_allele = _mm_set1_epi8(0x0D);
+        const __m128i delta = _mm_set1_epi8(std::int8_t(0x80 - 0x0E));
+        std::size_t i = 0;
+        for ( ; i + 32 <= n; i += 32, src += 16)
+        {
+          __m128i b = _mm_loadu_si128((const __m128i*)src);
+          __m128i c0 = _mm_and_si128(b, mask);
+          __m128i c1 = _mm_and_si128(_mm_srli_epi16(b, 4), mask);
+          _mm_storeu_si128((__m128i*)(dest + i), packed_codes_to_int8_sse2(_mm_unpacklo_epi8(c0, c1), max_allele, delta));
+          _mm_storeu_si128((__m128i*)(dest + i + 16), packed_codes_to_int8_sse2(_mm_unpackhi_epi8(c0, c1), max_allele, delta));
+        }
+        return i;
+      }
+#endif
+
+      /**
+       * Reduces the smallest and largest non-reserved values of a vector prefix. The caller finishes the remaining
+       * values with a scalar loop.
+       * @param p Pointer to values
+       * @param n Number of values
+       * @param min_val Running minimum (updated)
+       * @param max_val Running maximum (updated)
+       * @return Number of values reduced (zero when no kernel exists for type)
+       */
+      template <typename T>
+      std::size_t minmax_prefix(const T* p, std::size_t n, T& min_val, T& max_val)
+      {
+#ifdef SAVVY_SIMD_X86
+        return has_avx2() ? minmax_avx2(p, n, min_val, max_val) : minmax_sse2(p, n, min_val, max_val);
+#else
+        return 0;
+#endif
+      }
+
+      /**
+       * Converts a vector prefix to a narrower integer type, mapping reserved values the way
+       * typed_value::reserved_transformation() does. The caller finishes the remaining values with a scalar loop.
+       * @param src Source values
+       * @param n Number of values
+       * @param dest Destination (may be the same address as src)
+       * @return Number of values converted (zero when no kernel exists for the pair of types)
+       */
+      template <typename SrcT, typename DestT>
+      std::size_t narrow_prefix(const SrcT* src, std::size_t n, DestT* dest)
+      {
+#ifdef SAVVY_SIMD_X86
+        return narrow_sse2(src, n, dest);
+#else
+        return 0;
+#endif
+      }
+
+      /**
+       * Expands a prefix of bit-packed genotype codes (see typed_value::internal::serialize_packed()) into int8 values.
+       * The caller finishes the remaining values with a scalar loop.
+       * @param bits Bits per value (2 or 4)
+       * @param src Packed codes
+       * @param n Number of values
+       * @param dest Destination
+       * @return Number of values expanded (a multiple of 8)
+       */
+      inline std::size_t unpack_prefix(std::uint8_t bits, const std::uint8_t* src, std::size_t n, std::int8_t* dest)
+      {
+#ifdef SAVVY_SIMD_X86
+        return bits == 2 ? unpack2_sse2(src, n, dest) : unpack4_sse2(src, n, dest);
+#else
+        return 0;
+#endif
+      }
+
+      /**
+       * Calls fn with the index of each non-zero element in ascending order. Runs of zeros are skipped a vector at a
+       * time for 8-bit, 16-bit and float values.
+       * @param p Pointer to dense values
+       * @param n Number of values
+       * @param fn Functor taking std::size_t index
+       */
+      template <typename T, typename Fn>
+      void for_each_nonzero(const T* p, std::size_t n, Fn& fn)
+      {
+        for_each_nonzero(p, n, fn, std::integral_constant<bool, has_nonzero_kernel<T>::value>());
+      }
+    }
+  }
+}
+
+#endif // LIBSAVVY_SIMD_HPP
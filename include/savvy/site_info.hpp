@@ -259,10 +259,12 @@ namespace savvy
        */
       void set_format(const std::string& key, typed_value&& val);
     private:
-      template <typename OutT>
-      static bool serialize(const variant& v, OutT out_it, const dictionary& dict, std::size_t sample_size, bool is_bcf, phasing phased, ::savvy::internal::pbwt_sort_context& pbwt_ctx, const std::vector<::savvy::internal::pbwt_sort_map*>& pbwt_format_pointers);
+      template <typename OutT, typename ValT>
+      static bool serialize(const std::vector<std::pair<std::string, ValT>>& format_fields, OutT out_it, const dictionary& dict, std::size_t sample_size, bool is_bcf, phasing phased, ::savvy::internal::pbwt_sort_context& pbwt_ctx, const std::vector<::savvy::internal::pbwt_sort_format_context*>& pbwt_format_pointers, const std::vector<std::uint8_t>& packed_bit_widths);
       static std::int64_t deserialize_indiv(variant& v, std::istream& is, const dictionary& dict, std::size_t sample_size, bool is_bcf, phasing phased);
-      static void pbwt_unsort_typed_values(variant& v, typed_value& extra_val, internal::pbwt_sort_context& pbwt_context);
+      static void pbwt_unsort_typed_values(variant& v, const dictionary& dict, typed_value& extra_val, internal::pbwt_sort_context& pbwt_context);
+      static void pbwt_expand_runs_to_sparse(variant& v, typed_value& extra_val);
+      static bool indiv_has_pbwt_fields(const std::vector<char>& indiv_buf, std::uint32_t n_fmt);
       static bool deserialize_vcf(variant& v, std::istream& is, const dictionary& dict, std::size_t sample_size, phasing phasing_status);
       static bool deserialize_vcf2(variant& v, std::istream& is, const dictionary& dict, std::size_t sample_size, phasing phasing_status);
       static bool deserialize_sav1(variant& v, std::istream& is, const std::list<header_value_details>& format_headers, std::size_t sample_size);
@@ -886,19 +888,98 @@ namespace savvy
     }
 
     inline
-    void variant::pbwt_unsort_typed_values(variant& v, typed_value& extra_val, internal::pbwt_sort_context& pbwt_context)
+    void variant::pbwt_unsort_typed_values(variant& v, const dictionary& dict, typed_value& extra_val, internal::pbwt_sort_context& pbwt_context)
     {
       for (auto it = v.format_fields_.begin(); it != v.format_fields_.end(); ++it)
       {
         if (it->second.pbwt_flag())
         {
-          auto& format_pbwt_ctx = pbwt_context.format_contexts[it->first][it->second.size()];
+          auto res = dict.str_to_int[dictionary::id].find(it->first);
+          assert(res != dict.str_to_int[dictionary::id].end()); // FMT keys are validated in deserialize_indiv().
+          auto& format_pbwt_ctx = pbwt_context.get(res->second, it->second.size());
           typed_value::internal::pbwt_unsort(it->second, extra_val, format_pbwt_ctx, pbwt_context.prev_sort_mapping, pbwt_context.counts);
           std::swap(it->second, extra_val);
         }
       }
     }
 
+    inline
+    void variant::pbwt_expand_runs_to_sparse(variant& v, typed_value& extra_val)
+    {
+      for (auto it = v.format_fields_.begin(); it != v.format_fields_.end(); ++it)
+      {
+        if (it->second.pbwt_flag() && it->second.is_sparse())
+        {
+          typed_value::internal::pbwt_runs_to_sparse(it->second, extra_val);
+          std::swap(it->second, extra_val);
+        }
+      }
+    }
+
+    /**
+     * Scans serialized SAV individual data for PBWT-sorted fields without decoding it.
+     * @param indiv_buf Individual data of one record
+     * @param n_fmt Number of FORMAT fields in record
+     * @return True if any field is PBWT-sorted or if data is malformed
+     */
+    inline
+    bool variant::indiv_has_pbwt_fields(const std::vector<char>& indiv_buf, std::uint32_t n_fmt)
+    {
+      auto it = indiv_buf.begin();
+      auto end = indiv_buf.end();
+      try
+      {
+        for (std::uint32_t i = 0; i < n_fmt; ++i)
+        {
+          std::int32_t fmt_key_id;
+          it = typed_value::internal::deserialize_int(it, end, fmt_key_id);
+          if (it == end)
+            return true;
+
+          std::uint8_t type_byte = *(it++);
+          if (0x08u & type_byte)
+            return true;
+
+          std::uint8_t type = 0x07u & type_byte;
+          std::int64_t sz = type_byte >> 4u;
+          if (sz == 15)
+            it = typed_value::internal::deserialize_int(it, end, sz);
+
+          std::uint64_t n_bytes = 0;
+          if (sz && type == typed_value::sparse)
+          {
+            if (it == end)
+              return true;
+            std::uint8_t sp_type_byte = *(it++);
+            if ((sp_type_byte >> 4u) == 0) // bit-packed genotype codes
+            {
+              n_bytes = (sz * (sp_type_byte & 0x0Fu) + 7u) / 8u;
+            }
+            else
+            {
+              std::int64_t sp_sz = 0;
+              it = typed_value::internal::deserialize_int(it, end, sp_sz);
+              n_bytes = sp_sz * ((1u << bcf_type_shift[sp_type_byte >> 4u]) + (1u << bcf_type_shift[sp_type_byte & 0x0Fu]));
+            }
+          }
+          else
+          {
+            n_bytes = sz * (1u << bcf_type_shift[type]);
+          }
+
+          if (std::uint64_t(end - it) < n_bytes)
+            return true;
+          it += n_bytes;
+        }
+      }
+      catch (const std::exception&)
+      {
+        return true;
+      }
+
+      return false;
+    }
+
     /* OLD METHOD USED FOR FLAT BUFFER DESIGN
     inline
     bool variant::deserialize(variant& v, const dictionary& dict, internal::pbwt_sort_context& pbwt_context, std::size_t sample_size, bool is_bcf, phasing phased)
@@ -1581,11 +1662,11 @@ namespace savvy
       return false;
     }
 
-    template <typename OutT>
-    bool variant::serialize(const variant& v, OutT out_it, const dictionary& dict, std::size_t sample_size, bool is_bcf, phasing phased, ::savvy::internal::pbwt_sort_context& pbwt_ctx, const std::vector<::savvy::internal::pbwt_sort_map*>& pbwt_format_pointers)
+    template <typename OutT, typename ValT>
+    bool variant::serialize(const std::vector<std::pair<std::string, ValT>>& format_fields, OutT out_it, const dictionary& dict, std::size_t sample_size, bool is_bcf, phasing phased, ::savvy::internal::pbwt_sort_context& pbwt_ctx, const std::vector<::savvy::internal::pbwt_sort_format_context*>& pbwt_format_pointers, const std::vector<std::uint8_t>& packed_bit_widths)
     {
       // Encode FMT
-      for (auto it = v.format_fields_.begin(); it != v.format_fields_.end(); ++it)
+      for (auto it = format_fields.begin(); it != format_fields.end(); ++it)
       {
         if (is_bcf && it->first == "PH") continue;
         auto res = dict.str_to_int[dictionary::id].find(it->first);
@@ -1598,10 +1679,14 @@ namespace savvy
         // TODO: Allow for BCF writing.
         typed_value::internal::serialize_typed_scalar(out_it, static_cast<std::int32_t>(res->second));
 
-        auto* pbwt_ptr = pbwt_format_pointers[it - v.format_fields_.begin()];
+        auto* pbwt_ptr = pbwt_format_pointers[it - format_fields.begin()];
         if (pbwt_ptr)
         {
-          typed_value::internal::serialize(it->second, out_it, *pbwt_ptr, pbwt_ctx.prev_sort_mapping, pbwt_ctx.counts);
+          typed_value::internal::serialize(it->second, out_it, *pbwt_ptr, pbwt_ctx);
+        }
+        else if (packed_bit_widths[it - format_fields.begin()])
+        {
+          typed_value::internal::serialize_packed(it->second, out_it, packed_bit_widths[it - format_fields.begin()]);
         }
         else
         {
@@ -1611,17 +1696,17 @@ namespace savvy
             it->second.copy_as_dense(dense_gt);
 
             auto jt = it + 1;
-            for (; jt != v.format_fields().end(); ++jt)
+            for (; jt != format_fields.end(); ++jt)
             {
               if (jt->first == "PH")
               {
                 assert(dense_gt.size() % sample_size == 0 && (dense_gt.size() / sample_size - 1) * sample_size == jt->second.size()); // TODO: graceful error
-                dense_gt.apply_dense(typed_value::bcf_gt_encoder(), (std::int8_t*) jt->second.val_data_.data(), dense_gt.size() / sample_size);
+                dense_gt.apply_dense(typed_value::bcf_gt_encoder(), (const std::int8_t*) typed_value_view(jt->second).val_ptr_, dense_gt.size() / sample_size);
                 break;
               }
             }
 
-            if (jt == v.format_fields().end())
+            if (jt == format_fields.end())
               dense_gt.apply_dense(typed_value::bcf_gt_encoder(), phased == phasing::phased);
 
             typed_value::internal::serialize(dense_gt, out_it, is_bcf ? sample_size : 1);
@@ -0,0 +1,172 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef LIBSAVVY_SMALL_BUFFER_HPP
+#define LIBSAVVY_SMALL_BUFFER_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <iterator>
+
+namespace savvy
+{
+  namespace detail
+  {
+    /**
+     * Byte buffer with the subset of the std::vector<char> interface used by typed_value. Up to N bytes are stored
+     * inline, so scalars and short vectors (e.g., most INFO values) do not allocate. Larger sizes are stored on the
+     * heap, and capacity is retained by clear() and resize() like std::vector. Storage is aligned for 64-bit values.
+     */
+    template <std::size_t N>
+    class small_buffer
+    {
+    public:
+      typedef char value_type;
+      typedef std::size_t size_type;
+      typedef char* iterator;
+      typedef const char* const_iterator;
+
+      small_buffer() {}
+
+      small_buffer(const small_buffer& other)
+      {
+        assign(other.begin(), other.end());
+      }
+
+      small_buffer(small_buffer&& other)
+      {
+        steal(other);
+      }
+
+      ~small_buffer()
+      {
+        if (data_ != inline_)
+          delete[] data_;
+      }
+
+      small_buffer& operator=(const small_buffer& other)
+      {
+        if (this != &other)
+          assign(other.begin(), other.end());
+        return *this;
+      }
+
+      small_buffer& operator=(small_buffer&& other)
+      {
+        if (this != &other)
+        {
+          if (data_ != inline_)
+            delete[] data_;
+          data_ = inline_;
+          capacity_ = N;
+          steal(other);
+        }
+        return *this;
+      }
+
+      char* data() { return data_; }
+      const char* data() const { return data_; }
+      std::size_t size() const { return size_; }
+      std::size_t capacity() const { return capacity_; }
+      bool empty() const { return size_ == 0; }
+
+      iterator begin() { return data_; }
+      iterator end() { return data_ + size_; }
+      const_iterator begin() const { return data_; }
+      const_iterator end() const { return data_ + size_; }
+
+      char& operator[](std::size_t i) { return data_[i]; }
+      const char& operator[](std::size_t i) const { return data_[i]; }
+
+      void clear() { size_ = 0; }
+
+      void reserve(std::size_t n)
+      {
+        if (n > capacity_)
+          reallocate(n);
+      }
+
+      /**
+       * Resizes buffer. New bytes are zero-initialized like std::vector<char>.
+       * @param n New size
+       * @param val Value of new bytes
+       */
+      void resize(std::size_t n, char val = 0)
+      {
+        if (n > capacity_)
+          reallocate(std::max(n, capacity_ * 2));
+        if (n > size_)
+          std::memset(data_ + size_, val, n - size_);
+        size_ = n;
+      }
+
+      template <typename InIt>
+      void assign(InIt beg, InIt end)
+      {
+        std::size_t n = std::distance(beg, end);
+        if (n > capacity_)
+        {
+          size_ = 0; // nothing to preserve
+          reallocate(n);
+        }
+        std::copy(beg, end, data_);
+        size_ = n;
+      }
+
+      void swap(small_buffer& other)
+      {
+        if (data_ != inline_ && other.data_ != other.inline_)
+        {
+          std::swap(data_, other.data_);
+          std::swap(size_, other.size_);
+          std::swap(capacity_, other.capacity_);
+        }
+        else
+        {
+          small_buffer tmp(std::move(other));
+          other = std::move(*this);
+          *this = std::move(tmp);
+        }
+      }
+    private:
+      void reallocate(std::size_t n)
+      {
+        char* p = new char[n];
+        std::memcpy(p, data_, size_);
+        if (data_ != inline_)
+          delete[] data_;
+        data_ = p;
+        capacity_ = n;
+      }
+
+      // Takes heap storage of other or copies its inline bytes. Other is left empty with inline storage.
+      void steal(small_buffer& other)
+      {
+        if (other.data_ != other.inline_)
+        {
+          data_ = other.data_;
+          capacity_ = other.capacity_;
+          other.data_ = other.inline_;
+          other.capacity_ = N;
+        }
+        else
+        {
+          std::memcpy(inline_, other.inline_, other.size_);
+        }
+        size_ = other.size_;
+        other.size_ = 0;
+      }
+    private:
+      alignas(8) char inline_[N];
+      char* data_ = inline_;
+      std::size_t size_ = 0;
+      std::size_t capacity_ = N;
+    };
+  }
+}
+
+#endif // LIBSAVVY_SMALL_BUFFER_HPP
@@ -0,0 +1,320 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef LIBSAVVY_STAGE_STATS_HPP
+#define LIBSAVVY_STAGE_STATS_HPP
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <ostream>
+#include <streambuf>
+#include <utility>
+
+namespace savvy
+{
+  /**
+   * Time, byte and call counters for the stages of reading and writing records. Counters are only updated when savvy
+   * is compiled with SAVVY_PROFILE defined (-DENABLE_PROFILING=ON). Otherwise, the timers compile to nothing and all
+   * counters remain zero.
+   *
+   * Each stage's time excludes the time spent refilling the input buffer (the read stage) while that stage was
+   * running, so the stage times add up to the total time spent in the reader.
+   */
+  class stage_stats
+  {
+  public:
+    enum class stage : std::uint8_t
+    {
+      read = 0,           ///< Input buffer refills (file reads and zstd/bgzf decompression)
+      deserialize_shared, ///< Parsing of site data (SAV/BCF)
+      deserialize_indiv,  ///< Parsing of individual data (SAV/BCF)
+      pbwt_unsort,        ///< Restoring sample order of PBWT-sorted fields
+      subset,             ///< Sample subsetting and minimize()
+      vcf_parse,          ///< VCF tokenizing and minimize()
+      serialize,          ///< Serialization of site and individual data (includes PBWT sorting)
+      compress            ///< Compression and writing of serialized records
+    };
+
+    static const std::size_t stage_count = std::size_t(stage::compress) + 1;
+
+    struct counter
+    {
+      std::uint64_t nanoseconds = 0;
+      std::uint64_t bytes = 0;
+      std::uint64_t calls = 0;
+    };
+
+    /**
+     * @return Whether savvy was compiled with instrumentation enabled
+     */
+    static constexpr bool enabled()
+    {
+#ifdef SAVVY_PROFILE
+      return true;
+#else
+      return false;
+#endif
+    }
+
+    /**
+     * @param s Stage
+     * @return Name of stage as printed by print()
+     */
+    static const char* name(stage s);
+
+    /**
+     * @param s Stage
+     * @return Counters for stage
+     */
+    const counter& operator[](stage s) const { return counters_[std::size_t(s)]; }
+    counter& operator[](stage s) { return counters_[std::size_t(s)]; }
+
+    /**
+     * Adds counters of another object to this one.
+     * @param other Counters to add
+     * @return Reference to this object
+     */
+    stage_stats& operator+=(const stage_stats& other);
+
+    /**
+     * Resets all counters to zero.
+     */
+    void clear() { counters_ = {}; }
+
+    /**
+     * @return Whether any stage has been called
+     */
+    bool empty() const;
+
+    /**
+     * Prints a table of stages with seconds, calls, megabytes and throughput. Stages that were never called are omitted.
+     * @param os Output stream
+     */
+    void print(std::ostream& os) const;
+
+    /**
+     * Counters accumulated by all readers and writers that have been destroyed (only when SAVVY_PROFILE is defined).
+     * @return Copy of process-wide counters
+     */
+    static stage_stats process_totals();
+
+    /**
+     * Adds to process-wide counters. Thread safe.
+     * @param s Counters to add
+     */
+    static void add_to_process_totals(const stage_stats& s);
+  private:
+    static std::mutex& process_mutex();
+    static stage_stats& process_stats();
+  private:
+    std::array<counter, stage_count> counters_ = {};
+  };
+
+  inline
+  const char* stage_stats::name(stage s)
+  {
+    switch (s)
+    {
+    case stage::read: return "read";
+    case stage::deserialize_shared: return "deserialize_shared";
+    case stage::deserialize_indiv: return "deserialize_indiv";
+    case stage::pbwt_unsort: return "pbwt_unsort";
+    case stage::subset: return "subset";
+    case stage::vcf_parse: return "vcf_parse";
+    case stage::serialize: return "serialize";
+    case stage::compress: return "compress";
+    }
+    return "";
+  }
+
+  inline
+  stage_stats& stage_stats::operator+=(const stage_stats& other)
+  {
+    for (std::size_t i = 0; i < stage_count; ++i)
+    {
+      counters_[i].nanoseconds += other.counters_[i].nanoseconds;
+      counters_[i].bytes += other.counters_[i].bytes;
+      counters_[i].calls += other.counters_[i].calls;
+    }
+    return *this;
+  }
+
+  inline
+  bool stage_stats::empty() const
+  {
+    for (auto it = counters_.begin(); it != counters_.end(); ++it)
+    {
+      if (it->calls)
+        return false;
+    }
+    return true;
+  }
+
+  inline
+  void stage_stats::print(std::ostream& os) const
+  {
+    char line[128];
+    std::snprintf(line, sizeof(line), "%-20s %12s %12s %12s %12s\n", "stage", "seconds", "calls", "MB", "MB/s");
+    os << line;
+    for (std::size_t i = 0; i < stage_count; ++i)
+    {
+      const counter& c = counters_[i];
+      if (!c.calls)
+        continue;
+      double secs = double(c.nanoseconds) / 1e9;
+      double mb = double(c.bytes) / (1024. * 1024.);
+      std::snprintf(line, sizeof(line), "%-20s %12.3f %12llu %12.1f %12.1f\n", name(stage(i)), secs, (unsigned long long)c.calls, mb, secs > 0. ? mb / secs : 0.);
+      os << line;
+    }
+  }
+
+  inline
+  std::mutex& stage_stats::process_mutex()
+  {
+    static std::mutex m;
+    return m;
+  }
+
+  inline
+  stage_stats& stage_stats::process_stats()
+  {
+    static stage_stats s;
+    return s;
+  }
+
+  inline
+  stage_stats stage_stats::process_totals()
+  {
+    std::lock_guard<std::mutex> lk(process_mutex());
+    return process_stats();
+  }
+
+  inline
+  void stage_stats::add_to_process_totals(const stage_stats& s)
+  {
+    std::lock_guard<std::mutex> lk(process_mutex());
+    process_stats() += s;
+  }
+
+  namespace detail
+  {
+    /**
+     * Per-object counters that are added to the process-wide totals when the owning reader or writer is destroyed.
+     */
+    class owned_stage_stats : public stage_stats
+    {
+    public:
+      owned_stage_stats() = default;
+      owned_stage_stats(owned_stage_stats&& other) : stage_stats(other) { other.clear(); }
+      owned_stage_stats& operator=(owned_stage_stats&& other)
+      {
+        if (this != &other)
+        {
+#ifdef SAVVY_PROFILE
+          if (!empty())
+            add_to_process_totals(*this);
+#endif
+          stage_stats::operator=(other);
+          other.clear();
+        }
+        return *this;
+      }
+
+      ~owned_stage_stats()
+      {
+#ifdef SAVVY_PROFILE
+        if (!empty())
+          add_to_process_totals(*this);
+#endif
+      }
+    };
+
+    /**
+     * Scoped timer that adds elapsed time to a stage, minus any time spent in the read stage meanwhile.
+     */
+    class stage_timer
+    {
+#ifdef SAVVY_PROFILE
+    public:
+      stage_timer(stage_stats& stats, stage_stats::stage s, std::uint64_t bytes = 0) :
+        stats_(stats),
+        stage_(s),
+        bytes_(bytes),
+        read_ns_(stats[stage_stats::stage::read].nanoseconds),
+        start_(std::chrono::steady_clock::now())
+      {
+      }
+
+      ~stage_timer()
+      {
+        stop();
+      }
+
+      void add_bytes(std::uint64_t n) { bytes_ += n; }
+
+      /**
+       * Adds elapsed time to stage before the timer goes out of scope. Subsequent calls have no effect.
+       * @param bytes Bytes to add to stage
+       */
+      void stop(std::uint64_t bytes = 0)
+      {
+        if (stopped_)
+          return;
+        stopped_ = true;
+        bytes_ += bytes;
+        auto elapsed = std::uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start_).count());
+        std::uint64_t nested = stage_ == stage_stats::stage::read ? 0 : stats_[stage_stats::stage::read].nanoseconds - read_ns_;
+        stage_stats::counter& c = stats_[stage_];
+        c.nanoseconds += elapsed > nested ? elapsed - nested : 0;
+        c.bytes += bytes_;
+        ++c.calls;
+      }
+    private:
+      stage_stats& stats_;
+      stage_stats::stage stage_;
+      std::uint64_t bytes_;
+      std::uint64_t read_ns_;
+      std::chrono::steady_clock::time_point start_;
+      bool stopped_ = false;
+#else
+    public:
+      stage_timer(stage_stats&, stage_stats::stage, std::uint64_t = 0) {}
+      void add_bytes(std::uint64_t) {}
+      void stop(std::uint64_t = 0) {}
+#endif
+    };
+
+    /**
+     * Input stream buffer that times refills of the wrapped buffer type as the read stage.
+     */
+    template <typename BufT>
+    class profiled_ibuf : public BufT
+    {
+    public:
+      template <typename... Args>
+      profiled_ibuf(stage_stats& stats, Args&&... args) :
+        BufT(std::forward<Args>(args)...),
+        stats_(stats)
+      {
+      }
+    protected:
+      typename BufT::int_type underflow()
+      {
+        stage_timer t(stats_, stage_stats::stage::read);
+        auto ret = BufT::underflow();
+        t.add_bytes(std::uint64_t(this->egptr() - this->gptr()));
+        return ret;
+      }
+    private:
+      stage_stats& stats_;
+    };
+  }
+}
+
+#endif // LIBSAVVY_STAGE_STATS_HPP
@@ -0,0 +1,116 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef LIBSAVVY_SUBSET_INDEX_HPP
+#define LIBSAVVY_SUBSET_INDEX_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+namespace savvy
+{
+  namespace detail
+  {
+    /**
+     * Precomputed lookup tables for subsetting samples in place. Built once per call to reader::subset_samples() so
+     * that each record only pays for the kept samples (dense values) or for one bit test per non-zero (sparse values).
+     *
+     * The subset must preserve sample order (i.e., kept samples are numbered 0, 1, 2, ... in the order they appear),
+     * since values are moved toward the front of the same buffer.
+     */
+    class subset_index
+    {
+    public:
+      static const std::size_t excluded = std::numeric_limits<std::size_t>::max();
+
+      subset_index() {}
+
+      /**
+       * @param subset_map Maps each sample index to its index in the subset (or excluded)
+       * @param subset_size Number of samples in subset
+       */
+      subset_index(const std::vector<std::size_t>& subset_map, std::size_t subset_size)
+      {
+        assign(subset_map, subset_size);
+      }
+
+      void assign(const std::vector<std::size_t>& subset_map, std::size_t subset_size)
+      {
+        map_ = subset_map;
+        gather_.clear();
+        gather_.reserve(subset_size);
+        bitmap_.clear();
+        bitmap_.resize((map_.size() + 63) / 64, 0);
+        for (std::size_t i = 0; i < map_.size(); ++i)
+        {
+          if (map_[i] != excluded)
+          {
+            gather_.push_back(i);
+            bitmap_[i / 64] |= std::uint64_t(1) << (i % 64);
+          }
+        }
+
+        first_moved_ = 0;
+        while (first_moved_ < gather_.size() && gather_[first_moved_] == first_moved_)
+          ++first_moved_;
+      }
+
+      /**
+       * @return Number of samples before subsetting
+       */
+      std::size_t full_size() const { return map_.size(); }
+
+      /**
+       * @return Number of samples after subsetting
+       */
+      std::size_t subset_size() const { return gather_.size(); }
+
+      /**
+       * @param sample Index of sample before subsetting
+       * @return Whether sample is kept
+       */
+      bool contains(std::size_t sample) const { return (bitmap_[sample / 64] >> (sample % 64)) & 1u; }
+
+      /**
+       * @param sample Index of kept sample before subsetting
+       * @return Index of sample after subsetting
+       */
+      std::size_t operator[](std::size_t sample) const { return map_[sample]; }
+
+      /**
+       * @return Source sample index for each sample in subset
+       */
+      const std::vector<std::size_t>& gather() const { return gather_; }
+
+      /**
+       * @return Index of first kept sample that is not already in place (i.e., the length of the leading run of kept samples)
+       */
+      std::size_t first_moved() const { return first_moved_; }
+
+      /**
+       * @return Whether order of kept samples is preserved, which is required for subsetting in place
+       */
+      bool order_preserving() const
+      {
+        for (std::size_t i = 0; i < gather_.size(); ++i)
+        {
+          if (map_[gather_[i]] != i)
+            return false;
+        }
+        return true;
+      }
+    private:
+      std::vector<std::size_t> map_;
+      std::vector<std::size_t> gather_;
+      std::vector<std::uint64_t> bitmap_;
+      std::size_t first_moved_ = 0;
+    };
+  }
+}
+
+#endif // LIBSAVVY_SUBSET_INDEX_HPP
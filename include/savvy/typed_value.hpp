@@ -12,6 +12,10 @@
 #include "sample_subset.hpp"
 #include "portable_endian.hpp"
 #include "endianness.hpp"
+#include "pbwt.hpp"
+#include "simd.hpp"
+#include "small_buffer.hpp"
+#include "subset_index.hpp"
 
 #include <cstdint>
 #include <type_traits>
@@ -22,6 +26,7 @@
 #include <cassert>
 #include <cstring>
 #include <functional>
+#include <iterator>
 #include <unordered_set>
 #include <cinttypes>
 
@@ -51,11 +56,14 @@ namespace savvy
     class variant;
   //}
 
+  class typed_value_view;
+
   class typed_value
   {
     friend class reader;
     friend class writer;
     friend class variant;
+    friend class typed_value_view;
   public:
     static const std::uint8_t int8 = 1;
     static const std::uint8_t int16 = 2;
@@ -361,6 +369,15 @@ namespace savvy
       operator=(src);
     }
 
+    /**
+     * Copies the data referenced by a view.
+     * @param src Source view
+     */
+    typed_value(const typed_value_view& src)
+    {
+      operator=(src);
+    }
+
     std::size_t size() const { return size_; }
     std::size_t non_zero_size() const { return sparse_size_; }
 
@@ -369,6 +386,35 @@ namespace savvy
     std::size_t off_width() const { return (1u << bcf_type_shift[off_type_]); }
     std::size_t val_width() const { return (1u << bcf_type_shift[val_type_]); }
 
+    /**
+     * @return Whether this is a run-length encoded PBWT column (see reader::expand_pbwt_runs()). Such values can
+     * only be inspected with for_each_pbwt_run(); get() and the other visitors return false.
+     */
+    bool pbwt_runs() const { return pbwt_runs_; }
+
+    /**
+     * Visits the runs of a run-length encoded PBWT column in sorted order without expanding them, so the work is
+     * proportional to the number of runs. For example, the alternate allele count of a GT field is the sum of the
+     * lengths of runs with a value greater than zero.
+     * @param fn Callable invoked as fn(value, length) for each run, where value is std::int8_t or std::int16_t
+     * @return False if value is not a run-length encoded PBWT column
+     */
+    template <typename Fn>
+    bool for_each_pbwt_run(Fn fn) const
+    {
+      if (!pbwt_runs_)
+        return false;
+      switch (val_type_)
+      {
+      case 0x01u:
+        return for_each_pbwt_run<std::int8_t>(fn);
+      case 0x02u:
+        return for_each_pbwt_run<std::int16_t>(fn);
+      default:
+        return false;
+      }
+    }
+
     template<typename T>
     typed_value& operator=(const T& v)
     {
@@ -382,6 +428,7 @@ namespace savvy
 
     typed_value& operator=(typed_value&& src);
     typed_value& operator=(const typed_value& src);
+    typed_value& operator=(const typed_value_view& src);
     //void swap(typed_value& src); // This is not a good idea since the pointers sometimes reference external data.
 
     struct set_off_type
@@ -390,21 +437,20 @@ namespace savvy
       void operator()(const T* p, const T* p_end, typed_value& dest)
       {
         std::size_t sz = p_end - p;
-        dest.sparse_size_ = 0;
+        std::size_t sparse_size = 0;
         std::size_t offset_max = 0;
         std::size_t last_off = 0;
-        for (std::size_t i = 0; i < sz; ++i)
+        auto count_fn = [&](std::size_t i)
         {
-          if (p[i])
-          {
-            std::size_t off = i - last_off;
-            last_off = i + 1;
-            if (off > offset_max)
-              offset_max = off;
-            ++dest.sparse_size_;
-          }
-        }
-
+          std::size_t off = i - last_off;
+          last_off = i + 1;
+          if (off > offset_max)
+            offset_max = off;
+          ++sparse_size;
+        };
+        detail::simd::for_each_nonzero(p, sz, count_fn);
+
+        dest.sparse_size_ = sparse_size;
         dest.off_type_ = type_code_ignore_missing(static_cast<std::int64_t>(offset_max));
       }
     };
@@ -417,17 +463,15 @@ namespace savvy
         const ValT* dense_p = (const ValT*)src_p;
 
         std::size_t last_off = 0;
-        for (std::size_t i = 0; i < dense_sz; ++i)
+        auto compact_fn = [&](std::size_t i)
         {
-          if (dense_p[i])
-          {
-            std::size_t off = i - last_off;
-            last_off = i + 1;
+          std::size_t off = i - last_off;
+          last_off = i + 1;
 
-            *(off_p++) = off;
-            *(p++) = dense_p[i];
-          }
-        }
+          *(off_p++) = off;
+          *(p++) = dense_p[i];
+        };
+        detail::simd::for_each_nonzero(dense_p, dense_sz, compact_fn);
       }
     };
 
@@ -443,6 +487,7 @@ namespace savvy
         capply_dense(set_off_type(), std::ref(dest));
 
         dest.pbwt_flag_ = pbwt_flag_;
+        dest.pbwt_runs_ = false;
         dest.val_type_ = val_type_;
         dest.size_ = size_;
 
@@ -459,6 +504,9 @@ namespace savvy
 
     bool copy_as_dense(typed_value& dest) const
     {
+      if (pbwt_runs_)
+        return false;
+
       dest.sparse_size_ = 0;
       dest.off_type_ = 0;
       dest.off_data_.clear();
@@ -467,6 +515,7 @@ namespace savvy
       dest.val_data_.resize(size_ * (1u << bcf_type_shift[val_type_]));
       dest.size_ = size_;
       dest.pbwt_flag_ = pbwt_flag_;
+      dest.pbwt_runs_ = false;
 
       if (off_type_)
       {
@@ -598,10 +647,69 @@ namespace savvy
       return true;
     }
 
+    /**
+     * Concatenates the per-sample values of several typed values (e.g., when merging files with disjoint sample
+     * sets). If every source is sparse and has the same number of values per sample, offsets are spliced with a
+     * sample-offset shift instead of densifying. Otherwise, the result is dense and samples with fewer values are
+     * padded with end-of-vector values.
+     * @param srcs Source values in sample order (nullptr or empty if a source lacks the field, in which case its samples are set to missing)
+     * @param sample_counts Number of samples in each source
+     * @param dest Destination value
+     * @return False if a source size is not a multiple of its sample count, a source is in PBWT order, or strings are mixed with numeric values
+     */
+    static bool concat_samples(const std::vector<const typed_value*>& srcs, const std::vector<std::size_t>& sample_counts, typed_value& dest)
+    {
+      std::uint8_t val_type = 0;
+      std::size_t stride = 0;
+      bool sparse = true;
+      for (std::size_t i = 0; i < srcs.size(); ++i)
+      {
+        if (!srcs[i] || srcs[i]->size_ == 0)
+          continue;
+
+        if (sample_counts[i] == 0 || srcs[i]->size_ % sample_counts[i] || srcs[i]->pbwt_flag_)
+          return false;
+
+        if (val_type && (val_type == str) != (srcs[i]->val_type_ == str))
+          return false;
+
+        std::size_t src_stride = srcs[i]->size_ / sample_counts[i];
+        if (stride && src_stride != stride)
+          sparse = false;
+        if (!srcs[i]->off_type_)
+          sparse = false;
+
+        stride = std::max(stride, src_stride);
+        val_type = std::max(val_type, srcs[i]->val_type_);
+      }
+
+      dest.clear();
+      if (stride == 0)
+        return true;
+
+      switch (val_type)
+      {
+      case int8:
+        return sparse ? concat_samples_sparse<std::int8_t>(srcs, sample_counts, stride, dest) : concat_samples_dense<std::int8_t>(srcs, sample_counts, stride, dest);
+      case int16:
+        return sparse ? concat_samples_sparse<std::int16_t>(srcs, sample_counts, stride, dest) : concat_samples_dense<std::int16_t>(srcs, sample_counts, stride, dest);
+      case int32:
+        return sparse ? concat_samples_sparse<std::int32_t>(srcs, sample_counts, stride, dest) : concat_samples_dense<std::int32_t>(srcs, sample_counts, stride, dest);
+      case int64:
+        return sparse ? concat_samples_sparse<std::int64_t>(srcs, sample_counts, stride, dest) : concat_samples_dense<std::int64_t>(srcs, sample_counts, stride, dest);
+      case real:
+        return sparse ? concat_samples_sparse<float>(srcs, sample_counts, stride, dest) : concat_samples_dense<float>(srcs, sample_counts, stride, dest);
+      case str:
+        return concat_samples_dense<char>(srcs, sample_counts, stride, dest);
+      }
+
+      return false;
+    }
+
     template <typename ValT, typename Fn, typename... Args>
     bool apply_sparse_offsets(Fn fn, Args... args)
     {
-      if (!off_data_.data())
+      if (!off_data_.data() || pbwt_runs_)
         return false;
       switch (off_type_)
       {
@@ -648,7 +756,7 @@ namespace savvy
     template <typename ValT, typename Fn, typename... Args>
     bool capply_sparse_offsets(Fn fn, Args... args) const
     {
-      if (!off_data_.data())
+      if (!off_data_.data() || pbwt_runs_)
         return false;
       switch (off_type_)
       {
@@ -1037,7 +1145,7 @@ namespace savvy
       static_assert(std::is_signed<T>::value, "Destination value_type must be signed.");
       static_assert(!std::is_same<T, char>::value, "Destination value_type cannot be char. Use std::int8_t instead.");
 
-      if (val_type_ == 0x07u) return false;
+      if (val_type_ == 0x07u || pbwt_runs_) return false;
 
       if (off_type_)
       {
@@ -1205,6 +1313,87 @@ namespace savvy
       return false;
     }
 
+  private:
+    struct csc_column_fn
+    {
+      // Mean of all values that are not missing or end-of-vector, where values not stored in a sparse vector are zero.
+      template <typename T>
+      static double non_missing_mean(const T* beg, const T* end, std::size_t sz)
+      {
+        double sum = 0.;
+        std::size_t cnt = sz;
+        for ( ; beg != end; ++beg)
+        {
+          if (is_special_value(*beg))
+            --cnt;
+          else
+            sum += double(*beg);
+        }
+        return cnt ? sum / double(cnt) : 0.;
+      }
+
+      template <typename DestT, typename T>
+      static bool transform(const T& in, DestT imputed, bool mean_impute, DestT& out)
+      {
+        if (!is_special_value(in))
+          out = DestT(in);
+        else if (is_end_of_vector(in))
+          return false;
+        else
+          out = mean_impute ? imputed : reserved_transformation<DestT>(in);
+        return !(out == DestT());
+      }
+
+      template <typename T, typename OffT, typename IdxT, typename DestT>
+      void operator()(const T* valp, const T* endp, const OffT* offp, IdxT* row_out, DestT* val_out, bool mean_impute, std::size_t sz, std::size_t* written)
+      {
+        DestT imputed = mean_impute ? DestT(non_missing_mean(valp, endp, sz)) : DestT();
+        std::size_t n = 0;
+        std::size_t pos = 0;
+        for (const T* it = valp; it != endp; ++it,++offp,++pos)
+        {
+          pos += *offp;
+          if (transform(*it, imputed, mean_impute, val_out[n]))
+            row_out[n++] = IdxT(pos);
+        }
+        *written = n;
+      }
+
+      template <typename T, typename IdxT, typename DestT>
+      void operator()(const T* valp, const T* endp, IdxT* row_out, DestT* val_out, bool mean_impute, std::size_t sz, std::size_t* written)
+      {
+        DestT imputed = mean_impute ? DestT(non_missing_mean(valp, endp, sz)) : DestT();
+        std::size_t n = 0;
+        auto push = [&](std::size_t i)
+        {
+          if (transform(valp[i], imputed, mean_impute, val_out[n]))
+            row_out[n++] = IdxT(i);
+        };
+        detail::simd::for_each_nonzero(valp, std::size_t(endp - valp), push);
+        *written = n;
+      }
+    };
+  public:
+    /**
+     * Writes non-zero values as one column of a compressed sparse column (CSC) matrix, where the row of each value is
+     * its position in the vector. End-of-vector values are skipped.
+     * @param row_out Row index destination with room for non_zero_size() entries if sparse or size() entries if dense
+     * @param val_out Value destination with the same capacity as row_out
+     * @param mean_impute Whether to replace missing values with the mean of the non-missing values. Otherwise, missing values are stored as is (NaN for floating point destinations).
+     * @param written Number of rows written
+     * @return False if value is not numeric
+     */
+    template <typename IdxT, typename DestT>
+    bool get_csc_column(IdxT* row_out, DestT* val_out, bool mean_impute, std::size_t& written) const
+    {
+      written = 0;
+      if (val_type_ == 0x07u)
+        return false;
+      if (off_type_)
+        return capply_sparse(csc_column_fn(), row_out, val_out, mean_impute, size_, &written);
+      return capply_dense(csc_column_fn(), row_out, val_out, mean_impute, size_, &written);
+    }
+
     friend std::ostream& operator<<(std::ostream& os, const typed_value& val);
 
     class internal
@@ -1229,18 +1418,34 @@ namespace savvy
         }
       };
 
-      static void pbwt_unsort(const typed_value& src_v, typed_value& dest_v, std::vector<std::size_t>& sort_mapping, std::vector<std::size_t>& prev_sort_mapping, std::vector<std::size_t>& counts);
+      static void pbwt_unsort(const typed_value& src_v, typed_value& dest_v, ::savvy::internal::pbwt_sort_format_context& fmt_ctx, ::savvy::internal::pbwt_sort_map& prev_sort_mapping, std::vector<std::uint32_t>& counts);
 
       template<typename InIter, typename OutIter>
-      static void pbwt_sort(InIter in_data, std::size_t in_data_size, OutIter out_it, std::vector<std::size_t>& sort_mapping, std::vector<std::size_t>& prev_sort_mapping, std::vector<std::size_t>& counts);
+      static void pbwt_sort(InIter in_data, std::size_t in_data_size, OutIter out_it, ::savvy::internal::pbwt_sort_format_context& fmt_ctx, ::savvy::internal::pbwt_sort_map& prev_sort_mapping, std::vector<std::uint32_t>& counts);
 
       static std::int64_t deserialize(typed_value& v, std::istream& is, std::size_t size_divisor);
 
       template<typename Iter>
-      static void serialize(const typed_value& v, Iter out_it, std::size_t size_divisor);
+      static void serialize(const typed_value_view& v, Iter out_it, std::size_t size_divisor);
+
+      template<typename Iter>
+      static void serialize(const typed_value_view& v, Iter out_it, ::savvy::internal::pbwt_sort_format_context& fmt_ctx, ::savvy::internal::pbwt_sort_context& pbwt_ctx);
+
+      template<typename T, typename Iter>
+      static void serialize_pbwt_column(const char* sorted_data, std::size_t sz, std::uint8_t val_type, bool allow_rle, Iter out_it);
+
+      /**
+       * Determines whether an int8 vector can be stored with bit-packed genotype codes.
+       * @param v Value to check
+       * @return Bits per value (2 or 4), or zero if the vector has values other than 0-13, missing and end-of-vector or
+       * if packing would not be smaller than the sparse encoding
+       */
+      static std::uint8_t packed_bit_width(const typed_value_view& v);
 
       template<typename Iter>
-      static void serialize(const typed_value& v, Iter out_it, std::vector<std::size_t>& sort_mapping, std::vector<std::size_t>& prev_sort_mapping, std::vector<std::size_t>& counts);
+      static void serialize_packed(const typed_value_view& v, Iter out_it, std::uint8_t bits);
+
+      static void pbwt_runs_to_sparse(const typed_value& src_v, typed_value& dest_v);
 
       //~~~~~~~~ OLD BCF ROUTINES ~~~~~~~~//
       template<typename T>
@@ -1310,10 +1515,19 @@ namespace savvy
       off_data_.clear();
       val_data_.clear();
       pbwt_flag_ = false;
+      pbwt_runs_ = false;
     }
 
     struct thin_types_fn
     {
+      // Converts values in place to a narrower type.
+      template <typename DestT, typename T>
+      static void narrow(T* valp, T* endp)
+      {
+        std::size_t i = detail::simd::narrow_prefix((const T*)valp, endp - valp, (DestT*)valp);
+        std::transform(valp + i, endp, (DestT*)valp + i, reserved_transformation<DestT, T>);
+      }
+
       template <typename T>
       void operator()(T* valp, T* endp, typed_value* self)
       {
@@ -1323,7 +1537,7 @@ namespace savvy
         {
           T min_val = 0;
           T max_val = 0;
-          for (T* it = valp; it != endp; ++it)
+          for (T* it = valp + detail::simd::minmax_prefix((const T*)valp, endp - valp, min_val, max_val); it != endp; ++it)
           {
             if (!is_special_value(*it))
             {
@@ -1344,13 +1558,13 @@ namespace savvy
           switch (new_val_type)
           {
           case 0x01u:
-            std::transform(valp, endp, (std::int8_t*)valp, reserved_transformation<std::int8_t, T>);
+            narrow<std::int8_t>(valp, endp);
             break;
           case 0x02u:
-            std::transform(valp, endp, (std::int16_t*)valp, reserved_transformation<std::int16_t, T>); // TODO: handle endianess
+            narrow<std::int16_t>(valp, endp); // TODO: handle endianess
             break;
           case 0x03u:
-            std::transform(valp, endp, (std::int32_t*)valp, reserved_transformation<std::int32_t, T>);
+            narrow<std::int32_t>(valp, endp);
             break;
           default:
             assert(!"This should never happen");
@@ -1419,63 +1633,89 @@ namespace savvy
       }
     }
 
-    struct subset_shift_tpl
+    // Moves kept samples to the front using the precomputed gather index. Samples before first_moved() are already in
+    // place. Ploidy 1 and 2 get dedicated loops since they cover nearly all genotype fields.
+    struct subset_gather_fn
     {
       template <typename T>
-      void operator()(T* valp, T* endp, const std::vector<std::size_t>& subset_map)
+      void operator()(T* valp, T* endp, const detail::subset_index* idx)
       {
-        std::size_t sz = endp - valp;
-        std::size_t stride = sz / subset_map.size();
-
-        std::size_t i = 0;
-        for ( ; i < subset_map.size() && i == subset_map[i]; ++i) {}
+        std::size_t stride = (endp - valp) / idx->full_size();
+        const std::size_t* g = idx->gather().data();
+        std::size_t n = idx->subset_size();
+        std::size_t k = idx->first_moved();
 
-        for ( ; i < subset_map.size(); ++i)
+        if (stride == 1)
         {
-          if (subset_map[i] < std::numeric_limits<std::size_t>::max())
+          for ( ; k < n; ++k)
+            valp[k] = valp[g[k]];
+        }
+        else if (stride == 2)
+        {
+          for ( ; k < n; ++k)
           {
-            assert(subset_map[i] < i);
-            for (std::size_t j = 0; j < stride; ++j)
-            {
-              valp[subset_map[i] * stride + j] = valp[i * stride + j];
-            }
+            valp[k * 2] = valp[g[k] * 2];
+            valp[k * 2 + 1] = valp[g[k] * 2 + 1];
+          }
+        }
+        else
+        {
+          for ( ; k < n; ++k)
+          {
+            assert(g[k] > k);
+            std::copy(valp + g[k] * stride, valp + (g[k] + 1) * stride, valp + k * stride);
           }
         }
       }
     };
 
-    struct subset_shift_sparse_tpl
+    // Drops non-zeros of excluded samples with one bit test each. Values are compacted in place and the recomputed
+    // offsets are written to a separate 64-bit buffer, since gaps can grow past the range of the original offset type.
+    struct subset_sparse_fn
     {
-      template <typename T, typename T2>
-      void operator()(T* valp, T* endp, T2* offp, const std::vector<std::size_t>& subset_map, std::size_t sz, std::size_t& sparse_size)
+      template <std::size_t Stride, typename T, typename OffT>
+      static std::size_t filter(T* valp, std::size_t sp_sz, const OffT* offp, std::uint64_t* dest_offp, const detail::subset_index& idx, std::size_t stride)
       {
-        std::size_t sp_sz = endp - valp;
-        std::size_t stride = sz / subset_map.size();
-
-        auto dest_valp = valp;
-        auto dest_offp = offp;
-
-        std::size_t last_offset_new = 0;
+        T* dest_valp = valp;
+        std::uint64_t last_offset_new = 0;
         std::size_t total_offset_old = 0;
         for (std::size_t i = 0; i < sp_sz; ++i,++total_offset_old)
         {
           total_offset_old += offp[i];
-          if (subset_map[total_offset_old / stride] != std::numeric_limits<std::size_t>::max())
+          std::size_t sample = Stride == 1 ? total_offset_old : (Stride == 2 ? total_offset_old >> 1 : total_offset_old / stride);
+          if (idx.contains(sample))
           {
-            std::size_t new_off = subset_map[total_offset_old / stride] * stride + (total_offset_old % stride);
-            assert(new_off - last_offset_new < subset_map.size() * stride);
+            std::size_t j = Stride == 1 ? 0 : (Stride == 2 ? total_offset_old & 1u : total_offset_old % stride);
+            std::uint64_t new_off = idx[sample] * (Stride ? Stride : stride) + j;
             *(dest_offp++) = new_off - last_offset_new;
             *(dest_valp++) = valp[i];
             last_offset_new = new_off + 1;
           }
         }
+        return dest_valp - valp;
+      }
 
-        sparse_size = dest_valp - valp;
+      template <typename T, typename OffT>
+      void operator()(T* valp, T* endp, OffT* offp, const detail::subset_index* idx, std::size_t sz, std::uint64_t* dest_offp, std::size_t* sparse_size)
+      {
+        std::size_t sp_sz = endp - valp;
+        std::size_t stride = sz / idx->full_size();
+        if (stride == 1)
+          *sparse_size = filter<1>(valp, sp_sz, offp, dest_offp, *idx, stride);
+        else if (stride == 2)
+          *sparse_size = filter<2>(valp, sp_sz, offp, dest_offp, *idx, stride);
+        else
+          *sparse_size = filter<0>(valp, sp_sz, offp, dest_offp, *idx, stride);
       }
     };
 
-
-    bool subset(const std::vector<std::size_t>& subset_mask, std::size_t subset_size, typed_value& tmp_value)
+    /**
+     * Subsets samples in place.
+     * @param idx Precomputed subset tables (must preserve sample order)
+     * @param tmp_value Scratch value whose offset buffer is swapped with this one's
+     * @return False if value cannot be subset (e.g., string values or size not divisible by sample count)
+     */
+    bool subset(const detail::subset_index& idx, typed_value& tmp_value)
     {
       if (val_type_ == 0x07u)
       {
@@ -1483,13 +1723,13 @@ namespace savvy
         return false;
       }
 
-      if (size_ < subset_mask.size())
+      if (size_ < idx.full_size())
       {
         // TODO: print error message
         return false;
       }
 
-      if (size_ % subset_mask.size())
+      if (size_ % idx.full_size())
       {
         // TODO: print error message
         return false;
@@ -1497,40 +1737,31 @@ namespace savvy
 
       bool ret = false;
 
-      std::size_t stride = size_ / subset_mask.size();
+      std::size_t stride = size_ / idx.full_size();
 
       if (off_type_)
       {
         tmp_value.off_data_.resize(sizeof(std::uint64_t) * sparse_size_);
-        switch (off_type_)
-        {
-        case 0x01u:
-          std::copy((std::uint8_t*)off_data_.data(), ((std::uint8_t*)off_data_.data()) + sparse_size_, (std::uint64_t*)tmp_value.off_data_.data());
-          break;
-        case 0x02u:
-          std::copy((std::uint16_t*)off_data_.data(), ((std::uint16_t*)off_data_.data()) + sparse_size_, (std::uint64_t*)tmp_value.off_data_.data());
-          break;
-        case 0x03u:
-          std::copy((std::uint32_t*)off_data_.data(), ((std::uint32_t*)off_data_.data()) + sparse_size_, (std::uint64_t*)tmp_value.off_data_.data());
-          break;
-//        case 0x04u:
-//          DO NOTHING
-//          break;
-        }
-        std::swap(off_data_, tmp_value.off_data_);
-        ret = apply_sparse(subset_shift_sparse_tpl(), subset_mask, size_, std::ref(sparse_size_));
+        ret = apply_sparse(subset_sparse_fn(), &idx, size_, (std::uint64_t*)tmp_value.off_data_.data(), &sparse_size_);
+        off_data_.swap(tmp_value.off_data_);
+        off_type_ = 0x04u;
       }
       else if (val_type_)
       {
-        //dest.resize(subset.ids().size() * stride);
-
-        ret = apply_dense(subset_shift_tpl(), subset_mask);
+        ret = apply_dense(subset_gather_fn(), &idx);
       }
 
-      size_ = subset_size * stride;
+      size_ = idx.subset_size() * stride;
       return ret;
     }
 
+    bool subset(const std::vector<std::size_t>& subset_mask, std::size_t subset_size, typed_value& tmp_value)
+    {
+      detail::subset_index idx(subset_mask, subset_size);
+      assert(idx.order_preserving());
+      return subset(idx, tmp_value);
+    }
+
     struct copy_subset_functor
     {
       typed_value& dest_;
@@ -1554,12 +1785,14 @@ namespace savvy
         dest_.val_type_ = type_code<ValT>();
         dest_.off_type_ = type_code<std::int64_t>();
         //dest_.size_ = subset_size_ * stride;
-        dest_.off_data_.resize(sp_sz * stride * sizeof(std::int64_t));
-        dest_.val_data_.resize(sp_sz * stride  * sizeof(ValT));
+        dest_.off_data_.resize(sp_sz * sizeof(std::int64_t));
+        dest_.val_data_.resize(sp_sz * sizeof(ValT));
         ValT* dest_valp = (ValT*)dest_.val_data_.data();
         std::uint64_t* dest_offp = (std::uint64_t*)dest_.off_data_.data();
 
-        std::size_t last_offset_new = 0;
+        // Absolute offsets are stored first since a map that reorders samples produces them out of order.
+        bool in_order = true;
+        std::size_t next_offset_new = 0;
         std::size_t total_offset_old = 0;
         for (std::size_t i = 0; i < sp_sz; ++i,++total_offset_old)
         {
@@ -1567,14 +1800,37 @@ namespace savvy
           if (subset_map_[total_offset_old / stride] != std::numeric_limits<std::size_t>::max())
           {
             std::size_t new_off = subset_map_[total_offset_old / stride] * stride + (total_offset_old % stride);
-            assert(new_off - last_offset_new < subset_map_.size() * stride);
-            *(dest_offp++) = new_off - last_offset_new;
+            in_order = in_order && new_off >= next_offset_new;
+            *(dest_offp++) = new_off;
             *(dest_valp++) = val_ptr[i];
-            last_offset_new = new_off + 1;
+            next_offset_new = new_off + 1;
           }
         }
 
         dest_.sparse_size_ = dest_valp - (ValT*)dest_.val_data_.data();
+        dest_offp = (std::uint64_t*)dest_.off_data_.data();
+        dest_valp = (ValT*)dest_.val_data_.data();
+
+        if (!in_order)
+        {
+          std::vector<std::pair<std::uint64_t, ValT>> entries(dest_.sparse_size_);
+          for (std::size_t i = 0; i < entries.size(); ++i)
+            entries[i] = std::make_pair(dest_offp[i], dest_valp[i]);
+          std::sort(entries.begin(), entries.end(), [](const std::pair<std::uint64_t, ValT>& a, const std::pair<std::uint64_t, ValT>& b) { return a.first < b.first; });
+          for (std::size_t i = 0; i < entries.size(); ++i)
+          {
+            dest_offp[i] = entries[i].first;
+            dest_valp[i] = entries[i].second;
+          }
+        }
+
+        std::uint64_t last_offset_new = 0;
+        for (std::size_t i = 0; i < dest_.sparse_size_; ++i)
+        {
+          std::uint64_t new_off = dest_offp[i];
+          dest_offp[i] = new_off - last_offset_new;
+          last_offset_new = new_off + 1;
+        }
       }
 
       template <typename T>
@@ -1584,7 +1840,9 @@ namespace savvy
         std::size_t stride = sz / subset_map_.size();
 
         dest_.val_type_ = type_code<T>();
+        dest_.off_type_ = 0;
         dest_.size_ = subset_size_ * stride;
+        dest_.sparse_size_ = 0;
         dest_.val_data_.resize(dest_.size_ * sizeof(T));
 
         for (std::size_t i = 0; i < subset_map_.size(); ++i)
@@ -1598,6 +1856,14 @@ namespace savvy
       }
     };
 
+  public:
+    /**
+     * Copies values of a subset of samples to another typed_value.
+     * @param dest Destination value
+     * @param subset_mask Maps each sample index to its index in destination (or std::numeric_limits<std::size_t>::max() to exclude it). The map may reorder samples.
+     * @param subset_size Number of samples in destination
+     * @return False if value cannot be subset (e.g., string values or size not divisible by sample count)
+     */
     bool copy_subset(typed_value& dest, const std::vector<std::size_t>& subset_mask, std::size_t subset_size) const
     {
       if (val_type_ == 0x07u)
@@ -1620,7 +1886,17 @@ namespace savvy
 
       bool ret = false;
 
-      if (off_type_)
+      if (off_type_ && sparse_size_ == 0)
+      {
+        dest.val_type_ = val_type_;
+        dest.off_type_ = off_type_;
+        dest.size_ = subset_size * (size_ / subset_mask.size());
+        dest.sparse_size_ = 0;
+        dest.off_data_.clear();
+        dest.val_data_.clear();
+        ret = true;
+      }
+      else if (off_type_)
       {
         ret = capply_sparse(copy_subset_functor(dest, subset_mask, subset_size), size_);
       }
@@ -1630,8 +1906,178 @@ namespace savvy
         ret = capply_dense(copy_subset_functor(dest, subset_mask, subset_size)); // TODO: handle endianess
       }
 
+      if (ret)
+        dest.minimize();
+
       return ret;
     }
+  private:
+
+    template <typename T>
+    static void fill_missing_sample(T* beg, T* end) { std::fill(beg, end, missing_value<T>()); }
+    static void fill_missing_sample(char* beg, char* end) { if (beg != end) *(beg++) = '.'; std::fill(beg, end, '\0'); }
+
+    template <typename T>
+    static void fill_end_of_vector(T* beg, T* end) { std::fill(beg, end, end_of_vector_value<T>()); }
+    static void fill_end_of_vector(char* beg, char* end) { std::fill(beg, end, '\0'); }
+
+    struct concat_dense_functor
+    {
+      template <typename SrcT, typename DestT>
+      void operator()(const SrcT* beg, const SrcT* end, DestT* dest, std::size_t src_stride, std::size_t dest_stride) const
+      {
+        std::size_t sz = end - beg;
+        for (std::size_t i = 0; i < sz; ++i)
+          dest[(i / src_stride) * dest_stride + i % src_stride] = reserved_transformation<DestT, SrcT>(beg[i]);
+      }
+
+      template <typename SrcT, typename OffT, typename DestT>
+      void operator()(const SrcT* beg, const SrcT* end, const OffT* off, DestT* dest, std::size_t src_stride, std::size_t dest_stride) const
+      {
+        std::size_t sp_sz = end - beg;
+        std::size_t pos = 0;
+        for (std::size_t i = 0; i < sp_sz; ++i, ++pos)
+        {
+          pos += off[i];
+          dest[(pos / src_stride) * dest_stride + pos % src_stride] = reserved_transformation<DestT, SrcT>(beg[i]);
+        }
+      }
+
+      void operator()(const char* beg, const char* end, char* dest, std::size_t src_stride, std::size_t dest_stride) const
+      {
+        std::size_t sz = end - beg;
+        for (std::size_t i = 0; i < sz; i += src_stride)
+          std::copy_n(beg + i, src_stride, dest + (i / src_stride) * dest_stride);
+      }
+
+      // Strings are only concatenated with strings.
+      template <typename SrcT>
+      void operator()(const SrcT*, const SrcT*, char*, std::size_t, std::size_t) const {}
+      template <typename DestT>
+      void operator()(const char*, const char*, DestT*, std::size_t, std::size_t) const {}
+      template <typename SrcT, typename OffT>
+      void operator()(const SrcT*, const SrcT*, const OffT*, char*, std::size_t, std::size_t) const {}
+      template <typename OffT, typename DestT>
+      void operator()(const char*, const char*, const OffT*, DestT*, std::size_t, std::size_t) const {}
+      template <typename OffT>
+      void operator()(const char*, const char*, const OffT*, char*, std::size_t, std::size_t) const {}
+    };
+
+    template <typename DestT>
+    struct concat_sparse_functor
+    {
+      DestT* val_ptr;
+      std::uint64_t* off_ptr;
+      std::size_t next_pos; // Absolute position following the last value written
+
+      void push(std::size_t pos, DestT val)
+      {
+        *(off_ptr++) = pos - next_pos;
+        *(val_ptr++) = val;
+        next_pos = pos + 1;
+      }
+
+      template <typename SrcT, typename OffT>
+      void operator()(const SrcT* beg, const SrcT* end, const OffT* off, std::size_t dest_offset)
+      {
+        std::size_t sp_sz = end - beg;
+        std::size_t pos = dest_offset;
+        for (std::size_t i = 0; i < sp_sz; ++i, ++pos)
+        {
+          pos += off[i];
+          push(pos, reserved_transformation<DestT, SrcT>(beg[i]));
+        }
+      }
+
+      template <typename OffT>
+      void operator()(const char*, const char*, const OffT*, std::size_t) {}
+    };
+
+    template <typename DestT>
+    static bool concat_samples_sparse(const std::vector<const typed_value*>& srcs, const std::vector<std::size_t>& sample_counts, std::size_t stride, typed_value& dest)
+    {
+      std::size_t sp_sz = 0;
+      std::size_t n_samples = 0;
+      for (std::size_t i = 0; i < srcs.size(); ++i)
+      {
+        sp_sz += srcs[i] && srcs[i]->size_ ? srcs[i]->sparse_size_ : sample_counts[i] * stride;
+        n_samples += sample_counts[i];
+      }
+
+      dest.val_type_ = type_code<DestT>();
+      dest.off_type_ = type_code<std::int64_t>();
+      dest.size_ = n_samples * stride;
+      dest.off_data_.resize(sp_sz * sizeof(std::uint64_t));
+      dest.val_data_.resize(sp_sz * sizeof(DestT));
+
+      concat_sparse_functor<DestT> fn{(DestT*)dest.val_data_.data(), (std::uint64_t*)dest.off_data_.data(), 0};
+      std::size_t dest_offset = 0;
+      for (std::size_t i = 0; i < srcs.size(); ++i)
+      {
+        if (srcs[i] && srcs[i]->size_)
+        {
+          if (srcs[i]->sparse_size_ && !srcs[i]->capply_sparse(std::ref(fn), dest_offset))
+            return false;
+        }
+        else
+        {
+          for (std::size_t j = 0; j < sample_counts[i] * stride; ++j)
+            fn.push(dest_offset + j, missing_value<DestT>());
+        }
+        dest_offset += sample_counts[i] * stride;
+      }
+
+      dest.sparse_size_ = fn.val_ptr - (DestT*)dest.val_data_.data();
+      dest.minimize();
+      return true;
+    }
+
+    template <typename DestT>
+    static bool concat_samples_dense(const std::vector<const typed_value*>& srcs, const std::vector<std::size_t>& sample_counts, std::size_t stride, typed_value& dest)
+    {
+      std::size_t n_samples = 0;
+      for (std::size_t i = 0; i < srcs.size(); ++i)
+        n_samples += sample_counts[i];
+
+      dest.val_type_ = type_code<DestT>();
+      dest.size_ = n_samples * stride;
+      dest.val_data_.resize(dest.size_ * sizeof(DestT));
+
+      DestT* dest_ptr = (DestT*)dest.val_data_.data();
+      for (std::size_t i = 0; i < srcs.size(); ++i)
+      {
+        DestT* end_ptr = dest_ptr + sample_counts[i] * stride;
+        if (srcs[i] && srcs[i]->size_)
+        {
+          std::size_t src_stride = srcs[i]->size_ / sample_counts[i];
+          for (DestT* p = dest_ptr; p != end_ptr; p += stride)
+          {
+            std::fill(p, p + src_stride, DestT());
+            fill_end_of_vector(p + src_stride, p + stride);
+          }
+
+          if (!srcs[i]->off_type_)
+          {
+            if (!srcs[i]->capply_dense(concat_dense_functor(), dest_ptr, src_stride, stride))
+              return false;
+          }
+          else if (srcs[i]->sparse_size_)
+          {
+            if (!srcs[i]->capply_sparse(concat_dense_functor(), dest_ptr, src_stride, stride))
+              return false;
+          }
+        }
+        else
+        {
+          for (DestT* p = dest_ptr; p != end_ptr; p += stride)
+            fill_missing_sample(p, p + stride);
+        }
+        dest_ptr = end_ptr;
+      }
+
+      dest.minimize();
+      return true;
+    }
 
     //void serialize_vcf(std::size_t idx, std::ostream& os, char delim) const;
     void serialize_vcf(std::size_t idx, char*& out, char delim) const;
@@ -1654,6 +2100,9 @@ namespace savvy
     template<typename ValT, typename DestT>
     bool copy_sparse1(DestT* dest) const
     {
+      if (pbwt_runs_)
+        return false;
+
       switch (off_type_)
       {
       case 0x01u:
@@ -1694,6 +2143,21 @@ namespace savvy
         );
     };
 
+    // Returns pointer to contiguous storage of dense vector types that have it, otherwise null.
+    template<typename VecT>
+    static const typename VecT::value_type* contiguous_data(const VecT&) { return nullptr; }
+
+    template<typename T>
+    static const T* contiguous_data(const std::vector<T>& vec) { return vec.data(); }
+
+    // Copies dense vector to a type that all of its non-reserved values fit in.
+    template<typename VecT, typename DestT>
+    static void copy_narrowed(const VecT& vec, DestT* dest)
+    {
+      const typename VecT::value_type* contiguous = contiguous_data(vec);
+      std::size_t i = contiguous ? detail::simd::narrow_prefix(contiguous, vec.size(), dest) : 0;
+      std::transform(vec.begin() + i, vec.end(), dest + i, reserved_transformation<DestT, typename VecT::value_type>);
+    }
 
     template<typename T>
     typename std::enable_if<is_dense_vector<T>::value, void>::type
@@ -1715,38 +2179,388 @@ namespace savvy
 //    char *off_ptr_ = nullptr;
 //    char *val_ptr_ = nullptr;
 //    std::vector<char> local_data_;
-    std::vector<char> off_data_;
-    std::vector<char> val_data_;
+    detail::small_buffer<16> off_data_;
+    detail::small_buffer<16> val_data_; // scalars and short vectors are stored inline
     bool pbwt_flag_ = false;
-  };
+    bool pbwt_runs_ = false; // off_data_ holds run lengths minus one and val_data_ holds run values
+  private:
+    template <typename ValT, typename Fn>
+    bool for_each_pbwt_run(Fn& fn) const
+    {
+      switch (off_type_)
+      {
+      case 0x01u: visit_pbwt_runs((const ValT*)val_data_.data(), (const std::uint8_t*)off_data_.data(), sparse_size_, fn); return true;
+      case 0x02u: visit_pbwt_runs((const ValT*)val_data_.data(), (const std::uint16_t*)off_data_.data(), sparse_size_, fn); return true;
+      case 0x03u: visit_pbwt_runs((const ValT*)val_data_.data(), (const std::uint32_t*)off_data_.data(), sparse_size_, fn); return true;
+      case 0x04u: visit_pbwt_runs((const ValT*)val_data_.data(), (const std::uint64_t*)off_data_.data(), sparse_size_, fn); return true;
+      default: return false;
+      }
+    }
 
-  template<>
-  struct typed_value::is_dense_vector<std::int8_t>
-  {
-    static const bool value = false;
-  };
-  template<>
-  struct typed_value::is_dense_vector<std::int16_t>
-  {
-    static const bool value = false;
-  };
-  template<>
-  struct typed_value::is_dense_vector<std::int32_t>
-  {
-    static const bool value = false;
-  };
-  template<>
-  struct typed_value::is_dense_vector<std::int64_t>
-  {
-    static const bool value = false;
-  };
-  template<>
-  struct typed_value::is_dense_vector<float>
-  {
-    static const bool value = false;
+    template <typename ValT, typename LenT, typename Fn>
+    static void visit_pbwt_runs(const ValT* run_vals, const LenT* run_lens, std::size_t n_runs, Fn& fn)
+    {
+      for (std::size_t r = 0; r < n_runs; ++r)
+        fn(run_vals[r], std::size_t(run_lens[r]) + 1u);
+    }
   };
-  template<>
-  struct typed_value::is_dense_vector<double>
+
+  /**
+   * Non-owning view of a typed value. A view stores the type codes, sizes and pointers to the data of a typed_value or
+   * of an external buffer, so it is cheap to create and copy. Views support the same const visitors and get()
+   * conversions as typed_value and can be written without copying the data (see
+   * writer::write(const site_info&, const std::vector<std::pair<std::string, typed_value_view>>&)).
+   *
+   * The referenced data must outlive the view. A view of a typed_value is invalidated when the typed_value is
+   * modified, which includes reading the next record into the variant that owns it.
+   */
+  class typed_value_view
+  {
+    friend class typed_value;
+    friend class typed_value::internal;
+    friend class writer;
+    friend class variant;
+  public:
+    typed_value_view() {}
+
+    /**
+     * Constructs view of typed value.
+     * @param src Typed value to reference
+     */
+    typed_value_view(const typed_value& src) :
+      val_type_(src.val_type_),
+      off_type_(src.off_type_),
+      size_(src.size_),
+      sparse_size_(src.sparse_size_),
+      val_ptr_(src.val_data_.data()),
+      off_ptr_(src.off_data_.data()),
+      pbwt_flag_(src.pbwt_flag_),
+      pbwt_runs_(src.pbwt_runs_)
+    {
+    }
+
+    /**
+     * Constructs view of dense external data.
+     * @param val_type Type code of values (e.g., typed_value::int8)
+     * @param sz Number of values
+     * @param val_ptr Pointer to values (suitably aligned for type)
+     */
+    typed_value_view(std::uint8_t val_type, std::size_t sz, const void* val_ptr) :
+      val_type_(val_type),
+      size_(sz),
+      val_ptr_((const char*)val_ptr)
+    {
+    }
+
+    /**
+     * Constructs view of sparse external data.
+     * @param val_type Type code of non-zero values (e.g., typed_value::int8)
+     * @param sz Size of vector
+     * @param off_type Type code of offsets (typed_value::int8 through typed_value::int64, read as unsigned)
+     * @param sparse_sz Number of non-zero values
+     * @param val_ptr Pointer to non-zero values
+     * @param off_ptr Pointer to offsets, each relative to the position following the previous non-zero value
+     */
+    typed_value_view(std::uint8_t val_type, std::size_t sz, std::uint8_t off_type, std::size_t sparse_sz, const void* val_ptr, const void* off_ptr) :
+      val_type_(val_type),
+      off_type_(off_type),
+      size_(sz),
+      sparse_size_(sparse_sz),
+      val_ptr_((const char*)val_ptr),
+      off_ptr_((const char*)off_ptr)
+    {
+    }
+
+    std::size_t size() const { return size_; }
+    std::size_t non_zero_size() const { return sparse_size_; }
+
+    bool pbwt_flag() const { return pbwt_flag_; }
+    bool is_sparse() const { return off_type_ != 0; }
+    std::size_t off_width() const { return (1u << bcf_type_shift[off_type_]); }
+    std::size_t val_width() const { return (1u << bcf_type_shift[val_type_]); }
+
+    template <typename Fn, typename... Args>
+    bool capply_dense(Fn fn, Args... args) const
+    {
+      std::size_t sz = off_type_ ? sparse_size_ : size_;
+
+      switch (val_type_)
+      {
+      case 0x01u:
+        fn((const std::int8_t*)val_ptr_, ((const std::int8_t*)val_ptr_) + sz, std::forward<Args>(args)...);
+        break;
+      case 0x02u:
+        fn((const std::int16_t*)val_ptr_, ((const std::int16_t*)val_ptr_) + sz, std::forward<Args>(args)...);
+        break;
+      case 0x03u:
+        fn((const std::int32_t*)val_ptr_, ((const std::int32_t*)val_ptr_) + sz, std::forward<Args>(args)...);
+        break;
+      case 0x04u:
+        fn((const std::int64_t*)val_ptr_, ((const std::int64_t*)val_ptr_) + sz, std::forward<Args>(args)...);
+        break;
+      case 0x05u:
+        fn((const float*)val_ptr_, ((const float*)val_ptr_) + sz, std::forward<Args>(args)...);
+        break;
+      case 0x07u:
+        fn(val_ptr_, val_ptr_ + sz, std::forward<Args>(args)...);
+        break;
+      default:
+        return false;
+      }
+      return true;
+    }
+
+    template <typename ValT, typename Fn, typename... Args>
+    bool capply_sparse_offsets(Fn fn, Args... args) const
+    {
+      if (!off_ptr_ || pbwt_runs_)
+        return false;
+      switch (off_type_)
+      {
+      case 0x01u:
+        fn((const ValT*)val_ptr_, ((const ValT*)val_ptr_) + sparse_size_, (const std::uint8_t*)off_ptr_, std::forward<Args>(args)...);
+        break;
+      case 0x02u:
+        fn((const ValT*)val_ptr_, ((const ValT*)val_ptr_) + sparse_size_, (const std::uint16_t*)off_ptr_, std::forward<Args>(args)...);
+        break;
+      case 0x03u:
+        fn((const ValT*)val_ptr_, ((const ValT*)val_ptr_) + sparse_size_, (const std::uint32_t*)off_ptr_, std::forward<Args>(args)...);
+        break;
+      case 0x04u:
+        fn((const ValT*)val_ptr_, ((const ValT*)val_ptr_) + sparse_size_, (const std::uint64_t*)off_ptr_, std::forward<Args>(args)...);
+        break;
+      default:
+        return false;
+      }
+      return true;
+    }
+
+    template <typename Fn, typename... Args>
+    bool capply_sparse(Fn fn, Args... args) const
+    {
+      switch (val_type_)
+      {
+      case 0x01u:
+        return capply_sparse_offsets<std::int8_t>(std::forward<Fn>(fn), std::forward<Args>(args)...);
+      case 0x02u:
+        return capply_sparse_offsets<std::int16_t>(std::forward<Fn>(fn), std::forward<Args>(args)...);
+      case 0x03u:
+        return capply_sparse_offsets<std::int32_t>(std::forward<Fn>(fn), std::forward<Args>(args)...);
+      case 0x04u:
+        return capply_sparse_offsets<std::int64_t>(std::forward<Fn>(fn), std::forward<Args>(args)...);
+      case 0x05u:
+        return capply_sparse_offsets<float>(std::forward<Fn>(fn), std::forward<Args>(args)...);
+      case 0x07u:
+        return capply_sparse_offsets<char>(std::forward<Fn>(fn), std::forward<Args>(args)...);
+      default:
+        return false;
+      }
+    }
+
+    template <typename Fn, typename... Args>
+    bool capply(Fn fn, Args... args) const
+    {
+      if (off_type_)
+        return capply_sparse(std::forward<Fn>(fn), std::forward<Args>(args)...);
+      else
+        return capply_dense(std::forward<Fn>(fn), std::forward<Args>(args)...);
+    }
+
+    template<typename T>
+    typename std::enable_if<std::is_scalar<T>::value, bool>::type
+    get(T& dest) const
+    {
+      static_assert(std::is_signed<T>::value, "Destination value_type must be signed.");
+      if (!val_ptr_ || size_ == 0 || val_type_ == typed_value::str)
+        return false;
+      if (off_type_)
+        return capply_sparse(get_first_fn(), &dest);
+      return capply_dense(get_first_fn(), &dest);
+    }
+
+    bool get(std::string& dest) const
+    {
+      if (!val_ptr_ || size_ == 0 || val_type_ != typed_value::str)
+        return false;
+      dest.assign(val_ptr_, val_ptr_ + size_);
+      return true;
+    }
+
+    template<typename T>
+    bool get(std::vector<T>& dest) const
+    {
+      static_assert(std::is_signed<T>::value, "Destination value_type must be signed.");
+      static_assert(!std::is_same<T, char>::value, "Destination value_type cannot be char. Use std::int8_t instead.");
+
+      if (val_type_ == typed_value::str || !val_type_) return false;
+
+      if (off_type_)
+      {
+        dest.resize(0);
+        dest.resize(size_);
+        return capply_sparse(scatter_fn(), dest.data());
+      }
+
+      dest.resize(size_);
+      return capply_dense(transform_fn(), dest.data());
+    }
+
+    template<typename VecT>
+    typename std::enable_if<std::is_same<VecT, ::savvy::compressed_vector<typename VecT::value_type>>::value || std::is_same<VecT, ::savvy::sparse_vector<typename VecT::value_type>>::value, bool>::type
+    get(VecT& dest) const
+    {
+      typedef typename VecT::value_type T;
+      static_assert(std::is_signed<T>::value, "Destination value_type must be signed.");
+      static_assert(!std::is_same<T, char>::value, "Destination value_type cannot be char. Use std::int8_t instead.");
+
+      if (val_type_ == typed_value::str || !val_type_) return false;
+
+      if (off_type_)
+      {
+        dest.resize(0);
+        return capply_sparse(assign_sparse_fn(), &dest, size_);
+      }
+
+      return capply_dense(assign_dense_fn(), &dest);
+    }
+
+    /**
+     * Copies referenced data to a dense typed value.
+     * @param dest Destination value
+     * @return False if type is not supported
+     */
+    bool copy_as_dense(typed_value& dest) const
+    {
+      if (!off_type_)
+      {
+        dest = *this;
+        return true;
+      }
+
+      dest.clear();
+      dest.val_type_ = val_type_;
+      dest.size_ = size_;
+      dest.pbwt_flag_ = pbwt_flag_;
+      dest.val_data_.resize(size_ * val_width(), 0);
+      return capply_sparse(copy_sparse_fn(), dest.val_data_.data());
+    }
+  private:
+    struct get_first_fn
+    {
+      template <typename ValT, typename DestT>
+      void operator()(const ValT* valp, const ValT*, DestT* dest)
+      {
+        *dest = typed_value::reserved_transformation<DestT>(*valp);
+      }
+
+      template <typename DestT>
+      void operator()(const float* valp, const float*, DestT* dest)
+      {
+        *dest = *valp; // Same as typed_value::get(), which does not transform floats.
+      }
+
+      template <typename ValT, typename OffT, typename DestT>
+      void operator()(const ValT* valp, const ValT* endp, const OffT* offp, DestT* dest)
+      {
+        if (valp != endp && *offp == 0)
+          operator()(valp, endp, dest);
+        else
+          *dest = DestT();
+      }
+    };
+
+    struct transform_fn
+    {
+      template <typename ValT, typename DestT>
+      void operator()(const ValT* valp, const ValT* endp, DestT* dest)
+      {
+        std::transform(valp, endp, dest, typed_value::reserved_transformation<DestT, ValT>);
+      }
+    };
+
+    struct scatter_fn
+    {
+      template <typename ValT, typename OffT, typename DestT>
+      void operator()(const ValT* valp, const ValT* endp, const OffT* offp, DestT* dest)
+      {
+        std::size_t total_offset = 0;
+        for ( ; valp != endp; ++valp, ++offp)
+        {
+          total_offset += *offp;
+          dest[total_offset++] = typed_value::reserved_transformation<DestT, ValT>(*valp);
+        }
+      }
+    };
+
+    struct copy_sparse_fn
+    {
+      template <typename ValT, typename OffT>
+      void operator()(const ValT* valp, const ValT* endp, const OffT* offp, char* dest)
+      {
+        std::size_t total_offset = 0;
+        for ( ; valp != endp; ++valp, ++offp)
+        {
+          total_offset += *offp;
+          std::memcpy(dest + (total_offset++) * sizeof(ValT), valp, sizeof(ValT));
+        }
+      }
+    };
+
+    struct assign_dense_fn
+    {
+      template <typename ValT, typename VecT>
+      void operator()(const ValT* valp, const ValT* endp, VecT* dest)
+      {
+        dest->assign(valp, endp, typed_value::reserved_transformation_functor<typename VecT::value_type>());
+      }
+    };
+
+    struct assign_sparse_fn
+    {
+      template <typename ValT, typename OffT, typename VecT>
+      void operator()(const ValT* valp, const ValT* endp, const OffT* offp, VecT* dest, std::size_t sz)
+      {
+        dest->assign(valp, endp, typed_value::compressed_offset_iterator<OffT>(offp), sz, typed_value::reserved_transformation_functor<typename VecT::value_type>());
+      }
+    };
+  private:
+    std::uint8_t val_type_ = 0;
+    std::uint8_t off_type_ = 0;
+    std::size_t size_ = 0;
+    std::size_t sparse_size_ = 0;
+    const char* val_ptr_ = nullptr;
+    const char* off_ptr_ = nullptr;
+    bool pbwt_flag_ = false;
+    bool pbwt_runs_ = false;
+  };
+
+  template<>
+  struct typed_value::is_dense_vector<std::int8_t>
+  {
+    static const bool value = false;
+  };
+  template<>
+  struct typed_value::is_dense_vector<std::int16_t>
+  {
+    static const bool value = false;
+  };
+  template<>
+  struct typed_value::is_dense_vector<std::int32_t>
+  {
+    static const bool value = false;
+  };
+  template<>
+  struct typed_value::is_dense_vector<std::int64_t>
+  {
+    static const bool value = false;
+  };
+  template<>
+  struct typed_value::is_dense_vector<float>
+  {
+    static const bool value = false;
+  };
+  template<>
+  struct typed_value::is_dense_vector<double>
   {
     static const bool value = false;
   };
@@ -2020,12 +2834,14 @@ namespace savvy
       val_data_.swap(src.val_data_);
       off_data_.swap(src.off_data_);
       pbwt_flag_ = src.pbwt_flag_;
+      pbwt_runs_ = src.pbwt_runs_;
 
       src.val_type_ = 0;
       src.off_type_ = 0;
       src.size_ = 0;
       src.sparse_size_ = 0;
       src.pbwt_flag_ = false;
+      src.pbwt_runs_ = false;
     }
     return *this;
   }
@@ -2042,6 +2858,29 @@ namespace savvy
 //    local_data_.swap(other.local_data_);
 //  }
 
+  inline
+  typed_value& typed_value::operator=(const typed_value_view& src)
+  {
+    val_type_ = src.val_type_;
+    off_type_ = src.off_type_;
+    size_ = src.size_;
+    sparse_size_ = src.sparse_size_;
+    pbwt_flag_ = src.pbwt_flag_;
+    pbwt_runs_ = src.pbwt_runs_;
+
+    std::size_t off_width = off_type_ ? 1u << bcf_type_shift[off_type_] : 0;
+    std::size_t val_width = val_type_ ?  1u << bcf_type_shift[val_type_] : 0;
+    std::size_t sz = off_type_ ? sparse_size_ : size_;
+    off_data_.resize(off_width * sz);
+    val_data_.resize(val_width * sz);
+
+    if (off_width && sz)
+      std::memcpy(off_data_.data(), src.off_ptr_, off_width * sz);
+    if (val_width && sz)
+      std::memcpy(val_data_.data(), src.val_ptr_, val_width * sz);
+    return *this;
+  }
+
   inline
   typed_value& typed_value::operator=(const typed_value& src)
   {
@@ -2052,6 +2891,7 @@ namespace savvy
       size_ = src.size_;
       sparse_size_ = src.sparse_size_;
       pbwt_flag_ = src.pbwt_flag_;
+      pbwt_runs_ = src.pbwt_runs_;
 
       std::size_t off_width = off_type_ ? 1u << bcf_type_shift[off_type_] : 0;
       std::size_t val_width = val_type_ ?  1u << bcf_type_shift[val_type_] : 0;
@@ -2136,19 +2976,19 @@ namespace savvy
   }*/
 
   template<typename SrcT, typename DestT>
-  static void pbwt_unsort(SrcT src_ptr, std::size_t sz, DestT dest_ptr, std::vector<std::size_t>& sort_mapping, std::vector<std::size_t>& prev_sort_mapping, std::vector<std::size_t>& counts)
+  static void pbwt_unsort(SrcT src_ptr, std::size_t sz, DestT dest_ptr, ::savvy::internal::pbwt_sort_format_context& fmt_ctx, ::savvy::internal::pbwt_sort_map& prev_sort_mapping, std::vector<std::uint32_t>& counts)
   {
-    std::swap(sort_mapping, prev_sort_mapping);
-    if (prev_sort_mapping.empty())
+    if (sz > std::numeric_limits<std::uint32_t>::max())
     {
-      prev_sort_mapping.resize(sz);
-      for (std::size_t i = 0; i < sz; ++i)
-        prev_sort_mapping[i] = i;
+      fprintf(stderr, "PBWT sorted vectors cannot exceed 2^32 - 1 elements\n"); // TODO: handle better
+      exit(-1);
     }
 
+    std::swap(fmt_ctx.sort_mapping, prev_sort_mapping);
+    auto& sort_mapping = fmt_ctx.sort_mapping;
     sort_mapping.resize(sz);
 
-    if (prev_sort_mapping.size() != sz)
+    if (!fmt_ctx.identity && prev_sort_mapping.size() != sz)
     {
       fprintf(stderr, "Variable-sized data vectors not allowed with PBWT\n"); // TODO: handle better
       exit(-1);
@@ -2160,52 +3000,225 @@ namespace savvy
     counts.resize(std::numeric_limits<utype>::max() + 2);
     auto counts_ptr = counts.data() + 1;
     for (std::size_t i = 0; i < sz; ++i)
-    {
-//        unsigned int d = utype(src_ptr[i]) + 1u;
-//        if (d >= counts.size())
-//          counts.resize(d + 1u);
-//        ++counts[d];
       ++(counts_ptr[src_uptr[i]]);
+
+    for (std::size_t i = 1; i < counts.size(); ++i)
+      counts[i] = counts[i - 1] + counts[i];
+
+    if (fmt_ctx.identity)
+    {
+      // Previous permutation is the identity, so there is no need to materialize it.
+      for (std::size_t i = 0; i < sz; ++i)
+      {
+        dest_ptr[i] = src_ptr[i];
+        sort_mapping[counts[src_uptr[i]]++] = std::uint32_t(i);
+      }
+      fmt_ctx.identity = false;
+    }
+    else
+    {
+      for (std::size_t i = 0; i < sz; ++i)
+      {
+        const std::uint32_t unsorted_index = prev_sort_mapping[i];
+        dest_ptr[unsorted_index] = src_ptr[i];
+        sort_mapping[counts[src_uptr[i]]++] = unsorted_index;
+      }
+    }
+  }
+
+  template<typename ValT, typename LenT>
+  static void pbwt_unsort_runs(const ValT* run_vals, const LenT* run_lens, std::size_t n_runs, std::size_t sz, ValT* dest_ptr, ::savvy::internal::pbwt_sort_format_context& fmt_ctx, ::savvy::internal::pbwt_sort_map& prev_sort_mapping, std::vector<std::uint32_t>& counts)
+  {
+    if (sz > std::numeric_limits<std::uint32_t>::max())
+    {
+      fprintf(stderr, "PBWT sorted vectors cannot exceed 2^32 - 1 elements\n"); // TODO: handle better
+      exit(-1);
+    }
+
+    std::swap(fmt_ctx.sort_mapping, prev_sort_mapping);
+    auto& sort_mapping = fmt_ctx.sort_mapping;
+    sort_mapping.resize(sz);
+
+    if (!fmt_ctx.identity && prev_sort_mapping.size() != sz)
+    {
+      fprintf(stderr, "Variable-sized data vectors not allowed with PBWT\n"); // TODO: handle better
+      exit(-1);
+    }
+
+    // Value histogram comes straight from the runs.
+    typedef typename std::make_unsigned<ValT>::type utype;
+    counts.clear();
+    counts.resize(std::numeric_limits<utype>::max() + 2);
+    auto counts_ptr = counts.data() + 1;
+    std::uint64_t total = 0;
+    for (std::size_t r = 0; r < n_runs; ++r)
+    {
+      total += std::uint64_t(run_lens[r]) + 1u;
+      if (total > sz)
+        break;
+      counts_ptr[utype(run_vals[r])] += std::uint32_t(run_lens[r]) + 1u;
+    }
+
+    if (total != sz)
+    {
+      fprintf(stderr, "PBWT run lengths do not match vector size\n"); // TODO: handle better
+      exit(-1);
     }
 
     for (std::size_t i = 1; i < counts.size(); ++i)
       counts[i] = counts[i - 1] + counts[i];
 
-    for (std::size_t i = 0; i < prev_sort_mapping.size(); ++i)
+    std::size_t i = 0;
+    for (std::size_t r = 0; r < n_runs; ++r)
     {
-//        std::size_t unsorted_index = prev_sort_mapping[i];
-//        dest_ptr[unsorted_index] = src_ptr[i];
-//        std::uint8_t d(dest_ptr[unsorted_index]);
-//        sort_mapping[counts[d]++] = unsorted_index;
+      const ValT v = run_vals[r];
+      std::uint32_t& c = counts[utype(v)];
+      const std::size_t run_end = i + std::size_t(run_lens[r]) + 1u;
+      if (fmt_ctx.identity)
+      {
+        for ( ; i < run_end; ++i)
+        {
+          dest_ptr[i] = v;
+          sort_mapping[c++] = std::uint32_t(i);
+        }
+      }
+      else
+      {
+        for ( ; i < run_end; ++i)
+        {
+          const std::uint32_t unsorted_index = prev_sort_mapping[i];
+          dest_ptr[unsorted_index] = v;
+          sort_mapping[c++] = unsorted_index;
+        }
+      }
+    }
 
-      const std::size_t unsorted_index = prev_sort_mapping[i];
-      dest_ptr[unsorted_index] = src_ptr[i];
-      const utype d(src_ptr[i]);
-      sort_mapping[counts[d]++] = unsorted_index;
+    fmt_ctx.identity = false;
+  }
+
+  template<typename ValT, typename LenT, typename BufT>
+  static std::size_t pbwt_runs_to_sparse(const ValT* run_vals, const LenT* run_lens, std::size_t n_runs, BufT& dest_off_data, BufT& dest_val_data)
+  {
+    std::size_t nnz = 0;
+    for (std::size_t r = 0; r < n_runs; ++r)
+    {
+      if (run_vals[r])
+        nnz += std::size_t(run_lens[r]) + 1u;
+    }
+
+    dest_off_data.resize(nnz * sizeof(std::uint64_t));
+    dest_val_data.resize(nnz * sizeof(ValT));
+    auto dest_off = (std::uint64_t*) dest_off_data.data();
+    auto dest_val = (ValT*) dest_val_data.data();
+
+    std::uint64_t next_off = 0;
+    std::uint64_t pos = 0;
+    for (std::size_t r = 0; r < n_runs; ++r)
+    {
+      const std::uint64_t run_end = pos + std::uint64_t(run_lens[r]) + 1u;
+      if (run_vals[r])
+      {
+        *(dest_off++) = pos - next_off;
+        *(dest_val++) = run_vals[r];
+        for (++pos; pos < run_end; ++pos)
+        {
+          *(dest_off++) = 0;
+          *(dest_val++) = run_vals[r];
+        }
+        next_off = run_end;
+      }
+      pos = run_end;
     }
+
+    return nnz;
   }
 
-  inline void typed_value::internal::pbwt_unsort(const typed_value& src_v, typed_value& dest_v, std::vector<std::size_t>& sort_mapping, std::vector<std::size_t>& prev_sort_mapping, std::vector<std::size_t>& counts)
+  inline void typed_value::internal::pbwt_runs_to_sparse(const typed_value& src_v, typed_value& dest_v)
+  {
+    assert(src_v.pbwt_flag_ && src_v.off_type_);
+
+    dest_v.clear();
+    dest_v.size_ = src_v.size_;
+    dest_v.val_type_ = src_v.val_type_;
+    dest_v.off_type_ = type_code<std::int64_t>();
+    dest_v.pbwt_flag_ = true;
+
+    const std::size_t n_runs = src_v.sparse_size_;
+    if (src_v.val_type_ == 0x01u)
+    {
+      auto vals = (const std::int8_t*) src_v.val_data_.data();
+      switch (src_v.off_type_)
+      {
+      case 0x01u: dest_v.sparse_size_ = ::savvy::pbwt_runs_to_sparse(vals, (const std::uint8_t*) src_v.off_data_.data(), n_runs, dest_v.off_data_, dest_v.val_data_); break;
+      case 0x02u: dest_v.sparse_size_ = ::savvy::pbwt_runs_to_sparse(vals, (const std::uint16_t*) src_v.off_data_.data(), n_runs, dest_v.off_data_, dest_v.val_data_); break;
+      case 0x03u: dest_v.sparse_size_ = ::savvy::pbwt_runs_to_sparse(vals, (const std::uint32_t*) src_v.off_data_.data(), n_runs, dest_v.off_data_, dest_v.val_data_); break;
+      case 0x04u: dest_v.sparse_size_ = ::savvy::pbwt_runs_to_sparse(vals, (const std::uint64_t*) src_v.off_data_.data(), n_runs, dest_v.off_data_, dest_v.val_data_); break;
+      }
+    }
+    else if (src_v.val_type_ == 0x02u)
+    {
+      auto vals = (const std::int16_t*) src_v.val_data_.data();
+      switch (src_v.off_type_)
+      {
+      case 0x01u: dest_v.sparse_size_ = ::savvy::pbwt_runs_to_sparse(vals, (const std::uint8_t*) src_v.off_data_.data(), n_runs, dest_v.off_data_, dest_v.val_data_); break;
+      case 0x02u: dest_v.sparse_size_ = ::savvy::pbwt_runs_to_sparse(vals, (const std::uint16_t*) src_v.off_data_.data(), n_runs, dest_v.off_data_, dest_v.val_data_); break;
+      case 0x03u: dest_v.sparse_size_ = ::savvy::pbwt_runs_to_sparse(vals, (const std::uint32_t*) src_v.off_data_.data(), n_runs, dest_v.off_data_, dest_v.val_data_); break;
+      case 0x04u: dest_v.sparse_size_ = ::savvy::pbwt_runs_to_sparse(vals, (const std::uint64_t*) src_v.off_data_.data(), n_runs, dest_v.off_data_, dest_v.val_data_); break;
+      }
+    }
+
+    dest_v.minimize();
+  }
+
+  inline void typed_value::internal::pbwt_unsort(const typed_value& src_v, typed_value& dest_v, ::savvy::internal::pbwt_sort_format_context& fmt_ctx, ::savvy::internal::pbwt_sort_map& prev_sort_mapping, std::vector<std::uint32_t>& counts)
   {
-    assert(src_v.off_type_ == 0);
     //assert(v.local_data_.empty());
 
     dest_v.size_ = src_v.size_;
-    dest_v.sparse_size_ = src_v.sparse_size_;
+    dest_v.sparse_size_ = 0;
     dest_v.val_type_ = src_v.val_type_;
-    dest_v.off_type_ = src_v.off_type_;
+    dest_v.off_type_ = 0;
     dest_v.pbwt_flag_ = false;
+    dest_v.pbwt_runs_ = false;
 
     if (src_v.off_type_)
     {
-      fprintf(stderr, "PBWT sort not supported with sparse vectors\n"); // TODO: implement
+      // Run-length encoded column (see serialize_pbwt_column()).
+      dest_v.val_data_.resize(src_v.size_ * (1u << bcf_type_shift[src_v.val_type_]));
+      const std::size_t n_runs = src_v.sparse_size_;
+      if (src_v.val_type_ == 0x01u)
+      {
+        auto vals = (const std::int8_t*) src_v.val_data_.data();
+        auto dest = (std::int8_t*) dest_v.val_data_.data();
+        switch (src_v.off_type_)
+        {
+        case 0x01u: ::savvy::pbwt_unsort_runs(vals, (const std::uint8_t*) src_v.off_data_.data(), n_runs, src_v.size_, dest, fmt_ctx, prev_sort_mapping, counts); return;
+        case 0x02u: ::savvy::pbwt_unsort_runs(vals, (const std::uint16_t*) src_v.off_data_.data(), n_runs, src_v.size_, dest, fmt_ctx, prev_sort_mapping, counts); return;
+        case 0x03u: ::savvy::pbwt_unsort_runs(vals, (const std::uint32_t*) src_v.off_data_.data(), n_runs, src_v.size_, dest, fmt_ctx, prev_sort_mapping, counts); return;
+        case 0x04u: ::savvy::pbwt_unsort_runs(vals, (const std::uint64_t*) src_v.off_data_.data(), n_runs, src_v.size_, dest, fmt_ctx, prev_sort_mapping, counts); return;
+        }
+      }
+      else if (src_v.val_type_ == 0x02u)
+      {
+        auto vals = (const std::int16_t*) src_v.val_data_.data();
+        auto dest = (std::int16_t*) dest_v.val_data_.data();
+        switch (src_v.off_type_)
+        {
+        case 0x01u: ::savvy::pbwt_unsort_runs(vals, (const std::uint8_t*) src_v.off_data_.data(), n_runs, src_v.size_, dest, fmt_ctx, prev_sort_mapping, counts); return;
+        case 0x02u: ::savvy::pbwt_unsort_runs(vals, (const std::uint16_t*) src_v.off_data_.data(), n_runs, src_v.size_, dest, fmt_ctx, prev_sort_mapping, counts); return;
+        case 0x03u: ::savvy::pbwt_unsort_runs(vals, (const std::uint32_t*) src_v.off_data_.data(), n_runs, src_v.size_, dest, fmt_ctx, prev_sort_mapping, counts); return;
+        case 0x04u: ::savvy::pbwt_unsort_runs(vals, (const std::uint64_t*) src_v.off_data_.data(), n_runs, src_v.size_, dest, fmt_ctx, prev_sort_mapping, counts); return;
+        }
+      }
+
+      fprintf(stderr, "Invalid PBWT run-length encoding\n"); // TODO: handle better
       exit(-1);
     }
     else if (src_v.val_type_)
     {
       dest_v.val_data_.resize(src_v.size_ * (1u << bcf_type_shift[src_v.val_type_]));
-      if (src_v.val_type_ == 0x01u) ::savvy::pbwt_unsort((std::int8_t *) src_v.val_data_.data(), src_v.size_, (std::int8_t *) dest_v.val_data_.data(), sort_mapping, prev_sort_mapping, counts);
-      else if (src_v.val_type_ == 0x02u) ::savvy::pbwt_unsort((std::int16_t *) src_v.val_data_.data(), src_v.size_, (std::int16_t *) dest_v.val_data_.data(), sort_mapping, prev_sort_mapping, counts); // TODO: make sure this works
+      if (src_v.val_type_ == 0x01u) ::savvy::pbwt_unsort((std::int8_t *) src_v.val_data_.data(), src_v.size_, (std::int8_t *) dest_v.val_data_.data(), fmt_ctx, prev_sort_mapping, counts);
+      else if (src_v.val_type_ == 0x02u) ::savvy::pbwt_unsort((std::int16_t *) src_v.val_data_.data(), src_v.size_, (std::int16_t *) dest_v.val_data_.data(), fmt_ctx, prev_sort_mapping, counts); // TODO: make sure this works
       else
       {
         fprintf(stderr, "PBWT sorted vector values cannot be wider than 16 bits\n"); // TODO: handle better
@@ -2237,6 +3250,39 @@ namespace savvy
 
       std::uint8_t sp_type_byte = is.get();
       ++bytes_read;
+      if ((sp_type_byte >> 4u) == 0 && !v.pbwt_flag_)
+      {
+        // Bit-packed genotype codes are expanded to a dense int8 vector. off_data_ is reused as scratch space.
+        std::uint8_t bits = sp_type_byte & 0x0Fu;
+        if (bits != 2 && bits != 4)
+          return -1;
+
+        v.off_data_.resize((v.size_ * bits + 7u) / 8u);
+        is.read(v.off_data_.data(), v.off_data_.size());
+        bytes_read += v.off_data_.size();
+        if (!is.good())
+          return -1;
+
+        v.off_type_ = 0;
+        v.val_type_ = typed_value::int8;
+        v.sparse_size_ = 0;
+        v.val_data_.resize(v.size_);
+
+        const std::uint8_t* src = (const std::uint8_t*) v.off_data_.data();
+        std::int8_t* dest = (std::int8_t*) v.val_data_.data();
+        const std::size_t per_byte = 8u / bits;
+        const std::uint8_t mask = std::uint8_t((1u << bits) - 1u);
+        const std::uint8_t missing_code = std::uint8_t(mask - 1u);
+        std::size_t i = detail::simd::unpack_prefix(bits, src, v.size_, dest);
+        for ( ; i < v.size_; ++i)
+        {
+          std::uint8_t code = (src[i / per_byte] >> ((i % per_byte) * bits)) & mask;
+          dest[i] = code < missing_code ? std::int8_t(code) : std::int8_t(0x80u + (code - missing_code));
+        }
+        v.off_data_.clear();
+        return bytes_read;
+      }
+
       v.off_type_ = sp_type_byte >> 4u;
       v.val_type_ = sp_type_byte & 0x0Fu;
       v.sparse_size_ = 0;
@@ -2264,6 +3310,8 @@ namespace savvy
       {
         v.apply(endian_swapper_fn());
       }
+
+      v.pbwt_runs_ = v.pbwt_flag_; // Sparse PBWT columns are run-length encoded (see serialize_pbwt_column()).
     }
     else
     {
@@ -2287,7 +3335,7 @@ namespace savvy
   }
 
   template <typename Iter>
-  void typed_value::internal::serialize(const typed_value& v, Iter out_it, std::size_t size_divisor)
+  void typed_value::internal::serialize(const typed_value_view& v, Iter out_it, std::size_t size_divisor)
   {
     assert(!v.off_type_ || size_divisor == 1);
     std::uint8_t type_byte =  v.off_type_ ? typed_value::sparse : v.val_type_;
@@ -2310,8 +3358,8 @@ namespace savvy
       if (endianness::is_big() && off_width > 1)
       {
         // TODO: this is a slow approach, but big-endian systems should be rare.
-        const char* ip_end = v.off_data_.data() + sz * off_width;
-        for (const char* ip = v.off_data_.data(); ip < ip_end; ip+=off_width)
+        const char* ip_end = v.off_ptr_ + sz * off_width;
+        for (const char* ip = v.off_ptr_; ip < ip_end; ip+=off_width)
         {
           for (const char* jp = ip + off_width - 1; jp >= ip; --jp)
             *(out_it++) = *jp;
@@ -2319,7 +3367,7 @@ namespace savvy
       }
       else
       {
-        std::copy_n(v.off_data_.data(), sz * off_width, out_it);
+        std::copy_n(v.off_ptr_, sz * off_width, out_it);
       }
     }
 
@@ -2328,8 +3376,8 @@ namespace savvy
     if (endianness::is_big() && val_width > 1)
     {
       // TODO: this is a slow approach, but big-endian systems should be rare.
-      const char* ip_end = v.val_data_.data() + sz * val_width;
-      for (const char* ip = v.val_data_.data(); ip < ip_end; ip+=val_width)
+      const char* ip_end = v.val_ptr_ + sz * val_width;
+      for (const char* ip = v.val_ptr_; ip < ip_end; ip+=val_width)
       {
         for (const char* jp = ip + val_width - 1; jp >= ip; --jp)
           *(out_it++) = *jp;
@@ -2337,20 +3385,29 @@ namespace savvy
     }
     else
     {
-      std::copy_n(v.val_data_.data(), sz * val_width, out_it);
+      std::copy_n(v.val_ptr_, sz * val_width, out_it);
     }
 
   }
 
   template<typename InIter, typename OutIter>
-  inline void typed_value::internal::pbwt_sort(InIter in_data, std::size_t in_data_sz, OutIter out_it, std::vector<std::size_t>& sort_mapping, std::vector<std::size_t>& prev_sort_mapping, std::vector<std::size_t>& counts)
+  inline void typed_value::internal::pbwt_sort(InIter in_data, std::size_t in_data_sz, OutIter out_it, ::savvy::internal::pbwt_sort_format_context& fmt_ctx, ::savvy::internal::pbwt_sort_map& prev_sort_mapping, std::vector<std::uint32_t>& counts)
   {
-    std::swap(sort_mapping, prev_sort_mapping);
-    if (prev_sort_mapping.empty())
+    if (in_data_sz > std::numeric_limits<std::uint32_t>::max())
     {
+      fprintf(stderr, "PBWT sorted vectors cannot exceed 2^32 - 1 elements\n"); // TODO: handle better
+      exit(-1);
+    }
+
+    std::swap(fmt_ctx.sort_mapping, prev_sort_mapping);
+    auto& sort_mapping = fmt_ctx.sort_mapping;
+    if (fmt_ctx.identity)
+    {
+      // Lazily materialize identity so that block resets stay O(1) per field.
       prev_sort_mapping.resize(in_data_sz);
       for (std::size_t i = 0; i < in_data_sz; ++i)
-        prev_sort_mapping[i] = i;
+        prev_sort_mapping[i] = std::uint32_t(i);
+      fmt_ctx.identity = false;
     }
 
     sort_mapping.resize(in_data_sz);
@@ -2377,7 +3434,7 @@ namespace savvy
 
     for (std::size_t i = 0; i < prev_sort_mapping.size(); ++i)
     {
-      std::size_t unsorted_index = prev_sort_mapping[i];
+      std::uint32_t unsorted_index = prev_sort_mapping[i];
       utype d(in_data[unsorted_index]);
       sort_mapping[counts[d]++] = unsorted_index;
     }
@@ -2413,60 +3470,180 @@ namespace savvy
     }
   }
 
-  template <typename Iter>
-  void typed_value::internal::serialize(const typed_value& v, Iter out_it, std::vector<std::size_t>& sort_mapping, std::vector<std::size_t>& prev_sort_mapping, std::vector<std::size_t>& counts)
+  template <typename T, typename Iter>
+  void typed_value::internal::serialize_pbwt_column(const char* sorted_data, std::size_t sz, std::uint8_t val_type, bool allow_rle, Iter out_it)
   {
-    std::uint8_t type_byte =  v.off_type_ ? typed_value::sparse : (0x08u | v.val_type_); // sparse with PBWT not currently supported.
-    type_byte = std::uint8_t(std::min(std::size_t(15), v.size_) << 4u) | type_byte;
+    // Values are compared as raw little-endian bytes, so the runs do not depend on host byte order.
+    const std::size_t width = sizeof(T);
+    std::size_t n_runs = 0;
+    std::size_t max_run = 0;
+    for (std::size_t i = 0; allow_rle && i < sz; )
+    {
+      std::size_t j = i + 1;
+      for ( ; j < sz && std::memcmp(sorted_data + j * width, sorted_data + i * width, width) == 0; ++j) {}
+      max_run = std::max(max_run, j - i);
+      ++n_runs;
+      i = j;
+    }
+
+    const std::uint8_t len_type = offset_type_code(std::uint64_t(max_run ? max_run - 1 : 0));
+    const std::size_t len_width = 1u << bcf_type_shift[len_type];
+    const bool rle = allow_rle && sz && (2 + sizeof(std::int64_t) + n_runs * (len_width + width)) < sz * width;
+
+    std::uint8_t type_byte = std::uint8_t(std::min(std::size_t(15), sz) << 4u) | 0x08u | (rle ? typed_value::sparse : val_type);
     *(out_it++) = type_byte;
-    if (v.size_ >= 15u)
-      internal::serialize_typed_scalar(out_it, static_cast<std::int64_t>(v.size_));
+    if (sz >= 15u)
+      internal::serialize_typed_scalar(out_it, static_cast<std::int64_t>(sz));
 
-    if (v.off_type_ && v.size_)
+    if (!rle)
     {
-      assert(!"This should never happen"); // TODO: Then why is this here?
-      type_byte = std::uint8_t(v.off_type_ << 4u) | v.val_type_;
-      *(out_it++) = type_byte;
-      internal::serialize_typed_scalar(out_it, static_cast<std::int64_t>(v.sparse_size_));
-      //std::size_t pair_width = (1u << bcf_type_shift[v.off_type_]) + (1u << bcf_type_shift[v.val_type_]);
-      std::size_t off_width = (1u << bcf_type_shift[v.off_type_]);
-      std::size_t val_width = (1u << bcf_type_shift[v.val_type_]);
+      std::copy_n(sorted_data, sz * width, out_it);
+      return;
+    }
 
-      if (endianness::is_big() && off_width > 1)
+    // Laid out like a sparse vector: sub-type byte, typed run count, run lengths (minus one), then run values.
+    *(out_it++) = std::uint8_t(len_type << 4u) | val_type;
+    internal::serialize_typed_scalar(out_it, static_cast<std::int64_t>(n_runs));
+
+    for (std::size_t i = 0; i < sz; )
+    {
+      std::size_t j = i + 1;
+      for ( ; j < sz && std::memcmp(sorted_data + j * width, sorted_data + i * width, width) == 0; ++j) {}
+      std::uint64_t len = j - i - 1;
+      for (std::size_t b = 0; b < len_width; ++b)
+        *(out_it++) = char(std::uint8_t(len >> (8u * b)));
+      i = j;
+    }
+
+    for (std::size_t i = 0; i < sz; )
+    {
+      std::size_t j = i + 1;
+      for ( ; j < sz && std::memcmp(sorted_data + j * width, sorted_data + i * width, width) == 0; ++j) {}
+      std::copy_n(sorted_data + i * width, width, out_it);
+      i = j;
+    }
+  }
+
+  namespace detail
+  {
+    inline std::uint8_t packed_genotype_code(std::int8_t val, std::uint8_t bits)
+    {
+      if (val >= 0)
+        return std::uint8_t(val);
+      return std::uint8_t((1u << bits) - (val == end_of_vector_int8 ? 1u : 2u));
+    }
+
+    struct packed_sparse_writer_fn
+    {
+      template <typename OffT, typename Iter>
+      void operator()(const std::int8_t* valp, const std::int8_t* endp, const OffT* offp, Iter out_it, std::uint8_t bits, std::size_t n_bytes)
       {
-        // TODO: this is a slow approach, but big-endian systems should be rare.
-        const char* ip_end = v.off_data_.data() + v.sparse_size_ * off_width;
-        for (const char* ip = v.off_data_.data(); ip < ip_end; ip+=off_width)
+        const std::size_t per_byte = 8u / bits;
+        std::size_t cur_byte = 0;
+        std::uint8_t cur = 0;
+        std::size_t pos = 0;
+        for ( ; valp != endp; ++valp, ++offp, ++pos)
         {
-          for (const char* jp = ip + off_width - 1; jp >= ip; --jp)
-            *(out_it++) = *jp;
+          pos += *offp;
+          for ( ; cur_byte < pos / per_byte; ++cur_byte, cur = 0)
+            *(out_it++) = char(cur);
+          cur |= std::uint8_t(packed_genotype_code(*valp, bits) << ((pos % per_byte) * bits));
         }
 
-        ip_end = v.val_data_.data() + v.sparse_size_ * val_width;
-        for (const char* ip = v.val_data_.data(); ip < ip_end; ip+=val_width)
-        {
-          for (const char* jp = ip + val_width - 1; jp >= ip; --jp)
-            *(out_it++) = *jp;
-        }
+        for ( ; cur_byte < n_bytes; ++cur_byte, cur = 0)
+          *(out_it++) = char(cur);
       }
-      else
+    };
+  }
+
+  inline
+  std::uint8_t typed_value::internal::packed_bit_width(const typed_value_view& v)
+  {
+    if (v.val_type_ != typed_value::int8 || v.pbwt_flag_ || !v.size_)
+      return 0;
+
+    const std::int8_t* valp = (const std::int8_t*) v.val_ptr_;
+    const std::int8_t* endp = valp + (v.off_type_ ? v.sparse_size_ : v.size_);
+    std::uint8_t max_val = 0;
+    for ( ; valp != endp; ++valp)
+    {
+      std::uint8_t u = std::uint8_t(*valp);
+      if (u > 13u)
       {
-        std::copy_n(v.off_data_.data(), v.sparse_size_ * off_width, out_it);
-        std::copy_n(v.val_data_.data(), v.sparse_size_ * val_width, out_it);
+        if (u != 0x80u && u != 0x81u)
+          return 0;
       }
+      else if (u > max_val)
+      {
+        max_val = u;
+      }
+    }
+
+    std::uint8_t bits = max_val > 1u ? 4 : 2;
+    if (v.off_type_ && (v.size_ * bits + 7u) / 8u >= v.sparse_size_ * ((1u << bcf_type_shift[v.off_type_]) + 1u))
+      return 0;
+    return bits;
+  }
+
+  template <typename Iter>
+  void typed_value::internal::serialize_packed(const typed_value_view& v, Iter out_it, std::uint8_t bits)
+  {
+    assert(bits == 2 || bits == 4);
+    std::uint8_t type_byte = std::uint8_t(std::min(std::size_t(15), v.size_) << 4u) | typed_value::sparse;
+    *(out_it++) = type_byte;
+    if (v.size_ >= 15u)
+      internal::serialize_typed_scalar(out_it, static_cast<std::int64_t>(v.size_));
+
+    // A sparse sub-type byte with an offset type of zero is followed by the packed codes instead of a sparse size.
+    *(out_it++) = bits;
+
+    const std::size_t n_bytes = (v.size_ * bits + 7u) / 8u;
+    if (v.off_type_)
+    {
+      v.capply_sparse_offsets<std::int8_t>(detail::packed_sparse_writer_fn(), out_it, bits, n_bytes);
+      return;
+    }
+
+    const std::size_t per_byte = 8u / bits;
+    const std::int8_t* valp = (const std::int8_t*) v.val_ptr_;
+    for (std::size_t i = 0; i < v.size_; i += per_byte)
+    {
+      std::size_t n = std::min(per_byte, v.size_ - i);
+      std::uint8_t cur = 0;
+      for (std::size_t j = 0; j < n; ++j)
+        cur |= std::uint8_t(detail::packed_genotype_code(valp[i + j], bits) << (j * bits));
+      *(out_it++) = char(cur);
+    }
+  }
+
+  template <typename Iter>
+  void typed_value::internal::serialize(const typed_value_view& v, Iter out_it, ::savvy::internal::pbwt_sort_format_context& fmt_ctx, ::savvy::internal::pbwt_sort_context& pbwt_ctx)
+  {
+    if (v.off_type_)
+    {
+      // Sparse with PBWT not currently supported.
+      internal::serialize(v, out_it, 1);
+      return;
+    }
+
+    // ---- PBWT ---- //
+    pbwt_ctx.sorted_data.clear();
+    if (v.val_type_ == 0x01u)
+    {
+      internal::pbwt_sort((const std::int8_t *) v.val_ptr_, v.size_, std::back_inserter(pbwt_ctx.sorted_data), fmt_ctx, pbwt_ctx.prev_sort_mapping, pbwt_ctx.counts);
+      internal::serialize_pbwt_column<std::int8_t>(pbwt_ctx.sorted_data.data(), v.size_, v.val_type_, pbwt_ctx.run_length_encode, out_it);
+    }
+    else if (v.val_type_ == 0x02u)
+    {
+      internal::pbwt_sort((const std::int16_t *) v.val_ptr_, v.size_, std::back_inserter(pbwt_ctx.sorted_data), fmt_ctx, pbwt_ctx.prev_sort_mapping, pbwt_ctx.counts); // TODO: make sure this works
+      internal::serialize_pbwt_column<std::int16_t>(pbwt_ctx.sorted_data.data(), v.size_, v.val_type_, pbwt_ctx.run_length_encode, out_it);
     }
     else
     {
-      // ---- PBWT ---- //
-      if (v.val_type_ == 0x01u) internal::pbwt_sort((std::int8_t *) v.val_data_.data(), v.size_, out_it, sort_mapping, prev_sort_mapping, counts);
-      else if (v.val_type_ == 0x02u) internal::pbwt_sort((std::int16_t *) v.val_data_.data(), v.size_, out_it, sort_mapping, prev_sort_mapping, counts); // TODO: make sure this works
-      else
-      {
-        fprintf(stderr, "PBWT sorted vector values cannot be wider than 16 bits\n"); // TODO: handle better
-        exit(-1);
-      }
-      // ---- PBWT_END ---- //
+      fprintf(stderr, "PBWT sorted vector values cannot be wider than 16 bits\n"); // TODO: handle better
+      exit(-1);
     }
+    // ---- PBWT_END ---- //
   }
 
   template<typename T>
@@ -2486,11 +3663,13 @@ namespace savvy
   typed_value::init(const T& vec)
   {
     typedef typename T::value_type vtype;
-    if (std::is_integral<vtype>::value)
+    if (std::is_integral<vtype>::value && sizeof(vtype) > 1) // Any non-reserved 8-bit value is already minimal
     {
       vtype min_val = 0;
       vtype max_val = 0;
-      for (auto it = vec.begin(); it != vec.end(); ++it)
+      const vtype* contiguous = contiguous_data(vec);
+      auto it = vec.begin() + (contiguous ? detail::simd::minmax_prefix(contiguous, vec.size(), min_val, max_val) : 0);
+      for ( ; it != vec.end(); ++it)
       {
         if (!is_special_value(*it))
         {
@@ -2515,13 +3694,13 @@ namespace savvy
     switch (val_type_)
     {
     case 0x01u:
-      std::transform(vec.begin(), vec.begin() + size_, (std::int8_t*) val_data_.data(), reserved_transformation<std::int8_t, typename T::value_type>);
+      copy_narrowed(vec, (std::int8_t*) val_data_.data());
       break;
     case 0x02u:
-      std::transform(vec.begin(), vec.begin() + size_, (std::int16_t*) val_data_.data(), reserved_transformation<std::int16_t, typename T::value_type>); // TODO: handle endianess
+      copy_narrowed(vec, (std::int16_t*) val_data_.data()); // TODO: handle endianess
       break;
     case 0x03u:
-      std::transform(vec.begin(), vec.begin() + size_, (std::int32_t*) val_data_.data(), reserved_transformation<std::int32_t, typename T::value_type>);
+      copy_narrowed(vec, (std::int32_t*) val_data_.data());
       break;
     case 0x04u:
       std::transform(vec.begin(), vec.begin() + size_, (std::int64_t*) val_data_.data(), reserved_transformation<std::int64_t, typename T::value_type>);
@@ -19,6 +19,7 @@
 #include <cstdint>
 #include <array>
 #include <sstream>
+#include <streambuf>
 #include <cstring>
 #include <algorithm>
 #include <cassert>
@@ -67,6 +68,18 @@ namespace savvy
 
   namespace detail
   {
+    /**
+     * Read-only stream buffer over an existing block of memory.
+     */
+    class memory_istreambuf : public std::streambuf
+    {
+    public:
+      memory_istreambuf(char* beg, char* end)
+      {
+        setg(beg, beg, end);
+      }
+    };
+
     inline
     std::vector<std::string> split_string_to_vector(const char* in, char delim)
     {
@@ -201,6 +214,84 @@ namespace savvy
 
       return is.good() && os.good();;
     }
+
+    static const std::size_t footer_frame_footer_size = 27;
+
+    /**
+     * Locates a skippable zstd frame that ends at end_pos and is terminated by a footer consisting of the uint32
+     * payload size, the file's UUID and a 7-byte version string. These frames (e.g., zone maps) are stored between
+     * the last variant block and the appended S1R index, so they can be walked backward from the index.
+     * @param is Input stream of SAV file
+     * @param end_pos File position immediately following the frame
+     * @param version Destination for version string of frame
+     * @param uuid Destination for UUID stored in frame's footer
+     * @return File position of frame or -1 if no such frame exists
+     */
+    inline std::int64_t find_footer_frame(std::istream& is, std::int64_t end_pos, std::string& version, std::array<std::uint8_t, 16>& uuid)
+    {
+      std::int64_t footer_pos = end_pos - std::int64_t(footer_frame_footer_size);
+      if (footer_pos < 8)
+        return -1;
+
+      std::array<char, footer_frame_footer_size> footer;
+      is.clear();
+      is.seekg(footer_pos);
+      if (!is.read(footer.data(), footer.size()))
+      {
+        is.clear();
+        return -1;
+      }
+
+      std::uint32_t payload_size;
+      std::memcpy(&payload_size, footer.data(), 4);
+      payload_size = le32toh(payload_size);
+
+      std::int64_t frame_pos = end_pos - std::int64_t(payload_size) - 8;
+      if (payload_size < footer_frame_footer_size || frame_pos < 0)
+        return -1;
+
+      std::array<char, 8> header;
+      is.seekg(frame_pos);
+      if (!is.read(header.data(), header.size()) || (header[0] & 0xF0) != 0x50 || std::memcmp(header.data() + 1, "\x2A\x4D\x18", 3) != 0 || std::memcmp(header.data() + 4, footer.data(), 4) != 0)
+      {
+        is.clear();
+        return -1;
+      }
+
+      version.assign(footer.end() - 7, footer.end());
+      std::memcpy(uuid.data(), footer.data() + 4, uuid.size());
+      return frame_pos;
+    }
+
+    inline std::int64_t find_footer_frame(std::istream& is, std::int64_t end_pos, std::string& version)
+    {
+      std::array<std::uint8_t, 16> uuid;
+      return find_footer_frame(is, end_pos, version, uuid);
+    }
+
+    /**
+     * Locates a footer-terminated skippable zstd frame preceding the appended S1R index (see find_footer_frame()).
+     * Frames written for a different file (i.e., whose UUID does not match) are ignored.
+     * @param is Input stream of SAV file
+     * @param s1r_offset File offset of S1R index (see s1r::reader::file_offset())
+     * @param name First three characters of frame's version string
+     * @param file_uuid UUID from header of SAV file
+     * @return File position of frame or -1 if file does not contain the frame
+     */
+    inline std::int64_t find_footer_frame(std::istream& is, std::int64_t s1r_offset, const char* name, const std::array<std::uint8_t, 16>& file_uuid)
+    {
+      std::string version;
+      std::array<std::uint8_t, 16> uuid;
+      std::int64_t end_pos = s1r_offset - 8;
+      std::int64_t frame_pos;
+      while ((frame_pos = find_footer_frame(is, end_pos, version, uuid)) >= 0)
+      {
+        if (version.compare(0, 3, name) == 0 && uuid == file_uuid)
+          return frame_pos;
+        end_pos = frame_pos;
+      }
+      return -1;
+    }
   }
 
   struct header_value_details
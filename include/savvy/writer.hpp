@@ -16,6 +16,10 @@
 #include "region.hpp"
 #include "s1r.hpp"
 #include "pbwt.hpp"
+#include "zone_map.hpp"
+#include "id_index.hpp"
+#include "block_compressor.hpp"
+#include "stage_stats.hpp"
 
 
 #include <shrinkwrap/zstd.hpp>
@@ -35,6 +39,7 @@
 #include <cstdint>
 #include <type_traits>
 #include <cinttypes>
+#include <deque>
 
 namespace savvy
 {
@@ -63,11 +68,15 @@ namespace savvy
       static const int default_block_size = 4096;
     private:
       std::mt19937_64 rng_;
+      detail::owned_stage_stats stats_;
       std::unique_ptr<std::streambuf> output_buf_;
       std::ostream ofs_;
       std::size_t n_samples_ = 0;
       std::vector<char> serialized_buf_;
       std::unordered_set<std::string> pbwt_fields_;
+      std::unordered_set<std::string> packed_fields_;
+      bool pbwt_rle_declared_ = false;
+      bool packed_encoding_declared_ = false;
 
       // Data members to support indexing
       std::fstream append_ofs_;
@@ -79,6 +88,26 @@ namespace savvy
       std::uint32_t current_block_min_ = std::numeric_limits<std::uint32_t>::max();
       std::uint32_t current_block_max_ = 0;
       bool append_index_;
+      std::unique_ptr<zone_map> zone_map_;
+      std::unique_ptr<id_index> id_index_;
+
+      // Data members to support parallel compression
+      struct pending_block
+      {
+        std::string chromosome;
+        std::uint32_t min;
+        std::uint32_t max;
+        std::size_t record_count;
+        std::size_t index; // Block index in zone map and ID index
+      };
+      std::unique_ptr<block_compressor> compressor_;
+      std::deque<pending_block> pending_blocks_;
+      std::vector<char> block_buf_;
+      std::vector<char> frame_buf_;
+      std::uint64_t committed_pos_ = 0;
+      std::size_t compression_threads_ = 0;
+      std::size_t block_count_ = 0;
+      std::uint8_t compression_level_;
     private:
       static std::filebuf *create_std_filebuf(const std::string& file_path, std::ios::openmode mode);
 
@@ -110,6 +139,51 @@ namespace savvy
        */
       void set_pbwt(const std::unordered_set<std::string>& pbwt_fields);
 
+      /**
+       * Enables run-length encoding of PBWT-sorted fields, which is used for a sorted column when it is smaller than
+       * the sorted values. Older versions of savvy cannot read these columns, so the encoding must also be declared
+       * with a "##pbwt_encoding=rle" line in the headers passed to the constructor. Must be set before writing the
+       * first record.
+       * @param enabled Whether to run-length encode PBWT-sorted fields (default: false)
+       */
+      void set_pbwt_rle(bool enabled);
+
+      /**
+       * Specifies int8 FORMAT fields (e.g., GT) that are stored with 2 bits per value when all values are 0, 1, missing
+       * or end-of-vector, or with 4 bits per value when all values are 0-13, missing or end-of-vector. Other records
+       * and fields that are also PBWT-sorted are stored normally. Sparse values are only packed if that is smaller.
+       * Packing is transparent to readers, which expand the values to dense int8 vectors. Older versions of savvy cannot
+       * read packed fields, so the encoding must also be declared with a "##packed_encoding=bits" line in the headers
+       * passed to the constructor. Must be set before writing the first record.
+       * @param packed_fields Set of fields
+       */
+      void set_packed_fields(const std::unordered_set<std::string>& packed_fields);
+
+      /**
+       * Specifies numeric INFO fields for which per-block minimum and maximum values are stored. The zone map is
+       * appended to SAV files along with the S1R index and allows readers to skip blocks (see
+       * reader::set_block_filter()). Must be set before writing the first record.
+       * @param info_fields Set of fields
+       */
+      void set_zone_map_fields(const std::unordered_set<std::string>& info_fields);
+
+      /**
+       * Enables an index of variant IDs, which is appended to SAV files along with the S1R index and allows records
+       * to be queried by ID (see reader::reset_bounds(std::vector<std::string>)). The index is built in memory, using
+       * 16 bytes per ID. Must be set before writing the first record.
+       * @param enabled Whether to create the ID index
+       */
+      void set_id_index(bool enabled);
+
+      /**
+       * Sets number of threads used to compress SAV blocks. Records are still serialized on the calling thread, but
+       * each block is compressed into its own zstd frame by a worker thread while the next block is being written.
+       * Up to two blocks per thread are buffered in memory. Has no effect on VCF/BCF files, uncompressed SAV files or
+       * when the block size is zero. Must be set before writing the first record.
+       * @param n_threads Number of compression threads (0 or 1 compresses on the calling thread)
+       */
+      void set_compression_threads(std::size_t n_threads);
+
       /**
        * Checks for EOF or write error.
        *
@@ -127,14 +201,36 @@ namespace savvy
       writer& write(const variant& r);
       writer& operator<<(const variant& v) { return write(v); } ///< Shorthand for write()
 
+      /**
+       * Writes record whose FORMAT fields are views (e.g., into variants read by other readers or into external
+       * buffers). The viewed data is serialized directly, so fields can be passed through or rearranged without
+       * copying them into a variant. VCF output copies the fields.
+       * @param site Site information of record
+       * @param format_fields FORMAT keys and views of values
+       * @return *this
+       */
+      writer& write(const site_info& site, const std::vector<std::pair<std::string, typed_value_view>>& format_fields);
+
       /**
        * For SAV files, gets file position for the beginning of current zstd block. For VCF/BCF files, gets "virtual offset".
+       * When blocks are compressed in parallel, gets end of last block that has been written to file.
        *
        * @return File position
        */
-      std::streampos tellp() { return ofs_.tellp(); }
+      std::streampos tellp() { return compressor_ ? std::streampos(committed_pos_) : ofs_.tellp(); }
+
+      /**
+       * Per-stage timers and counters. These are only updated when compiled with SAVVY_PROFILE. When blocks are
+       * compressed in parallel, the compress stage includes time spent by all compression threads.
+       * @return Counters accumulated since file was opened
+       */
+      stage_stats stats() const;
     private:
+      void queue_block();
+      void write_compressed_blocks(bool wait_all);
       writer& write_vcf(const variant& r);
+      template <typename ValT>
+      writer& write_record(const site_info& r, const std::vector<std::pair<std::string, ValT>>& format_fields);
       void write_header(std::vector<std::pair<std::string, std::string>>& headers, const std::vector<std::string>& ids);
 
       bool serialize_vcf_shared(const site_info& s);
@@ -175,7 +271,8 @@ namespace savvy
       output_buf_(create_out_streambuf(file_path, file_format, compression_level)),
       ofs_(output_buf_.get()),
       append_ofs_(file_path, std::ios::out | std::ios::binary | std::ios::app),
-      append_index_(custom_index_path.empty())
+      append_index_(custom_index_path.empty()),
+      compression_level_(compression_level)
     {
       file_format_ = file_format;
       uuid_ = ::savvy::detail::gen_uuid(rng_);
@@ -218,6 +315,16 @@ namespace savvy
     inline
     writer::~writer()
     {
+      if (compressor_)
+      {
+        queue_block();
+        write_compressed_blocks(true);
+#ifdef SAVVY_PROFILE
+        stats_[stage_stats::stage::compress].nanoseconds += compressor_->compression_nanoseconds();
+#endif
+        compressor_.reset();
+      }
+
       // TODO: This is only a temp solution.
       if (index_file_)
       {
@@ -236,6 +343,10 @@ namespace savvy
 
           s1r::entry e(current_block_min_, current_block_max_, (file_pos << 16) | std::uint16_t(record_count_in_block_ - 1));
           index_file_->write(current_chromosome_, e);
+          if (zone_map_)
+            zone_map_->end_block(e.value());
+          if (id_index_)
+            id_index_->end_block(e.value());
         }
 
         ofs_.flush();
@@ -243,6 +354,18 @@ namespace savvy
 
         if (append_index_) // append if custom index path was not provided
         {
+          if (zone_map_ && !zone_map_->serialize(append_ofs_, uuid_))
+          {
+            ofs_.setstate(ofs_.rdstate() | std::ios::badbit);
+            std::cerr << "Error: could not append zone map" << std::endl;
+          }
+
+          if (id_index_ && !id_index_->serialize(append_ofs_, uuid_))
+          {
+            ofs_.setstate(ofs_.rdstate() | std::ios::badbit);
+            std::cerr << "Error: could not append ID index" << std::endl;
+          }
+
           if (!::savvy::detail::append_skippable_zstd_frame(idx_fs, append_ofs_))
           {
             ofs_.setstate(ofs_.rdstate() | std::ios::badbit); // TODO: Use linkat or send file (see https://stackoverflow.com/a/25154505/1034772)
@@ -272,9 +395,154 @@ namespace savvy
       // TODO: potentially set failbit if not sav2.
     }
 
+    inline
+    void writer::set_pbwt_rle(bool enabled)
+    {
+      if (file_format() != file::format::sav2)
+        return;
+
+      if (enabled && !pbwt_rle_declared_)
+      {
+        ofs_.setstate(ofs_.rdstate() | std::ios::failbit);
+        std::cerr << "Warning: set_pbwt_rle() failed because file header does not contain ##pbwt_encoding=rle" << std::endl;
+        return;
+      }
+      sort_context_.run_length_encode = enabled;
+    }
+
+    inline
+    void writer::set_packed_fields(const std::unordered_set<std::string>& packed_fields)
+    {
+      if (file_format() != file::format::sav2)
+        return;
+
+      if (!packed_fields.empty() && !packed_encoding_declared_)
+      {
+        ofs_.setstate(ofs_.rdstate() | std::ios::failbit);
+        std::cerr << "Warning: set_packed_fields() failed because file header does not contain ##packed_encoding=bits" << std::endl;
+        return;
+      }
+      packed_fields_ = packed_fields;
+    }
+
+    inline
+    void writer::set_zone_map_fields(const std::unordered_set<std::string>& info_fields)
+    {
+      if (file_format() == file::format::sav2 && index_file_ && append_index_ && !info_fields.empty())
+      {
+        std::vector<std::string> fields(info_fields.begin(), info_fields.end());
+        std::sort(fields.begin(), fields.end());
+        zone_map_ = ::savvy::detail::make_unique<zone_map>(std::move(fields));
+      }
+      else
+      {
+        zone_map_.reset();
+      }
+    }
+
+    inline
+    void writer::set_id_index(bool enabled)
+    {
+      if (enabled && file_format() == file::format::sav2 && index_file_ && append_index_)
+        id_index_ = ::savvy::detail::make_unique<id_index>();
+      else
+        id_index_.reset();
+    }
+
+    inline
+    void writer::set_compression_threads(std::size_t n_threads)
+    {
+      compression_threads_ = n_threads;
+    }
+
+    inline
+    void writer::queue_block()
+    {
+      if (!record_count_in_block_)
+        return;
+
+      if (record_count_in_block_ > 0x10000) // Max records per block: 64*1024
+      {
+        assert(!"Too many records in zstd frame to be indexed!");
+        ofs_.setstate(std::ios::badbit);
+      }
+
+      // The S1R entry is written once the block's file position is known. Until then, the zone map and ID index only
+      // store the record count.
+      pending_blocks_.push_back({current_chromosome_, current_block_min_, current_block_max_, record_count_in_block_, block_count_++});
+      if (index_file_)
+      {
+        if (zone_map_)
+          zone_map_->end_block(std::uint16_t(record_count_in_block_ - 1));
+        if (id_index_)
+          id_index_->end_block(std::uint16_t(record_count_in_block_ - 1));
+      }
+
+#ifdef SAVVY_PROFILE
+      stats_[stage_stats::stage::compress].bytes += block_buf_.size(); // Compression time is collected from worker threads
+#endif
+      compressor_->submit(block_buf_);
+      record_count_in_block_ = 0;
+      write_compressed_blocks(false);
+    }
+
+    inline
+    stage_stats writer::stats() const
+    {
+      stage_stats ret = stats_;
+      if (compressor_)
+        ret[stage_stats::stage::compress].nanoseconds += compressor_->compression_nanoseconds();
+      return ret;
+    }
+
+    inline
+    void writer::write_compressed_blocks(bool wait_all)
+    {
+      // Frames that are ready are written without waiting unless too many blocks are buffered.
+      const std::size_t max_pending = 2 * compression_threads_;
+      while (compressor_->next_frame(frame_buf_, wait_all || compressor_->pending() > max_pending))
+      {
+        const pending_block& b = pending_blocks_.front();
+        if (frame_buf_.empty())
+        {
+          std::cerr << "Error: failed to compress block" << std::endl;
+          ofs_.setstate(ofs_.rdstate() | std::ios::badbit);
+        }
+
+        std::uint64_t file_pos = committed_pos_;
+        if (file_pos > 0x0000FFFFFFFFFFFF) // Max file size: 256 TiB
+        {
+          assert(!"File size too large to be indexed!");
+          ofs_.setstate(std::ios::badbit);
+        }
+
+        {
+          detail::stage_timer timer(stats_, stage_stats::stage::compress);
+          append_ofs_.write(frame_buf_.data(), frame_buf_.size());
+        }
+        committed_pos_ += frame_buf_.size();
+
+        if (index_file_)
+        {
+          s1r::entry e(b.min, b.max, (file_pos << 16) | std::uint16_t(b.record_count - 1));
+          index_file_->write(b.chromosome, e);
+          if (zone_map_)
+            zone_map_->set_block_file_pos(b.index, file_pos);
+          if (id_index_)
+            id_index_->set_block_file_pos(b.index, file_pos);
+        }
+        pending_blocks_.pop_front();
+      }
+
+      append_ofs_.flush();
+      if (!append_ofs_)
+        ofs_.setstate(ofs_.rdstate() | std::ios::badbit);
+    }
+
     inline
     writer& writer::write_vcf(const variant& r)
     {
+      detail::stage_timer timer(stats_, stage_stats::stage::serialize);
       if (!serialize_vcf_shared(r) || !serialize_vcf_indiv(r, phasing_))
         ofs_.setstate(ofs_.rdstate() | std::ios::badbit);
 
@@ -286,13 +554,43 @@ namespace savvy
     {
       if (file_format_ == format::vcf)
         return write_vcf(r);
+      return write_record(r, r.format_fields());
+    }
 
+    inline
+    writer& writer::write(const site_info& site, const std::vector<std::pair<std::string, typed_value_view>>& format_fields)
+    {
+      if (file_format_ == format::vcf)
+      {
+        variant tmp;
+        static_cast<site_info&>(tmp) = site;
+        for (auto it = format_fields.begin(); it != format_fields.end(); ++it)
+          tmp.set_format(it->first, typed_value(it->second));
+        return write_vcf(tmp);
+      }
+      return write_record(site, format_fields);
+    }
+
+    template <typename ValT>
+    writer& writer::write_record(const site_info& r, const std::vector<std::pair<std::string, ValT>>& format_fields)
+    {
       bool is_bcf = file_format_ == format::bcf; // TODO: ...
       bool flushed = false;
 
+      if (record_count_ == 0 && compression_threads_ > 1 && file_format_ == format::sav2 && compression_level_ > 0 && block_size_ != 0)
+      {
+        ofs_.flush();
+        committed_pos_ = std::uint64_t(ofs_.tellp());
+        compressor_ = ::savvy::detail::make_unique<block_compressor>(compression_threads_, compression_level_);
+      }
+
       if (block_size_ != 0 && file_format_ == format::sav2 && (block_size_ <= record_count_in_block_ || r.chrom() != current_chromosome_)) // TODO: this needs to be fixed to support variable block size
       {
-        if (index_file_ && record_count_in_block_)
+        if (compressor_)
+        {
+          queue_block();
+        }
+        else if (index_file_ && record_count_in_block_)
         {
           auto file_pos = std::uint64_t(ofs_.tellp());
           if (record_count_in_block_ > 0x10000) // Max records per block: 64*1024
@@ -309,8 +607,17 @@ namespace savvy
 
           s1r::entry e(current_block_min_, current_block_max_, (file_pos << 16) | std::uint16_t(record_count_in_block_ - 1));
           index_file_->write(current_chromosome_, e);
+          if (zone_map_)
+            zone_map_->end_block(e.value());
+          if (id_index_)
+            id_index_->end_block(e.value());
+        }
+
+        if (!compressor_)
+        {
+          detail::stage_timer timer(stats_, stage_stats::stage::compress);
+          ofs_.flush();
         }
-        ofs_.flush();
         current_chromosome_ = r.chrom();
         record_count_in_block_ = 0;
         current_block_min_ = std::numeric_limits<std::uint32_t>::max();
@@ -343,14 +650,23 @@ namespace savvy
       //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~//
       // Determine which fields sort
       std::size_t n_fmt = 0;
-      std::vector<::savvy::internal::pbwt_sort_map*> pbwt_format_pointers;
-      pbwt_format_pointers.reserve(r.format_fields().size());
-      for (auto it = r.format_fields().begin(); it != r.format_fields().end(); ++it)
+      std::vector<::savvy::internal::pbwt_sort_format_context*> pbwt_format_pointers;
+      pbwt_format_pointers.reserve(format_fields.size());
+      std::vector<std::uint8_t> packed_bit_widths(format_fields.size(), 0);
+      if (!pbwt_fields_.empty() && sort_context_.format_contexts.size() < dict_.entries[dictionary::id].size())
+        sort_context_.format_contexts.resize(dict_.entries[dictionary::id].size()); // keeps pointers below stable
+      for (auto it = format_fields.begin(); it != format_fields.end(); ++it)
       {
         pbwt_format_pointers.emplace_back(nullptr);
         if (!it->second.is_sparse() && it->second.val_width() <= 2 && pbwt_fields_.find(it->first) != pbwt_fields_.end())
         {
-          pbwt_format_pointers.back() = &sort_context_.format_contexts[it->first][it->second.size()];
+          auto res = dict_.str_to_int[dictionary::id].find(it->first);
+          if (res != dict_.str_to_int[dictionary::id].end()) // missing keys are reported by variant::serialize()
+            pbwt_format_pointers.back() = &sort_context_.get(res->second, it->second.size());
+        }
+        else if (!packed_fields_.empty() && packed_fields_.find(it->first) != packed_fields_.end())
+        {
+          packed_bit_widths[it - format_fields.begin()] = typed_value::internal::packed_bit_width(it->second);
         }
 
         if (file_format_ == format::sav2 || it->first != "PH")
@@ -372,7 +688,7 @@ namespace savvy
           }
         }
 
-        for (auto it = r.format_fields().begin(); it != r.format_fields().end(); ++it)
+        for (auto it = format_fields.begin(); it != format_fields.end(); ++it)
         {
           if (it->second.val_width() > 4)
           {
@@ -384,6 +700,7 @@ namespace savvy
       }
       //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~//
 
+      detail::stage_timer serialize_timer(stats_, stage_stats::stage::serialize);
       serialized_buf_.clear();
       serialized_buf_.reserve(24);
 
@@ -407,9 +724,9 @@ namespace savvy
 
       //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~//
       // Serialize individual data
-      if (!variant::serialize(r, std::back_inserter(serialized_buf_),
+      if (!variant::serialize(format_fields, std::back_inserter(serialized_buf_),
         dict_, n_samples_, is_bcf, phasing_,
-        sort_context_, pbwt_format_pointers))
+        sort_context_, pbwt_format_pointers, packed_bit_widths))
       {
         ofs_.setstate(ofs_.rdstate() | std::ios::badbit);
         return *this;
@@ -424,6 +741,7 @@ namespace savvy
       }
 
       indiv_sz = serialized_buf_.size() - shared_sz;
+      serialize_timer.stop(serialized_buf_.size());
       //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~//
 
       if (endianness::is_big())
@@ -432,9 +750,19 @@ namespace savvy
         indiv_sz = endianness::swap(indiv_sz);
       }
 
-      ofs_.write((char *) &shared_sz, sizeof(shared_sz));
-      ofs_.write((char *) &indiv_sz, sizeof(indiv_sz));
-      ofs_.write(serialized_buf_.data(), serialized_buf_.size());
+      if (compressor_)
+      {
+        block_buf_.insert(block_buf_.end(), (char *) &shared_sz, (char *) &shared_sz + sizeof(shared_sz));
+        block_buf_.insert(block_buf_.end(), (char *) &indiv_sz, (char *) &indiv_sz + sizeof(indiv_sz));
+        block_buf_.insert(block_buf_.end(), serialized_buf_.begin(), serialized_buf_.end());
+      }
+      else
+      {
+        detail::stage_timer timer(stats_, stage_stats::stage::compress, sizeof(shared_sz) + sizeof(indiv_sz) + serialized_buf_.size());
+        ofs_.write((char *) &shared_sz, sizeof(shared_sz));
+        ofs_.write((char *) &indiv_sz, sizeof(indiv_sz));
+        ofs_.write(serialized_buf_.data(), serialized_buf_.size());
+      }
 
       current_block_min_ = std::min(current_block_min_, std::uint32_t(r.pos()));
       
@@ -451,6 +779,11 @@ namespace savvy
         current_block_max_ = std::max(current_block_max_, std::uint32_t(r.pos() + std::max(r.ref().size(), max_alt_size)) - 1);
       }
 
+      if (zone_map_)
+        zone_map_->update(r);
+      if (id_index_)
+        id_index_->update(r);
+
       ++record_count_in_block_;
       ++record_count_;
 
@@ -479,7 +812,15 @@ namespace savvy
           hval.idx.clear();
         }
 
-        if (it->first == "FORMAT")
+        if (it->first == "pbwt_encoding")
+        {
+          pbwt_rle_declared_ = it->second == "rle";
+        }
+        else if (it->first == "packed_encoding")
+        {
+          packed_encoding_declared_ = it->second == "bits";
+        }
+        else if (it->first == "FORMAT")
         {
           if (hval.id == "GT")
           {
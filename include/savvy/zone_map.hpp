@@ -0,0 +1,354 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef LIBSAVVY_ZONE_MAP_HPP
+#define LIBSAVVY_ZONE_MAP_HPP
+
+#include "site_info.hpp"
+#include "utility.hpp"
+#include "portable_endian.hpp"
+
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <istream>
+#include <limits>
+#include <ostream>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+namespace savvy
+{
+  /**
+   * Per-block minimum and maximum values of selected numeric INFO fields. SAV writers append zone maps as a skippable
+   * zstd frame immediately before the S1R index so that readers can skip blocks that cannot contain records of
+   * interest without decompressing them. Only the first value of each INFO field is summarized.
+   */
+  class zone_map
+  {
+  public:
+    struct range
+    {
+      double min = std::numeric_limits<double>::infinity();
+      double max = -std::numeric_limits<double>::infinity();
+      bool has_missing = false; ///< At least one record is missing the field or its first value
+      bool bounded = true;      ///< False if field contains non-numeric values
+    };
+
+    class block
+    {
+    public:
+      block(const zone_map& parent, std::size_t idx) : parent_(&parent), idx_(idx) {}
+
+      /**
+       * Gets value range of INFO field.
+       * @param field INFO field ID
+       * @return Pointer to range or nullptr if field is not summarized
+       */
+      const range* get(const std::string& field) const;
+
+      std::uint64_t file_position() const { return (parent_->block_values_[idx_] >> 16u) & 0x0000FFFFFFFFFFFF; }
+      std::uint32_t record_count() const { return std::uint32_t(parent_->block_values_[idx_] & 0xFFFF) + 1; }
+    private:
+      const zone_map* parent_;
+      std::size_t idx_;
+    };
+
+  private:
+    std::vector<std::string> fields_;
+    std::vector<std::uint64_t> block_values_; // Same encoding as S1R entry values: (file_pos << 16) | (record_count - 1)
+    std::vector<range> ranges_; // fields_.size() ranges per block
+    std::vector<range> current_;
+  public:
+    zone_map() = default;
+
+    /**
+     * Constructs empty zone map.
+     * @param info_fields INFO fields to summarize
+     */
+    zone_map(std::vector<std::string> info_fields) :
+      fields_(std::move(info_fields)),
+      current_(fields_.size())
+    {
+    }
+
+    const std::vector<std::string>& fields() const { return fields_; }
+    std::size_t block_count() const { return block_values_.size(); }
+    block operator[](std::size_t idx) const { return block(*this, idx); }
+
+    /**
+     * Finds block by file position.
+     * @param file_pos File position of block's zstd frame
+     * @return Block index or block_count() if not found
+     */
+    std::size_t find_block(std::uint64_t file_pos) const;
+
+    /**
+     * Adds record to current block's summary.
+     * @param site Record
+     */
+    void update(const site_info& site);
+
+    /**
+     * Ends current block.
+     * @param s1r_value Value of block's S1R entry
+     */
+    void end_block(std::uint64_t s1r_value);
+
+    /**
+     * Sets the file position of a block that was ended before its position was known (e.g., when blocks are
+     * compressed in parallel).
+     * @param block Block index
+     * @param file_pos File position of block's zstd frame
+     */
+    void set_block_file_pos(std::size_t block, std::uint64_t file_pos);
+
+    /**
+     * Appends blocks of another zone map with the same fields (e.g., when concatenating files).
+     * @param other Source zone map
+     * @param file_pos_delta Offset added to file positions of appended blocks
+     * @return False if fields differ
+     */
+    bool append(const zone_map& other, std::int64_t file_pos_delta);
+
+    /**
+     * Writes zone map as skippable zstd frame.
+     * @param os Output stream
+     * @param uuid UUID of SAV file
+     * @return False on write error
+     */
+    bool serialize(std::ostream& os, const std::array<std::uint8_t, 16>& uuid) const;
+
+    /**
+     * Locates zone map frame preceding the appended S1R index.
+     * @param is Input stream of SAV file
+     * @param s1r_offset File offset of S1R index (see s1r::reader::file_offset())
+     * @param uuid UUID of SAV file (see s1r::reader::uuid()). Frames with a different UUID are ignored.
+     * @return File position of skippable frame or -1 if file has no zone map
+     */
+    static std::int64_t find_frame(std::istream& is, std::int64_t s1r_offset, const std::array<std::uint8_t, 16>& uuid);
+
+    /**
+     * Reads zone map preceding the appended S1R index.
+     * @param is Input stream of SAV file
+     * @param s1r_offset File offset of S1R index (see s1r::reader::file_offset())
+     * @param uuid UUID of SAV file (see s1r::reader::uuid()). Frames with a different UUID are ignored.
+     * @return False if file has no zone map or it is corrupt
+     */
+    bool deserialize(std::istream& is, std::int64_t s1r_offset, const std::array<std::uint8_t, 16>& uuid);
+  private:
+    struct update_functor
+    {
+      template <typename T>
+      void operator()(const T* beg, const T* end, range* r) const
+      {
+        if (beg == end || typed_value::is_special_value(*beg) || std::isnan(double(*beg)))
+        {
+          r->has_missing = true;
+        }
+        else
+        {
+          r->min = std::min(r->min, double(*beg));
+          r->max = std::max(r->max, double(*beg));
+        }
+      }
+
+      void operator()(const char*, const char*, range* r) const
+      {
+        r->bounded = false;
+      }
+    };
+
+    static void write_u64(std::ostream& os, std::uint64_t v)
+    {
+      v = htole64(v);
+      os.write((char*)&v, sizeof(v));
+    }
+
+    static bool read_u64(std::istream& is, std::uint64_t& v)
+    {
+      is.read((char*)&v, sizeof(v));
+      v = le64toh(v);
+      return is.good();
+    }
+  };
+
+  inline
+  const zone_map::range* zone_map::block::get(const std::string& field) const
+  {
+    auto it = std::find(parent_->fields_.begin(), parent_->fields_.end(), field);
+    if (it == parent_->fields_.end())
+      return nullptr;
+    return &parent_->ranges_[idx_ * parent_->fields_.size() + (it - parent_->fields_.begin())];
+  }
+
+  inline
+  std::size_t zone_map::find_block(std::uint64_t file_pos) const
+  {
+    auto it = std::lower_bound(block_values_.begin(), block_values_.end(), file_pos << 16u);
+    if (it != block_values_.end() && (*it >> 16u) == file_pos)
+      return it - block_values_.begin();
+    return block_values_.size();
+  }
+
+  inline
+  void zone_map::update(const site_info& site)
+  {
+    for (std::size_t i = 0; i < fields_.size(); ++i)
+    {
+      auto res = std::find_if(site.info_fields().begin(), site.info_fields().end(), [this, i](const std::pair<std::string, savvy::typed_value>& v) { return v.first == fields_[i]; });
+      if (res == site.info_fields().end())
+        current_[i].has_missing = true;
+      else if (res->second.is_sparse())
+        current_[i].bounded = false;
+      else if (!res->second.capply_dense(update_functor(), &current_[i]))
+        current_[i].has_missing = true; // Flag or empty value
+    }
+  }
+
+  inline
+  void zone_map::end_block(std::uint64_t s1r_value)
+  {
+    block_values_.push_back(s1r_value);
+    ranges_.insert(ranges_.end(), current_.begin(), current_.end());
+    current_.assign(fields_.size(), range());
+  }
+
+  inline
+  void zone_map::set_block_file_pos(std::size_t block, std::uint64_t file_pos)
+  {
+    block_values_[block] = file_pos << 16u | (block_values_[block] & 0xFFFF);
+  }
+
+  inline
+  bool zone_map::append(const zone_map& other, std::int64_t file_pos_delta)
+  {
+    if (other.fields_ != fields_)
+      return false;
+
+    for (auto it = other.block_values_.begin(); it != other.block_values_.end(); ++it)
+      block_values_.push_back(std::uint64_t(std::int64_t(*it >> 16u) + file_pos_delta) << 16u | (*it & 0xFFFF));
+    ranges_.insert(ranges_.end(), other.ranges_.begin(), other.ranges_.end());
+    return true;
+  }
+
+  inline
+  bool zone_map::serialize(std::ostream& os, const std::array<std::uint8_t, 16>& uuid) const
+  {
+    // Layout: field count (uint32), null-terminated field IDs, block count (uint64), then for each block its S1R
+    // entry value (uint64) followed by a min (double), max (double) and flags byte for each field. The footer
+    // (payload size, UUID and version string) allows the frame to be located from the start of the S1R frame.
+    std::size_t payload_size = 4 + 8 + block_values_.size() * (8 + fields_.size() * 17) + ::savvy::detail::footer_frame_footer_size;
+    for (auto it = fields_.begin(); it != fields_.end(); ++it)
+      payload_size += it->size() + 1;
+
+    if (payload_size > std::numeric_limits<std::uint32_t>::max())
+    {
+      std::cerr << "Error: zone map too big for skippable zstd frame" << std::endl;
+      return false;
+    }
+
+    std::uint32_t payload_size_le = htole32(std::uint32_t(payload_size));
+    os.write("\x51\x2A\x4D\x18", 4);
+    os.write((char*)&payload_size_le, 4);
+
+    std::uint32_t n_fields_le = htole32(std::uint32_t(fields_.size()));
+    os.write((char*)&n_fields_le, 4);
+    for (auto it = fields_.begin(); it != fields_.end(); ++it)
+      os.write(it->c_str(), it->size() + 1);
+
+    write_u64(os, block_values_.size());
+    for (std::size_t i = 0; i < block_values_.size(); ++i)
+    {
+      write_u64(os, block_values_[i]);
+      for (std::size_t j = 0; j < fields_.size(); ++j)
+      {
+        const range& r = ranges_[i * fields_.size() + j];
+        std::uint64_t tmp;
+        std::memcpy(&tmp, &r.min, sizeof(tmp));
+        write_u64(os, tmp);
+        std::memcpy(&tmp, &r.max, sizeof(tmp));
+        write_u64(os, tmp);
+        os.put(char((r.has_missing ? 0x01 : 0x00) | (r.bounded ? 0x00 : 0x02)));
+      }
+    }
+
+    os.write((char*)&payload_size_le, 4);
+    os.write((const char*)uuid.data(), uuid.size());
+    os.write("zmp\x00\x01\x00\x00", 7);
+
+    return os.good();
+  }
+
+  inline
+  std::int64_t zone_map::find_frame(std::istream& is, std::int64_t s1r_offset, const std::array<std::uint8_t, 16>& uuid)
+  {
+    return ::savvy::detail::find_footer_frame(is, s1r_offset, "zmp", uuid);
+  }
+
+  inline
+  bool zone_map::deserialize(std::istream& is, std::int64_t s1r_offset, const std::array<std::uint8_t, 16>& uuid)
+  {
+    fields_.clear();
+    block_values_.clear();
+    ranges_.clear();
+
+    std::int64_t frame_pos = find_frame(is, s1r_offset, uuid);
+    if (frame_pos < 0)
+      return false;
+
+    is.seekg(frame_pos + 8);
+
+    std::uint32_t n_fields;
+    is.read((char*)&n_fields, 4);
+    n_fields = le32toh(n_fields);
+    for (std::uint32_t i = 0; i < n_fields && is; ++i)
+    {
+      fields_.emplace_back();
+      std::getline(is, fields_.back(), '\0');
+    }
+
+    std::uint64_t n_blocks;
+    if (!read_u64(is, n_blocks) || n_blocks * (8 + n_fields * 17) > std::uint64_t(s1r_offset - frame_pos))
+      return false;
+
+    block_values_.resize(n_blocks);
+    ranges_.resize(n_blocks * n_fields);
+    for (std::size_t i = 0; i < n_blocks && is; ++i)
+    {
+      read_u64(is, block_values_[i]);
+      for (std::size_t j = 0; j < n_fields; ++j)
+      {
+        range& r = ranges_[i * n_fields + j];
+        std::uint64_t tmp;
+        read_u64(is, tmp);
+        std::memcpy(&r.min, &tmp, sizeof(tmp));
+        read_u64(is, tmp);
+        std::memcpy(&r.max, &tmp, sizeof(tmp));
+        int flags = is.get();
+        r.has_missing = (flags & 0x01) != 0;
+        r.bounded = (flags & 0x02) == 0;
+      }
+    }
+
+    current_.assign(fields_.size(), range());
+
+    if (!is)
+    {
+      is.clear();
+      fields_.clear();
+      block_values_.clear();
+      ranges_.clear();
+      return false;
+    }
+
+    return true;
+  }
+}
+
+#endif // LIBSAVVY_ZONE_MAP_HPP
@@ -0,0 +1,583 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#include "savvy/reader.hpp"
+#include "savvy/writer.hpp"
+
+#include <getopt.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <numeric>
+#include <random>
+#include <sstream>
+#include <unordered_set>
+
+class bench_prog_args
+{
+private:
+  std::vector<option> long_options_;
+  std::vector<int> compression_levels_ = {1, 3, 6, 9};
+  std::string input_path_;
+  std::string output_path_ = "/dev/stdout";
+  std::string temp_directory_ = "/tmp";
+  std::size_t n_samples_ = 1000;
+  std::size_t n_records_ = 10000;
+  std::size_t n_iterations_ = 3;
+  std::size_t n_queries_ = 100;
+  std::uint64_t query_span_ = 10000;
+  std::uint64_t seed_ = 1;
+  bool help_ = false;
+public:
+  bench_prog_args() :
+    long_options_(
+      {
+        {"compression-levels", required_argument, 0, 'l'},
+        {"help", no_argument, 0, 'h'},
+        {"input", required_argument, 0, 'i'},
+        {"iterations", required_argument, 0, 'n'},
+        {"output", required_argument, 0, 'o'},
+        {"queries", required_argument, 0, 'q'},
+        {"query-span", required_argument, 0, 'w'},
+        {"records", required_argument, 0, 'r'},
+        {"samples", required_argument, 0, 's'},
+        {"seed", required_argument, 0, '\x01'},
+        {"temp-directory", required_argument, 0, 'd'},
+        {0, 0, 0, 0}
+      })
+  {
+  }
+
+  const std::vector<int>& compression_levels() const { return compression_levels_; }
+  const std::string& input_path() const { return input_path_; }
+  const std::string& output_path() const { return output_path_; }
+  const std::string& temp_directory() const { return temp_directory_; }
+  std::size_t n_samples() const { return n_samples_; }
+  std::size_t n_records() const { return n_records_; }
+  std::size_t n_iterations() const { return n_iterations_; }
+  std::size_t n_queries() const { return n_queries_; }
+  std::uint64_t query_span() const { return query_span_; }
+  std::uint64_t seed() const { return seed_; }
+  bool help_is_set() const { return help_; }
+
+  void print_usage(std::ostream& os)
+  {
+    os << "Usage: savvy-bench [opts ...]\n";
+    os << "\n";
+    os << " -d, --temp-directory      Directory for benchmark files (default: /tmp)\n";
+    os << " -h, --help                Print usage\n";
+    os << " -i, --input               VCF, BCF or SAV file from which records are loaded instead of generating them\n";
+    os << " -l, --compression-levels  Comma separated list of compression levels used for write benchmarks (default: 1,3,6,9)\n";
+    os << " -n, --iterations          Number of times each benchmark is run (default: 3)\n";
+    os << " -o, --output              Path of JSON results (default: /dev/stdout)\n";
+    os << " -q, --queries             Number of region queries (default: 100)\n";
+    os << " -r, --records             Number of records to generate or load (default: 10000)\n";
+    os << " -s, --samples             Number of samples to generate (default: 1000)\n";
+    os << " -w, --query-span          Length in base pairs of each region query (default: 10000)\n";
+    os << "\n";
+    os << "     --seed                Seed for generated records and queries (default: 1)\n";
+    os << std::flush;
+  }
+
+  bool parse(int argc, char** argv)
+  {
+    int long_index = 0;
+    int opt = 0;
+    while ((opt = getopt_long(argc, argv, "d:hi:l:n:o:q:r:s:w:", long_options_.data(), &long_index )) != -1)
+    {
+      char copt = char(opt & 0xFF);
+      switch (copt)
+      {
+      case '\x01':
+        if (std::string(long_options_[long_index].name) == "seed")
+        {
+          seed_ = std::strtoull(optarg ? optarg : "", nullptr, 10);
+          break;
+        }
+        return false;
+      case 'd':
+        temp_directory_ = optarg ? optarg : "";
+        break;
+      case 'h':
+        help_ = true;
+        return true;
+      case 'i':
+        input_path_ = optarg ? optarg : "";
+        break;
+      case 'l':
+      {
+        compression_levels_.clear();
+        std::istringstream ss(optarg ? optarg : "");
+        std::string lvl;
+        while (std::getline(ss, lvl, ','))
+        {
+          int l = std::atoi(lvl.c_str());
+          if (l < 1 || l > 19)
+          {
+            std::cerr << "Invalid compression level (" << lvl << ")\n";
+            return false;
+          }
+          compression_levels_.push_back(l);
+        }
+        break;
+      }
+      case 'n':
+        n_iterations_ = std::size_t(std::max(1ll, std::atoll(optarg ? optarg : "")));
+        break;
+      case 'o':
+        output_path_ = optarg ? optarg : "";
+        break;
+      case 'q':
+        n_queries_ = std::size_t(std::max(0ll, std::atoll(optarg ? optarg : "")));
+        break;
+      case 'r':
+        n_records_ = std::size_t(std::max(1ll, std::atoll(optarg ? optarg : "")));
+        break;
+      case 's':
+        n_samples_ = std::size_t(std::max(1ll, std::atoll(optarg ? optarg : "")));
+        break;
+      case 'w':
+        query_span_ = std::uint64_t(std::max(1ll, std::atoll(optarg ? optarg : "")));
+        break;
+      default:
+        return false;
+      }
+    }
+
+    if (argc - optind > 0)
+    {
+      std::cerr << "Too many arguments\n";
+      return false;
+    }
+
+    return true;
+  }
+};
+
+/**
+ * Timings of a single benchmark. Throughput is computed from the fastest iteration.
+ */
+struct bench_result
+{
+  std::string name;
+  std::size_t records = 0;
+  std::uint64_t bytes = 0; // Compressed file size for read and write benchmarks, or uncompressed size of converted values
+  std::size_t queries = 0;
+  std::vector<double> seconds;
+};
+
+struct bench_data
+{
+  std::vector<std::pair<std::string, std::string>> headers;
+  std::vector<std::string> samples;
+  std::vector<savvy::variant> records;
+};
+
+static std::uint64_t file_size(const std::string& path)
+{
+  struct stat st;
+  return ::stat(path.c_str(), &st) == 0 ? std::uint64_t(st.st_size) : 0;
+}
+
+static std::string json_escape(const std::string& s)
+{
+  std::string ret;
+  ret.reserve(s.size());
+  for (char c : s)
+  {
+    if (c == '"' || c == '\\')
+      ret += '\\';
+    if ((unsigned char)c < 0x20)
+      ret += ' ';
+    else
+      ret += c;
+  }
+  return ret;
+}
+
+/**
+ * Generates biallelic records with sparse GT. Allele frequencies are skewed toward rare variants to resemble a
+ * sequencing cohort, and carriers are drawn with geometric skips so that generation time scales with non-zero count.
+ */
+static void generate_records(const bench_prog_args& args, bench_data& data)
+{
+  data.headers = {
+    {"fileformat", "VCFv4.2"},
+    {"contig", "<ID=1>"},
+    {"INFO", "<ID=AC,Number=A,Type=Integer,Description=\"Alternate allele count\">"},
+    {"FORMAT", "<ID=GT,Number=1,Type=String,Description=\"Genotype\">"},
+    {"phasing", "full"}};
+
+  data.samples.resize(args.n_samples());
+  for (std::size_t i = 0; i < data.samples.size(); ++i)
+    data.samples[i] = "SAMPLE" + std::to_string(i + 1);
+
+  const std::size_t n_haps = args.n_samples() * 2;
+  const char* nucleotides = "ACGT";
+  std::mt19937_64 rng(args.seed());
+  std::uniform_real_distribution<double> unif(0., 1.);
+  std::uniform_int_distribution<int> nuc(0, 3);
+  std::uniform_int_distribution<int> pos_step(1, 200);
+
+  savvy::compressed_vector<std::int8_t> gt;
+  std::uint32_t pos = 0;
+  data.records.resize(args.n_records());
+  for (auto it = data.records.begin(); it != data.records.end(); ++it)
+  {
+    pos += pos_step(rng);
+    int ref = nuc(rng);
+    int alt = (ref + 1 + nuc(rng) % 3) % 4;
+    double af = std::max(0.5 * std::pow(unif(rng), 4.), 1. / n_haps);
+
+    gt.clear();
+    gt.resize(n_haps);
+    std::geometric_distribution<std::size_t> skip(af);
+    for (std::size_t off = skip(rng); off < n_haps; off += skip(rng) + 1)
+      gt[off] = 1;
+
+    *it = savvy::variant("1", pos, std::string(1, nucleotides[ref]), {std::string(1, nucleotides[alt])});
+    it->set_info("AC", std::int32_t(gt.non_zero_size()));
+    it->set_format("GT", gt);
+  }
+}
+
+static bool load_records(const bench_prog_args& args, bench_data& data)
+{
+  savvy::reader rdr(args.input_path());
+  if (!rdr)
+  {
+    std::cerr << "Error: could not open input file (" << args.input_path() << ")" << std::endl;
+    return false;
+  }
+
+  data.headers = rdr.headers();
+  data.samples = rdr.samples();
+  data.records.resize(args.n_records());
+  std::size_t cnt = 0;
+  while (cnt < data.records.size() && rdr.read(data.records[cnt]))
+    ++cnt;
+  data.records.resize(cnt);
+
+  if (rdr.bad() || cnt == 0)
+  {
+    std::cerr << "Error: could not read records from input file" << std::endl;
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Runs benchmark function the requested number of times.
+ * @param name Name of benchmark in results
+ * @param args Program arguments
+ * @param fn Function that is passed a result object to fill with record and byte counts and returns false on failure
+ * @param results Destination of benchmark timings
+ * @return False if benchmark function fails
+ */
+template <typename Fn>
+static bool run_bench(const std::string& name, const bench_prog_args& args, Fn fn, std::vector<bench_result>& results)
+{
+  std::cerr << "Running " << name << " ..." << std::endl;
+  bench_result res;
+  res.name = name;
+  for (std::size_t i = 0; i < args.n_iterations(); ++i)
+  {
+    auto start = std::chrono::steady_clock::now();
+    if (!fn(res))
+    {
+      std::cerr << "Error: " << name << " failed" << std::endl;
+      return false;
+    }
+    res.seconds.push_back(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+  }
+  results.emplace_back(std::move(res));
+  return true;
+}
+
+static bool write_records(const std::string& path, savvy::file::format fmt, int level, const bench_data& data, const std::vector<savvy::variant>& records, bool pbwt)
+{
+  savvy::writer wrt(path, fmt, data.headers, data.samples, std::uint8_t(level));
+  if (pbwt)
+    wrt.set_pbwt({"GT"});
+  for (auto it = records.begin(); it != records.end() && wrt.good(); ++it)
+    wrt.write(*it);
+  return wrt.good();
+}
+
+static bool read_records(savvy::reader& rdr, std::size_t& cnt)
+{
+  savvy::variant rec;
+  while (rdr.read(rec))
+    ++cnt;
+  return !rdr.bad();
+}
+
+static void write_json(std::ostream& os, const bench_prog_args& args, const bench_data& data, const std::vector<bench_result>& results)
+{
+  os << "{\n";
+  os << "  \"savvy_version\": \"" << SAVVY_VERSION << "\",\n";
+  os << "  \"input\": \"" << json_escape(args.input_path().empty() ? "generated" : args.input_path()) << "\",\n";
+  os << "  \"seed\": " << args.seed() << ",\n";
+  os << "  \"samples\": " << data.samples.size() << ",\n";
+  os << "  \"records\": " << data.records.size() << ",\n";
+  os << "  \"iterations\": " << args.n_iterations() << ",\n";
+  os << "  \"results\": [";
+  for (auto it = results.begin(); it != results.end(); ++it)
+  {
+    double best = *std::min_element(it->seconds.begin(), it->seconds.end());
+    double mean = std::accumulate(it->seconds.begin(), it->seconds.end(), 0.) / it->seconds.size();
+    os << (it == results.begin() ? "\n" : ",\n");
+    os << "    {\"name\": \"" << json_escape(it->name) << "\"";
+    os << ", \"records\": " << it->records;
+    os << ", \"bytes\": " << it->bytes;
+    os << ", \"best_seconds\": " << best;
+    os << ", \"mean_seconds\": " << mean;
+    os << ", \"records_per_sec\": " << (best > 0. ? it->records / best : 0.);
+    os << ", \"mb_per_sec\": " << (best > 0. ? it->bytes / 1e6 / best : 0.);
+    if (it->queries)
+    {
+      os << ", \"queries\": " << it->queries;
+      os << ", \"latency_ms\": " << best * 1000. / it->queries;
+    }
+    os << "}";
+  }
+  os << "\n  ]\n";
+  os << "}" << std::endl;
+}
+
+int main(int argc, char** argv)
+{
+  bench_prog_args args;
+  if (!args.parse(argc, argv))
+  {
+    args.print_usage(std::cerr);
+    return EXIT_FAILURE;
+  }
+
+  if (args.help_is_set())
+  {
+    args.print_usage(std::cout);
+    return EXIT_SUCCESS;
+  }
+
+  bench_data data;
+  if (args.input_path().size())
+  {
+    if (!load_records(args, data))
+      return EXIT_FAILURE;
+  }
+  else
+  {
+    generate_records(args, data);
+  }
+
+  std::string prefix = args.temp_directory() + "/savvy-bench-" + std::to_string(::getpid());
+  const std::string sav_path = prefix + ".sav";
+  const std::string bcf_path = prefix + ".bcf";
+  const std::string vcf_path = prefix + ".vcf";
+  const std::string pbwt_path = prefix + ".pbwt.sav";
+
+  std::vector<bench_result> results;
+  bool success = true;
+
+  // Write
+  for (auto lvl = args.compression_levels().begin(); success && lvl != args.compression_levels().end(); ++lvl)
+  {
+    success = run_bench("write_sav2_level" + std::to_string(*lvl), args, [&](bench_result& res)
+    {
+      res.records = data.records.size();
+      bool ret = write_records(sav_path, savvy::file::format::sav2, *lvl, data, data.records, false);
+      res.bytes = file_size(sav_path);
+      return ret;
+    }, results);
+  }
+
+  success = success && run_bench("write_bcf", args, [&](bench_result& res)
+  {
+    res.records = data.records.size();
+    bool ret = write_records(bcf_path, savvy::file::format::bcf, savvy::writer::default_compression_level, data, data.records, false);
+    res.bytes = file_size(bcf_path);
+    return ret;
+  }, results);
+
+  success = success && run_bench("write_vcf", args, [&](bench_result& res)
+  {
+    res.records = data.records.size();
+    bool ret = write_records(vcf_path, savvy::file::format::vcf, 0, data, data.records, false);
+    res.bytes = file_size(vcf_path);
+    return ret;
+  }, results);
+
+  // Read (SAV2 file used by the remaining benchmarks is written at the default level)
+  success = success && write_records(sav_path, savvy::file::format::sav2, savvy::writer::default_compression_level, data, data.records, false);
+
+  const std::vector<std::pair<std::string, std::string>> read_benches = {{"read_sav2", sav_path}, {"read_bcf", bcf_path}, {"read_vcf", vcf_path}};
+  for (auto it = read_benches.begin(); success && it != read_benches.end(); ++it)
+  {
+    const std::string path = it->second;
+    success = run_bench(it->first, args, [&](bench_result& res)
+    {
+      savvy::reader rdr(path);
+      res.records = 0;
+      res.bytes = file_size(path);
+      return rdr.good() && read_records(rdr, res.records);
+    }, results);
+  }
+
+  // Region queries
+  if (success && args.n_queries() && data.records.size())
+  {
+    std::mt19937_64 rng(args.seed());
+    std::uniform_int_distribution<std::size_t> rec_dist(0, data.records.size() - 1);
+    std::vector<savvy::genomic_region> queries;
+    queries.reserve(args.n_queries());
+    for (std::size_t i = 0; i < args.n_queries(); ++i)
+    {
+      const savvy::variant& r = data.records[rec_dist(rng)];
+      queries.emplace_back(r.chromosome(), r.position(), r.position() + args.query_span() - 1);
+    }
+
+    success = run_bench("region_query_sav2", args, [&](bench_result& res)
+    {
+      savvy::reader rdr(sav_path);
+      res.records = 0;
+      res.queries = queries.size();
+      for (auto q = queries.begin(); q != queries.end(); ++q)
+      {
+        rdr.reset_bounds(*q);
+        if (!read_records(rdr, res.records))
+          return false;
+      }
+      res.bytes = 0;
+      return !rdr.bad();
+    }, results);
+  }
+
+  // Sample subsetting
+  if (success)
+  {
+    std::unordered_set<std::string> subset;
+    for (std::size_t i = 0; i < data.samples.size(); i += 10)
+      subset.insert(data.samples[i]);
+
+    success = run_bench("subset_10pct_sav2", args, [&](bench_result& res)
+    {
+      savvy::reader rdr(sav_path);
+      rdr.subset_samples(subset);
+      res.records = 0;
+      res.bytes = file_size(sav_path);
+      return rdr.good() && read_records(rdr, res.records);
+    }, results);
+  }
+
+  // PBWT applies to dense GT, so records are converted before timing.
+  if (success)
+  {
+    std::vector<savvy::variant> dense_records(data.records);
+    std::vector<std::int8_t> gt;
+    for (auto it = dense_records.begin(); it != dense_records.end(); ++it)
+    {
+      if (it->get_format("GT", gt))
+        it->set_format("GT", gt);
+    }
+
+    success = run_bench("pbwt_encode_sav2", args, [&](bench_result& res)
+    {
+      res.records = dense_records.size();
+      bool ret = write_records(pbwt_path, savvy::file::format::sav2, savvy::writer::default_compression_level, data, dense_records, true);
+      res.bytes = file_size(pbwt_path);
+      return ret;
+    }, results);
+
+    success = success && run_bench("pbwt_decode_sav2", args, [&](bench_result& res)
+    {
+      savvy::reader rdr(pbwt_path);
+      res.records = 0;
+      res.bytes = file_size(pbwt_path);
+      return rdr.good() && read_records(rdr, res.records);
+    }, results);
+  }
+
+  // typed_value conversions
+  if (success)
+  {
+    std::vector<std::int8_t> dense;
+    savvy::compressed_vector<std::int8_t> sparse;
+    std::vector<float> dense_float;
+
+    success = run_bench("typed_value_sparse_to_dense", args, [&](bench_result& res)
+    {
+      res.records = 0;
+      res.bytes = 0;
+      for (auto it = data.records.begin(); it != data.records.end(); ++it)
+      {
+        if (it->get_format("GT", dense))
+        {
+          ++res.records;
+          res.bytes += dense.size() * sizeof(std::int8_t);
+        }
+      }
+      return true;
+    }, results);
+
+    std::vector<savvy::typed_value> dense_values;
+    dense_values.reserve(data.records.size());
+    for (auto it = data.records.begin(); it != data.records.end(); ++it)
+    {
+      if (it->get_format("GT", dense))
+        dense_values.emplace_back(dense);
+    }
+
+    success = success && run_bench("typed_value_dense_to_sparse", args, [&](bench_result& res)
+    {
+      res.records = dense_values.size();
+      res.bytes = 0;
+      for (auto it = dense_values.begin(); it != dense_values.end(); ++it)
+      {
+        if (!it->get(sparse))
+          return false;
+        res.bytes += it->size() * sizeof(std::int8_t);
+      }
+      return true;
+    }, results);
+
+    success = success && run_bench("typed_value_int8_to_float", args, [&](bench_result& res)
+    {
+      res.records = dense_values.size();
+      res.bytes = 0;
+      for (auto it = dense_values.begin(); it != dense_values.end(); ++it)
+      {
+        if (!it->get(dense_float))
+          return false;
+        res.bytes += it->size() * sizeof(std::int8_t);
+      }
+      return true;
+    }, results);
+  }
+
+  std::remove(sav_path.c_str());
+  std::remove(bcf_path.c_str());
+  std::remove(vcf_path.c_str());
+  std::remove(pbwt_path.c_str());
+
+  if (!success)
+    return EXIT_FAILURE;
+
+  std::ofstream ofs(args.output_path(), std::ios::binary);
+  write_json(ofs, args, data, results);
+  if (!ofs)
+  {
+    std::cerr << "Error: could not write results (" << args.output_path() << ")" << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
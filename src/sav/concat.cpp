@@ -9,11 +9,21 @@
 #include "savvy/reader.hpp"
 #include "savvy/writer.hpp"
 
-
+#include <atomic>
+#include <cerrno>
 #include <fstream>
 #include <getopt.h>
+#include <thread>
 #include <vector>
 
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <sys/sendfile.h>
+#endif
+
 class concat_prog_args
 {
 private:
@@ -22,6 +32,7 @@ private:
   std::vector<std::string> input_paths_;
   std::string output_path_;
   std::string sample_ids_path_;
+  std::size_t threads_ = 1;
   bool help_ = false;
 public:
   concat_prog_args() :
@@ -29,6 +40,7 @@ public:
       {
         {"help", no_argument, 0, 'h'},
         {"out", required_argument, 0, 'o'},
+        {"threads", required_argument, 0, 't'},
         {0, 0, 0, 0}
       })
   {
@@ -38,6 +50,7 @@ public:
   const std::vector<std::string>& input_paths() const { return input_paths_; }
   const std::string& output_path() const { return output_path_; }
   const std::string& sample_ids_path() const { return sample_ids_path_; }
+  std::size_t threads() const { return threads_; }
 
   bool help_is_set() const { return help_; }
 
@@ -47,6 +60,7 @@ public:
     os << "\n";
     os << " -h, --help             Print usage\n";
     os << " -o, --out              Output file (default: /dev/stdout)\n";
+    os << " -t, --threads          Number of threads used to copy inputs when output is a regular file (default: 1)\n";
     os << std::flush;
   }
 
@@ -54,7 +68,7 @@ public:
   {
     int long_index = 0;
     int opt = 0;
-    while ((opt = getopt_long(argc, argv, "ho:", long_options_.data(), &long_index )) != -1)
+    while ((opt = getopt_long(argc, argv, "ho:t:", long_options_.data(), &long_index )) != -1)
     {
       char copt = char(opt & 0xFF);
       switch (copt)
@@ -65,6 +79,9 @@ public:
       case 'o':
         output_path_ = optarg ? optarg : "";
         break;
+      case 't':
+        threads_ = std::size_t(std::max(1ll, std::atoll(optarg ? optarg : "")));
+        break;
       default:
         return false;
       }
@@ -94,21 +111,112 @@ public:
 
 
 
-int concat_main(int argc, char **argv)
+struct concat_input
 {
-  concat_prog_args args;
-  if (!args.parse(argc, argv))
+  std::int64_t data_pos = 0;   // File position of first variant block
+  std::int64_t data_end = 0;   // End of last variant block
+  std::int64_t idx_off = 0;    // File offset of appended S1R index (0 if none)
+  std::int64_t output_pos = 0; // Position of first variant block in output file
+};
+
+static void preallocate_file(int fd, std::int64_t offset, std::int64_t len)
+{
+#if defined(__linux__)
+  // Failure is not an error (e.g., file system without fallocate support). Unlike posix_fallocate(), this does not
+  // fall back to writing zeros.
+  if (len > 0)
+    ::fallocate(fd, 0, offset, len);
+#endif
+}
+
+/**
+ * Copies file data in the kernel when possible, falling back to a buffered copy.
+ * @param in_fd Input file descriptor
+ * @param in_off Offset in input file
+ * @param out_fd Output file descriptor
+ * @param out_off Offset in output file or -1 to write at output's current position (e.g., for pipes)
+ * @param len Number of bytes to copy
+ * @return False on read or write error
+ */
+static bool copy_file_data(int in_fd, std::int64_t in_off, int out_fd, std::int64_t out_off, std::int64_t len)
+{
+#if defined(__linux__)
+  auto can_fall_back = [](int err) { return err == EINVAL || err == EXDEV || err == ENOSYS || err == EOPNOTSUPP || err == EBADF; };
+
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27))
+  while (out_off >= 0 && len > 0)
   {
-    args.print_usage(std::cerr);
-    return EXIT_FAILURE;
+    loff_t in_pos = in_off, out_pos = out_off;
+    ssize_t n = ::copy_file_range(in_fd, &in_pos, out_fd, &out_pos, std::size_t(len), 0);
+    if (n > 0)
+    {
+      in_off += n;
+      out_off += n;
+      len -= n;
+    }
+    else if (n == 0)
+      break; // Some file systems report no support this way. End of input is detected below.
+    else if (errno != EINTR)
+    {
+      if (!can_fall_back(errno))
+        return false;
+      break;
+    }
   }
+#endif
 
-  if (args.help_is_set())
+  while (out_off < 0 && len > 0)
   {
-    args.print_usage(std::cout);
-    return EXIT_SUCCESS;
+    off_t in_pos = in_off;
+    ssize_t n = ::sendfile(out_fd, in_fd, &in_pos, std::size_t(std::min<std::int64_t>(len, 0x7FFFF000)));
+    if (n > 0)
+    {
+      in_off += n;
+      len -= n;
+    }
+    else if (n == 0)
+      break;
+    else if (errno != EINTR)
+    {
+      if (!can_fall_back(errno))
+        return false;
+      break;
+    }
+  }
+#endif
+
+  std::vector<char> buf(std::size_t(std::min<std::int64_t>(len, 1 << 20)));
+  while (len > 0)
+  {
+    ssize_t n = ::pread(in_fd, buf.data(), std::size_t(std::min<std::int64_t>(len, buf.size())), in_off);
+    if (n <= 0)
+    {
+      if (n < 0 && errno == EINTR)
+        continue;
+      return false;
+    }
+
+    for (ssize_t written = 0; written < n; )
+    {
+      ssize_t w = out_off >= 0 ? ::pwrite(out_fd, buf.data() + written, std::size_t(n - written), out_off + written) : ::write(out_fd, buf.data() + written, std::size_t(n - written));
+      if (w < 0 && errno == EINTR)
+        continue;
+      if (w <= 0)
+        return false;
+      written += w;
+    }
+
+    in_off += n;
+    if (out_off >= 0)
+      out_off += n;
+    len -= n;
   }
 
+  return true;
+}
+
+bool concat_sav_files(const std::vector<std::string>& input_paths, const std::string& output_path, std::size_t threads)
+{
   savvy::dictionary dict;
   std::vector<std::string> samples;
 
@@ -118,25 +226,25 @@ int concat_main(int argc, char **argv)
   //std::set<std::string> unique_headers;
 
   std::vector<std::size_t> variant_offsets;
-  variant_offsets.reserve(args.input_paths().size());
+  variant_offsets.reserve(input_paths.size());
 
-  for (auto it = args.input_paths().begin(); it != args.input_paths().end(); ++it)
+  for (auto it = input_paths.begin(); it != input_paths.end(); ++it)
   {
     savvy::reader sav_reader(*it);
 
     if (!sav_reader)
     {
       std::cerr << "Error: could not open input SAV file (" << (*it) << ")\n";
-      return EXIT_FAILURE;
+      return false;
     }
 
     if (sav_reader.file_format() != savvy::file::format::sav2)
     {
       std::cerr << "Error: " << (*it) << " is not a SAV v2 file\n";
-      return EXIT_FAILURE;
+      return false;
     }
 
-    if (it == args.input_paths().begin())
+    if (it == input_paths.begin())
     {
       dict = sav_reader.dictionary();
       headers = sav_reader.headers();
@@ -147,13 +255,13 @@ int concat_main(int argc, char **argv)
       if (dict != sav_reader.dictionary())
       {
         std::cerr << "Header dictionaries incompatible\n";
-        return EXIT_FAILURE;
+        return false;
       }
 
       if (samples.size() != sav_reader.samples().size())
       {
         std::cerr << "Files do not have the same sameple size\n";
-        return EXIT_FAILURE;
+        return false;
       }
     }
 
@@ -173,7 +281,7 @@ int concat_main(int argc, char **argv)
   std::array<std::uint8_t, 16> uuid;
 
   {
-    savvy::writer header_writer( args.output_path(), savvy::file::format::sav2, headers, samples, savvy::writer::default_compression_level, "/dev/null");
+    savvy::writer header_writer( output_path, savvy::file::format::sav2, headers, samples, savvy::writer::default_compression_level, "/dev/null");
     uuid = header_writer.uuid();
     output_pos = header_writer.tellp();
   }
@@ -196,28 +304,125 @@ int concat_main(int argc, char **argv)
     }
   }
 
-  std::ofstream ofs(args.output_path(), std::ios::binary | std::ios::app);
-  if (!ofs)
+  // Output offsets depend only on the sizes of the inputs' variant blocks, so they are computed up front. This allows
+  // the data to be copied by worker threads while the indexes are rewritten.
+  std::vector<concat_input> inputs(input_paths.size());
+  for (std::size_t i = 0; i < inputs.size(); ++i)
   {
-    std::cerr << "Could not open output path (" << args.output_path() << ")\n";
-    return EXIT_FAILURE;
+    const std::string& path = input_paths[i];
+    std::ifstream ifs(path, std::ios::binary);
+    savvy::s1r::reader idx(path);
+    if (!ifs)
+    {
+      std::cerr << "Could not open input SAV file (" << path << ")\n";
+      return false;
+    }
+
+    concat_input& in = inputs[i];
+    in.data_pos = variant_offsets[i];
+    in.idx_off = idx.file_offset(); // If index doesn't exist at end of file, then idx.file_offset() is equal to 0.
+    in.output_pos = output_pos;
+    assert(in.idx_off == 0 || in.idx_off >= 8);
+
+    if (in.idx_off)
+    {
+      ifs.seekg(in.idx_off - 8);
+
+      // Test that next bytes in file are a skippable frame
+      std::string h(4, '\0');
+      ifs.read(&h[0], 4);
+      if (h != "\x50\x2A\x4D\x18")
+      {
+        std::cerr << "Error: boundary not at skippable frame, so " << path << " is likely corrupted\n";
+        return false;
+      }
+
+      // Test that size of index matches size of skippable frame
+      std::uint32_t index_file_size_le = 0;
+      ifs.read((char*)&index_file_size_le, 4);
+      if (le32toh(index_file_size_le) != idx.size_on_disk())
+      {
+        std::cerr << "Error: skippable frame size does not match index size, so " << path << " is likely corrupted\n";
+        return false;
+      }
+
+      // Zone maps and ID indexes are stored in skippable frames preceding the index and are merged below instead of copied.
+      in.data_end = in.idx_off - 8;
+      std::string frame_version;
+      for (std::int64_t frame_pos = in.data_end; (frame_pos = savvy::detail::find_footer_frame(ifs, frame_pos, frame_version)) >= in.data_pos; )
+        in.data_end = frame_pos;
+    }
+    else
+    {
+      ifs.seekg(0, std::ios::end);
+      in.data_end = ifs.tellg();
+    }
+
+    if (!ifs || in.data_end < in.data_pos)
+    {
+      std::cerr << "Error: could not determine size of " << path << "\n";
+      return false;
+    }
+
+    output_pos += in.data_end - in.data_pos;
   }
 
-  std::vector<char> buf(4096);
-  for (auto ft = args.input_paths().begin(); ft != args.input_paths().end(); ++ft)
+  int out_fd = ::open(output_path.c_str(), O_WRONLY);
+  if (out_fd < 0)
   {
-    std::ifstream ifs(*ft, std::ios::binary);
-    ifs.seekg(variant_offsets[ft - args.input_paths().begin()]);
+    std::cerr << "Could not open output path (" << output_path << ")\n";
+    return false;
+  }
 
-    if (!ifs)
+  // Regular files are written at precomputed positions by multiple threads. Otherwise (e.g., stdout), inputs are
+  // streamed in order by a single thread.
+  struct stat out_stat;
+  bool positional = ::fstat(out_fd, &out_stat) == 0 && S_ISREG(out_stat.st_mode);
+  if (positional)
+  {
+    if (!inputs.empty())
+      preallocate_file(out_fd, inputs.front().output_pos, output_pos - inputs.front().output_pos);
+  }
+  else if (::lseek(out_fd, 0, SEEK_END) < 0 && errno != ESPIPE)
+  {
+    std::cerr << "Could not seek output path (" << output_path << ")\n";
+    ::close(out_fd);
+    return false;
+  }
+
+  std::atomic<std::size_t> next_input(0);
+  std::atomic<bool> copy_failed(false);
+  auto copy_worker = [&]()
+  {
+    for (std::size_t i = next_input++; i < inputs.size() && !copy_failed; i = next_input++)
     {
-      std::cerr << "Could not open input SAV file (" << (*ft) << ")\n";
-      return EXIT_FAILURE;
+      const concat_input& in = inputs[i];
+      int in_fd = ::open(input_paths[i].c_str(), O_RDONLY);
+      if (in_fd < 0 || !copy_file_data(in_fd, in.data_pos, out_fd, positional ? in.output_pos : -1, in.data_end - in.data_pos))
+      {
+        std::cerr << "Error: failed to copy data from " << input_paths[i] << std::endl;
+        copy_failed = true;
+      }
+      if (in_fd >= 0)
+        ::close(in_fd);
     }
+  };
+
+  std::vector<std::thread> copy_threads(positional ? std::max<std::size_t>(1, std::min(threads, inputs.size())) : 1);
+  for (auto it = copy_threads.begin(); it != copy_threads.end(); ++it)
+    *it = std::thread(copy_worker);
 
-    auto delta = output_pos - ifs.tellg();
-    savvy::s1r::reader idx(*ft);
-    if (output_index && idx.good())
+  std::unique_ptr<savvy::zone_map> output_zone_map;
+  bool merge_zone_maps = true;
+  std::unique_ptr<savvy::id_index> output_id_index = savvy::detail::make_unique<savvy::id_index>();
+  bool merge_id_indexes = true;
+
+  for (std::size_t i = 0; i < inputs.size() && output_index; ++i)
+  {
+    const concat_input& in = inputs[i];
+    auto delta = in.output_pos - in.data_pos;
+    savvy::s1r::reader idx(input_paths[i]);
+    if (idx.good())
     {
       std::size_t cnt = 0;
       for (auto it = idx.trees_begin(); it != idx.trees_end(); ++it)
@@ -228,7 +433,7 @@ int concat_main(int argc, char **argv)
           std::uint64_t record_cnt = jt->value() & 0xFFFF;
           if (cnt == 0)
           {
-            assert(old_file_pos == std::size_t(ifs.tellg()));
+            assert(std::int64_t(old_file_pos) == in.data_pos);
           }
           std::uint64_t new_file_pos = old_file_pos + delta;
           output_index->write(it->name(), ::savvy::s1r::entry(jt->region_start(), jt->region_end(), (new_file_pos << 16u) | record_cnt));
@@ -237,47 +442,65 @@ int concat_main(int argc, char **argv)
       }
     }
 
-    std::int64_t idx_off = idx.file_offset();
-    assert(idx_off == 0 || idx_off >= 8);
-
-    std::int64_t bytes_to_read = (idx_off ? idx_off - 8 : 0) - ifs.tellg(); // If index doesn't exist at end of file, then idx.file_offset() is equal to 0.
-
-    while (ifs && bytes_to_read > 0)
+    if (in.idx_off)
     {
-      std::size_t sz = ifs.read(buf.data(), std::min<std::size_t>(bytes_to_read, buf.size())).gcount();
-      ofs.write(buf.data(), sz);
-      bytes_to_read -= sz;
-      output_pos += sz;
-      assert(bytes_to_read >= 0);
-    }
-
-    if (idx_off)
-    {
-      // Test that next bytes in file are a skippable frame
-      std::string h(4, '\0');
-      ifs.read(&h[0], 4);
-      if (h != "\x50\x2A\x4D\x18")
+      std::ifstream ifs(input_paths[i], std::ios::binary);
+      if (merge_zone_maps)
       {
-        std::cerr << "Error: boundary not at skippable frame, so " << (*ft) << " is likely corrupted\n";
-        return EXIT_FAILURE;
+        savvy::zone_map zm;
+        if (!zm.deserialize(ifs, in.idx_off, idx.uuid()))
+          merge_zone_maps = false;
+        else if (!output_zone_map)
+          output_zone_map = savvy::detail::make_unique<savvy::zone_map>(zm.fields());
+
+        if (merge_zone_maps && !output_zone_map->append(zm, delta))
+          merge_zone_maps = false;
       }
 
-      // Test that size of index matches size of skippable frame
-      std::uint32_t index_file_size_le = 0;
-      ifs.read((char*)&index_file_size_le, 4);
-      if (le32toh(index_file_size_le) != idx.size_on_disk())
+      if (merge_id_indexes)
       {
-        std::cerr << "Error: skippable frame size does not match index size, so " << (*ft) << " is likely corrupted\n";
-        return EXIT_FAILURE;
+        savvy::id_index ids;
+        if (ids.deserialize(ifs, in.idx_off, idx.uuid()))
+          output_id_index->append(ids, delta);
+        else
+          merge_id_indexes = false;
       }
-
-      // TODO: use this test in reader class when hitting the end of file
+    }
+    else
+    {
+      merge_zone_maps = false;
+      merge_id_indexes = false;
     }
   }
 
+  for (auto it = copy_threads.begin(); it != copy_threads.end(); ++it)
+    it->join();
+  ::close(out_fd);
+
+  if (copy_failed)
+    return false;
+
+  std::ofstream ofs(output_path, std::ios::binary | std::ios::app);
+  if (!ofs)
+  {
+    std::cerr << "Could not open output path (" << output_path << ")\n";
+    return false;
+  }
 
   if (output_index)
   {
+    if (merge_zone_maps && output_zone_map && !output_zone_map->serialize(ofs, uuid))
+    {
+      std::cerr << "Error: could not write zone map" << std::endl;
+      return false;
+    }
+
+    if (merge_id_indexes && !output_id_index->serialize(ofs, uuid))
+    {
+      std::cerr << "Error: could not write ID index" << std::endl;
+      return false;
+    }
+
     std::fstream s1r_fs = output_index->close();
     if (!savvy::detail::append_skippable_zstd_frame(s1r_fs, ofs))
     {
@@ -291,10 +514,28 @@ int concat_main(int argc, char **argv)
       //   int targetfd = open("target/filename", O_WRONLY | O_CREAT | O_EXCL);
       //   fstat(fd,&s);
       //   sendfile(targetfd,fd,&offset, s.st_size);
-      return EXIT_FAILURE;
+      return false;
     }
   }
 
 
-  return (ofs ? EXIT_SUCCESS : EXIT_FAILURE);
-}
\ No newline at end of file
+  return ofs.good();
+}
+
+int concat_main(int argc, char **argv)
+{
+  concat_prog_args args;
+  if (!args.parse(argc, argv))
+  {
+    args.print_usage(std::cerr);
+    return EXIT_FAILURE;
+  }
+
+  if (args.help_is_set())
+  {
+    args.print_usage(std::cout);
+    return EXIT_SUCCESS;
+  }
+
+  return concat_sav_files(args.input_paths(), args.output_path(), args.threads()) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
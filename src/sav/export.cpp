@@ -6,6 +6,7 @@
 
 
 #include "sav/export.hpp"
+#include "sav/concat.hpp"
 #include "sav/sort.hpp"
 #include "sav/utility.hpp"
 #include "sav/filter.hpp"
@@ -27,7 +28,15 @@
 #include <string>
 #include <vector>
 #include <memory>
+#include <functional>
 #include <unordered_set>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <unistd.h>
 
 
 class export_prog_args
@@ -44,7 +53,10 @@ private:
   std::unique_ptr<savvy::slice_bounds> slice_;
   std::vector<std::string> info_fields_;
   std::unordered_set<std::string> pbwt_fields_;
+  std::unordered_set<std::string> packed_fields_;
   std::unordered_set<std::string> sparse_fields_ = {"GT", "HDS", "EC", "DS"};
+  std::unordered_set<std::string> zone_map_fields_;
+  std::vector<std::string> variant_ids_;
   filter filter_;
   std::string sub_command_;
   std::string input_path_;
@@ -60,9 +72,12 @@ private:
   int update_info_ = -1;
   int compression_level_ = -1;
   std::uint16_t block_size_ = default_block_size;
+  std::size_t threads_ = 1;
   bool sites_only_ = false;
   bool help_ = false;
   bool index_ = false;
+  bool id_index_ = false;
+  bool pbwt_rle_ = false;
 public:
   export_prog_args() :
     long_options_(
@@ -74,23 +89,30 @@ public:
         {"generate-info", required_argument, 0, '\x01'},
         {"headers", required_argument, 0, '\x01'},
         {"help", no_argument, 0, 'h'},
+        {"id-index", no_argument, 0, '\x02'},
         {"index", no_argument, 0, 'x'},
         {"index-file", required_argument, 0, 'X'},
         {"info-fields", required_argument, 0, 'm'},
         {"output-format", required_argument, 0, 'O'},
+        {"packed-fields", required_argument, 0, '\x01'},
         {"pbwt-fields", required_argument, 0, '\x01'},
+        {"pbwt-rle", no_argument, 0, '\x02'},
         {"phasing", required_argument, 0, '\x01'},
         {"regions", required_argument, 0, 'r'},
         {"regions-file", required_argument, 0, 'R'},
         {"sample-ids", required_argument, 0, 'i'},
         {"sample-ids-file", required_argument, 0, 'I'},
         {"slice", required_argument, 0, 'c'},
+        {"threads", required_argument, 0, 't'},
 //        {"sort", no_argument, 0, 's'},
 //        {"sort-point", required_argument, 0, 'S'},
         {"sparse-fields", required_argument, 0, '\x01'},
         {"sparse-threshold", required_argument, 0, '\x01'},
         {"sites-only", no_argument, 0, '\x02'},
         {"update-info", required_argument, 0, '\x01'},
+        {"variant-ids", required_argument, 0, '\x01'},
+        {"variant-ids-file", required_argument, 0, '\x01'},
+        {"zone-map-fields", required_argument, 0, '\x01'},
         {0, 0, 0, 0}
       })
   {
@@ -105,8 +127,11 @@ public:
   const std::unordered_set<std::string>& subset_ids() const { return subset_ids_; }
   const std::unordered_set<std::string>& fields_to_generate() const { return fields_to_generate_; }
   const std::unordered_set<std::string>& pbwt_fields() const { return pbwt_fields_; }
+  const std::unordered_set<std::string>& packed_fields() const { return packed_fields_; }
   const std::unordered_set<std::string>& sparse_fields() const { return sparse_fields_; }
+  const std::unordered_set<std::string>& zone_map_fields() const { return zone_map_fields_; }
   const std::vector<savvy::genomic_region>& regions() const { return regions_; }
+  const std::vector<std::string>& variant_ids() const { return variant_ids_; }
   const std::vector<std::string>& info_fields() const { return info_fields_; }
   const std::unique_ptr<savvy::s1r::sort_point>& sort_type() const { return sort_type_; }
   const std::unique_ptr<savvy::slice_bounds>& slice() const { return slice_; }
@@ -116,8 +141,11 @@ public:
   savvy::bounding_point bounding_point() const { return bounding_point_; }
   std::uint8_t compression_level() const { return std::uint8_t(compression_level_); }
   std::uint16_t block_size() const { return block_size_; }
+  std::size_t threads() const { return threads_; }
   bool update_info() const { return update_info_ == 1 || (update_info_ == -1 && subset_ids_.size()); }
   bool index_is_set() const { return index_; }
+  bool id_index_is_set() const { return id_index_; }
+  bool pbwt_rle_is_set() const { return pbwt_rle_; }
   bool sites_only_is_set() const { return sites_only_; }
   bool help_is_set() const { return help_; }
 
@@ -143,18 +171,25 @@ public:
     os << " -p, --bounding-point   Determines the inclusion policy of indels during region queries (any, all, beg or end, default: beg)\n";
     os << " -r, --regions          Comma separated list of genomic regions formatted as chr[:start-end]\n";
     os << " -R, --regions-file     Path to file containing list of regions formatted as chr<tab>start<tab>end\n";
+    os << " -t, --threads          Number of threads used to read, convert and compress records (default: 1)\n";
     //os << " -s, --sort             Enables sorting by first position of allele\n";
     //os << " -S, --sort-point       Enables sorting and specifies which allele position to sort by (beg, mid or end)\n";
     //os << " -x, --index            Enables indexing (SAV output only)\n";
     os << " -X, --index-file       Specifies index output file (SAV output only)\n";
     os << "\n";
+    os << "     --id-index            Stores an index of variant IDs so that records can be queried by ID (SAV output only)\n";
     os << "     --phasing          Sets file phasing status if phasing header is not present (none, full, or partial)\n";
+    os << "     --packed-fields       Comma separated list of FORMAT fields (e.g., GT) to store with 2 or 4 bits per value when possible (SAV output only; files cannot be read by older versions of savvy)\n";
     os << "     --pbwt-fields         Comma separated list of FORMAT fields for which to enable PBWT sorting\n";
+    os << "     --pbwt-rle            Run-length encodes PBWT-sorted fields when smaller (SAV output only; files cannot be read by older versions of savvy)\n";
     os << "     --sparse-fields       Comma separated list of FORMAT fields to make sparse (default: GT,HDS,DS,EC)\n";
     os << "     --sparse-threshold    Non-zero frequency threshold for which sparse fields are encoded as sparse vectors (default: 1.0)\n";
     //os << "     --headers          Path to headers file that is either formatted as VCF headers or tab-delimited key value pairs\n";
     //os << "     --sites-only       Exclude individual level data.\n";
     os << "     --update-info      Specifies whether AC, MAC, AN, AF and MAF info fields should be updated (always, never or auto, default: auto)\n";
+    os << "     --variant-ids         Comma separated list of variant IDs to query (requires input file with ID index)\n";
+    os << "     --variant-ids-file    Path to file containing list of variant IDs to query (requires input file with ID index)\n";
+    os << "     --zone-map-fields     Comma separated list of numeric INFO fields for which per-block min/max values are stored so that filters can skip blocks (SAV output only)\n";
     os << std::flush;
   }
 
@@ -164,7 +199,7 @@ public:
 
     int long_index = 0;
     int opt = 0;
-    while ((opt = getopt_long(argc, argv, "0123456789b:c:f:hi:I:m:O:p:r:R:sS:xX:", long_options_.data(), &long_index )) != -1)
+    while ((opt = getopt_long(argc, argv, "0123456789b:c:f:hi:I:m:O:p:r:R:sS:t:xX:", long_options_.data(), &long_index )) != -1)
     {
       char copt = char(opt & 0xFF);
       switch (copt)
@@ -213,11 +248,31 @@ public:
           }
           break;
         }
+        else if (strcmp(long_options_[long_index].name, "packed-fields") == 0)
+        {
+          packed_fields_ = split_string_to_set(optarg, ',');
+          break;
+        }
         else if (strcmp(long_options_[long_index].name, "pbwt-fields") == 0)
         {
           pbwt_fields_ = split_string_to_set(optarg, ',');
           break;
         }
+        else if (strcmp(long_options_[long_index].name, "zone-map-fields") == 0)
+        {
+          zone_map_fields_ = split_string_to_set(optarg, ',');
+          break;
+        }
+        else if (strcmp(long_options_[long_index].name, "variant-ids") == 0)
+        {
+          variant_ids_ = split_string_to_vector(optarg, ',');
+          break;
+        }
+        else if (strcmp(long_options_[long_index].name, "variant-ids-file") == 0)
+        {
+          variant_ids_ = split_file_to_vector(optarg);
+          break;
+        }
         else if (strcmp(long_options_[long_index].name, "sparse-fields") == 0)
         {
           sparse_fields_ = split_string_to_set(optarg, ',');
@@ -237,6 +292,14 @@ public:
         {
           sites_only_ = true;
         }
+        else if (std::string(long_options_[long_index].name) == "id-index")
+        {
+          id_index_ = true;
+        }
+        else if (std::string(long_options_[long_index].name) == "pbwt-rle")
+        {
+          pbwt_rle_ = true;
+        }
         break;
       }
       case '0':
@@ -414,6 +477,9 @@ public:
         }
         break;
       }
+      case 't':
+        threads_ = std::size_t(std::max(1ll, std::atoll(optarg ? optarg : "")));
+        break;
       case 'x':
         index_ = true;
         break;
@@ -436,9 +502,9 @@ public:
 
     if (remaining_arg_count == 0)
     {
-      if (regions_.size())
+      if (regions_.size() || variant_ids_.size())
       {
-        std::cerr << "Input path must be specified when using --regions option." << std::endl;
+        std::cerr << "Input path must be specified when using --regions or --variant-ids option." << std::endl;
         return false;
       }
 
@@ -490,6 +556,12 @@ public:
       return false;
     }
 
+    if (variant_ids_.size() && (regions_.size() || slice_))
+    {
+      std::cerr << "--variant-ids cannot be combined with --regions or --slice\n";
+      return false;
+    }
+
     if (update_info_ < 0)
     {
       update_info_ = subset_ids_.size() ? 1 : 0; // Automatically update info fields if samples are subset.
@@ -826,20 +898,15 @@ void update_standard_info_fields(savvy::variant& var)
       an = it->second.size();
       if (it->second.is_sparse())
       {
-        if (allele_counts.size() == 1)
-        {
-          allele_counts[0] = it->second.non_zero_size();
-        }
-        else
+        savvy::compressed_vector<std::int32_t> sp_vec;
+        it->second.get(sp_vec);
+        for (auto it = sp_vec.begin(); it != sp_vec.end(); ++it)
         {
-          savvy::compressed_vector<std::int32_t> sp_vec;
-          it->second.get(sp_vec);
-          for (auto it = sp_vec.begin(); it != sp_vec.end(); ++it)
-          {
-            std::uint32_t al = *it - 1;
-            if (al < allele_counts.size()) // missing will overflow to > allele_counts.size()
-              ++allele_counts[al];
-          }
+          std::uint32_t al = *it - 1;
+          if (al < allele_counts.size())
+            ++allele_counts[al];
+          else if (savvy::typed_value::is_special_value(*it)) // Missing alleles (e.g., samples absent from a merged input) are not called
+            --an;
         }
       }
       else
@@ -851,6 +918,8 @@ void update_standard_info_fields(savvy::variant& var)
           std::uint32_t al = *it - 1;
           if (al < allele_counts.size()) // missing and zero will overflow to > allele_counts.size()
             ++allele_counts[al];
+          else if (savvy::typed_value::is_special_value(*it))
+            --an;
         }
       }
       break;
@@ -881,44 +950,457 @@ void update_standard_info_fields(savvy::variant& var)
   }
 }
 
+void export_record(savvy::variant& var, savvy::typed_value& tmp_val, const export_prog_args& args, bool remove_ph)
+{
+  if (remove_ph)
+    var.set_format("PH", {});
+
+  for (auto it = var.format_fields().begin(); it != var.format_fields().end(); ++it)
+  {
+    if (it->second.size() == 0) continue;
+
+    bool should_be_sparse = args.sparse_fields().find(it->first) != args.sparse_fields().end();
+    if (!it->second.is_sparse() && should_be_sparse)
+    {
+      it->second.copy_as_sparse(tmp_val);
+      if (tmp_val.size() && static_cast<double>(tmp_val.non_zero_size()) / tmp_val.size() <= args.sparse_threshold())
+        var.set_format(it->first, std::move(tmp_val)); // typed_value move operator implementation allows for reuse of tmp_val;
+    }
+    else if (it->second.is_sparse() && (!should_be_sparse || static_cast<double>(it->second.non_zero_size()) / it->second.size() > args.sparse_threshold()))
+    {
+      it->second.copy_as_dense(tmp_val);
+      var.set_format(it->first, std::move(tmp_val));
+    }
+  }
+
+  for (auto it = args.fields_to_generate().begin(); it != args.fields_to_generate().end(); ++it)
+    var.set_info(*it, 0);
+
+  if (args.update_info() || args.fields_to_generate().size())
+    update_standard_info_fields(var);
+}
+
 void export_records(savvy::reader& rdr, savvy::writer& wrt, const export_prog_args& args, bool remove_ph)
 {
   savvy::variant var;
   savvy::typed_value tmp_val;
   while (wrt && rdr.read(var))
   {
-    if (args.filter_functor()(var))
+    export_record(var, tmp_val, args, remove_ph);
+    wrt.write(var);
+  }
+}
+
+struct export_batch
+{
+  std::vector<savvy::variant> records;
+  std::size_t size = 0;
+  std::size_t seq = 0;
+};
+
+/**
+ * Reads records on one thread and converts them (sparse/dense conversion and INFO updates) on worker threads, so that
+ * the calling thread only has to serialize them. Batches are recycled, which lets records reuse their typed_value
+ * buffers, and the number of batches in flight is bounded, so the reader stalls when the writer falls behind.
+ */
+class export_pipeline
+{
+public:
+  static const std::size_t max_batch_records = 1024;
+  static const std::size_t max_batch_bytes = 4 * 1024 * 1024; // Approximate size of FORMAT data
+
+  /**
+   * Starts reading records. The reader must already be positioned at the first region (if any), and the remaining
+   * regions are queried in order.
+   * @param rdr Input file
+   * @param args Program arguments
+   * @param remove_ph Whether to remove PH fields
+   */
+  export_pipeline(savvy::reader& rdr, const export_prog_args& args, bool remove_ph) :
+    rdr_(rdr),
+    args_(args),
+    remove_ph_(remove_ph),
+    max_batches_(4 * args.threads())
+  {
+    threads_.reserve(args.threads() + 1);
+    threads_.emplace_back(&export_pipeline::read_batches, this);
+    for (std::size_t i = 0; i < args.threads(); ++i)
+      threads_.emplace_back(&export_pipeline::convert_batches, this);
+  }
+
+  ~export_pipeline()
+  {
+    {
+      std::unique_lock<std::mutex> lk(mtx_);
+      stop_ = true;
+    }
+    free_cv_.notify_all();
+    parsed_cv_.notify_all();
+    for (auto it = threads_.begin(); it != threads_.end(); ++it)
+      it->join();
+  }
+
+  /**
+   * Waits for next batch in input order. The batch must be returned with release().
+   * @return Converted batch or nullptr at end of input
+   */
+  export_batch* next()
+  {
+    std::unique_lock<std::mutex> lk(mtx_);
+    converted_cv_.wait(lk, [this]() { return converted_.count(next_seq_) || (reader_done_ && next_seq_ == n_parsed_); });
+    auto res = converted_.find(next_seq_);
+    if (res == converted_.end())
+      return nullptr;
+    export_batch* ret = res->second;
+    converted_.erase(res);
+    ++next_seq_;
+    return ret;
+  }
+
+  void release(export_batch* b)
+  {
+    b->size = 0;
+    {
+      std::unique_lock<std::mutex> lk(mtx_);
+      free_.push_back(b);
+    }
+    free_cv_.notify_one();
+  }
+
+  bool bounds_failed() const { return bounds_failed_; }
+private:
+  static std::size_t approximate_size(const savvy::variant& var)
+  {
+    std::size_t ret = 0;
+    for (auto it = var.format_fields().begin(); it != var.format_fields().end(); ++it)
+      ret += it->second.is_sparse() ? it->second.non_zero_size() * (it->second.val_width() + it->second.off_width()) : it->second.size() * it->second.val_width();
+    return ret;
+  }
+
+  export_batch* acquire_batch()
+  {
+    std::unique_lock<std::mutex> lk(mtx_);
+    free_cv_.wait(lk, [this]() { return stop_ || !free_.empty() || batches_.size() < max_batches_; });
+    if (stop_)
+      return nullptr;
+
+    if (free_.empty())
     {
-      if (remove_ph)
-        var.set_format("PH", {});
+      batches_.emplace_back(::savvy::detail::make_unique<export_batch>());
+      batches_.back()->records.resize(max_batch_records);
+      return batches_.back().get();
+    }
+
+    export_batch* ret = free_.front();
+    free_.pop_front();
+    return ret;
+  }
 
-      for (auto it = var.format_fields().begin(); it != var.format_fields().end(); ++it)
+  void push_parsed(export_batch* b)
+  {
+    {
+      std::unique_lock<std::mutex> lk(mtx_);
+      b->seq = n_parsed_++;
+      parsed_.push_back(b);
+    }
+    parsed_cv_.notify_one();
+  }
+
+  void read_batches()
+  {
+    auto region_it = args_.regions().begin();
+    export_batch* b = nullptr;
+    std::size_t batch_bytes = 0;
+    while (true)
+    {
+      if (!b)
       {
-        if (it->second.size() == 0) continue;
+        if (!(b = acquire_batch()))
+          break;
+        batch_bytes = 0;
+      }
 
-        bool should_be_sparse = args.sparse_fields().find(it->first) != args.sparse_fields().end();
-        if (!it->second.is_sparse() && should_be_sparse)
+      if (rdr_.read(b->records[b->size]))
+      {
+        batch_bytes += approximate_size(b->records[b->size]);
+        if (++b->size == b->records.size() || batch_bytes >= max_batch_bytes)
         {
-          it->second.copy_as_sparse(tmp_val);
-          if (tmp_val.size() && static_cast<double>(tmp_val.non_zero_size()) / tmp_val.size() <= args.sparse_threshold())
-            var.set_format(it->first, std::move(tmp_val)); // typed_value move operator implementation allows for reuse of tmp_val;
+          push_parsed(b);
+          b = nullptr;
         }
-        else if (it->second.is_sparse() && (!should_be_sparse || static_cast<double>(it->second.non_zero_size()) / it->second.size() > args.sparse_threshold()))
+      }
+      else if (!rdr_.bad() && args_.regions().size() && ++region_it != args_.regions().end())
+      {
+        if (!rdr_.reset_bounds(*region_it, args_.bounding_point()))
         {
-          it->second.copy_as_dense(tmp_val);
-          var.set_format(it->first, std::move(tmp_val));
+          bounds_failed_ = true;
+          break;
         }
       }
+      else
+      {
+        break;
+      }
+    }
 
-      for (auto it = args.fields_to_generate().begin(); it != args.fields_to_generate().end(); ++it)
-        var.set_info(*it, 0);
+    if (b && b->size)
+      push_parsed(b);
+    else if (b)
+      release(b);
 
-      if (args.update_info() || args.fields_to_generate().size())
-        update_standard_info_fields(var);
+    {
+      std::unique_lock<std::mutex> lk(mtx_);
+      reader_done_ = true;
+    }
+    parsed_cv_.notify_all();
+    converted_cv_.notify_all();
+  }
 
-      wrt.write(var);
+  void convert_batches()
+  {
+    savvy::typed_value tmp_val;
+    std::unique_lock<std::mutex> lk(mtx_);
+    while (true)
+    {
+      parsed_cv_.wait(lk, [this]() { return stop_ || reader_done_ || !parsed_.empty(); });
+      if (parsed_.empty())
+        break;
+
+      export_batch* b = parsed_.front();
+      parsed_.pop_front();
+      lk.unlock();
+      for (std::size_t i = 0; i < b->size; ++i)
+        export_record(b->records[i], tmp_val, args_, remove_ph_);
+      lk.lock();
+      converted_[b->seq] = b;
+      converted_cv_.notify_all();
+    }
+  }
+private:
+  savvy::reader& rdr_;
+  const export_prog_args& args_;
+  bool remove_ph_;
+  std::size_t max_batches_;
+  std::mutex mtx_;
+  std::condition_variable free_cv_;
+  std::condition_variable parsed_cv_;
+  std::condition_variable converted_cv_;
+  std::vector<std::unique_ptr<export_batch>> batches_;
+  std::deque<export_batch*> free_;
+  std::deque<export_batch*> parsed_;
+  std::map<std::size_t, export_batch*> converted_;
+  std::vector<std::thread> threads_;
+  std::size_t n_parsed_ = 0;
+  std::size_t next_seq_ = 0;
+  bool bounds_failed_ = false; // Read after next() returns nullptr
+  bool reader_done_ = false;
+  bool stop_ = false;
+};
+
+struct export_slice
+{
+  std::size_t region; // Index into export_prog_args::regions() or npos when not a region query
+  savvy::slice_bounds bounds;
+};
+
+/**
+ * Splits the S1R blocks to be exported into shards of roughly equal record counts at block boundaries. Blocks outside
+ * of the regions or excluded by the zone map are dropped. Shards are in output order (regions in the order given, and
+ * file order within each region).
+ * @param args Program arguments
+ * @param n_shards Target number of shards
+ * @param shards Destination shards
+ * @return False if input is not an indexed SAV file or if the index cannot be read in file order
+ */
+bool plan_export_shards(const export_prog_args& args, std::size_t n_shards, std::vector<std::vector<export_slice>>& shards)
+{
+  bool external_index = savvy::detail::file_exists(args.input_path() + ".s1r");
+  savvy::s1r::reader index(external_index ? args.input_path() + ".s1r" : args.input_path());
+  if (!index.good())
+    return false;
+
+  savvy::zone_map zmap;
+  if (!external_index)
+  {
+    std::ifstream ifs(args.input_path(), std::ios::binary);
+    zmap.deserialize(ifs, index.file_offset(), index.uuid());
+  }
+
+  std::vector<export_slice> blocks; // Record ranges of blocks to be read
+  std::uint64_t total_records = 0;
+  std::size_t n_queries = std::max<std::size_t>(1, args.regions().size());
+  for (std::size_t r = 0; r < n_queries; ++r)
+  {
+    // Record slices are relative to the query of the whole contig (or of all contigs), matching reader::reset_bounds(slice_bounds).
+    const savvy::genomic_region* reg = args.regions().empty() ? nullptr : &args.regions()[r];
+    std::string chrom = reg ? reg->chromosome() : "";
+    std::uint64_t record_offset = 0;
+    std::uint64_t prev_file_pos = 0;
+    auto query = index.create_query(savvy::genomic_region(chrom));
+    for (auto it = query.begin(); it != query.end(); ++it)
+    {
+      std::uint64_t file_pos = (it->value() >> 16u) & 0x0000FFFFFFFFFFFF;
+      if (file_pos < prev_file_pos)
+        return false; // Contigs are not contiguous in file, so the query order differs from file order.
+      prev_file_pos = file_pos;
+
+      std::uint64_t cnt = (it->value() & 0xFFFF) + 1;
+      bool keep = !reg || (it->region_start() <= reg->to() && it->region_end() >= reg->from());
+      if (keep)
+      {
+        std::size_t idx = zmap.find_block(file_pos);
+        keep = idx == zmap.block_count() || args.filter_functor().may_match(zmap[idx]);
+      }
+
+      if (keep)
+      {
+        blocks.push_back({reg ? r : std::size_t(-1), savvy::slice_bounds(record_offset, record_offset + cnt, chrom)});
+        total_records += cnt;
+      }
+      record_offset += cnt;
     }
   }
+
+  std::uint64_t shard_target = std::max<std::uint64_t>(1, (total_records + n_shards - 1) / n_shards);
+  std::uint64_t shard_size = shard_target;
+  shards.clear();
+  for (auto it = blocks.begin(); it != blocks.end(); ++it)
+  {
+    if (shard_size >= shard_target)
+    {
+      shards.emplace_back();
+      shard_size = 0;
+    }
+
+    export_slice* prev = shards.back().empty() ? nullptr : &shards.back().back();
+    if (prev && prev->region == it->region && prev->bounds.to() == it->bounds.from())
+      prev->bounds = savvy::slice_bounds(prev->bounds.from(), it->bounds.to(), it->bounds.chromosome());
+    else
+      shards.back().push_back(*it);
+    shard_size += it->bounds.to() - it->bounds.from();
+  }
+
+  return true;
+}
+
+/**
+ * Exports shards of an indexed SAV file to temporary files in parallel and concatenates them in order.
+ * @return EXIT_SUCCESS or EXIT_FAILURE, or -1 if input cannot be sharded
+ */
+int export_sharded(const export_prog_args& args, savvy::file::format fmt, const std::vector<std::pair<std::string, std::string>>& hdrs, const std::vector<std::string>& sample_ids, savvy::phasing phasing_status, bool remove_ph)
+{
+  std::vector<std::vector<export_slice>> shards;
+  if (!plan_export_shards(args, args.threads() * 4, shards) || shards.empty())
+    return -1;
+
+  const char* tmpdir = std::getenv("TMPDIR");
+  std::string temp_directory = tmpdir && tmpdir[0] ? tmpdir : "/tmp";
+  std::vector<std::string> part_paths;
+  part_paths.reserve(shards.size());
+  auto remove_parts = [&part_paths]()
+  {
+    for (auto it = part_paths.begin(); it != part_paths.end(); ++it)
+      std::remove(it->c_str());
+  };
+
+  for (std::size_t i = 0; i < shards.size(); ++i)
+  {
+    std::string path = temp_directory + "/sav-export-XXXXXX";
+    int fd = mkstemp(&path[0]);
+    if (fd < 0)
+    {
+      std::cerr << "Error: could not create temp file in " << temp_directory << std::endl;
+      remove_parts();
+      return EXIT_FAILURE;
+    }
+    ::close(fd);
+    part_paths.push_back(path);
+  }
+
+  // Each shard is written as a complete file so that subsetting, INFO updates, serialization and compression all run
+  // in the worker threads. The files are then joined in shard order.
+  std::vector<std::int64_t> header_sizes(shards.size(), 0);
+  std::atomic<std::size_t> next_shard(0);
+  std::atomic<bool> failed(false);
+  std::vector<std::thread> threads(std::min(args.threads(), shards.size()));
+  for (auto& t : threads)
+  {
+    t = std::thread([&]()
+    {
+      savvy::reader rdr(args.input_path());
+      rdr.phasing_status(phasing_status);
+      rdr.set_site_filter(std::cref(args.filter_functor()));
+      if (args.subset_ids().size())
+        rdr.subset_samples({args.subset_ids().begin(), args.subset_ids().end()});
+
+      savvy::variant var;
+      savvy::typed_value tmp_val;
+      std::size_t s;
+      while (!failed && (s = next_shard++) < shards.size())
+      {
+        savvy::writer wrt(part_paths[s], fmt, hdrs, sample_ids, args.compression_level());
+        header_sizes[s] = wrt.tellp();
+        wrt.set_block_size(args.block_size());
+        wrt.set_pbwt(args.pbwt_fields());
+        wrt.set_pbwt_rle(args.pbwt_rle_is_set());
+        wrt.set_packed_fields(args.packed_fields());
+        wrt.set_zone_map_fields(args.zone_map_fields());
+        wrt.set_id_index(args.id_index_is_set());
+
+        for (auto it = shards[s].begin(); it != shards[s].end() && wrt; ++it)
+        {
+          rdr.reset_bounds(it->bounds);
+          while (wrt && rdr.read(var))
+          {
+            if (it->region < args.regions().size() && !savvy::region_compare(args.bounding_point(), var, args.regions()[it->region]))
+              continue;
+            export_record(var, tmp_val, args, remove_ph);
+            wrt.write(var);
+          }
+
+          if (rdr.bad())
+          {
+            std::cerr << "Error: failed reading records " << it->bounds.from() << "-" << it->bounds.to() << std::endl;
+            failed = true;
+          }
+        }
+
+        if (!wrt.good())
+        {
+          std::cerr << "Error: failed writing to " << part_paths[s] << std::endl;
+          failed = true;
+        }
+      }
+    });
+  }
+
+  for (auto it = threads.begin(); it != threads.end(); ++it)
+    it->join();
+
+  bool success = !failed;
+  if (success && fmt == savvy::file::format::sav2)
+  {
+    success = concat_sav_files(part_paths, args.output_path(), args.threads());
+  }
+  else if (success)
+  {
+    // Uncompressed VCF: first part is copied whole and the headers of the remaining parts are skipped.
+    std::ofstream ofs(args.output_path(), std::ios::binary);
+    for (std::size_t i = 0; i < part_paths.size() && ofs; ++i)
+    {
+      std::ifstream ifs(part_paths[i], std::ios::binary | std::ios::ate);
+      std::int64_t off = i == 0 ? 0 : header_sizes[i];
+      if (ifs && std::int64_t(ifs.tellg()) > off)
+      {
+        ifs.seekg(off);
+        ofs << ifs.rdbuf();
+      }
+    }
+    success = ofs.good();
+  }
+
+  remove_parts();
+  return success ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
 int export_main(int argc, char** argv)
@@ -959,6 +1441,17 @@ int export_main(int argc, char** argv)
       return EXIT_FAILURE;
     }
   }
+  else if (args.variant_ids().size())
+  {
+    if (!rdr.reset_bounds(args.variant_ids()))
+    {
+      std::cerr << "Error: failed to load ID index for variant ID query" << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+
+  rdr.set_block_filter([&args](const savvy::zone_map::block& b) { return args.filter_functor().may_match(b); });
+  rdr.set_site_filter(std::cref(args.filter_functor()));
 
   auto fmt = savvy::file::format::vcf;
   if (args.file_format() == "sav" || args.file_format() == "sav")
@@ -1030,7 +1523,8 @@ int export_main(int argc, char** argv)
     std::string header_id = savvy::parse_header_sub_field(it->second, "ID");
     if (((remove_ph || args.file_format() != "sav") && it->first == "FORMAT" && header_id == "PH") ||
       (it->first == "INFO"  && rdr.file_format() == savvy::file::format::sav1 && (header_id == "ID" || header_id == "QUAL" || header_id == "FILTER")) ||
-      (it->first == "INFO" && args.info_fields().size() && std::find(args.info_fields().begin(), args.info_fields().end(), header_id) == args.info_fields().end()))
+      (it->first == "INFO" && args.info_fields().size() && std::find(args.info_fields().begin(), args.info_fields().end(), header_id) == args.info_fields().end()) ||
+      it->first == "pbwt_encoding" || it->first == "packed_encoding")
     {
       it = hdrs.erase(it);
     }
@@ -1060,14 +1554,66 @@ int export_main(int argc, char** argv)
       hdrs.emplace_back("INFO", "<ID=" + (*it) + ">");
   }
 
+  if (args.pbwt_rle_is_set() && fmt == savvy::file::format::sav2)
+    hdrs.emplace_back("pbwt_encoding", "rle");
+  if (args.packed_fields().size() && fmt == savvy::file::format::sav2)
+    hdrs.emplace_back("packed_encoding", "bits");
+
   std::vector<std::string> sample_ids(rdr.samples().size());
   std::copy(rdr.samples().begin(), rdr.samples().end(), sample_ids.begin());
   if (args.subset_ids().size())
     sample_ids = rdr.subset_samples({args.subset_ids().begin(), args.subset_ids().end()});
 
+  if (args.threads() > 1)
+  {
+    bool shardable_output = (fmt == savvy::file::format::sav2 && args.index_path().empty()) || (fmt == savvy::file::format::vcf && args.compression_level() == 0);
+    int res = -1;
+    if (rdr.file_format() == savvy::file::format::sav2 && shardable_output && !args.slice() && args.variant_ids().empty())
+      res = export_sharded(args, fmt, hdrs, sample_ids, rdr.phasing_status(), remove_ph);
+
+    if (res >= 0)
+      return res;
+  }
+
   savvy::writer wrt(args.output_path(), fmt, hdrs, sample_ids, args.compression_level(), args.index_path());
   wrt.set_block_size(args.block_size());
   wrt.set_pbwt(args.pbwt_fields());
+  wrt.set_pbwt_rle(args.pbwt_rle_is_set());
+  wrt.set_packed_fields(args.packed_fields());
+  wrt.set_zone_map_fields(args.zone_map_fields());
+  wrt.set_id_index(args.id_index_is_set());
+
+  if (args.threads() > 1)
+  {
+    // Input that cannot be sharded (e.g., VCF or BCF) is read, converted, serialized and compressed on separate
+    // threads.
+    wrt.set_compression_threads(args.threads());
+    bool bounds_failed = false;
+    {
+      export_pipeline pipeline(rdr, args, remove_ph);
+      while (wrt)
+      {
+        export_batch* b = pipeline.next();
+        if (!b)
+        {
+          bounds_failed = pipeline.bounds_failed();
+          break;
+        }
+
+        for (std::size_t i = 0; i < b->size; ++i)
+          wrt.write(b->records[i]);
+        pipeline.release(b);
+      }
+    }
+
+    if (bounds_failed)
+    {
+      std::cerr << "Error: failed to load index for genomic region query" << std::endl;
+      return EXIT_FAILURE;
+    }
+
+    return wrt.good() && !rdr.bad() ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
 
   export_records(rdr, wrt, args, remove_ph);
 
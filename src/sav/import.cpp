@@ -12,6 +12,7 @@
 #include "savvy/savvy.hpp"
 #include "savvy/writer.hpp"
 
+#include <algorithm>
 #include <cstdlib>
 #include <getopt.h>
 
@@ -26,6 +27,7 @@ private:
   std::unordered_set<std::string> subset_ids_;
   std::vector<savvy::genomic_region> regions_;
   std::unordered_set<std::string> pbwt_fields_;
+  std::unordered_set<std::string> packed_fields_;
   std::unordered_set<std::string> sparse_fields_ = {"GT", "HDS", "EC", "DS"};
   std::string input_path_;
   std::string output_path_;
@@ -51,6 +53,7 @@ public:
         {"help", no_argument, 0, 'h'},
         {"index", no_argument, 0, 'x'},
         {"index-file", required_argument, 0, 'X'},
+        {"packed-fields", required_argument, 0, '\x01'},
         {"phasing", required_argument, 0, '\x01'},
         {"pbwt-fields", required_argument, 0, '\x01'},
         {"regions", required_argument, 0, 'r'},
@@ -73,6 +76,7 @@ public:
   const std::string& index_path() const { return index_path_; }
   const std::unordered_set<std::string>& subset_ids() const { return subset_ids_; }
   const std::unordered_set<std::string>& pbwt_fields() const { return pbwt_fields_; }
+  const std::unordered_set<std::string>& packed_fields() const { return packed_fields_; }
   const std::unordered_set<std::string>& sparse_fields() const { return sparse_fields_; }
   const std::vector<savvy::genomic_region>& regions() const { return regions_; }
   std::uint8_t compression_level() const { return std::uint8_t(compression_level_); }
@@ -106,6 +110,7 @@ public:
     os << " -X, --index-file          Enables indexing and specifies index output file\n";
     os << "\n";
     os << "     --phasing             Sets file phasing status if phasing header is not present (none, full, or partial)\n";
+    os << "     --packed-fields       Comma separated list of FORMAT fields (e.g., GT) to store with 2 or 4 bits per value when possible (files cannot be read by older versions of savvy)\n";
     os << "     --pbwt-fields         Comma separated list of FORMAT fields for which to enable PBWT sorting\n";
     os << "     --skip-empty-vectors  Skips variants that don't contain the request data format (By default, the import fails)\n";
     os << "     --sparse-fields       Comma separated list of FORMAT fields to make sparse (default: GT,HDS,DS,EC)\n";
@@ -146,6 +151,11 @@ public:
             }
             break;
           }
+          else if (strcmp(long_options_[long_index].name, "packed-fields") == 0)
+          {
+            packed_fields_ = split_string_to_set(optarg, ',');
+            break;
+          }
           else if (strcmp(long_options_[long_index].name, "pbwt-fields") == 0)
           {
             pbwt_fields_ = split_string_to_set(optarg, ',');
@@ -503,6 +513,9 @@ int import_main2(int argc, char** argv)
     }
 
     auto hdrs = input.headers();
+    hdrs.erase(std::remove_if(hdrs.begin(), hdrs.end(), [](const std::pair<std::string, std::string>& h) { return h.first == "packed_encoding"; }), hdrs.end());
+    if (args.packed_fields().size())
+      hdrs.emplace_back("packed_encoding", "bits");
 
     auto gt_present = std::find_if(input.format_headers().begin(), input.format_headers().end(),
       [](const savvy::header_value_details& h) { return h.id == "GT"; }) != input.format_headers().end();
@@ -541,6 +554,7 @@ int import_main2(int argc, char** argv)
 
     savvy::writer output(args.output_path(), savvy::file::format::sav2, hdrs, subset_fn ? subset_fn->id_intersection() : input.samples(), args.compression_level());
     output.set_block_size(args.block_size());
+    output.set_packed_fields(args.packed_fields());
 
     std::size_t cnt = 0;
     while (output && input >> var)
@@ -8,8 +8,11 @@
 #include "sav/utility.hpp"
 #include "savvy/reader.hpp"
 
+#include <atomic>
+#include <cstring>
 #include <set>
 #include <fstream>
+#include <thread>
 #include <getopt.h>
 
 class index_prog_args
@@ -21,13 +24,17 @@ private:
   std::vector<option> long_options_;
   std::string input_path_;
   std::string index_path_;
+  std::size_t threads_ = 1;
   bool help_ = false;
+  bool id_index_ = false;
 public:
   index_prog_args() :
     long_options_(
       {
         {"help", no_argument, 0, 'h'},
+        {"id-index", no_argument, 0, '\x01'},
         {"output", required_argument, 0, 'o'},
+        {"threads", required_argument, 0, 't'},
         {0, 0, 0, 0}
       })
   {
@@ -35,14 +42,19 @@ public:
 
   const std::string& input_path() const { return input_path_; }
   const std::string& index_path() const { return index_path_; }
+  std::size_t threads() const { return threads_; }
   bool help_is_set() const { return help_; }
+  bool id_index_is_set() const { return id_index_; }
 
   void print_usage(std::ostream& os)
   {
     os << "Usage: sav index [opts ...] <in.sav> \n";
     os << "\n";
-    os << " -h, --help    Print usage\n";
-    os << " -o, --output  Output path (default: appends index to SAV file)\n";
+    os << " -h, --help     Print usage\n";
+    os << " -o, --output   Output path (default: appends index to SAV file)\n";
+    os << " -t, --threads  Number of threads used to read zstd blocks (default: 1)\n";
+    os << "\n";
+    os << "     --id-index   Also appends an index of variant IDs (cannot be combined with --output)\n";
     os << std::flush;
   }
 
@@ -50,17 +62,27 @@ public:
   {
     int long_index = 0;
     int opt = 0;
-    while ((opt = getopt_long(argc, argv, "ho:", long_options_.data(), &long_index )) != -1)
+    while ((opt = getopt_long(argc, argv, "ho:t:", long_options_.data(), &long_index )) != -1)
     {
       char copt = char(opt & 0xFF);
       switch (copt)
       {
+        case '\x01':
+          if (strcmp(long_options_[long_index].name, "id-index") == 0)
+          {
+            id_index_ = true;
+            break;
+          }
+          return false;
         case 'h':
           help_ = true;
           return true;
       case 'o':
         index_path_ = optarg ? optarg : "";
         break;
+      case 't':
+        threads_ = std::size_t(std::max(1ll, std::atoll(optarg ? optarg : "")));
+        break;
         default:
           return false;
       }
@@ -89,6 +111,12 @@ public:
       return false;
     }
 
+    if (id_index_ && !index_path_.empty())
+    {
+      std::cerr << "--id-index cannot be combined with --output\n";
+      return false;
+    }
+
     return true;
   }
 };
@@ -124,7 +152,144 @@ bool append_index(const std::string& sav_file_path, const std::string& s1r_file_
   return (index_file.good() && sav_file.good());
 }
 
-bool create_index(const std::string& input_file_path, std::string output_file_path)
+/**
+ * Locates zstd frames by walking frame and block headers without decompressing them. Stops at the first skippable
+ * frame (e.g., an appended index) or at the end of the file. Frames without content are left out.
+ * @param file_path Path to SAV file
+ * @param start_pos File position of first frame after header
+ * @param frames Destination file positions of frames
+ * @return False if file is not a sequence of zstd frames
+ */
+bool find_zstd_frames(const std::string& file_path, std::int64_t start_pos, std::vector<std::int64_t>& frames)
+{
+  static const std::int64_t dict_id_sizes[] = {0, 1, 2, 4};
+
+  std::ifstream ifs(file_path, std::ios::binary);
+  ifs.seekg(start_pos);
+  std::int64_t pos = start_pos;
+  std::uint8_t buf[4];
+  frames.clear();
+  while (ifs.read((char*)buf, 4))
+  {
+    std::uint32_t magic = std::uint32_t(buf[0]) | std::uint32_t(buf[1]) << 8u | std::uint32_t(buf[2]) << 16u | std::uint32_t(buf[3]) << 24u;
+    if ((magic & 0xFFFFFFF0) == 0x184D2A50) // skippable frame
+      return true;
+    if (magic != 0xFD2FB528 || !ifs.read((char*)buf, 1))
+      return false;
+
+    std::uint8_t descriptor = buf[0];
+    bool single_segment = descriptor & 0x20;
+    std::uint8_t fcs_flag = descriptor >> 6u;
+    std::int64_t frame_pos = pos;
+    pos += 5 + (single_segment ? 0 : 1) + dict_id_sizes[descriptor & 0x03] + (fcs_flag ? (1 << fcs_flag) : (single_segment ? 1 : 0));
+
+    std::int64_t content_size = 0;
+    bool last_block = false;
+    while (!last_block)
+    {
+      if (!ifs.seekg(pos) || !ifs.read((char*)buf, 3))
+        return false;
+
+      std::uint32_t block_header = std::uint32_t(buf[0]) | std::uint32_t(buf[1]) << 8u | std::uint32_t(buf[2]) << 16u;
+      std::uint32_t block_type = (block_header >> 1u) & 0x03;
+      std::uint32_t block_size = block_header >> 3u;
+      if (block_type == 3)
+        return false;
+
+      last_block = block_header & 0x01;
+      content_size += block_size;
+      pos += 3 + (block_type == 1 ? 1 : block_size); // RLE blocks store a single byte
+    }
+
+    if (descriptor & 0x04) // content checksum
+      pos += 4;
+
+    if (content_size)
+      frames.push_back(frame_pos);
+    ifs.seekg(pos);
+  }
+
+  return ifs.gcount() == 0 && !ifs.bad();
+}
+
+struct index_chunk
+{
+  std::vector<std::pair<std::string, savvy::s1r::entry>> entries;
+  savvy::id_index ids;
+};
+
+/**
+ * Reads the site data of records in consecutive zstd frames. Individual data is skipped without being decoded.
+ * @param file_path Path to SAV file
+ * @param beg First frame
+ * @param end End of frames
+ * @param build_id_index Whether to collect variant IDs
+ * @param dest Destination S1R entries (one per frame) and ID index
+ * @return False on read error or if a frame cannot be indexed
+ */
+bool index_frames(const std::string& file_path, std::vector<std::int64_t>::const_iterator beg, std::vector<std::int64_t>::const_iterator end, bool build_id_index, index_chunk& dest)
+{
+  savvy::reader r(file_path);
+  r.sites_only(true);
+
+  savvy::variant variant;
+  for (auto it = beg; it != end; ++it)
+  {
+    std::int64_t start_pos = *it;
+    if (start_pos > 0x0000FFFFFFFFFFFF) // Max file size: 256 TiB
+    {
+      std::cerr << "Error: file size too large to be indexed" << std::endl;
+      return false;
+    }
+
+    std::size_t records_in_block = 0;
+    std::uint32_t min = std::numeric_limits<std::uint32_t>::max();
+    std::uint32_t max = 0;
+    std::string chromosome;
+
+    // The stream position changes to the next frame once the last record of the current frame has been read.
+    r.seekg(start_pos);
+    do
+    {
+      if (!r.read(variant))
+      {
+        std::cerr << "Error: failed to read records at file position " << start_pos << std::endl;
+        return false;
+      }
+
+      if (records_in_block == 0)
+        chromosome = variant.chromosome();
+      else if (variant.chromosome() != chromosome)
+      {
+        std::cerr << "Error: zstd block at file position " << start_pos << " contains multiple chromosomes" << std::endl;
+        return false;
+      }
+
+      if (++records_in_block > 0x10000) // Max records per block: 64*1024
+      {
+        std::cerr << "Error: too many records in zstd block at file position " << start_pos << std::endl;
+        return false;
+      }
+
+      min = std::min(min, std::uint32_t(variant.position()));
+      std::size_t variant_size = variant.ref().size();
+      for (auto a = variant.alts().begin(); a != variant.alts().end(); ++a)
+        variant_size = std::max(variant_size, a->size());
+      max = std::max(max, std::uint32_t(variant.position() + variant_size - 1));
+      if (build_id_index)
+        dest.ids.update(variant);
+    } while (std::int64_t(r.tellg()) == start_pos);
+
+    savvy::s1r::entry e(min, max, (static_cast<std::uint64_t>(start_pos) << 16) | std::uint16_t(records_in_block - 1));
+    dest.entries.emplace_back(chromosome, e);
+    if (build_id_index)
+      dest.ids.end_block(e.value());
+  }
+
+  return true;
+}
+
+bool create_index(const std::string& input_file_path, std::string output_file_path, bool build_id_index, std::size_t n_threads)
 {
   bool ret = false;
 
@@ -165,75 +330,63 @@ bool create_index(const std::string& input_file_path, std::string output_file_pa
   if (append_index)
     std::remove(output_file_path.c_str());
 
-  std::uint32_t min = std::numeric_limits<std::uint32_t>::max();
-  std::uint32_t max = 0;
-  std::map<std::string, std::vector<savvy::s1r::entry>> index_data;
+  std::unique_ptr<savvy::id_index> id_idx;
+  if (append_index && build_id_index)
+    id_idx = savvy::detail::make_unique<savvy::id_index>();
 
-  savvy::variant variant;
-
-  std::size_t records_in_block = 0;
-  std::string current_chromosome;
-  while (r.read(variant) && start_pos >= 0)
+  // Frames are split into contiguous chunks that are read in parallel. Only the site data of each record is decoded.
+  std::vector<std::int64_t> frames;
+  if (start_pos < 0 || !find_zstd_frames(input_file_path, start_pos, frames))
   {
-    if (records_in_block > 0 && variant.chromosome() != current_chromosome)
-    {
-      // TODO: Possibly make this an error case.
-      savvy::s1r::entry e(min, max, (static_cast<std::uint64_t>(start_pos) << 16) | std::uint16_t(records_in_block - 1));
-      index_data[current_chromosome].emplace_back(std::move(e));
-      records_in_block = 0;
-      min = std::numeric_limits<std::uint32_t>::max();
-      max = 0;
-      start_pos = r.tellg();
-    }
-
-    ++records_in_block;
-    current_chromosome = variant.chromosome();
-    min = std::min(min, std::uint32_t(variant.position()));
-    std::size_t variant_size = variant.ref().size();
-    for (auto it = variant.alts().begin(); it != variant.alts().end(); ++it)
-      variant_size = std::max(variant_size, it->size());
-    max = std::max(max, std::uint32_t(variant.position() + variant_size - 1));
-
-    std::int64_t end_pos = r.tellg();
-    if (start_pos != end_pos) // zstd frame frame boundary
+    std::cerr << "Error: could not locate zstd blocks in " << input_file_path << std::endl;
+  }
+  else
+  {
+    std::vector<index_chunk> chunks(std::min(frames.size(), n_threads > 1 ? n_threads * 4 : 1));
+    std::atomic<std::size_t> next_chunk(0);
+    std::atomic<bool> failed(false);
+    auto run = [&]()
     {
-      if (records_in_block > 0x10000) // Max records per block: 64*1024
-      {
-        assert(!"Too many records in zstd frame to be indexed!");
-        return false;
-      }
-
-      if (start_pos > 0x0000FFFFFFFFFFFF) // Max file size: 256 TiB
+      std::size_t c;
+      while (!failed && (c = next_chunk++) < chunks.size())
       {
-        assert(!"File size to large to be indexed!");
-        return false;
+        auto beg = frames.cbegin() + c * frames.size() / chunks.size();
+        auto end = frames.cbegin() + (c + 1) * frames.size() / chunks.size();
+        if (!index_frames(input_file_path, beg, end, id_idx != nullptr, chunks[c]))
+          failed = true;
       }
+    };
 
-      savvy::s1r::entry e(min, max, (static_cast<std::uint64_t>(start_pos) << 16) | std::uint16_t(records_in_block - 1));
-      idx.write(variant.chromosome(), e);
+    std::vector<std::thread> threads(std::min(n_threads, chunks.size()) > 1 ? std::min(n_threads, chunks.size()) - 1 : 0);
+    for (auto it = threads.begin(); it != threads.end(); ++it)
+      *it = std::thread(run);
+    run();
+    for (auto it = threads.begin(); it != threads.end(); ++it)
+      it->join();
 
-      records_in_block = 0;
-      min = std::numeric_limits<std::uint32_t>::max();
-      max = 0;
-      start_pos = end_pos;
+    for (auto it = chunks.begin(); it != chunks.end() && !failed; ++it)
+    {
+      for (auto jt = it->entries.begin(); jt != it->entries.end(); ++jt)
+        idx.write(jt->first, jt->second);
+      if (id_idx)
+        id_idx->append(it->ids, 0);
     }
-  }
 
-  if (start_pos < 0)
-  {
-    // TODO: handle error.
-  }
-  else
-  {
-    ret = idx.good() && !r.bad();
+    ret = !failed && idx.good();
     if (ret && append_index)
     {
       std::fstream sav_fs(input_file_path, std::ios::in | std::ios::out | std::ios::binary | std::ios::app);
       sav_fs.seekp(0, std::ios::end);
       // TODO: Check if index already exists and replace. Use std::filesystem::resize_file (c++17) to shrink file when needed.
 
+      if (id_idx && !id_idx->serialize(sav_fs, r.uuid()))
+      {
+        std::cerr << "Error: could not append ID index" << std::endl;
+        ret = false;
+      }
+
       std::fstream s1r_fs = idx.close();
-      if (!savvy::detail::append_skippable_zstd_frame(s1r_fs, sav_fs))
+      if (ret && !savvy::detail::append_skippable_zstd_frame(s1r_fs, sav_fs))
       {
         // TODO: Use linkat or send file (see https://stackoverflow.com/a/25154505/1034772)
         std::cerr << "Error: index file too big for skippable zstd frame" << std::endl;
@@ -272,7 +425,7 @@ int index_main(int argc, char** argv)
     return EXIT_SUCCESS;
   }
 
-  if (!create_index(args.input_path(), args.index_path()))
+  if (!create_index(args.input_path(), args.index_path(), args.id_index_is_set(), args.threads()))
     return EXIT_FAILURE;
   return EXIT_SUCCESS; //append_index(args.input_path(), index_file_path) ? EXIT_SUCCESS : EXIT_FAILURE;
 }
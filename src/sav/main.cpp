@@ -9,15 +9,20 @@
 #include "sav/head.hpp"
 #include "sav/import.hpp"
 #include "sav/index.hpp"
+#include "sav/match.hpp"
 #include "sav/merge.hpp"
 #include "sav/rehead.hpp"
+#include "sav/sample_sort.hpp"
+#include "sav/simulate.hpp"
 #include "sav/sort.hpp"
 #include "sav/stat.hpp"
 #include "savvy/utility.hpp"
 #include "savvy/endianness.hpp"
+#include "savvy/stage_stats.hpp"
 
 #include <cmath>
 #include <cstdlib>
+#include <cstring>
 #include <vector>
 #include <iostream>
 
@@ -27,6 +32,7 @@ private:
   std::string sub_command_;
   bool help_ = false;
   bool version_ = false;
+  bool profile_ = false;
 public:
   prog_args()
   {
@@ -35,6 +41,7 @@ public:
   const std::string& sub_command() const { return sub_command_; }
   bool help_is_set() const { return help_; }
   bool version_is_set() const { return version_; }
+  bool profile_is_set() const { return profile_; }
 
   void print_usage(std::ostream& os)
   {
@@ -47,8 +54,11 @@ public:
     os << " head:        Prints SAV headers or samples IDs\n";
     os << " import:      Imports VCF or BCF into SAV\n";
     os << " index:       Indexes SAV file\n";
-    //os << " merge:       Merges multiple files into one\n";
+    os << " match:       Finds PBWT haplotype matches between query and reference panel\n";
+    os << " merge:       Merges multiple files into one\n";
     os << " rehead:      Replaces headers without recompressing variant blocks\n";
+    os << " sample-sort: Reorders samples to improve sparsity and compression\n";
+    os << " simulate:    Generates synthetic genotype data\n";
     os << " sort:        Sorts variant records\n";
     os << " stat:        Gathers statistics on SAV file\n";
     os << " stat-index:  Gathers statistics on s1r index\n";
@@ -57,12 +67,25 @@ public:
     os << "Options:\n";
     os << " -h, --help     Print usage\n";
     os << " -v, --version  Print version\n";
+    os << "     --profile  Print per-stage reader/writer timings to stderr (requires -DENABLE_PROFILING=ON)\n";
     //os << "----------------------------------------------\n";
     os << std::flush;
   }
 
   bool parse(int& argc, char**& argv)
   {
+    // --profile is accepted anywhere on the command line and removed before sub-command options are parsed.
+    int n_args = 1;
+    for (int i = 1; i < argc; ++i)
+    {
+      if (std::strcmp(argv[i], "--profile") == 0)
+        profile_ = true;
+      else
+        argv[n_args++] = argv[i];
+    }
+    argv[n_args] = nullptr;
+    argc = n_args;
+
     if (argc > 1)
     {
       std::string str_opt_arg(argv[1]);
@@ -91,6 +114,24 @@ public:
   }
 };
 
+class profile_reporter
+{
+private:
+  bool enabled_;
+public:
+  profile_reporter(bool enabled) : enabled_(enabled)
+  {
+    if (enabled_ && !savvy::stage_stats::enabled())
+      std::cerr << "Warning: --profile has no effect because sav was built without profiling (-DENABLE_PROFILING=ON)" << std::endl;
+  }
+
+  ~profile_reporter()
+  {
+    if (enabled_ && savvy::stage_stats::enabled())
+      savvy::stage_stats::process_totals().print(std::cerr);
+  }
+};
+
 int main(int argc, char** argv)
 {
   prog_args args;
@@ -100,6 +141,8 @@ int main(int argc, char** argv)
     return EXIT_FAILURE;
   }
 
+  profile_reporter profile(args.profile_is_set()); // Prints totals of all readers and writers when sub-command returns
+
   if (args.sub_command() == "concat")
   {
     return concat_main(argc, argv);
@@ -116,14 +159,26 @@ int main(int argc, char** argv)
   {
     return index_main(argc, argv);
   }
-//  else if (args.sub_command() == "merge") // TODO
-//  {
-//    return merge_main(argc, argv);
-//  }
+  else if (args.sub_command() == "match")
+  {
+    return match_main(argc, argv);
+  }
+  else if (args.sub_command() == "merge")
+  {
+    return merge_main(argc, argv);
+  }
   else if (args.sub_command() == "rehead")
   {
     return rehead_main(argc, argv);
   }
+  else if (args.sub_command() == "sample-sort")
+  {
+    return sample_sort_main(argc, argv);
+  }
+  else if (args.sub_command() == "simulate")
+  {
+    return simulate_main(argc, argv);
+  }
   else if (args.sub_command() == "sort")
   {
     return sort_main(argc, argv);
@@ -0,0 +1,292 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#include "sav/match.hpp"
+#include "sav/utility.hpp"
+#include "savvy/reader.hpp"
+#include "savvy/haplotype_matcher.hpp"
+
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <getopt.h>
+#include <iostream>
+#include <memory>
+
+class match_prog_args
+{
+private:
+  std::vector<option> long_options_;
+  std::unordered_set<std::string> subset_ids_;
+  std::unique_ptr<savvy::genomic_region> reg_;
+  std::string panel_path_;
+  std::string query_path_;
+  std::string output_path_ = "/dev/stdout";
+  std::string fmt_field_ = "GT";
+  savvy::haplotype_matcher::mode mode_ = savvy::haplotype_matcher::mode::set_maximal;
+  std::size_t min_length_ = 1;
+  bool help_ = false;
+public:
+  match_prog_args() :
+    long_options_(
+      {
+        {"format-field", required_argument, 0, 'f'},
+        {"help", no_argument, 0, 'h'},
+        {"min-length", required_argument, 0, 'l'},
+        {"mode", required_argument, 0, 'm'},
+        {"output", required_argument, 0, 'o'},
+        {"region", required_argument, 0, 'r'},
+        {"sample-ids", required_argument, 0, 'i'},
+        {"sample-ids-file", required_argument, 0, 'I'},
+        {0, 0, 0, 0}
+      })
+  {
+  }
+
+  const std::string& panel_path() const { return panel_path_; }
+  const std::string& query_path() const { return query_path_; }
+  const std::string& output_path() const { return output_path_; }
+  const std::string& fmt_field() const { return fmt_field_; }
+  const std::unordered_set<std::string>& subset_ids() const { return subset_ids_; }
+  const std::unique_ptr<savvy::genomic_region>& reg() const { return reg_; }
+  savvy::haplotype_matcher::mode mode() const { return mode_; }
+  std::size_t min_length() const { return min_length_; }
+  bool help_is_set() const { return help_; }
+
+  void print_usage(std::ostream& os)
+  {
+    os << "Usage: sav match [opts ...] <panel.sav> <query.{sav,bcf,vcf,vcf.gz}>\n";
+    os << "\n";
+    os << " -f, --format-field     Haplotype FORMAT field (default: GT)\n";
+    os << " -h, --help             Print usage\n";
+    os << " -i, --sample-ids       Comma separated list of query sample IDs to match\n";
+    os << " -I, --sample-ids-file  Path to file containing list of query sample IDs to match\n";
+    os << " -l, --min-length       Minimum number of markers in reported matches (default: 1)\n";
+    os << " -m, --mode             Matches to report (set-maximal or longest; default: set-maximal)\n";
+    os << " -o, --output           Output path (default: /dev/stdout)\n";
+    os << " -r, --region           Genomic region formatted as chr[:start-end]\n";
+    os << "\n";
+    os << " Only markers present in both files (same position and alleles) are used. Matches do not span chromosomes.\n";
+    os << std::flush;
+  }
+
+  bool parse(int argc, char** argv)
+  {
+    int long_index = 0;
+    int opt = 0;
+    while ((opt = getopt_long(argc, argv, "f:hi:I:l:m:o:r:", long_options_.data(), &long_index )) != -1)
+    {
+      char copt = char(opt & 0xFF);
+      switch (copt)
+      {
+      case 'f':
+        fmt_field_ = optarg ? optarg : "";
+        break;
+      case 'h':
+        help_ = true;
+        return true;
+      case 'i':
+        subset_ids_ = split_string_to_set(optarg, ',');
+        break;
+      case 'I':
+        subset_ids_ = split_file_to_set(optarg);
+        break;
+      case 'l':
+        min_length_ = std::size_t(std::max(1ll, std::atoll(optarg ? optarg : "")));
+        break;
+      case 'm':
+      {
+        std::string str_opt_arg(optarg ? optarg : "");
+        if (str_opt_arg == "set-maximal")
+          mode_ = savvy::haplotype_matcher::mode::set_maximal;
+        else if (str_opt_arg == "longest")
+          mode_ = savvy::haplotype_matcher::mode::longest;
+        else
+        {
+          std::cerr << "Invalid --mode argument (" << str_opt_arg << ")\n";
+          return false;
+        }
+        break;
+      }
+      case 'o':
+        output_path_ = optarg ? optarg : "";
+        break;
+      case 'r':
+        reg_ = savvy::detail::make_unique<savvy::genomic_region>(string_to_region(optarg ? optarg : ""));
+        break;
+      default:
+        return false;
+      }
+    }
+
+    int remaining_arg_count = argc - optind;
+
+    if (remaining_arg_count == 2)
+    {
+      panel_path_ = argv[optind];
+      query_path_ = argv[optind + 1];
+    }
+    else if (remaining_arg_count < 2)
+    {
+      std::cerr << "Too few arguments\n";
+      return false;
+    }
+    else
+    {
+      std::cerr << "Too many arguments\n";
+      return false;
+    }
+
+    return true;
+  }
+};
+
+class match_writer
+{
+private:
+  std::ostream& os_;
+  const std::vector<std::string>& panel_ids_;
+  const std::vector<std::string>& query_ids_;
+  std::size_t panel_ploidy_;
+  std::size_t query_ploidy_;
+public:
+  match_writer(std::ostream& os, const std::vector<std::string>& panel_ids, const std::vector<std::string>& query_ids, std::size_t panel_ploidy, std::size_t query_ploidy) :
+    os_(os),
+    panel_ids_(panel_ids),
+    query_ids_(query_ids),
+    panel_ploidy_(panel_ploidy),
+    query_ploidy_(query_ploidy)
+  {
+  }
+
+  void write(savvy::haplotype_matcher& matcher, const std::string& chrom, const std::vector<std::uint32_t>& positions)
+  {
+    for (auto it = matcher.matches().begin(); it != matcher.matches().end(); ++it)
+    {
+      os_ << query_ids_[it->query / query_ploidy_] << "\t" << (it->query % query_ploidy_ + 1) << "\t"
+        << panel_ids_[it->haplotype / panel_ploidy_] << "\t" << (it->haplotype % panel_ploidy_ + 1) << "\t"
+        << chrom << "\t" << positions[it->begin] << "\t" << positions[it->end - 1] << "\t" << (it->end - it->begin) << "\n";
+    }
+    matcher.clear_matches();
+  }
+};
+
+int match_main(int argc, char** argv)
+{
+  match_prog_args args;
+  if (!args.parse(argc, argv))
+  {
+    args.print_usage(std::cerr);
+    return EXIT_FAILURE;
+  }
+
+  if (args.help_is_set())
+  {
+    args.print_usage(std::cout);
+    return EXIT_SUCCESS;
+  }
+
+  savvy::reader panel(args.panel_path());
+  if (!panel)
+  {
+    std::cerr << "Error: could not open panel file (" << args.panel_path() << ")\n";
+    return EXIT_FAILURE;
+  }
+
+  savvy::reader query(args.query_path());
+  if (!query)
+  {
+    std::cerr << "Error: could not open query file (" << args.query_path() << ")\n";
+    return EXIT_FAILURE;
+  }
+
+  std::vector<std::string> query_ids = query.samples();
+  if (args.subset_ids().size())
+    query_ids = query.subset_samples(args.subset_ids());
+
+  if (args.reg())
+  {
+    panel.reset_bounds(*args.reg());
+    query.reset_bounds(*args.reg());
+  }
+
+  std::ofstream ofs(args.output_path(), std::ios::binary);
+  if (!ofs)
+  {
+    std::cerr << "Error: could not open output file (" << args.output_path() << ")\n";
+    return EXIT_FAILURE;
+  }
+
+  ofs << "#QUERY_ID\tQUERY_HAP\tPANEL_ID\tPANEL_HAP\tCHROM\tBEGIN\tEND\tN_MARKERS\n";
+
+  savvy::variant query_var;
+  std::vector<std::int8_t> panel_haps, query_haps;
+  std::unique_ptr<savvy::haplotype_matcher> matcher;
+  std::unique_ptr<match_writer> out;
+  std::vector<std::uint32_t> positions;
+  std::string chrom;
+  std::size_t panel_ploidy = 0, query_ploidy = 0;
+
+  auto flush_contig = [&]()
+  {
+    if (matcher)
+    {
+      matcher->finalize();
+      out->write(*matcher, chrom, positions);
+      matcher.reset();
+    }
+    positions.clear();
+  };
+
+  std::vector<std::pair<std::string, std::string>> contig_headers = panel.headers();
+  contig_headers.insert(contig_headers.end(), query.headers().begin(), query.headers().end());
+  savvy::marker_cursor<savvy::reader, savvy::variant> cursor(panel, contig_headers);
+  while (cursor.good() && query >> query_var)
+  {
+    if (!cursor.seek(query_var))
+      continue; // marker not in panel
+
+    savvy::variant& panel_var = cursor.record();
+    if (!panel_var.get_format(args.fmt_field(), panel_haps) || !query_var.get_format(args.fmt_field(), query_haps))
+    {
+      std::cerr << "Error: " << args.fmt_field() << " missing at " << query_var.chrom() << ":" << query_var.pos() << "\n";
+      return EXIT_FAILURE;
+    }
+
+    if (!matcher || chrom != query_var.chrom())
+    {
+      flush_contig();
+      if (panel.samples().empty() || query_ids.empty() || panel_haps.size() % panel.samples().size() || query_haps.size() % query_ids.size())
+      {
+        std::cerr << "Error: invalid " << args.fmt_field() << " vector size\n";
+        return EXIT_FAILURE;
+      }
+
+      panel_ploidy = panel_haps.size() / panel.samples().size();
+      query_ploidy = query_haps.size() / query_ids.size();
+      if (!out)
+        out = savvy::detail::make_unique<match_writer>(ofs, panel.samples(), query_ids, panel_ploidy, query_ploidy);
+      matcher = savvy::detail::make_unique<savvy::haplotype_matcher>(panel_haps.size(), query_haps.size(), args.mode(), args.min_length());
+      chrom = query_var.chrom();
+    }
+
+    positions.push_back(query_var.pos());
+    if (!matcher->add_marker(panel_haps, query_haps))
+    {
+      std::cerr << "Error: ploidy must be constant (" << query_var.chrom() << ":" << query_var.pos() << ")\n";
+      return EXIT_FAILURE;
+    }
+
+    if (args.mode() == savvy::haplotype_matcher::mode::set_maximal)
+      out->write(*matcher, chrom, positions);
+
+    cursor.next();
+  }
+
+  flush_contig();
+
+  return panel.bad() || query.bad() || !ofs ? EXIT_FAILURE : EXIT_SUCCESS;
+}
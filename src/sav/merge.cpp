@@ -4,55 +4,52 @@
  * file, You can obtain one at http://mozilla.org/MPL/2.0/.
  */
 
-#ifdef NEEDS_PORT_TO_SAV_V2
-#include <cmath>
 #include "sav/merge.hpp"
+#include "sav/export.hpp"
 #include "savvy/reader.hpp"
+#include "savvy/writer.hpp"
 #include "savvy/utility.hpp"
 
+#include <condition_variable>
 #include <cstdlib>
-#include <getopt.h>
-
-#include <fstream>
-#include <list>
 #include <deque>
+#include <getopt.h>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
-#include <set>
 
 class merge_prog_args
 {
 private:
   static const int default_compression_level = 3;
-  static const int default_block_size = 2048;
 
   std::vector<option> long_options_;
   std::vector<std::string> input_paths_;
-  std::string output_path_;
+  std::string output_path_ = "/dev/stdout";
   int compression_level_ = -1;
-  std::uint16_t block_size_ = default_block_size;
-  savvy::fmt format_ = savvy::fmt::gt;
+  std::size_t threads_ = 1;
   bool help_ = false;
-  std::uint32_t ploidy_ = 2;
 public:
   merge_prog_args() :
     long_options_(
       {
-        {"block-size", required_argument, 0, 'b'},
-        {"format", required_argument, 0, 'f'},
         {"help", no_argument, 0, 'h'},
         {"output", required_argument, 0, 'o'},
+        {"threads", required_argument, 0, 't'},
         {0, 0, 0, 0}
-      }),
-    output_path_("tmp.sav")
+      })
   {
   }
 
   const std::vector<std::string>& input_paths() const { return input_paths_; }
   const std::string& output_path() const { return output_path_; }
   std::uint8_t compression_level() const { return std::uint8_t(compression_level_); }
-  std::uint16_t block_size() const { return block_size_; }
-  savvy::fmt format() const { return format_; }
-  std::uint32_t ploidy() const { return ploidy_; }
+  std::size_t threads() const { return threads_; }
   bool help_is_set() const { return help_; }
 
   void print_usage(std::ostream& os)
@@ -60,10 +57,12 @@ public:
     os << "Usage: sav merge [opts ...] <input.{sav,vcf,vcf.gz,bcf}> <input2.{sav,vcf,vcf.gz,bcf}> [additional_input.{sav,vcf,vcf.gz,bcf} ...] \n";
     os << "\n";
     os << " -#                # compression level (1-19, default: " << default_compression_level << ")\n";
-    os << " -b, --block-size  Number of markers in compression block (0-65535, default: " << default_block_size << ")\n";
-    os << " -f, --format      Format field to copy (GT or HDS, default: GT)\n";
     os << " -h, --help        Print usage\n";
-    os << " -o, --output      Output file (default: stdout)\n";
+    os << " -o, --output      Output file (default: /dev/stdout)\n";
+    os << " -t, --threads     Number of threads used to decode inputs ahead of merging (default: 1, decodes on merging thread)\n";
+    os << "\n";
+    os << "Inputs must be sorted and have disjoint samples. Records are matched by position and alleles, and samples\n";
+    os << "of inputs lacking a record are set to missing.\n";
     os << std::flush;
   }
 
@@ -71,9 +70,8 @@ public:
   {
     int long_index = 0;
     int opt = 0;
-    while ((opt = getopt_long(argc, argv, "0123456789b:f:ho:", long_options_.data(), &long_index )) != -1)
+    while ((opt = getopt_long(argc, argv, "0123456789ho:t:", long_options_.data(), &long_index )) != -1)
     {
-      std::string str_opt_arg(optarg ? optarg : "");
       char copt = char(opt & 0xFF);
       switch (copt)
       {
@@ -92,25 +90,15 @@ public:
           compression_level_ *= 10;
           compression_level_ += copt - '0';
           break;
-        case 'b':
-          block_size_ = std::uint16_t(atoi(optarg) > 0xFFFF ? 0xFFFF : atoi(optarg));
-          break;
-        case 'f':
-          if (str_opt_arg == "HDS")
-          {
-            format_ = savvy::fmt::hds;
-          }
-          else if (str_opt_arg != "GT")
-          {
-            std::cerr << "Invalid format field value (" << str_opt_arg << ")\n";
-            return false;
-          }
-          break;
         case 'h':
           help_ = true;
           return true;
         case 'o':
-          output_path_ = std::string(optarg);
+          output_path_ = std::string(optarg ? optarg : "");
+          break;
+        case 't':
+          threads_ = std::size_t(std::max(1ll, std::atoll(optarg ? optarg : "")));
+          break;
         default:
           return false;
       }
@@ -132,7 +120,6 @@ public:
       }
     }
 
-
     if (compression_level_ < 0)
       compression_level_ = default_compression_level;
     else if (compression_level_ > 19)
@@ -142,251 +129,216 @@ public:
   }
 };
 
-template <std::size_t BitWidth, typename T, typename OutIt>
-void merge_serialize_alleles(const savvy::compressed_vector<T>& m, OutIt os_it, std::int64_t last_pos = 0)
-{
-  auto end = m.end();
-  for (auto it = m.begin(); it != end; ++it)
-  {
-    std::int8_t signed_allele = savvy::sav::detail::allele_encoder<BitWidth>::encode(*it);
-    if (signed_allele >= 0)
-    {
-      std::uint64_t dist = it.offset();
-      std::uint64_t offset = dist - last_pos;
-      last_pos = dist + 1;
-      savvy::prefixed_varint<BitWidth>::encode((std::uint8_t)(signed_allele), offset, os_it);
-    }
-  }
-
-}
-
-class sav_reader : public savvy::sav::reader_base
-{
-public:
-  using savvy::sav::reader_base::reader_base;
-  using savvy::sav::reader_base::read_variant_details;
-  using savvy::sav::reader_base::read_genotypes;
-};
+class merge_prefetch_pool;
 
-template <typename T>
-class compressed_vector_append_wrapper
+/**
+ * Buffers the records of one input in fixed-size batches. When a prefetch pool is used, the next batch is decoded by
+ * a worker thread while the current batch is being merged.
+ */
+class merge_input
 {
+  friend class merge_prefetch_pool;
 public:
-  typedef T value_type;
-  static const T const_value_type;
+  static const std::size_t batch_size = 256;
 
-  compressed_vector_append_wrapper(savvy::compressed_vector<T>& vec) :
-    vec_(vec),
-    offset_(vec.size())
+  merge_input(const std::string& file_path) :
+    rdr_(file_path),
+    front_(batch_size),
+    back_(batch_size)
   {
   }
 
-  void resize(std::size_t sz)
-  {
-    vec_.resize(offset_ + sz);
-  }
+  savvy::reader& reader() { return rdr_; }
+  const savvy::reader& reader() const { return rdr_; }
 
-  T& operator[](std::size_t pos)
-  {
-    return vec_[offset_ + pos];
-  }
+  /**
+   * Starts decoding the first batch.
+   * @param pool Prefetch pool or nullptr to decode on the calling thread
+   */
+  void start(merge_prefetch_pool* pool);
 
-  const T& operator[](std::size_t pos) const
+  /**
+   * Gets next unconsumed record.
+   * @return Pointer to record or nullptr at end of input
+   */
+  savvy::variant* peek()
   {
-    return vec_[offset_ + pos];
+    if (pos_ == front_size_ && !end_)
+      next_batch();
+    return pos_ < front_size_ ? &front_[pos_] : nullptr;
   }
 
-  std::size_t size() const
+  void pop() { ++pos_; }
+private:
+  void fill()
   {
-    return vec_.size() - offset_;
+    back_size_ = 0;
+    while (back_size_ < back_.size() && rdr_.read(back_[back_size_]))
+      ++back_size_;
   }
+
+  void next_batch();
 private:
-  savvy::compressed_vector<T>& vec_;
-  std::size_t offset_;
+  savvy::reader rdr_;
+  std::vector<savvy::variant> front_;
+  std::vector<savvy::variant> back_;
+  std::size_t front_size_ = 0;
+  std::size_t back_size_ = 0;
+  std::size_t pos_ = 0;
+  merge_prefetch_pool* pool_ = nullptr;
+  bool back_ready_ = false;
+  bool end_ = false;
 };
 
-int merge_main(int argc, char** argv)
+class merge_prefetch_pool
 {
-  merge_prog_args args;
-  if (!args.parse(argc, argv))
-  {
-    args.print_usage(std::cerr);
-    return EXIT_FAILURE;
-  }
-
-  if (args.help_is_set())
+public:
+  merge_prefetch_pool(std::size_t n_threads)
   {
-    args.print_usage(std::cout);
-    return EXIT_SUCCESS;
+    threads_.reserve(n_threads);
+    for (std::size_t i = 0; i < n_threads; ++i)
+      threads_.emplace_back(&merge_prefetch_pool::run, this);
   }
 
-  std::deque<savvy::sav::reader> input_files;
-  for (auto it = args.input_paths().begin(); it != args.input_paths().end(); ++it)
+  ~merge_prefetch_pool()
   {
-    input_files.emplace_back(*it, args.format());
-    if (!input_files.back().good())
     {
-      std::cerr << "Could not open file (" << input_files.back().file_path() << ")\n";
-      return EXIT_FAILURE;
+      std::unique_lock<std::mutex> lk(mtx_);
+      stop_ = true;
     }
+    task_cv_.notify_all();
+    for (auto it = threads_.begin(); it != threads_.end(); ++it)
+      it->join();
   }
 
-  std::size_t num_samples = 0;
-  std::vector<std::size_t> sample_offsets(input_files.size());
+  void submit(merge_input* in)
   {
-    auto ft = input_files.begin();
-    for (auto it = sample_offsets.begin(); it != sample_offsets.end(); ++it, ++ft)
     {
-      (*it) = num_samples;
-      num_samples += ft->samples().size();
+      std::unique_lock<std::mutex> lk(mtx_);
+      in->back_ready_ = false;
+      tasks_.push_back(in);
     }
+    task_cv_.notify_one();
   }
 
-
-  //std::vector<savvy::compressed_vector<float>> genos(args.input_paths().size()); //std::vector<savvy::compressed_vector<float>> genos(args.input_paths().size());
-  std::vector<float> output_genos(num_samples * args.ploidy());
-
-  std::vector<std::string> sample_ids;
-  sample_ids.reserve(num_samples);
-
-  std::vector<std::pair<std::string,std::string>> merged_headers;
-
-  std::set<std::string> info_fields;
-  std::set<std::string> unique_headers;
-
-  for (auto& f : input_files)
+  void wait(merge_input* in)
   {
-    for (auto it = f.samples().begin(); it != f.samples().end(); ++it)
-      sample_ids.emplace_back(*it);
-
-    //merged_headers.reserve(merged_headers.size() + (f.headers().end() - f.headers().begin()));
-    for (auto it = f.headers().begin(); it != f.headers().end(); ++it)
+    std::unique_lock<std::mutex> lk(mtx_);
+    done_cv_.wait(lk, [in]() { return in->back_ready_; });
+  }
+private:
+  void run()
+  {
+    std::unique_lock<std::mutex> lk(mtx_);
+    while (true)
     {
-      if ((it->first != "INFO" || info_fields.insert(savvy::parse_header_sub_field(it->second, "ID")).second) && unique_headers.insert(it->first + "=" + it->second).second)
-      {
-        merged_headers.push_back(*it);
-      }
+      task_cv_.wait(lk, [this]() { return stop_ || !tasks_.empty(); });
+      if (tasks_.empty())
+        break;
+
+      merge_input* in = tasks_.front();
+      tasks_.pop_front();
+      lk.unlock();
+      in->fill();
+      lk.lock();
+      in->back_ready_ = true;
+      done_cv_.notify_all();
     }
   }
+private:
+  std::mutex mtx_;
+  std::condition_variable task_cv_;
+  std::condition_variable done_cv_;
+  std::deque<merge_input*> tasks_;
+  std::vector<std::thread> threads_;
+  bool stop_ = false;
+};
 
+void merge_input::start(merge_prefetch_pool* pool)
+{
+  pool_ = pool;
+  if (pool_)
+    pool_->submit(this);
+}
 
-  if (info_fields.insert("FILTER").second)
-    merged_headers.insert(merged_headers.begin(), {"INFO","<ID=FILTER,Description=\"Variant filter\">"});
-  if (info_fields.insert("QUAL").second)
-    merged_headers.insert(merged_headers.begin(), {"INFO","<ID=QUAL,Description=\"Variant quality\">"});
-  if (info_fields.insert("ID").second)
-    merged_headers.insert(merged_headers.begin(), {"INFO","<ID=ID,Description=\"Variant ID\">"});
-
-  savvy::sav::writer::options opts;
-  opts.compression_level = args.compression_level();
-  opts.block_size = args.block_size();
-
-  savvy::sav::writer output(args.output_path(), opts, sample_ids.begin(), sample_ids.end(), merged_headers.begin(), merged_headers.end(), args.format());
-
-  std::vector<std::list<savvy::variant<std::vector<float>>>> variants(args.input_paths().size());
-
-
-  for (std::size_t i = 0; i < input_files.size(); ++i)
-  {
-    variants[i].emplace_back();
-    input_files[i] >> variants[i].back();
-    if (!input_files[i])
-      variants[i].pop_back();
-  }
+void merge_input::next_batch()
+{
+  if (pool_)
+    pool_->wait(this);
+  else
+    fill();
+
+  std::swap(front_, back_);
+  front_size_ = back_size_;
+  pos_ = 0;
+
+  // A short batch means the reader reached the end of the file or failed.
+  if (front_size_ < batch_size)
+    end_ = true;
+  else if (pool_)
+    pool_->submit(this);
+}
 
-  std::size_t min_pos_index = 0;
-  while (min_pos_index < input_files.size())
+/**
+ * Builds the merged header lines. Lines of the same key and ID (or identical lines for unstructured keys) are only
+ * included once.
+ * @param inputs Input files
+ * @param headers Destination header lines
+ * @return False if inputs have conflicting phasing status
+ */
+bool merge_headers(const std::deque<merge_input>& inputs, std::vector<std::pair<std::string, std::string>>& headers)
+{
+  std::unordered_set<std::string> unique_headers;
+  std::string phasing;
+  for (auto in = inputs.begin(); in != inputs.end(); ++in)
   {
-    min_pos_index = (std::size_t)-1;
-    savvy::site_info min_site;
-    for (std::size_t i = 0; i < input_files.size(); ++i)
+    for (auto it = in->reader().headers().begin(); it != in->reader().headers().end(); ++it)
     {
-      if (variants[i].size())
+      std::string unique_key;
+      if (it->first == "fileformat")
       {
-        if (min_site.chromosome().empty())
-        {
-          min_site = variants[i].front();
-          min_pos_index = i;
-        }
-        else
-        {
-          if (input_files[i].good() && min_site.chromosome() == variants[i].front().chromosome() && variants[i].front().position() < min_site.position())
-          {
-            min_site = variants[i].front();
-            min_pos_index = i;
-          }
-        }
+        unique_key = it->first;
       }
-    }
-
-    while (true)
-    {
-      std::size_t equal_cnt = 0;
-      for (std::size_t i = 0; i < input_files.size(); ++i)
+      else if (it->first == "phasing")
       {
-        if (input_files[i].good())
+        if (phasing.size() && phasing != it->second)
         {
-          if (variants[i].back().chromosome() == min_site.chromosome() &&
-            variants[i].back().position() == min_site.position())
-          {
-            ++equal_cnt;
-            variants[i].emplace_back();
-            input_files[i] >> variants[i].back();
-            if (!input_files[i])
-              variants[i].pop_back();
-          }
+          std::cerr << "Error: inputs have conflicting phasing status (" << phasing << " vs " << it->second << ")" << std::endl;
+          return false;
         }
+        phasing = it->second;
+        unique_key = it->first;
       }
-
-      if (equal_cnt == 0)
-        break;
-    }
-
-    output_genos.resize(0);
-    output_genos.resize(num_samples * args.ploidy());
-    for (std::size_t i = 0; i < input_files.size(); ++i)
-    {
-      for (auto v = variants[i].begin(); v != variants[i].end(); ++v)
+      else if (it->first == "INFO" || it->first == "FORMAT" || it->first == "FILTER" || it->first == "contig" || it->first == "ALT")
       {
-        if (v->chromosome() == min_site.chromosome() &&
-          v->position() == min_site.position() &&
-          v->ref() == min_site.ref() &&
-          v->alt() == min_site.alt())
-        {
-          for (std::size_t j = 0; j < v->data().size(); ++j)
-            output_genos[sample_offsets[i]* args.ploidy() + j] = v->data()[j];
-
-          if (i != min_pos_index)
-          {
-            auto end_it = input_files[i].info_fields().end();
-            for (auto it = input_files[i].info_fields().begin(); it != end_it; ++it)
-            {
-              min_site.prop(*it, v->prop(*it));
-            }
-          }
-
-          variants[i].erase(v);
-          if (variants[i].empty() && input_files[i].good())
-          {
-            variants[i].emplace_back();
-            input_files[i] >> variants[i].back();
-            if (!input_files[i])
-              variants[i].pop_back();
-          }
-          break;
-        }
+        unique_key = it->first + "=" + savvy::parse_header_sub_field(it->second, "ID");
+      }
+      else
+      {
+        unique_key = it->first + "=" + it->second;
       }
-    }
 
-    savvy::update_info_fields(min_site, output_genos, args.format());
-    output.write(min_site, output_genos);
+      if (unique_headers.insert(unique_key).second)
+        headers.emplace_back(*it);
+    }
   }
 
-  return output.good() ? EXIT_SUCCESS : EXIT_FAILURE;
+  return true;
 }
-#endif
 
-#ifdef MERGE_OLD
+class merge_site_key
+{
+public:
+  merge_site_key() = default;
+  merge_site_key(std::size_t contig_rank, std::uint32_t pos) : contig_rank_(contig_rank), pos_(pos) {}
+
+  bool operator<(const merge_site_key& other) const { return std::tie(contig_rank_, pos_) < std::tie(other.contig_rank_, other.pos_); }
+  bool operator==(const merge_site_key& other) const { return contig_rank_ == other.contig_rank_ && pos_ == other.pos_; }
+private:
+  std::size_t contig_rank_ = 0;
+  std::uint32_t pos_ = 0;
+};
+
 int merge_main(int argc, char** argv)
 {
   merge_prog_args args;
@@ -402,154 +354,195 @@ int merge_main(int argc, char** argv)
     return EXIT_SUCCESS;
   }
 
-  std::deque<sav_reader> input_files;
+  std::deque<merge_input> inputs;
   for (auto it = args.input_paths().begin(); it != args.input_paths().end(); ++it)
   {
-    input_files.emplace_back(*it, args.format());
-    if (!input_files.back().good())
+    inputs.emplace_back(*it);
+    if (!inputs.back().reader())
     {
-      std::cerr << "Could not open file (" << input_files.back().file_path() << ")\n";
+      std::cerr << "Error: could not open file (" << *it << ")" << std::endl;
       return EXIT_FAILURE;
     }
   }
-  std::vector<savvy::site_info> sites(args.input_paths().size());
-  //std::vector<savvy::compressed_vector<float>> genos(args.input_paths().size()); //std::vector<savvy::compressed_vector<float>> genos(args.input_paths().size());
-  savvy::compressed_vector<float> output_genos;
 
+  std::vector<std::string> sample_ids;
+  std::vector<std::size_t> sample_counts;
+  std::unordered_set<std::string> unique_sample_ids;
+  for (auto in = inputs.begin(); in != inputs.end(); ++in)
   {
-    std::size_t num_samples = 0;
-    for (auto& f : input_files)
-      num_samples += f.samples().size();
-    std::vector<std::string> sample_ids;
-    sample_ids.reserve(num_samples);
-
-    std::vector<std::pair<std::string,std::string>> merged_headers;
-
-    std::set<std::string> info_fields;
-
-    for (auto& f : input_files)
+    sample_counts.push_back(in->reader().samples().size());
+    for (auto it = in->reader().samples().begin(); it != in->reader().samples().end(); ++it)
     {
-      for (auto it = f.samples().begin(); it != f.samples().end(); ++it)
-        sample_ids.emplace_back(*it);
-
-      merged_headers.reserve(merged_headers.size() + (f.headers().end() - f.headers().begin()));
-      for (auto it = f.headers().begin(); it != f.headers().end(); ++it)
+      if (!unique_sample_ids.insert(*it).second)
       {
-        if (it->first != "INFO" || info_fields.insert(savvy::parse_header_sub_field(it->second, "ID")).second)
-        {
-          merged_headers.push_back(*it);
-        }
+        std::cerr << "Error: sample ID " << *it << " is present in multiple inputs" << std::endl;
+        return EXIT_FAILURE;
       }
+      sample_ids.push_back(*it);
     }
+  }
+
+  std::vector<std::pair<std::string, std::string>> headers;
+  if (!merge_headers(inputs, headers))
+    return EXIT_FAILURE;
+
+  // Contigs are ordered by the merged contig header lines. Contigs without header lines are ordered by first occurrence.
+  std::unordered_map<std::string, std::size_t> contig_ranks;
+  for (auto it = headers.begin(); it != headers.end(); ++it)
+  {
+    if (it->first == "contig")
+      contig_ranks.emplace(savvy::parse_header_sub_field(it->second, "ID"), contig_ranks.size());
+  }
 
+  auto site_key = [&contig_ranks](const savvy::site_info& s)
+  {
+    auto res = contig_ranks.emplace(s.chrom(), contig_ranks.size());
+    return merge_site_key(res.first->second, s.pos());
+  };
 
-    if (info_fields.insert("FILTER").second)
-      merged_headers.insert(merged_headers.begin(), {"INFO","<ID=FILTER,Description=\"Variant filter\">"});
-    if (info_fields.insert("QUAL").second)
-      merged_headers.insert(merged_headers.begin(), {"INFO","<ID=QUAL,Description=\"Variant quality\">"});
-    if (info_fields.insert("ID").second)
-      merged_headers.insert(merged_headers.begin(), {"INFO","<ID=ID,Description=\"Variant ID\">"});
+  savvy::writer output(args.output_path(), savvy::file::format::sav2, headers, sample_ids, args.compression_level());
+  if (!output)
+  {
+    std::cerr << "Error: could not open output file (" << args.output_path() << ")" << std::endl;
+    return EXIT_FAILURE;
+  }
 
-    savvy::sav::writer::options opts;
-    opts.compression_level = args.compression_level();
-    opts.block_size = args.block_size();
+  std::unique_ptr<merge_prefetch_pool> pool;
+  if (args.threads() > 1)
+    pool.reset(new merge_prefetch_pool(std::min(args.threads(), inputs.size())));
 
-    savvy::sav::writer output(args.output_path(), opts, sample_ids.begin(), sample_ids.end(), merged_headers.begin(), merged_headers.end(), args.format());
+  for (auto it = inputs.begin(); it != inputs.end(); ++it)
+    it->start(pool.get());
 
-    std::string current_chrom;
-    std::size_t min_pos_index = input_files.size();
-    std::uint64_t min_pos = std::numeric_limits<std::uint64_t>::max();
-    for (std::size_t i = 0; i < input_files.size(); ++i)
-    {
-      input_files[i].read_variant_details(sites[i]);
-      if (current_chrom.empty())
-        current_chrom = sites[i].chromosome();
+  std::vector<std::vector<savvy::variant>> site_records(inputs.size()); // Records of each input at current position
+  std::vector<std::vector<bool>> site_records_used(inputs.size());
+  std::vector<std::size_t> site_record_counts(inputs.size());
+  std::vector<merge_site_key> last_keys(inputs.size());
+  std::vector<savvy::variant*> matched(inputs.size());
+  std::vector<const savvy::typed_value*> srcs(inputs.size());
+  std::vector<std::string> format_keys;
+  std::vector<savvy::typed_value> merged_values;
 
-      if (input_files[i].good() && current_chrom == sites[i].chromosome() && sites[i].position() < min_pos)
+  while (output)
+  {
+    merge_site_key min_key;
+    bool found = false;
+    for (std::size_t i = 0; i < inputs.size(); ++i)
+    {
+      savvy::variant* rec = inputs[i].peek();
+      if (rec)
       {
-        min_pos = sites[i].position();
-        min_pos_index = i;
+        merge_site_key k = site_key(*rec);
+        if (k < last_keys[i])
+        {
+          std::cerr << "Error: input is not sorted (" << args.input_paths()[i] << ")" << std::endl;
+          return EXIT_FAILURE;
+        }
+        last_keys[i] = k;
+
+        if (!found || k < min_key)
+          min_key = k;
+        found = true;
       }
     }
 
-    while (min_pos_index < input_files.size())
+    if (!found)
+      break;
+
+    for (std::size_t i = 0; i < inputs.size(); ++i)
     {
-      std::vector<bool> matching(input_files.size(), false);
-      savvy::site_info merged_site = sites[min_pos_index];
-      for (std::size_t i = 0; i < input_files.size(); ++i)
+      site_record_counts[i] = 0;
+      savvy::variant* rec;
+      while ((rec = inputs[i].peek()) && site_key(*rec) == min_key)
       {
-        if (i == min_pos_index
-          || (input_files[i].good()
-          && sites[i].chromosome() == sites[min_pos_index].chromosome()
-          && sites[i].position() == sites[min_pos_index].position()
-          && sites[i].ref() == sites[min_pos_index].ref()
-          && sites[i].alt() == sites[min_pos_index].alt()))
-        {
-          matching[i] = true;
-          if (i != min_pos_index)
-          {
-            // TODO: merge props.
-          }
-        }
+        if (site_record_counts[i] == site_records[i].size())
+          site_records[i].emplace_back();
+        std::swap(site_records[i][site_record_counts[i]++], *rec);
+        inputs[i].pop();
       }
+      site_records_used[i].assign(site_record_counts[i], false);
+    }
 
-      output_genos.resize(0);
-      for (std::size_t i = 0; i < input_files.size(); ++i)
+    // Each distinct set of alleles at the current position becomes one output record, led by the first input that has it.
+    for (std::size_t lead_input = 0; lead_input < inputs.size(); ++lead_input)
+    {
+      for (std::size_t lead_idx = 0; lead_idx < site_record_counts[lead_input]; ++lead_idx)
       {
-        compressed_vector_append_wrapper<float> vec_wrapper(output_genos);
-        if (!matching[i])
-        {
-          vec_wrapper.resize(input_files[i].samples().size() * args.ploidy());
-        }
-        else
+        if (site_records_used[lead_input][lead_idx])
+          continue;
+
+        savvy::variant& lead = site_records[lead_input][lead_idx];
+        format_keys.clear();
+        for (std::size_t i = 0; i < inputs.size(); ++i)
         {
-          savvy::site_info tmp;
-          input_files[i].read_genotypes(tmp, vec_wrapper);
-          if (!input_files[i].good())
+          matched[i] = nullptr;
+          for (std::size_t j = 0; j < site_record_counts[i]; ++j)
           {
-            // TODO: Corrupt File
+            savvy::variant& rec = site_records[i][j];
+            if (!site_records_used[i][j] && rec.ref() == lead.ref() && rec.alts() == lead.alts())
+            {
+              site_records_used[i][j] = true;
+              matched[i] = &rec;
+              for (auto it = rec.format_fields().begin(); it != rec.format_fields().end(); ++it)
+              {
+                if (std::find(format_keys.begin(), format_keys.end(), it->first) == format_keys.end())
+                  format_keys.push_back(it->first);
+              }
+              break;
+            }
           }
         }
-      }
-
 
-      output.write(merged_site, output_genos);
-
-      min_pos_index = input_files.size();
-      min_pos = std::numeric_limits<std::uint64_t>::max();
-
-      for (int j = 0; j < 2 && min_pos_index == input_files.size(); ++j)
-      {
-        for (std::size_t i = 0; i < input_files.size(); ++i)
+        merged_values.resize(format_keys.size());
+        for (std::size_t k = 0; k < format_keys.size(); ++k)
         {
-          if (matching[i])
+          for (std::size_t i = 0; i < inputs.size(); ++i)
           {
-            input_files[i].read_variant_details(sites[i]);
-            matching[i] = false;
+            srcs[i] = nullptr;
+            if (matched[i])
+            {
+              auto res = std::find_if(matched[i]->format_fields().begin(), matched[i]->format_fields().end(), [&format_keys, k](const std::pair<std::string, savvy::typed_value>& f) { return f.first == format_keys[k]; });
+              if (res != matched[i]->format_fields().end())
+                srcs[i] = &res->second;
+            }
           }
 
-          if (input_files[i].good() && current_chrom == sites[i].chromosome() && sites[i].position() < min_pos)
+          if (!savvy::typed_value::concat_samples(srcs, sample_counts, merged_values[k]))
           {
-            min_pos = sites[i].position();
-            min_pos_index = i;
+            std::cerr << "Error: could not merge " << format_keys[k] << " values at " << lead.chrom() << ":" << lead.pos() << std::endl;
+            return EXIT_FAILURE;
           }
         }
 
-        if (min_pos_index == input_files.size())
+        for (std::size_t i = 0; i < inputs.size(); ++i)
         {
-          for (std::size_t i = 0; i < input_files.size(); ++i)
+          if (matched[i] && matched[i] != &lead)
           {
-            if (input_files[i].good())
+            for (auto it = matched[i]->info_fields().begin(); it != matched[i]->info_fields().end(); ++it)
             {
-              current_chrom = sites[i].chromosome();
-              break;
+              if (std::find_if(lead.info_fields().begin(), lead.info_fields().end(), [it](const std::pair<std::string, savvy::typed_value>& f) { return f.first == it->first; }) == lead.info_fields().end())
+                lead.set_info(it->first, it->second);
             }
           }
         }
+
+        for (std::size_t k = 0; k < format_keys.size(); ++k)
+          lead.set_format(format_keys[k], std::move(merged_values[k]));
+
+        update_standard_info_fields(lead);
+        output.write(lead);
       }
     }
   }
 
-  return EXIT_FAILURE;
+  for (std::size_t i = 0; i < inputs.size(); ++i)
+  {
+    if (inputs[i].reader().bad())
+    {
+      std::cerr << "Error: failed reading input (" << args.input_paths()[i] << ")" << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+
+  return output.good() ? EXIT_SUCCESS : EXIT_FAILURE;
 }
-#endif
\ No newline at end of file
@@ -0,0 +1,422 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#include "sav/sample_sort.hpp"
+#include "sav/utility.hpp"
+#include "savvy/reader.hpp"
+#include "savvy/writer.hpp"
+
+#include <getopt.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <numeric>
+#include <vector>
+
+class sample_sort_prog_args
+{
+private:
+  static const int default_compression_level = savvy::writer::default_compression_level;
+  static const int default_block_size = savvy::writer::default_block_size;
+
+  std::vector<option> long_options_;
+  std::unordered_set<std::string> pbwt_fields_;
+  std::string input_path_;
+  std::string output_path_;
+  std::string fmt_field_ = "GT";
+  std::string method_ = "alt-count";
+  int compression_level_ = -1;
+  std::uint16_t block_size_ = default_block_size;
+  std::size_t threads_ = 1;
+  bool help_ = false;
+public:
+  sample_sort_prog_args() :
+    long_options_(
+      {
+        {"block-size", required_argument, 0, 'b'},
+        {"field", required_argument, 0, 'f'},
+        {"help", no_argument, 0, 'h'},
+        {"method", required_argument, 0, 'm'},
+        {"pbwt-fields", required_argument, 0, '\x01'},
+        {"threads", required_argument, 0, 't'},
+        {0, 0, 0, 0}
+      })
+  {
+  }
+
+  const std::string& input_path() const { return input_path_; }
+  const std::string& output_path() const { return output_path_; }
+  const std::string& fmt_field() const { return fmt_field_; }
+  const std::string& method() const { return method_; }
+  const std::unordered_set<std::string>& pbwt_fields() const { return pbwt_fields_; }
+  std::uint8_t compression_level() const { return std::uint8_t(compression_level_); }
+  std::uint16_t block_size() const { return block_size_; }
+  std::size_t threads() const { return threads_; }
+  bool help_is_set() const { return help_; }
+
+  void print_usage(std::ostream& os)
+  {
+    os << "Usage: sav sample-sort [opts ...] <in.sav> <out.sav>\n";
+    os << "\n";
+    os << " -#                  Number (#) of compression level (1-19, default: " << default_compression_level << ")\n";
+    os << " -b, --block-size    Number of markers in SAV compression block (0-65535, default: " << default_block_size << ")\n";
+    os << " -f, --field         FORMAT field used to determine sample order (default: GT)\n";
+    os << " -h, --help          Print usage\n";
+    os << " -m, --method        Sample ordering method (alt-count or similarity, default: alt-count)\n";
+    os << "                       alt-count:  Sorts samples by descending number of alternate alleles\n";
+    os << "                       similarity: Groups samples whose haplotypes share alleles using the final PBWT ordering\n";
+    os << " -t, --threads       Number of threads used to compress output blocks (default: 1)\n";
+    os << "\n";
+    os << "     --pbwt-fields   Comma separated list of FORMAT fields for which to enable PBWT sorting\n";
+    os << std::flush;
+  }
+
+  bool parse(int argc, char** argv)
+  {
+    int long_index = 0;
+    int opt = 0;
+    while ((opt = getopt_long(argc, argv, "0123456789b:f:hm:t:", long_options_.data(), &long_index )) != -1)
+    {
+      char copt = char(opt & 0xFF);
+      switch (copt)
+      {
+      case '\x01':
+        if (strcmp(long_options_[long_index].name, "pbwt-fields") == 0)
+        {
+          pbwt_fields_ = split_string_to_set(optarg, ',');
+          break;
+        }
+        return false;
+      case '0':
+      case '1':
+      case '2':
+      case '3':
+      case '4':
+      case '5':
+      case '6':
+      case '7':
+      case '8':
+      case '9':
+        if (compression_level_ < 0)
+          compression_level_ = 0;
+        compression_level_ *= 10;
+        compression_level_ += copt - '0';
+        break;
+      case 'b':
+        block_size_ = std::uint16_t(std::atoi(optarg) > 0xFFFF ? 0xFFFF : std::atoi(optarg));
+        break;
+      case 'f':
+        fmt_field_ = std::string(optarg ? optarg : "");
+        break;
+      case 'h':
+        help_ = true;
+        return true;
+      case 'm':
+        method_ = std::string(optarg ? optarg : "");
+        if (method_ != "alt-count" && method_ != "similarity")
+        {
+          std::cerr << "Invalid --method (" << method_ << ")\n";
+          return false;
+        }
+        break;
+      case 't':
+        threads_ = std::size_t(std::max(1ll, std::atoll(optarg ? optarg : "")));
+        break;
+      default:
+        return false;
+      }
+    }
+
+    int remaining_arg_count = argc - optind;
+
+    if (remaining_arg_count < 2)
+    {
+      std::cerr << "Too few arguments\n";
+      return false;
+    }
+    else if (remaining_arg_count > 2)
+    {
+      std::cerr << "Too many arguments\n";
+      return false;
+    }
+
+    input_path_ = argv[optind];
+    output_path_ = argv[optind + 1];
+
+    if (input_path_ == "/dev/stdin" || input_path_ == "/dev/fd/0")
+    {
+      std::cerr << "Input file cannot be stdin since it is read twice\n";
+      return false;
+    }
+
+    if (compression_level_ < 0)
+      compression_level_ = default_compression_level;
+    else if (compression_level_ > 19)
+      compression_level_ = 19;
+
+    return true;
+  }
+};
+
+/**
+ * Determines whether a haplotype value is treated as an alternate allele when building the PBWT. GT values are allele
+ * indices, while dosage fields (e.g., HDS) count as alternate at 0.5 or above.
+ */
+static bool is_alt_value(float v, bool is_gt)
+{
+  return !std::isnan(v) && (is_gt ? v > 0.f : v >= 0.5f);
+}
+
+/**
+ * Orders samples by descending alternate allele count (or dosage sum for non-GT fields) so that carriers of rare
+ * variants are clustered at low offsets. Ties keep their original order.
+ * @param rdr Reader positioned at first record
+ * @param args Program arguments
+ * @param order Destination for original sample indices in new order
+ * @return False on read failure
+ */
+static bool alt_count_order(savvy::reader& rdr, const sample_sort_prog_args& args, std::vector<std::size_t>& order)
+{
+  const std::size_t n_samples = rdr.samples().size();
+  const bool is_gt = args.fmt_field() == "GT";
+  std::vector<double> weights(n_samples, 0.);
+
+  savvy::variant rec;
+  savvy::compressed_vector<float> vec;
+  while (rdr.read(rec))
+  {
+    if (!rec.get_format(args.fmt_field(), vec) || vec.size() % n_samples)
+      continue;
+
+    std::size_t stride = vec.size() / n_samples;
+    for (auto it = vec.begin(); it != vec.end(); ++it)
+    {
+      if (!std::isnan(*it) && *it > 0.f)
+        weights[it.offset() / stride] += is_gt ? 1. : *it;
+    }
+  }
+
+  if (rdr.bad())
+    return false;
+
+  order.resize(n_samples);
+  std::iota(order.begin(), order.end(), 0);
+  std::stable_sort(order.begin(), order.end(), [&weights](std::size_t a, std::size_t b) { return weights[a] > weights[b]; });
+  return true;
+}
+
+/**
+ * Runs the positional PBWT over haplotypes of all records and orders samples by the first occurrence of any of their
+ * haplotypes in the final prefix array, which places samples with matching haplotype suffixes next to each other.
+ * @param rdr Reader positioned at first record
+ * @param args Program arguments
+ * @param order Destination for original sample indices in new order
+ * @return False on read failure or when haplotype count changes between records
+ */
+static bool similarity_order(savvy::reader& rdr, const sample_sort_prog_args& args, std::vector<std::size_t>& order)
+{
+  const std::size_t n_samples = rdr.samples().size();
+  const bool is_gt = args.fmt_field() == "GT";
+  std::vector<std::size_t> prefix;
+  std::vector<std::size_t> alt_prefix;
+  std::vector<char> is_alt;
+
+  savvy::variant rec;
+  savvy::compressed_vector<float> vec;
+  while (rdr.read(rec))
+  {
+    if (!rec.get_format(args.fmt_field(), vec) || vec.size() % n_samples)
+      continue;
+
+    if (prefix.empty())
+    {
+      prefix.resize(vec.size());
+      std::iota(prefix.begin(), prefix.end(), 0);
+      is_alt.resize(vec.size(), 0);
+    }
+    else if (prefix.size() != vec.size())
+    {
+      std::cerr << "Error: haplotype count of " << args.fmt_field() << " changes at " << rec.chromosome() << ":" << rec.position() << std::endl;
+      return false;
+    }
+
+    std::size_t alt_cnt = 0;
+    for (auto it = vec.begin(); it != vec.end(); ++it)
+    {
+      if (is_alt_value(*it, is_gt))
+      {
+        is_alt[it.offset()] = 1;
+        ++alt_cnt;
+      }
+    }
+
+    if (alt_cnt == 0)
+      continue; // Record does not change the prefix array.
+
+    // Stable partition of prefix array into reference then alternate haplotypes.
+    alt_prefix.clear();
+    std::size_t ref_end = 0;
+    for (std::size_t i = 0; i < prefix.size(); ++i)
+    {
+      if (is_alt[prefix[i]])
+        alt_prefix.push_back(prefix[i]);
+      else
+        prefix[ref_end++] = prefix[i];
+    }
+    std::copy(alt_prefix.begin(), alt_prefix.end(), prefix.begin() + ref_end);
+
+    for (auto it = vec.begin(); it != vec.end(); ++it)
+      is_alt[it.offset()] = 0;
+  }
+
+  if (rdr.bad())
+    return false;
+
+  order.clear();
+  order.reserve(n_samples);
+  if (prefix.empty())
+  {
+    order.resize(n_samples);
+    std::iota(order.begin(), order.end(), 0);
+    return true;
+  }
+
+  std::size_t stride = prefix.size() / n_samples;
+  std::vector<char> placed(n_samples, 0);
+  for (auto it = prefix.begin(); it != prefix.end(); ++it)
+  {
+    std::size_t sample = *it / stride;
+    if (!placed[sample])
+    {
+      placed[sample] = 1;
+      order.push_back(sample);
+    }
+  }
+  return true;
+}
+
+static bool file_size(const std::string& path, std::int64_t& sz)
+{
+  struct stat st;
+  if (::stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode))
+    return false;
+  sz = st.st_size;
+  return true;
+}
+
+int sample_sort_main(int argc, char** argv)
+{
+  sample_sort_prog_args args;
+  if (!args.parse(argc, argv))
+  {
+    args.print_usage(std::cerr);
+    return EXIT_FAILURE;
+  }
+
+  if (args.help_is_set())
+  {
+    args.print_usage(std::cout);
+    return EXIT_SUCCESS;
+  }
+
+  std::vector<std::size_t> order;
+  std::vector<std::pair<std::string, std::string>> headers;
+  std::vector<std::string> sample_ids;
+  {
+    savvy::reader rdr(args.input_path());
+    if (!rdr)
+    {
+      std::cerr << "Error: failed to open input file" << std::endl;
+      return EXIT_FAILURE;
+    }
+
+    if (rdr.samples().empty())
+    {
+      std::cerr << "Error: input file has no samples" << std::endl;
+      return EXIT_FAILURE;
+    }
+
+    headers = rdr.headers();
+    sample_ids = rdr.samples();
+
+    bool success = args.method() == "similarity" ? similarity_order(rdr, args, order) : alt_count_order(rdr, args, order);
+    if (!success)
+    {
+      if (rdr.bad())
+        std::cerr << "Error: read failure" << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+
+  std::vector<std::size_t> new_index(order.size());
+  std::vector<std::string> sorted_ids(order.size());
+  for (std::size_t i = 0; i < order.size(); ++i)
+  {
+    new_index[order[i]] = i;
+    sorted_ids[i] = sample_ids[order[i]];
+  }
+
+  {
+    savvy::reader rdr(args.input_path());
+    if (!rdr)
+    {
+      std::cerr << "Error: failed to open input file" << std::endl;
+      return EXIT_FAILURE;
+    }
+
+    savvy::writer wrt(args.output_path(), savvy::file::format::sav2, headers, sorted_ids, args.compression_level());
+    wrt.set_block_size(args.block_size());
+    wrt.set_pbwt(args.pbwt_fields());
+    if (args.threads() > 1)
+      wrt.set_compression_threads(args.threads());
+
+    savvy::variant rec;
+    savvy::typed_value sorted_value;
+    std::vector<std::string> keys;
+    while (wrt && rdr.read(rec))
+    {
+      keys.clear();
+      for (auto it = rec.format_fields().begin(); it != rec.format_fields().end(); ++it)
+        keys.push_back(it->first);
+
+      for (std::size_t i = 0; i < keys.size(); ++i)
+      {
+        if (!rec.format_fields()[i].second.copy_subset(sorted_value, new_index, new_index.size()))
+        {
+          std::cerr << "Error: could not reorder " << keys[i] << " at " << rec.chromosome() << ":" << rec.position() << std::endl;
+          return EXIT_FAILURE;
+        }
+        rec.set_format(keys[i], std::move(sorted_value));
+      }
+
+      wrt << rec;
+    }
+
+    if (rdr.bad())
+    {
+      std::cerr << "Error: read failure" << std::endl;
+      return EXIT_FAILURE;
+    }
+
+    if (!wrt.good())
+    {
+      std::cerr << "Error: write failure" << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+
+  std::int64_t in_size = 0, out_size = 0;
+  if (file_size(args.input_path(), in_size) && file_size(args.output_path(), out_size) && in_size > 0)
+  {
+    std::cerr << "Input size: " << in_size << " bytes\n";
+    std::cerr << "Output size: " << out_size << " bytes (" << std::showpos << (100. * (out_size - in_size) / in_size) << std::noshowpos << "%)" << std::endl;
+  }
+
+  return EXIT_SUCCESS;
+}
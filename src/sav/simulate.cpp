@@ -0,0 +1,702 @@
+/*
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#include "sav/simulate.hpp"
+#include "sav/utility.hpp"
+#include "savvy/savvy.hpp"
+#include "savvy/writer.hpp"
+
+#include <getopt.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <thread>
+#include <vector>
+
+class simulate_prog_args
+{
+private:
+  static const int default_compression_level = savvy::writer::default_compression_level;
+  static const int default_block_size = savvy::writer::default_block_size;
+
+  std::vector<option> long_options_;
+  std::unordered_set<std::string> fields_ = {"GT"};
+  std::unordered_set<std::string> pbwt_fields_;
+  std::string output_path_ = "/dev/stdout";
+  std::string file_format_;
+  std::string chromosome_ = "1";
+  std::string af_spectrum_ = "neutral";
+  std::string phasing_ = "full";
+  double missing_rate_ = 0.;
+  double dosage_noise_ = 0.;
+  double ld_noise_ = 0.001;
+  std::uint64_t n_samples_ = 1000;
+  std::uint64_t n_variants_ = 10000;
+  std::uint64_t ld_block_size_ = 0;
+  std::uint64_t seed_ = 1;
+  std::uint32_t spacing_ = 100;
+  std::size_t ploidy_ = 2;
+  std::size_t n_founders_ = 32;
+  std::size_t threads_ = 1;
+  int compression_level_ = -1;
+  std::uint16_t block_size_ = default_block_size;
+  bool help_ = false;
+public:
+  simulate_prog_args() :
+    long_options_(
+      {
+        {"af-spectrum", required_argument, 0, '\x01'},
+        {"block-size", required_argument, 0, 'b'},
+        {"chromosome", required_argument, 0, 'c'},
+        {"dosage-noise", required_argument, 0, '\x01'},
+        {"fields", required_argument, 0, 'f'},
+        {"founders", required_argument, 0, '\x01'},
+        {"help", no_argument, 0, 'h'},
+        {"ld-block-size", required_argument, 0, 'l'},
+        {"ld-noise", required_argument, 0, '\x01'},
+        {"missing-rate", required_argument, 0, 'm'},
+        {"output-format", required_argument, 0, 'O'},
+        {"pbwt-fields", required_argument, 0, '\x01'},
+        {"phasing", required_argument, 0, '\x01'},
+        {"ploidy", required_argument, 0, 'p'},
+        {"samples", required_argument, 0, 's'},
+        {"seed", required_argument, 0, '\x01'},
+        {"spacing", required_argument, 0, '\x01'},
+        {"threads", required_argument, 0, 't'},
+        {"variants", required_argument, 0, 'n'},
+        {0, 0, 0, 0}
+      })
+  {
+  }
+
+  const std::unordered_set<std::string>& fields() const { return fields_; }
+  const std::unordered_set<std::string>& pbwt_fields() const { return pbwt_fields_; }
+  const std::string& output_path() const { return output_path_; }
+  const std::string& file_format() const { return file_format_; }
+  const std::string& chromosome() const { return chromosome_; }
+  const std::string& af_spectrum() const { return af_spectrum_; }
+  const std::string& phasing() const { return phasing_; }
+  double missing_rate() const { return missing_rate_; }
+  double dosage_noise() const { return dosage_noise_; }
+  double ld_noise() const { return ld_noise_; }
+  std::uint64_t n_samples() const { return n_samples_; }
+  std::uint64_t n_variants() const { return n_variants_; }
+  std::uint64_t ld_block_size() const { return ld_block_size_; }
+  std::uint64_t seed() const { return seed_; }
+  std::uint32_t spacing() const { return spacing_; }
+  std::size_t ploidy() const { return ploidy_; }
+  std::size_t n_founders() const { return n_founders_; }
+  std::size_t threads() const { return threads_; }
+  std::uint8_t compression_level() const { return std::uint8_t(compression_level_); }
+  std::uint16_t block_size() const { return block_size_; }
+  bool help_is_set() const { return help_; }
+
+  void print_usage(std::ostream& os)
+  {
+    os << "Usage: sav simulate [opts ...] [out.{sav,bcf,vcf,vcf.gz}]\n";
+    os << "\n";
+    os << " -#                     Number (#) of compression level (1-19, default: " << default_compression_level << ")\n";
+    os << " -b, --block-size       Number of markers in SAV compression block (0-65535, default: " << default_block_size << ")\n";
+    os << " -c, --chromosome       Chromosome name of simulated records (default: 1)\n";
+    os << " -f, --fields           Comma separated list of FORMAT fields to generate (GT, HDS, DS and/or GP, default: GT)\n";
+    os << " -h, --help             Print usage\n";
+    os << " -l, --ld-block-size    Number of consecutive variants whose haplotypes are copied from a shared set of founder haplotypes (default: 0, no LD)\n";
+    os << " -m, --missing-rate     Probability that a sample's genotype is missing (default: 0)\n";
+    os << " -n, --variants         Number of variants (default: 10000)\n";
+    os << " -O, --output-format    Output file format (sav, bcf, vcf or vcf.gz, default: sav)\n";
+    os << " -p, --ploidy           Number of haplotypes per sample (default: 2)\n";
+    os << " -s, --samples          Number of samples (default: 1000)\n";
+    os << " -t, --threads          Number of threads used to generate and compress records (default: 1)\n";
+    os << "\n";
+    os << "     --af-spectrum      Allele frequency distribution (neutral or uniform, default: neutral)\n";
+    os << "                          neutral: density proportional to 1/AF between 1/haplotypes and 0.5\n";
+    os << "                          uniform: uniform between 1/haplotypes and 0.5\n";
+    os << "     --dosage-noise     Maximum deviation of HDS values from true alleles, which makes dosage fields dense (default: 0)\n";
+    os << "     --founders         Number of founder haplotypes per LD block (default: 32)\n";
+    os << "     --ld-noise         Probability that an allele differs from its founder haplotype (default: 0.001)\n";
+    os << "     --pbwt-fields      Comma separated list of FORMAT fields for which to enable PBWT sorting (these fields are stored dense)\n";
+    os << "     --phasing          Phasing status of genotypes (full or none, default: full)\n";
+    os << "     --seed             Seed of random number generator (default: 1)\n";
+    os << "     --spacing          Average distance in base pairs between variants (default: 100)\n";
+    os << std::flush;
+  }
+
+  bool parse(int argc, char** argv)
+  {
+    int long_index = 0;
+    int opt = 0;
+    while ((opt = getopt_long(argc, argv, "0123456789b:c:f:hl:m:n:O:p:s:t:", long_options_.data(), &long_index )) != -1)
+    {
+      char copt = char(opt & 0xFF);
+      switch (copt)
+      {
+      case '\x01':
+      {
+        std::string str_opt_arg(optarg ? optarg : "");
+        if (strcmp(long_options_[long_index].name, "af-spectrum") == 0)
+        {
+          if (str_opt_arg != "neutral" && str_opt_arg != "uniform")
+          {
+            std::cerr << "Invalid --af-spectrum (" << str_opt_arg << ")\n";
+            return false;
+          }
+          af_spectrum_ = str_opt_arg;
+        }
+        else if (strcmp(long_options_[long_index].name, "dosage-noise") == 0)
+        {
+          dosage_noise_ = std::min(0.5, std::max(0., std::atof(str_opt_arg.c_str())));
+        }
+        else if (strcmp(long_options_[long_index].name, "founders") == 0)
+        {
+          n_founders_ = std::size_t(std::max(1ll, std::atoll(str_opt_arg.c_str())));
+        }
+        else if (strcmp(long_options_[long_index].name, "ld-noise") == 0)
+        {
+          ld_noise_ = std::min(1., std::max(0., std::atof(str_opt_arg.c_str())));
+        }
+        else if (strcmp(long_options_[long_index].name, "pbwt-fields") == 0)
+        {
+          pbwt_fields_ = split_string_to_set(str_opt_arg.c_str(), ',');
+        }
+        else if (strcmp(long_options_[long_index].name, "phasing") == 0)
+        {
+          if (str_opt_arg != "full" && str_opt_arg != "none")
+          {
+            std::cerr << "Invalid --phasing (" << str_opt_arg << ")\n";
+            return false;
+          }
+          phasing_ = str_opt_arg;
+        }
+        else if (strcmp(long_options_[long_index].name, "seed") == 0)
+        {
+          seed_ = std::strtoull(str_opt_arg.c_str(), nullptr, 10);
+        }
+        else if (strcmp(long_options_[long_index].name, "spacing") == 0)
+        {
+          spacing_ = std::uint32_t(std::max(1ll, std::atoll(str_opt_arg.c_str())));
+        }
+        else
+        {
+          return false;
+        }
+        break;
+      }
+      case '0':
+      case '1':
+      case '2':
+      case '3':
+      case '4':
+      case '5':
+      case '6':
+      case '7':
+      case '8':
+      case '9':
+        if (compression_level_ < 0)
+          compression_level_ = 0;
+        compression_level_ *= 10;
+        compression_level_ += copt - '0';
+        break;
+      case 'b':
+        block_size_ = std::uint16_t(std::atoi(optarg) > 0xFFFF ? 0xFFFF : std::atoi(optarg));
+        break;
+      case 'c':
+        chromosome_ = optarg ? optarg : "";
+        break;
+      case 'f':
+        fields_ = split_string_to_set(optarg ? optarg : "", ',');
+        for (auto it = fields_.begin(); it != fields_.end(); ++it)
+        {
+          if (*it != "GT" && *it != "HDS" && *it != "DS" && *it != "GP")
+          {
+            std::cerr << "Invalid FORMAT field (" << *it << ")\n";
+            return false;
+          }
+        }
+        break;
+      case 'h':
+        help_ = true;
+        return true;
+      case 'l':
+        ld_block_size_ = std::uint64_t(std::max(0ll, std::atoll(optarg ? optarg : "")));
+        break;
+      case 'm':
+        missing_rate_ = std::min(1., std::max(0., std::atof(optarg ? optarg : "")));
+        break;
+      case 'n':
+        n_variants_ = std::uint64_t(std::max(0ll, std::atoll(optarg ? optarg : "")));
+        break;
+      case 'O':
+      {
+        std::string str_opt_arg(optarg ? optarg : "");
+        if (str_opt_arg == "sav" || str_opt_arg == "bcf" || str_opt_arg == "vcf" || str_opt_arg == "vcf.gz")
+        {
+          file_format_ = str_opt_arg;
+        }
+        else
+        {
+          std::cerr << "Invalid file format value (" << str_opt_arg << ")\n";
+          return false;
+        }
+        break;
+      }
+      case 'p':
+        ploidy_ = std::size_t(std::max(1ll, std::atoll(optarg ? optarg : "")));
+        break;
+      case 's':
+        n_samples_ = std::uint64_t(std::max(1ll, std::atoll(optarg ? optarg : "")));
+        break;
+      case 't':
+        threads_ = std::size_t(std::max(1ll, std::atoll(optarg ? optarg : "")));
+        break;
+      default:
+        return false;
+      }
+    }
+
+    int remaining_arg_count = argc - optind;
+
+    if (remaining_arg_count == 1)
+    {
+      output_path_ = argv[optind];
+      if (file_format_.empty())
+      {
+        if (::savvy::detail::has_extension(output_path_, ".bcf"))
+          file_format_ = "bcf";
+        else if (::savvy::detail::has_extension(output_path_, ".vcf"))
+          file_format_ = "vcf";
+        else if (::savvy::detail::has_extension(output_path_, ".vcf.gz"))
+          file_format_ = "vcf.gz";
+      }
+    }
+    else if (remaining_arg_count > 1)
+    {
+      std::cerr << "Too many arguments\n";
+      return false;
+    }
+
+    if (file_format_.empty())
+      file_format_ = "sav";
+
+    if ((n_variants_ + 1) * spacing_ > std::numeric_limits<std::uint32_t>::max())
+    {
+      std::cerr << "Positions of simulated variants exceed 32-bit range (reduce --spacing or split into multiple chromosomes with --chromosome)\n";
+      return false;
+    }
+
+    if (fields_.empty())
+    {
+      std::cerr << "At least one FORMAT field must be generated\n";
+      return false;
+    }
+
+    if (compression_level_ < 0)
+    {
+      if (file_format_ == "vcf")
+        compression_level_ = 0;
+      else
+        compression_level_ = default_compression_level;
+    }
+    else if (compression_level_ > 19)
+    {
+      compression_level_ = 19;
+    }
+
+    return true;
+  }
+};
+
+/**
+ * Generates records independently of each other so that output does not depend on thread count. Each record is drawn
+ * from a generator seeded with the record index, and haplotype-to-founder assignments of LD blocks are drawn from a
+ * generator seeded with the block index.
+ */
+class record_simulator
+{
+private:
+  const simulate_prog_args& args_;
+  const std::size_t n_haps_;
+  const double min_af_;
+  std::uint64_t current_block_ = std::numeric_limits<std::uint64_t>::max();
+  std::vector<std::uint32_t> founder_of_;
+  std::vector<char> founder_alt_;
+  std::vector<char> hap_alt_;
+  std::vector<std::size_t> alt_offsets_;
+  std::vector<std::pair<std::size_t, std::int8_t>> entries_; // Sorted non-zero haplotype values (alternate or missing)
+  savvy::compressed_vector<std::int8_t> sparse_gt_;
+  savvy::compressed_vector<float> sparse_hds_;
+  savvy::compressed_vector<float> sparse_ds_;
+  std::vector<std::int8_t> dense_gt_;
+  std::vector<float> dosages_;
+  std::vector<float> ds_;
+  std::vector<float> gp_;
+public:
+  record_simulator(const simulate_prog_args& args) :
+    args_(args),
+    n_haps_(args.n_samples() * args.ploidy()),
+    min_af_(std::min(0.5, 1. / double(args.n_samples() * args.ploidy())))
+  {
+  }
+
+  /**
+   * Generates record.
+   * @param idx Zero-based index of record within output
+   * @param rec Destination record
+   */
+  void simulate(std::uint64_t idx, savvy::variant& rec)
+  {
+    std::seed_seq seq({std::uint32_t(args_.seed()), std::uint32_t(args_.seed() >> 32u), std::uint32_t(idx), std::uint32_t(idx >> 32u), 0u});
+    std::mt19937_64 rng(seq);
+    std::uniform_real_distribution<double> unif(0., 1.);
+
+    static const char* nucleotides = "ACGT";
+    std::uniform_int_distribution<int> nuc(0, 3);
+    int ref = nuc(rng);
+    int alt = (ref + 1 + nuc(rng) % 3) % 4;
+    std::uint32_t pos = std::uint32_t(idx * args_.spacing() + 1 + std::uniform_int_distribution<std::uint32_t>(0, args_.spacing() - 1)(rng));
+
+    double af = args_.af_spectrum() == "uniform" ?
+      min_af_ + unif(rng) * (0.5 - min_af_) :
+      std::exp(unif(rng) * std::log(0.5 / min_af_)) * min_af_;
+
+    if (args_.ld_block_size() && af * args_.n_founders() >= 1.)
+      draw_ld_alleles(idx / args_.ld_block_size(), af, rng);
+    else
+      draw_independent_alleles(af, rng);
+
+    add_missing(rng);
+
+    std::int64_t ac = 0, an = std::int64_t(n_haps_);
+    for (auto it = entries_.begin(); it != entries_.end(); ++it)
+    {
+      if (it->second == 1)
+        ++ac;
+      else
+        --an;
+    }
+
+    rec = savvy::variant(args_.chromosome(), pos, std::string(1, nucleotides[ref]), {std::string(1, nucleotides[alt])});
+    rec.set_info("AC", std::int32_t(ac));
+    rec.set_info("AN", std::int32_t(an));
+    if (an > 0)
+      rec.set_info("AF", float(double(ac) / double(an)));
+
+    if (args_.fields().count("GT"))
+      set_gt(rec);
+
+    if (args_.fields().count("HDS") || args_.fields().count("DS") || args_.fields().count("GP"))
+      set_dosage_fields(rec, rng);
+  }
+private:
+  void init_block(std::uint64_t block)
+  {
+    if (block == current_block_)
+      return;
+    current_block_ = block;
+
+    std::seed_seq seq({std::uint32_t(args_.seed()), std::uint32_t(args_.seed() >> 32u), std::uint32_t(block), std::uint32_t(block >> 32u), 1u});
+    std::mt19937_64 rng(seq);
+    std::uniform_int_distribution<std::uint32_t> founder_dist(0, std::uint32_t(args_.n_founders() - 1));
+    founder_of_.resize(n_haps_);
+    for (auto it = founder_of_.begin(); it != founder_of_.end(); ++it)
+      *it = founder_dist(rng);
+  }
+
+  void draw_independent_alleles(double af, std::mt19937_64& rng)
+  {
+    alt_offsets_.clear();
+    std::geometric_distribution<std::uint64_t> skip(af);
+    for (std::uint64_t off = skip(rng); off < n_haps_; off += skip(rng) + 1)
+      alt_offsets_.push_back(off);
+  }
+
+  void draw_ld_alleles(std::uint64_t block, double af, std::mt19937_64& rng)
+  {
+    init_block(block);
+
+    std::bernoulli_distribution founder_dist(af);
+    founder_alt_.resize(args_.n_founders());
+    for (auto it = founder_alt_.begin(); it != founder_alt_.end(); ++it)
+      *it = founder_dist(rng);
+
+    hap_alt_.resize(n_haps_);
+    for (std::size_t i = 0; i < n_haps_; ++i)
+      hap_alt_[i] = founder_alt_[founder_of_[i]];
+
+    if (args_.ld_noise() > 0.)
+    {
+      std::geometric_distribution<std::uint64_t> skip(args_.ld_noise());
+      for (std::uint64_t off = skip(rng); off < n_haps_; off += skip(rng) + 1)
+        hap_alt_[off] = !hap_alt_[off];
+    }
+
+    alt_offsets_.clear();
+    for (std::size_t i = 0; i < n_haps_; ++i)
+    {
+      if (hap_alt_[i])
+        alt_offsets_.push_back(i);
+    }
+  }
+
+  /**
+   * Merges alternate alleles with missing samples into entries_.
+   */
+  void add_missing(std::mt19937_64& rng)
+  {
+    entries_.clear();
+    const std::size_t ploidy = args_.ploidy();
+    auto alt_it = alt_offsets_.begin();
+    if (args_.missing_rate() > 0.)
+    {
+      std::geometric_distribution<std::uint64_t> skip(args_.missing_rate());
+      for (std::uint64_t s = skip(rng); s < args_.n_samples(); s += skip(rng) + 1)
+      {
+        for ( ; alt_it != alt_offsets_.end() && *alt_it < s * ploidy; ++alt_it)
+          entries_.emplace_back(*alt_it, 1);
+        for (std::size_t j = 0; j < ploidy; ++j)
+          entries_.emplace_back(s * ploidy + j, savvy::typed_value::missing_value<std::int8_t>());
+        while (alt_it != alt_offsets_.end() && *alt_it < (s + 1) * ploidy)
+          ++alt_it;
+      }
+    }
+
+    for ( ; alt_it != alt_offsets_.end(); ++alt_it)
+      entries_.emplace_back(*alt_it, 1);
+  }
+
+  void set_gt(savvy::variant& rec)
+  {
+    if (args_.pbwt_fields().count("GT"))
+    {
+      dense_gt_.assign(n_haps_, 0);
+      for (auto it = entries_.begin(); it != entries_.end(); ++it)
+        dense_gt_[it->first] = it->second;
+      rec.set_format("GT", dense_gt_);
+    }
+    else
+    {
+      sparse_gt_.clear();
+      sparse_gt_.resize(n_haps_);
+      for (auto it = entries_.begin(); it != entries_.end(); ++it)
+        sparse_gt_[it->first] = it->second;
+      rec.set_format("GT", sparse_gt_);
+    }
+  }
+
+  /**
+   * Converts haplotype dosages of one sample to genotype probabilities.
+   */
+  static void dosages_to_gp(const float* hds, std::size_t ploidy, float* gp)
+  {
+    std::fill(gp, gp + ploidy + 1, 0.f);
+    gp[0] = 1.f;
+    for (std::size_t i = 0; i < ploidy; ++i)
+    {
+      for (std::size_t k = i + 1; k > 0; --k)
+        gp[k] = gp[k] * (1.f - hds[i]) + gp[k - 1] * hds[i];
+      gp[0] *= 1.f - hds[i];
+    }
+  }
+
+  void set_dosage_fields(savvy::variant& rec, std::mt19937_64& rng)
+  {
+    const std::size_t ploidy = args_.ploidy();
+    const float missing = savvy::typed_value::missing_value<float>();
+    const bool dense = args_.dosage_noise() > 0.;
+
+    dosages_.resize(n_haps_);
+    if (dense)
+    {
+      std::uniform_real_distribution<float> noise(0.f, float(args_.dosage_noise()));
+      auto e = entries_.begin();
+      for (std::size_t i = 0; i < n_haps_; ++i)
+      {
+        std::int8_t allele = 0;
+        if (e != entries_.end() && e->first == i)
+          allele = (e++)->second;
+        float n = noise(rng);
+        dosages_[i] = allele == 1 ? 1.f - n : (allele == 0 ? n : missing);
+      }
+    }
+    else
+    {
+      std::fill(dosages_.begin(), dosages_.end(), 0.f);
+      for (auto it = entries_.begin(); it != entries_.end(); ++it)
+        dosages_[it->first] = it->second == 1 ? 1.f : missing;
+    }
+
+    if (args_.fields().count("HDS"))
+    {
+      if (dense || args_.pbwt_fields().count("HDS"))
+      {
+        rec.set_format("HDS", dosages_);
+      }
+      else
+      {
+        sparse_hds_.clear();
+        sparse_hds_.resize(n_haps_);
+        for (auto it = entries_.begin(); it != entries_.end(); ++it)
+          sparse_hds_[it->first] = dosages_[it->first];
+        rec.set_format("HDS", sparse_hds_);
+      }
+    }
+
+    if (args_.fields().count("DS"))
+    {
+      ds_.assign(args_.n_samples(), 0.f);
+      for (std::size_t i = 0; i < n_haps_; ++i)
+        ds_[i / ploidy] += dosages_[i];
+      for (auto it = ds_.begin(); it != ds_.end(); ++it)
+      {
+        if (std::isnan(*it))
+          *it = missing; // Any missing haplotype makes sample missing.
+      }
+
+      if (dense || args_.pbwt_fields().count("DS"))
+      {
+        rec.set_format("DS", ds_);
+      }
+      else
+      {
+        sparse_ds_.clear();
+        sparse_ds_.resize(args_.n_samples());
+        for (auto it = entries_.begin(); it != entries_.end(); ++it)
+        {
+          std::size_t s = it->first / ploidy;
+          sparse_ds_[s] = ds_[s];
+        }
+        rec.set_format("DS", sparse_ds_);
+      }
+    }
+
+    if (args_.fields().count("GP"))
+    {
+      gp_.resize(args_.n_samples() * (ploidy + 1));
+      for (std::size_t s = 0; s < args_.n_samples(); ++s)
+      {
+        const float* hds = &dosages_[s * ploidy];
+        float* gp = &gp_[s * (ploidy + 1)];
+        if (std::any_of(hds, hds + ploidy, [](float v) { return std::isnan(v); }))
+          std::fill(gp, gp + ploidy + 1, missing);
+        else
+          dosages_to_gp(hds, ploidy, gp);
+      }
+      rec.set_format("GP", gp_);
+    }
+  }
+};
+
+static std::vector<std::pair<std::string, std::string>> simulated_headers(const simulate_prog_args& args)
+{
+  std::vector<std::pair<std::string, std::string>> headers = {
+    {"fileformat", "VCFv4.2"},
+    {"source", "sav simulate --seed " + std::to_string(args.seed())},
+    {"contig", "<ID=" + args.chromosome() + ",length=" + std::to_string((args.n_variants() + 1) * args.spacing()) + ">"},
+    {"INFO", "<ID=AC,Number=A,Type=Integer,Description=\"Alternate allele count\">"},
+    {"INFO", "<ID=AN,Number=1,Type=Integer,Description=\"Number of non-missing alleles\">"},
+    {"INFO", "<ID=AF,Number=A,Type=Float,Description=\"Alternate allele frequency\">"}};
+
+  if (args.fields().count("GT"))
+    headers.emplace_back("FORMAT", "<ID=GT,Number=1,Type=String,Description=\"Genotype\">");
+  if (args.fields().count("HDS"))
+    headers.emplace_back("FORMAT", "<ID=HDS,Number=" + std::to_string(args.ploidy()) + ",Type=Float,Description=\"Haplotype dosages\">");
+  if (args.fields().count("DS"))
+    headers.emplace_back("FORMAT", "<ID=DS,Number=1,Type=Float,Description=\"Alternate allele dosage\">");
+  if (args.fields().count("GP"))
+    headers.emplace_back("FORMAT", "<ID=GP,Number=G,Type=Float,Description=\"Genotype probabilities\">");
+
+  headers.emplace_back("phasing", args.phasing());
+  return headers;
+}
+
+int simulate_main(int argc, char** argv)
+{
+  simulate_prog_args args;
+  if (!args.parse(argc, argv))
+  {
+    args.print_usage(std::cerr);
+    return EXIT_FAILURE;
+  }
+
+  if (args.help_is_set())
+  {
+    args.print_usage(std::cout);
+    return EXIT_SUCCESS;
+  }
+
+  auto fmt = savvy::file::format::vcf;
+  if (args.file_format() == "sav")
+    fmt = savvy::file::format::sav2;
+  else if (args.file_format() == "bcf")
+    fmt = savvy::file::format::bcf;
+
+  std::vector<std::string> sample_ids(args.n_samples());
+  for (std::size_t i = 0; i < sample_ids.size(); ++i)
+    sample_ids[i] = "SAMPLE" + std::to_string(i + 1);
+
+  savvy::writer wrt(args.output_path(), fmt, simulated_headers(args), sample_ids, args.compression_level());
+  wrt.set_block_size(args.block_size());
+  wrt.set_pbwt(args.pbwt_fields());
+  if (args.threads() > 1)
+    wrt.set_compression_threads(args.threads());
+
+  // Each thread generates a batch of records while the previous round of batches is written. Batches are smaller for
+  // large sample sizes to bound memory.
+  const std::size_t n_threads = args.threads();
+  const std::size_t batch_size = std::max<std::size_t>(1, std::min<std::size_t>(1024, (std::size_t(1) << 22u) / (args.n_samples() * args.ploidy())));
+  std::vector<record_simulator> simulators(n_threads, record_simulator(args));
+  std::vector<std::vector<savvy::variant>> batches(n_threads), next_batches(n_threads);
+  std::vector<std::thread> threads;
+  std::uint64_t next_record = 0;
+
+  auto launch = [&]()
+  {
+    for (std::size_t t = 0; t < n_threads; ++t)
+    {
+      std::uint64_t beg = next_record;
+      next_record = std::min<std::uint64_t>(args.n_variants(), beg + batch_size);
+      next_batches[t].resize(next_record - beg);
+      threads.emplace_back([&simulators, &next_batches, t, beg]()
+      {
+        for (std::size_t i = 0; i < next_batches[t].size(); ++i)
+          simulators[t].simulate(beg + i, next_batches[t][i]);
+      });
+    }
+  };
+
+  launch();
+  while (true)
+  {
+    for (auto it = threads.begin(); it != threads.end(); ++it)
+      it->join();
+    threads.clear();
+
+    batches.swap(next_batches);
+    if (batches.front().empty())
+      break;
+
+    if (next_record < args.n_variants() && wrt)
+      launch();
+    else
+      std::for_each(next_batches.begin(), next_batches.end(), [](std::vector<savvy::variant>& b) { b.clear(); });
+
+    for (auto b = batches.begin(); b != batches.end() && wrt; ++b)
+    {
+      for (auto it = b->begin(); it != b->end() && wrt; ++it)
+        wrt.write(*it);
+    }
+  }
+
+  if (!wrt)
+  {
+    std::cerr << "Error: write failure" << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -9,7 +9,19 @@
 #include "savvy/writer.hpp"
 
 #include <getopt.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
 #include <chrono>
+#include <cstdlib>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <numeric>
+#include <thread>
 
 //================================================================//
 less_than_comparator::less_than_comparator(savvy::s1r::sort_point type, std::unordered_map<std::string, std::size_t> contig_order_map) :
@@ -198,10 +210,16 @@ std::string random_string_generator::operator()(std::size_t length)
 class sort_prog_args
 {
 private:
+  static const std::size_t default_max_memory = std::size_t(1) << 30;
+
   std::vector<option> long_options_;
   std::string input_path_;
   std::string output_path_ = "/dev/stdout";
   std::string direction_ = "asc";
+  std::string temp_directory_;
+  std::size_t max_memory_ = default_max_memory;
+  std::size_t threads_ = 1;
+  std::size_t window_size_ = 0;
   savvy::s1r::sort_point point_ = savvy::s1r::sort_point::beg;
   bool help_ = false;
 public:
@@ -210,16 +228,26 @@ public:
       {
         {"direction", required_argument, 0, 'd'},
         {"help", no_argument, 0, 'h'},
+        {"max-memory", required_argument, 0, 'm'},
         {"output", required_argument, 0, 'o'},
         {"point", required_argument, 0, 'p'},
+        {"temp-dir", required_argument, 0, 'T'},
+        {"threads", required_argument, 0, 't'},
+        {"window", required_argument, 0, 'w'},
         {0, 0, 0, 0}
       })
   {
+    const char* tmpdir = std::getenv("TMPDIR");
+    temp_directory_ = tmpdir && tmpdir[0] ? tmpdir : "/tmp";
   }
 
   const std::string& direction() const { return direction_; }
   const std::string& input_path() const { return input_path_; }
   const std::string& output_path() const { return output_path_; }
+  const std::string& temp_directory() const { return temp_directory_; }
+  std::size_t max_memory() const { return max_memory_; }
+  std::size_t threads() const { return threads_; }
+  std::size_t window_size() const { return window_size_; }
   savvy::s1r::sort_point point() const { return point_; }
 
   bool help_is_set() const { return help_; }
@@ -230,8 +258,14 @@ public:
     os << "\n";
     os << " -d, --direction   Specifies whether to sort in ascending or descending order (asc or desc; default: asc)\n";
     os << " -h, --help        Print usage\n";
+    os << " -m, --max-memory  Approximate memory budget for buffered records, with optional K, M or G suffix (default: 1G)\n";
     os << " -o, --output      Path to output SAV file (default: /dev/stdout).\n";
     os << " -p, --point       Specifies which allele position to sort by (beg, mid or end; default: beg)\n";
+    os << " -t, --threads     Number of threads used to sort and compress temporary runs (default: 1)\n";
+    os << " -T, --temp-dir    Directory for temporary files (default: $TMPDIR or /tmp)\n";
+    os << " -w, --window      Enables streaming mode for nearly sorted input, where records displaced by up to this many\n";
+    os << "                   positions are reordered in memory and others are merged separately. The output is only\n";
+    os << "                   decoded a second time when records fall outside of the window (default: 0, disabled)\n";
 
     os << std::flush;
   }
@@ -240,7 +274,7 @@ public:
   {
     int long_index = 0;
     int opt = 0;
-    while ((opt = getopt_long(argc, argv, "d:ho:p:", long_options_.data(), &long_index )) != -1)
+    while ((opt = getopt_long(argc, argv, "d:hm:o:p:t:T:w:", long_options_.data(), &long_index )) != -1)
     {
       char copt = char(opt & 0xFF);
       switch (copt)
@@ -256,6 +290,29 @@ public:
       case 'h':
         help_ = true;
         return true;
+      case 'm':
+      {
+        std::string mem_str = std::string(optarg ? optarg : "");
+        char* suffix = nullptr;
+        double mem = std::strtod(mem_str.c_str(), &suffix);
+        std::string unit = suffix ? std::string(suffix) : "";
+        if (unit == "K" || unit == "k")
+          mem *= 1024.;
+        else if (unit == "M" || unit == "m")
+          mem *= 1024. * 1024.;
+        else if (unit == "G" || unit == "g")
+          mem *= 1024. * 1024. * 1024.;
+        else if (!unit.empty())
+          mem = 0.;
+
+        if (mem < 1.)
+        {
+          std::cerr << "Invalid --max-memory argument (" << mem_str << ")." << std::endl;
+          return false;
+        }
+        max_memory_ = std::size_t(mem);
+        break;
+      }
       case 'o':
         output_path_ = std::string(optarg ? optarg : "");
         break;
@@ -281,6 +338,15 @@ public:
         }
         break;
       }
+      case 't':
+        threads_ = std::size_t(std::max(1ll, std::atoll(optarg ? optarg : "")));
+        break;
+      case 'T':
+        temp_directory_ = std::string(optarg ? optarg : "");
+        break;
+      case 'w':
+        window_size_ = std::size_t(std::max(0ll, std::atoll(optarg ? optarg : "")));
+        break;
       default:
         return false;
       }
@@ -307,106 +373,612 @@ public:
   }
 };
 
+// Approximate heap usage of a record, used to enforce --max-memory.
+static std::size_t record_memory_usage(const savvy::variant& v)
+{
+  std::size_t ret = sizeof(savvy::variant) + v.chrom().size() + v.id().size() + v.ref().size();
+  for (auto it = v.alts().begin(); it != v.alts().end(); ++it)
+    ret += sizeof(std::string) + it->size();
+
+  auto typed_value_usage = [](const std::pair<std::string, savvy::typed_value>& f)
+  {
+    const savvy::typed_value& tv = f.second;
+    std::size_t data_size = tv.is_sparse() ? tv.non_zero_size() * (tv.val_width() + tv.off_width()) : tv.size() * tv.val_width();
+    return sizeof(f) + f.first.size() + data_size;
+  };
+
+  for (auto it = v.info_fields().begin(); it != v.info_fields().end(); ++it)
+    ret += typed_value_usage(*it);
+  for (auto it = v.format_fields().begin(); it != v.format_fields().end(); ++it)
+    ret += typed_value_usage(*it);
+
+  return ret;
+}
+
+static std::string make_temp_path(const std::string& temp_directory)
+{
+  std::string path = temp_directory + "/sav-sort-XXXXXX";
+  int fd = mkstemp(&path[0]);
+  if (fd < 0)
+  {
+    std::cerr << "Error: could not create temp file in " << temp_directory << std::endl;
+    return "";
+  }
+  ::close(fd);
+  return path;
+}
+
+// Maximum number of runs merged at once. Each temp reader holds open file descriptors for the run and for probing its
+// index, so the fan-in is kept well below the process's file descriptor limit.
+static std::size_t max_merge_fan_in()
+{
+  struct rlimit lim;
+  std::size_t fd_limit = 1024;
+  if (getrlimit(RLIMIT_NOFILE, &lim) == 0 && lim.rlim_cur != RLIM_INFINITY)
+    fd_limit = lim.rlim_cur;
+  return std::max<std::size_t>(2, std::min<std::size_t>(1024, (fd_limit - std::min<std::size_t>(fd_limit, 32)) / 2));
+}
+
+struct sort_run
+{
+  std::vector<savvy::variant> records;
+  std::size_t size = 0;
+  std::string path;
+  bool success = true;
+  std::thread worker;
+};
+
 template <typename SiteCompare>
-int run(savvy::reader& in, savvy::writer& out, const SiteCompare& compare_fn)
+void sort_records(sort_run& run, const SiteCompare& compare_fn, std::vector<const savvy::variant*>& order)
 {
-  random_string_generator str_gen;
-  const std::size_t temp_file_size = 8192;
-  std::deque<std::string> temp_file_paths;
-  std::deque<savvy::writer> temp_writers;
-  std::deque<savvy::reader> temp_readers;
+  order.resize(run.size);
+  for (std::size_t i = 0; i < run.size; ++i)
+    order[i] = &run.records[i];
+  std::stable_sort(order.begin(), order.end(), [&compare_fn](const savvy::variant* a, const savvy::variant* b) { return compare_fn(*a, *b); });
+}
 
+template <typename SiteCompare>
+void write_run(sort_run& run, const SiteCompare& compare_fn, const std::vector<std::pair<std::string, std::string>>& headers, const std::vector<std::string>& samples)
+{
+  // Temp runs are read back once, so they use fast compression and no index.
+  std::vector<const savvy::variant*> order;
+  sort_records(run, compare_fn, order);
+  savvy::writer temp_writer(run.path, savvy::file::format::sav2, headers, samples, 1, "/dev/null");
+  for (auto it = order.begin(); it != order.end() && temp_writer; ++it)
+    temp_writer << **it;
+  run.success = temp_writer.good();
+}
 
-  std::vector<savvy::variant> in_mem_variants(temp_file_size);
-  std::vector<std::reference_wrapper<savvy::variant>> in_mem_variant_refs(in_mem_variants.begin(), in_mem_variants.end());
+/**
+ * Buffers records up to a memory budget and writes them as sorted temp runs. While one run is being filled, up to
+ * args.threads() runs are sorted and written by worker threads.
+ */
+template <typename SiteCompare>
+class sort_run_generator
+{
+private:
+  const SiteCompare& compare_fn_;
+  const sort_prog_args& args_;
+  const std::vector<std::pair<std::string, std::string>>& headers_;
+  const std::vector<std::string>& samples_;
+  std::size_t run_memory_;
+  std::deque<sort_run> runs_;
+  std::deque<sort_run*> active_;
+  std::vector<std::string> run_paths_;
+  std::size_t current_ = 0;
+  std::size_t current_memory_ = 0;
+  bool success_ = true;
+public:
+  sort_run_generator(const SiteCompare& compare_fn, const sort_prog_args& args, const std::vector<std::pair<std::string, std::string>>& headers, const std::vector<std::string>& samples, std::size_t reserved_memory = 0) :
+    compare_fn_(compare_fn),
+    args_(args),
+    headers_(headers),
+    samples_(samples),
+    run_memory_(std::max<std::size_t>(1, (args.max_memory() - std::min(args.max_memory(), reserved_memory)) / (args.threads() + 1))),
+    runs_(args.threads() + 1)
+  {
+  }
+
+  ~sort_run_generator()
+  {
+    while (!active_.empty())
+      join_oldest();
+    for (auto it = run_paths_.begin(); it != run_paths_.end(); ++it)
+      std::remove(it->c_str());
+  }
 
-  std::size_t read_counter = temp_file_size;
-  while (read_counter == temp_file_size)
+  bool good() const { return success_; }
+  sort_run& current() { return runs_[current_]; }
+  bool empty() const { return run_paths_.empty() && runs_[current_].size == 0; }
+
+  /**
+   * Gets slot for next record in current run. The record must be committed with commit().
+   */
+  savvy::variant& next()
+  {
+    sort_run& r = runs_[current_];
+    if (r.size == r.records.size())
+      r.records.emplace_back();
+    return r.records[r.size];
+  }
+
+  /**
+   * Adds record returned by next() to current run and spills the run once it exceeds its share of the memory budget.
+   * @return True if the run was spilled
+   */
+  bool commit()
   {
-    read_counter = 0;
-    for (; read_counter < temp_file_size; )
+    sort_run& r = runs_[current_];
+    current_memory_ += record_memory_usage(r.records[r.size++]);
+    if (current_memory_ >= run_memory_)
     {
-      in >> in_mem_variant_refs[read_counter].get();
-      if (!in.good())
+      spill();
+      return true;
+    }
+    return false;
+  }
+
+  /**
+   * Spills current run and waits for all runs to be written.
+   * @return Paths of temp runs, which are removed once this object is destroyed
+   */
+  const std::vector<std::string>& finish()
+  {
+    if (runs_[current_].size)
+      spill();
+    while (!active_.empty())
+      join_oldest();
+    return run_paths_;
+  }
+
+  /**
+   * Transfers ownership of temp run paths to caller.
+   */
+  std::vector<std::string> release()
+  {
+    return std::move(run_paths_);
+  }
+private:
+  void join_oldest()
+  {
+    sort_run* r = active_.front();
+    active_.pop_front();
+    r->worker.join();
+    if (!r->success)
+    {
+      std::cerr << "Error: failed to write temp file (" << r->path << ")" << std::endl;
+      success_ = false;
+    }
+  }
+
+  void spill()
+  {
+    sort_run& r = runs_[current_];
+    current_ = (current_ + 1) % runs_.size();
+    current_memory_ = 0;
+
+    if (active_.size() == args_.threads())
+      join_oldest();
+
+    r.path = make_temp_path(args_.temp_directory());
+    if (r.path.empty())
+      success_ = false;
+
+    if (success_)
+    {
+      run_paths_.push_back(r.path);
+      r.worker = std::thread(write_run<SiteCompare>, std::ref(r), std::cref(compare_fn_), std::cref(headers_), std::cref(samples_));
+      active_.push_back(&r);
+    }
+    runs_[current_].size = 0;
+  }
+};
+
+/**
+ * Merges sorted runs with a binary heap. Ties are broken by run order so that the merge is stable.
+ */
+template <typename SiteCompare>
+class run_merger
+{
+private:
+  struct heap_compare
+  {
+    const run_merger& m;
+    bool operator()(std::size_t a, std::size_t b) const
+    {
+      // std heap functions keep the greatest element on top, so order by descending (record, run index).
+      if (m.compare_fn_(m.heads_[b], m.heads_[a]))
+        return true;
+      return !m.compare_fn_(m.heads_[a], m.heads_[b]) && b < a;
+    }
+  };
+
+  const SiteCompare& compare_fn_;
+  std::deque<savvy::reader> readers_;
+  std::vector<savvy::variant> heads_;
+  std::vector<std::size_t> heap_;
+public:
+  run_merger(const SiteCompare& compare_fn) : compare_fn_(compare_fn) {}
+
+  /**
+   * Opens runs and reads the first record of each. Run files are removed once opened.
+   * @param run_paths Paths of sorted runs
+   * @return False if a run could not be opened
+   */
+  bool open(const std::vector<std::string>& run_paths)
+  {
+    for (auto it = run_paths.begin(); it != run_paths.end(); ++it)
+    {
+      readers_.emplace_back(*it);
+      std::remove(it->c_str());
+      if (!readers_.back())
       {
-        break;
+        std::cerr << "Error: could not open temp file (" << *it << ")" << std::endl;
+        return false;
       }
-      else
+    }
+
+    heads_.resize(readers_.size());
+    heap_.reserve(readers_.size());
+    for (std::size_t i = 0; i < readers_.size(); ++i)
+    {
+      if (readers_[i].read(heads_[i]))
+        heap_.push_back(i);
+    }
+    std::make_heap(heap_.begin(), heap_.end(), heap_compare{*this});
+    return true;
+  }
+
+  bool empty() const { return heap_.empty(); }
+
+  /**
+   * @return Least record across all runs
+   */
+  const savvy::variant& top() const { return heads_[heap_.front()]; }
+
+  /**
+   * Removes least record and reads the next record from its run.
+   */
+  void pop()
+  {
+    std::pop_heap(heap_.begin(), heap_.end(), heap_compare{*this});
+    std::size_t rdr_index = heap_.back();
+    if (readers_[rdr_index].read(heads_[rdr_index]))
+      std::push_heap(heap_.begin(), heap_.end(), heap_compare{*this});
+    else
+      heap_.pop_back();
+  }
+
+  /**
+   * @return False if a read failure occurred
+   */
+  bool good() const
+  {
+    for (std::size_t i = 0; i < readers_.size(); ++i)
+    {
+      if (readers_[i].bad())
       {
-        ++read_counter;
+        std::cerr << "Error: read failure with temp reader " << i << std::endl;
+        return false;
       }
     }
+    return true;
+  }
+};
 
-    if (read_counter)
+template <typename SiteCompare>
+bool merge_runs(const std::vector<std::string>& run_paths, savvy::writer& out, const SiteCompare& compare_fn)
+{
+  run_merger<SiteCompare> runs(compare_fn);
+  if (!runs.open(run_paths))
+    return false;
+
+  for ( ; !runs.empty() && out; runs.pop())
+    out << runs.top();
+
+  return runs.good() && out.good();
+}
+
+/**
+ * Merges groups of runs until there are no more runs than can be opened at once. Run files that are merged are
+ * removed. On failure, all run files are removed.
+ */
+template <typename SiteCompare>
+bool reduce_runs(std::vector<std::string>& run_paths, const SiteCompare& compare_fn, const sort_prog_args& args, const std::vector<std::pair<std::string, std::string>>& headers, const std::vector<std::string>& samples)
+{
+  bool success = true;
+  const std::size_t fan_in = max_merge_fan_in();
+  while (success && run_paths.size() > fan_in)
+  {
+    std::vector<std::string> merged_paths;
+    for (std::size_t i = 0; i < run_paths.size() && success; i += fan_in)
     {
-      std::sort(in_mem_variant_refs.begin(), in_mem_variant_refs.begin() + read_counter, compare_fn);
-
-      temp_file_paths.emplace_back("/tmp/tmp-" + str_gen(32) + ".sav");
-      temp_writers.emplace_back(temp_file_paths.back(), savvy::file::format::sav2, in.headers(), in.samples());
-      // TODO: open FILE*  and unlink file
-      // temp_readers.emplace_back(temp_path, /*in.samples().begin(), in.samples().end(), in.headers().begin(), in.headers().end(),*/ out_format);
-      // std::remove(temp_path.c_str());
-      for (std::size_t i = 0; i<read_counter; ++i)
+      std::vector<std::string> group(run_paths.begin() + i, run_paths.begin() + std::min(run_paths.size(), i + fan_in));
+      if (group.size() == 1)
+      {
+        merged_paths.push_back(group.front());
+        continue;
+      }
+
+      merged_paths.push_back(make_temp_path(args.temp_directory()));
+      if (merged_paths.back().empty())
       {
-        temp_writers.back() << in_mem_variant_refs[i].get();
+        success = false;
+        break;
       }
+
+      savvy::writer merged_writer(merged_paths.back(), savvy::file::format::sav2, headers, samples, 1, "/dev/null");
+      success = merge_runs(group, merged_writer, compare_fn);
     }
+
+    if (!success)
+      run_paths.insert(run_paths.end(), merged_paths.begin(), merged_paths.end());
+    else
+      run_paths = std::move(merged_paths);
+  }
+
+  if (!success)
+  {
+    for (auto it = run_paths.begin(); it != run_paths.end(); ++it)
+      std::remove(it->c_str());
+    run_paths.clear();
   }
 
+  return success;
+}
 
+/**
+ * Merges runs into output file, using multiple passes when there are more runs than can be opened at once. Run files
+ * are removed.
+ */
+template <typename SiteCompare>
+bool merge_all_runs(std::vector<std::string> run_paths, const std::string& output_path, const SiteCompare& compare_fn, const sort_prog_args& args, const std::vector<std::pair<std::string, std::string>>& headers, const std::vector<std::string>& samples)
+{
+  if (!reduce_runs(run_paths, compare_fn, args, headers, samples))
+    return false;
 
-  temp_writers.clear();
+  savvy::writer out(output_path, savvy::file::format::sav2, headers, samples);
+  return merge_runs(run_paths, out, compare_fn);
+}
 
-  for (auto it = temp_file_paths.begin(); it != temp_file_paths.end(); ++it)
+template <typename SiteCompare>
+bool run(savvy::reader& in, const SiteCompare& compare_fn, const sort_prog_args& args)
+{
+  const std::vector<std::pair<std::string, std::string>> headers = in.headers();
+  const std::vector<std::string> samples = in.samples();
+
+  sort_run_generator<SiteCompare> runs(compare_fn, args, headers, samples);
+  bool spilled = false;
+  while (runs.good() && in.read(runs.next()))
+    spilled = runs.commit() || spilled;
+
+  if (in.bad())
   {
-    temp_readers.emplace_back(*it);
-    std::remove(it->c_str());
+    std::cerr << "Error: read failure" << std::endl;
+    return false;
   }
 
-  std::vector<savvy::variant> write_variants(temp_readers.size());
-  std::size_t i = 0;
-  for (auto it = temp_readers.begin(); it != temp_readers.end(); ++it)
+  if (!spilled)
   {
-    it->read(write_variants[i]);
-    ++i;
+    // Entire input fits within memory budget.
+    savvy::writer out(args.output_path(), savvy::file::format::sav2, headers, samples);
+    std::vector<const savvy::variant*> order;
+    sort_records(runs.current(), compare_fn, order);
+    for (auto it = order.begin(); it != order.end() && out; ++it)
+      out << **it;
+    return out.good();
   }
 
+  runs.finish();
+  if (!runs.good())
+    return false;
+  return merge_all_runs(runs.release(), args.output_path(), compare_fn, args, headers, samples);
+}
 
-  std::size_t min_index;
+// Whether output can be written to a temp file in the same directory and renamed into place (i.e., output is a regular
+// file or does not exist yet, as opposed to a pipe or /dev/stdout).
+static bool is_replaceable_path(const std::string& path)
+{
+  struct stat st;
+  if (::lstat(path.c_str(), &st) != 0)
+    return errno == ENOENT;
+  return S_ISREG(st.st_mode);
+}
 
-  do
+static std::string parent_directory(const std::string& path)
+{
+  std::size_t pos = path.find_last_of('/');
+  if (pos == std::string::npos)
+    return ".";
+  return pos == 0 ? "/" : path.substr(0, pos);
+}
+
+// Moves completed temp file to output path. Output that cannot be replaced (e.g., a pipe) is copied instead.
+static bool publish_output(const std::string& temp_path, const std::string& output_path, bool replace)
+{
+  if (replace)
   {
-    min_index = write_variants.size();
-    for (std::size_t rdr_index = 0; rdr_index < write_variants.size(); ++rdr_index)
+    struct stat st;
+    mode_t mode;
+    if (::stat(output_path.c_str(), &st) == 0)
+    {
+      mode = st.st_mode & 07777;
+    }
+    else
     {
-      if (temp_readers[rdr_index].good())
+      mode = ::umask(0);
+      ::umask(mode);
+      mode = 0666 & ~mode;
+    }
+
+    if (::chmod(temp_path.c_str(), mode) == 0 && std::rename(temp_path.c_str(), output_path.c_str()) == 0)
+      return true;
+    std::cerr << "Error: could not move temp file to output (" << output_path << ")" << std::endl;
+    std::remove(temp_path.c_str());
+    return false;
+  }
+
+  std::ifstream ifs(temp_path, std::ios::binary);
+  std::ofstream ofs(output_path, std::ios::binary);
+  if (ifs.peek() != std::char_traits<char>::eof())
+    ofs << ifs.rdbuf();
+  ofs.close();
+  std::remove(temp_path.c_str());
+  if (!ifs || !ofs)
+  {
+    std::cerr << "Error: could not copy temp file to output (" << output_path << ")" << std::endl;
+    return false;
+  }
+  return true;
+}
+
+/**
+ * Reorder window for nearly sorted input. Once the window is full, the least record is released. An incoming record
+ * that is less than the last released record can no longer be placed in order and is rejected.
+ */
+template <typename SiteCompare>
+class reorder_window
+{
+private:
+  struct heap_compare
+  {
+    const reorder_window& w;
+    bool operator()(std::size_t a, std::size_t b) const
+    {
+      if (w.compare_fn_(w.records_[b], w.records_[a]))
+        return true;
+      return !w.compare_fn_(w.records_[a], w.records_[b]) && w.arrival_order_[b] < w.arrival_order_[a];
+    }
+  };
+
+  const SiteCompare& compare_fn_;
+  std::size_t window_size_;
+  std::vector<savvy::variant> records_; // window plus last released and incoming records
+  std::vector<std::uint64_t> arrival_order_;
+  std::uint64_t arrival_counter_ = 0;
+  std::vector<std::size_t> free_slots_;
+  std::vector<std::size_t> heap_;
+  std::size_t last_released_;
+public:
+  reorder_window(const SiteCompare& compare_fn, std::size_t window_size) :
+    compare_fn_(compare_fn),
+    window_size_(window_size),
+    records_(window_size + 2),
+    arrival_order_(records_.size()),
+    free_slots_(records_.size()),
+    last_released_(records_.size())
+  {
+    std::iota(free_slots_.rbegin(), free_slots_.rend(), 0);
+    heap_.reserve(records_.size());
+  }
+
+  /**
+   * Gets slot for next record. The record must be added with commit().
+   */
+  savvy::variant& next() { return records_[free_slots_.back()]; }
+
+  /**
+   * Adds record returned by next() to window.
+   * @return False if record is less than the last released record, in which case it is left in the slot returned by next()
+   */
+  bool commit()
+  {
+    std::size_t slot = free_slots_.back();
+    if (last_released_ < records_.size() && compare_fn_(records_[slot], records_[last_released_]))
+      return false;
+
+    free_slots_.pop_back();
+    arrival_order_[slot] = arrival_counter_++;
+    heap_.push_back(slot);
+    std::push_heap(heap_.begin(), heap_.end(), heap_compare{*this});
+    return true;
+  }
+
+  bool full() const { return heap_.size() > window_size_; }
+  bool empty() const { return heap_.empty(); }
+
+  /**
+   * Removes least record from window.
+   * @return Removed record, which remains valid until the next call to release()
+   */
+  const savvy::variant& release()
+  {
+    std::pop_heap(heap_.begin(), heap_.end(), heap_compare{*this});
+    std::size_t slot = heap_.back();
+    heap_.pop_back();
+    if (last_released_ < records_.size())
+      free_slots_.push_back(last_released_);
+    last_released_ = slot;
+    return records_[slot];
+  }
+};
+
+/**
+ * Sorts input that is already sorted except for records displaced by at most window_size positions (e.g., when indels
+ * are sorted by a different point). Records pass through a reorder window and are written to a temp file next to the
+ * output, which is renamed into place when every record fit within the window. Records that arrive after a greater
+ * record has already left the window cannot be written in order. These late records are written to sorted temp runs
+ * and merged with the windowed output afterward, so only inputs with late records are decoded a second time.
+ *
+ * @param in Input reader
+ */
+template <typename SiteCompare>
+bool run_windowed(savvy::reader& in, const SiteCompare& compare_fn, const sort_prog_args& args)
+{
+  const std::vector<std::pair<std::string, std::string>> headers = in.headers();
+  const std::vector<std::string> samples = in.samples();
+
+  const bool replace_output = is_replaceable_path(args.output_path());
+  std::string windowed_path = make_temp_path(replace_output ? parent_directory(args.output_path()) : args.temp_directory());
+  if (windowed_path.empty())
+    return false;
+
+  std::vector<std::string> late_paths;
+  std::size_t late_count = 0;
+  {
+    savvy::writer out(windowed_path, savvy::file::format::sav2, headers, samples);
+    sort_run_generator<SiteCompare> late_runs(compare_fn, args, headers, samples);
+    reorder_window<SiteCompare> window(compare_fn, args.window_size());
+    while (out && late_runs.good() && in.read(window.next()))
+    {
+      if (!window.commit())
       {
-        if (min_index < write_variants.size())
-        {
-          if (compare_fn(write_variants[rdr_index], write_variants[min_index]))
-            min_index = rdr_index;
-        }
-        else
-        {
-          min_index = rdr_index;
-        }
+        std::swap(late_runs.next(), window.next());
+        late_runs.commit();
+        ++late_count;
       }
-      else if (temp_readers[rdr_index].bad())
+      else if (window.full())
       {
-        std::cerr << "Error: read failure with temp reader " << rdr_index << std::endl;
-        return false;
+        out << window.release();
       }
     }
 
-    if (min_index < write_variants.size())
+    while (!window.empty() && out)
+      out << window.release();
+
+    if (in.bad())
+      std::cerr << "Error: read failure" << std::endl;
+
+    late_runs.finish();
+    if (in.bad() || !out.good() || !late_runs.good())
     {
-      out << write_variants[min_index];
-      temp_readers[min_index] >> write_variants[min_index];
+      late_paths = late_runs.release();
+      for (auto it = late_paths.begin(); it != late_paths.end(); ++it)
+        std::remove(it->c_str());
+      std::remove(windowed_path.c_str());
+      return false;
     }
+    late_paths = late_runs.release();
+  }
 
-  } while (min_index < write_variants.size());
+  if (!late_count)
+    return publish_output(windowed_path, args.output_path(), replace_output);
 
-  return true;
+  std::cerr << "Notice: " << late_count << " records fell outside of the reorder window and were merged separately" << std::endl;
+
+  // The windowed records come first so that they are written before late records that compare equal.
+  late_paths.insert(late_paths.begin(), windowed_path);
+  return merge_all_runs(std::move(late_paths), args.output_path(), compare_fn, args, headers, samples);
 }
 
 int sort_main(int argc, char** argv)
@@ -431,8 +1003,6 @@ int sort_main(int argc, char** argv)
     return EXIT_FAILURE;
   }
 
-  savvy::writer wtr(args.output_path(), savvy::file::format::sav2, rdr.headers(), rdr.samples());
-
   std::unordered_map<std::string, std::size_t> contig_order_map;
   contig_order_map.reserve(rdr.headers().size()); // std::count_if(in.headers().begin(), in.headers().end(), [](const std::pair<std::string,std::string>& e) { return e.first == "contig"; }));
 
@@ -447,15 +1017,17 @@ int sort_main(int argc, char** argv)
   }
 
 
+  bool success;
   if (args.direction() == "desc")
   {
     greater_than_comparator greater_than(args.point(), std::move(contig_order_map));
-    return run(rdr, wtr, greater_than) ? EXIT_SUCCESS : EXIT_FAILURE;
+    success = args.window_size() ? run_windowed(rdr, greater_than, args) : run(rdr, greater_than, args);
   }
   else
   {
     less_than_comparator less_than(args.point(), std::move(contig_order_map));
-    return run(rdr, wtr, less_than) ? EXIT_SUCCESS : EXIT_FAILURE;
+    success = args.window_size() ? run_windowed(rdr, less_than, args) : run(rdr, less_than, args);
   }
-}
 
+  return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
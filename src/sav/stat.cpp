@@ -10,11 +10,14 @@
 #include "savvy/savvy.hpp"
 #include "savvy/reader.hpp"
 #include "savvy/writer.hpp"
+#include "savvy/zone_map.hpp"
 #include "sav/filter.hpp"
 
+#include <atomic>
 #include <functional>
 #include <getopt.h>
 #include <memory>
+#include <thread>
 
 class stat_prog_args
 {
@@ -26,6 +29,7 @@ private:
   std::string per_ac_path_;
   std::string per_sample_path_;
   std::unique_ptr<savvy::genomic_region> reg_;
+  std::size_t threads_ = 1;
   bool help_ = false;
 public:
   stat_prog_args() :
@@ -37,6 +41,7 @@ public:
         {"per-sample-out", required_argument, 0, '\x01'},
         {"region", required_argument, 0, 'r'},
         {"summary-out", required_argument, 0, '\x01'},
+        {"threads", required_argument, 0, 't'},
         {0, 0, 0, 0}
       })
   {
@@ -48,13 +53,20 @@ public:
   const std::string& per_ac_path() const { return per_ac_path_; }
   const std::string& per_sample_path() const { return per_sample_path_; }
   const std::unique_ptr<savvy::genomic_region>& reg() const { return reg_; }
+  std::size_t threads() const { return threads_; }
   bool help_is_set() const { return help_; }
 
   void print_usage(std::ostream& os)
   {
     os << "Usage: sav stat [opts ...] <in.sav> \n";
     os << "\n";
-    os << " -h, --help  Print usage\n";
+    os << " -f, --filter          Filter expression for including variants based on FILTER, QUAL, and INFO fields (eg, -f 'AC>=10;AF>0.01')\n";
+    os << " -h, --help            Print usage\n";
+    os << " -r, --region          Genomic region to gather statistics on (format: chr[:beg-end])\n";
+    os << " -t, --threads         Number of threads used to process indexed SAV files in shards of compression blocks (default: 1)\n";
+    os << "     --per-ac-out      Output path for counts binned by allele count (requires AC and AN INFO fields)\n";
+    os << "     --per-sample-out  Output path for per-sample counts\n";
+    os << "     --summary-out     Output path for record, variant and multi-allelic counts (default: /dev/stdout)\n";
     os << std::flush;
   }
 
@@ -62,7 +74,7 @@ public:
   {
     int long_index = 0;
     int opt = 0;
-    while ((opt = getopt_long(argc, argv, "\x01:hr:", long_options_.data(), &long_index )) != -1)
+    while ((opt = getopt_long(argc, argv, "\x01:f:hr:t:", long_options_.data(), &long_index )) != -1)
     {
       char copt = char(opt & 0xFF);
       switch (copt)
@@ -80,6 +92,11 @@ public:
           per_sample_path_ = optarg ? optarg : "";
           break;
         }
+        else if (long_opt_name == "summary-out")
+        {
+          summary_path_ = optarg ? optarg : "";
+          break;
+        }
 
         std::cerr << "Invalid long only index (" << long_index << ")\n";
         return false;
@@ -101,6 +118,9 @@ public:
       case 'r':
         reg_ = savvy::detail::make_unique<savvy::genomic_region>(string_to_region(optarg ? optarg : ""));
         break;
+      case 't':
+        threads_ = std::size_t(std::max(1ll, std::atoll(optarg ? optarg : "")));
+        break;
       default:
         return false;
       }
@@ -134,6 +154,15 @@ struct per_ac_t
   std::size_t n_syn = 0;
   std::size_t n_nonsyn = 0;
 
+  per_ac_t& operator+=(const per_ac_t& other)
+  {
+    n_snp += other.n_snp;
+    n_indel += other.n_indel;
+    n_syn += other.n_syn;
+    n_nonsyn += other.n_nonsyn;
+    return *this;
+  }
+
   static void print_header(std::ostream& os)
   {
     os << "#bin_id\tn_snp\tn_indel\tn_syn\tn_nonsyn\n";
@@ -164,6 +193,17 @@ struct per_sample_t
   {
   }
 
+  per_sample_t& operator+=(const per_sample_t& other)
+  {
+    n_het += other.n_het;
+    n_hom += other.n_hom;
+    n_snp += other.n_snp;
+    n_indel += other.n_indel;
+    n_syn += other.n_syn;
+    n_nonsyn += other.n_nonsyn;
+    return *this;
+  }
+
   static void print_header(std::ostream& os)
   {
     os << "#sample_id\tn_het\tn_hom\tn_snp\tn_indel\tn_syn\tn_nonsyn\n";
@@ -181,77 +221,181 @@ struct per_sample_t
   }
 };
 
-int stat_main(int argc, char** argv)
+/**
+ * Statistics gathered from a set of records. Each worker thread fills its own accumulator, and accumulators are
+ * reduced with merge() once all shards are processed.
+ */
+class stat_accumulator
 {
-  stat_prog_args args;
-  if (!args.parse(argc, argv))
+public:
+  std::size_t multi_allelic = 0;
+  std::size_t record_cnt = 0;
+  std::size_t variant_cnt = 0;
+  std::vector<per_ac_t> per_ac_stats;
+  std::vector<per_sample_t> per_sample_stats;
+private:
+  std::size_t bin_width_ = 1;
+  bool per_ac_ = false;
+  std::vector<std::int8_t> dense_geno_;
+  savvy::compressed_vector<std::int8_t> sparse_geno_;
+public:
+  stat_accumulator(const stat_prog_args& args, const std::vector<std::string>& sample_ids) :
+    per_ac_(!args.per_ac_path().empty())
   {
-    args.print_usage(std::cerr);
-    return EXIT_FAILURE;
+    if (args.per_sample_path().size())
+      per_sample_stats.assign(sample_ids.begin(), sample_ids.end());
   }
 
-  if (args.help_is_set())
+  /**
+   * Adds record to statistics.
+   * @param rec Record
+   * @return False if record lacks valid AC and AN fields when per-AC statistics are requested
+   */
+  bool add(const savvy::variant& rec)
   {
-    args.print_usage(std::cout);
-    return EXIT_SUCCESS;
-  }
+    if (rec.alts().size() > 1)
+      ++multi_allelic;
+    variant_cnt += std::max<std::size_t>(1, rec.alts().size());
+    ++record_cnt;
 
-  std::size_t multi_allelic{}, record_cnt{}, variant_cnt{};
+    bool is_snp = rec.ref().size() == 1 && rec.alts().size() && rec.alts()[0].size() == 1;
+    bool is_syn = false;
+    bool is_nonsyn = false;
+    classify_annotation(rec, is_syn, is_nonsyn);
 
+    if (per_ac_)
+    {
+      std::int64_t ac,an;
+      if (!rec.get_info("AC", ac) || !rec.get_info("AN", an))
+      {
+        std::cerr << "Error: AC and AN INFO fields are required" << std::endl;
+        return false;
+      }
 
-  savvy::reader input_file(args.input_path());
-  if (!input_file)
-  {
-    std::cerr << "Error: could not open " << args.input_path() << std::endl;
-    return EXIT_FAILURE;
-  }
+      if (ac > an || ac < 0)
+      {
+        std::cerr << "Error: AC INFO field must be in range of [0, AN]" << std::endl;
+        return false;
+      }
 
-  if (args.reg())
-  {
-    input_file.reset_bounds(*args.reg());
-    if (!input_file)
+      if (an / bin_width_ + 1 > per_ac_stats.size())
+        per_ac_stats.resize(an / bin_width_ + 1);
+
+      auto& s = per_ac_stats[ac / bin_width_];
+
+      if (is_snp)
+        s.n_snp += 1;
+      else
+        s.n_indel += 1;
+
+      if (is_syn)
+        s.n_syn += 1;
+      if (is_nonsyn)
+        s.n_nonsyn += 1;
+    }
+
+    if (per_sample_stats.size())
     {
-      std::cerr << "Error: could not load region " << args.reg()->chromosome() << ":" << args.reg()->from() << "-" << args.reg()->to() << std::endl;
-      return EXIT_FAILURE;
+      auto gt = std::find_if(rec.format_fields().begin(), rec.format_fields().end(), [](const std::pair<std::string, savvy::typed_value>& f) { return f.first == "GT"; });
+      if (gt == rec.format_fields().end() || gt->second.size() % per_sample_stats.size())
+        return true;
+
+      std::size_t stride = gt->second.size() / per_sample_stats.size();
+
+      // Only non-zero alleles contribute to per-sample counts, so sparse GT is visited without densifying. Samples
+      // with a missing allele are skipped.
+      std::size_t cur_sample = std::size_t(-1);
+      std::int64_t g = 0;
+      auto add_allele = [&](std::size_t off, std::int8_t allele)
+      {
+        std::size_t sample = off / stride;
+        if (sample != cur_sample)
+        {
+          add_sample_genotype(cur_sample, g, is_snp, is_syn, is_nonsyn);
+          cur_sample = sample;
+          g = 0;
+        }
+
+        if (savvy::typed_value::is_missing(allele))
+          g = std::numeric_limits<std::int64_t>::min() / 2;
+        else if (!savvy::typed_value::is_end_of_vector(allele))
+          g += allele;
+      };
+
+      if (gt->second.is_sparse())
+      {
+        gt->second.get(sparse_geno_);
+        for (auto it = sparse_geno_.begin(); it != sparse_geno_.end(); ++it)
+          add_allele(it.offset(), *it);
+      }
+      else
+      {
+        gt->second.get(dense_geno_);
+        for (std::size_t i = 0; i < dense_geno_.size(); ++i)
+        {
+          if (dense_geno_[i])
+            add_allele(i, dense_geno_[i]);
+        }
+      }
+      add_sample_genotype(cur_sample, g, is_snp, is_syn, is_nonsyn);
     }
+
+    return true;
   }
 
-  savvy::variant rec;
-  std::vector<std::int8_t> geno;
+  void merge(const stat_accumulator& other)
+  {
+    multi_allelic += other.multi_allelic;
+    record_cnt += other.record_cnt;
+    variant_cnt += other.variant_cnt;
 
-  std::vector<per_sample_t> per_sample_stats;
-  if (args.per_sample_path().size())
-    per_sample_stats.assign(input_file.samples().begin(), input_file.samples().end());
+    if (other.per_ac_stats.size() > per_ac_stats.size())
+      per_ac_stats.resize(other.per_ac_stats.size());
+    for (std::size_t i = 0; i < other.per_ac_stats.size(); ++i)
+      per_ac_stats[i] += other.per_ac_stats[i];
 
-  std::size_t bin_width = 1;
-  std::vector<per_ac_t> per_ac_stats;
+    for (std::size_t i = 0; i < per_sample_stats.size() && i < other.per_sample_stats.size(); ++i)
+      per_sample_stats[i] += other.per_sample_stats[i];
+  }
+private:
+  void add_sample_genotype(std::size_t sample, std::int64_t g, bool is_snp, bool is_syn, bool is_nonsyn)
+  {
+    if (sample >= per_sample_stats.size() || g <= 0)
+      return;
 
-  std::unordered_set<std::string> synonymous_labels = {
-    "start_retained",
-    "stop_retained",
-    "synonymous"};
+    per_sample_t& s = per_sample_stats[sample];
+    if (is_snp)
+      s.n_snp += g;
+    else
+      s.n_indel += g;
 
-  std::unordered_set<std::string> nonsynonymous_labels = {
-    "stop_gained",
-    "frameshift",
-    "stop_lost",
-    "start_lost",
-    "inframe_insertion",
-    "inframe_deletion",
-    "missense"};
+    if (g == 1)
+      ++s.n_het;
+    else // assuming  g == 2
+      ++s.n_hom;
 
-  while (input_file.read(rec))
+    if (is_syn)
+      s.n_syn += g;
+    if (is_nonsyn)
+      s.n_nonsyn += g;
+  }
+
+  static void classify_annotation(const savvy::variant& rec, bool& is_syn, bool& is_nonsyn)
   {
-    if (!args.filter_functor()(rec)) continue;
+    static const std::unordered_set<std::string> synonymous_labels = {
+      "start_retained",
+      "stop_retained",
+      "synonymous"};
 
-    if (rec.alts().size() > 1)
-      ++multi_allelic;
-    variant_cnt += std::max<std::size_t>(1, rec.alts().size());
-    ++record_cnt;
+    static const std::unordered_set<std::string> nonsynonymous_labels = {
+      "stop_gained",
+      "frameshift",
+      "stop_lost",
+      "start_lost",
+      "inframe_insertion",
+      "inframe_deletion",
+      "missense"};
 
-    bool is_snp = rec.ref().size() == 1 && rec.alts()[0].size() == 1;
-    bool is_syn = false;
-    bool is_nonsyn = false;
     std::string ann;
     if (rec.get_info("ANN", ann))
     {
@@ -278,78 +422,194 @@ int stat_main(int argc, char** argv)
       is_nonsyn = nonscnt > 0;
       is_syn = scnt && !nonscnt;
     }
+  }
+};
+
+/**
+ * Splits the S1R blocks to be read into shards of roughly equal record counts at block boundaries. Blocks outside of
+ * the region or excluded by the zone map are dropped, and each shard is a list of record slices covering contiguous
+ * blocks.
+ * @param args Program arguments
+ * @param n_shards Target number of shards
+ * @param shards Destination shards
+ * @return False if input is not an indexed SAV file
+ */
+bool plan_stat_shards(const stat_prog_args& args, std::size_t n_shards, std::vector<std::vector<savvy::slice_bounds>>& shards)
+{
+  bool external_index = savvy::detail::file_exists(args.input_path() + ".s1r");
+  savvy::s1r::reader index(external_index ? args.input_path() + ".s1r" : args.input_path());
+  if (!index.good())
+    return false;
+
+  savvy::zone_map zmap;
+  if (!external_index)
+  {
+    std::ifstream ifs(args.input_path(), std::ios::binary);
+    zmap.deserialize(ifs, index.file_offset(), index.uuid());
+  }
 
-    if (args.per_ac_path().size())
+  // Record slices are relative to the query of the whole contig (or of all contigs), matching reader::reset_bounds(slice_bounds).
+  std::string chrom = args.reg() ? args.reg()->chromosome() : "";
+  std::vector<std::pair<std::uint64_t, std::uint64_t>> blocks; // Record ranges of blocks to be read
+  std::uint64_t total_records = 0;
+  std::uint64_t record_offset = 0;
+  auto query = index.create_query(savvy::genomic_region(chrom));
+  for (auto it = query.begin(); it != query.end(); ++it)
+  {
+    std::uint64_t cnt = (it->value() & 0xFFFF) + 1;
+    bool keep = !args.reg() || (it->region_start() <= args.reg()->to() && it->region_end() >= args.reg()->from());
+    if (keep)
     {
-      std::int64_t ac,an;
-      if (!rec.get_info("AC", ac) || !rec.get_info("AN", an))
-      {
-        std::cerr << "Error: AC and AN INFO fields are required" << std::endl;
-        return EXIT_FAILURE;
-      }
+      std::size_t idx = zmap.find_block((it->value() >> 16u) & 0x0000FFFFFFFFFFFF);
+      keep = idx == zmap.block_count() || args.filter_functor().may_match(zmap[idx]);
+    }
 
-      if (ac > an || ac < 0)
-      {
-        std::cerr << "Error: AC INFO field must be in range of [0, AN]" << std::endl;
-        return EXIT_FAILURE;
-      }
+    if (keep)
+    {
+      blocks.emplace_back(record_offset, record_offset + cnt);
+      total_records += cnt;
+    }
+    record_offset += cnt;
+  }
 
-      if (an / bin_width + 1 > per_ac_stats.size())
-        per_ac_stats.resize(an / bin_width + 1);
+  std::uint64_t shard_target = std::max<std::uint64_t>(1, (total_records + n_shards - 1) / n_shards);
+  std::uint64_t shard_size = shard_target;
+  shards.clear();
+  for (auto it = blocks.begin(); it != blocks.end(); ++it)
+  {
+    if (shard_size >= shard_target)
+    {
+      shards.emplace_back();
+      shard_size = 0;
+    }
 
-      auto& s = per_ac_stats[ac / bin_width];
+    if (shards.back().size() && shards.back().back().to() == it->first)
+      shards.back().back() = savvy::slice_bounds(shards.back().back().from(), it->second, chrom);
+    else
+      shards.back().emplace_back(it->first, it->second, chrom);
+    shard_size += it->second - it->first;
+  }
 
-      if (is_snp)
-        s.n_snp += 1;
-      else
-        s.n_indel += 1;
+  return true;
+}
 
-      if (is_syn)
-        s.n_syn += 1;
-      if (is_nonsyn)
-        s.n_nonsyn += 1;
-    }
+bool stat_records(savvy::reader& input_file, stat_accumulator& stats)
+{
+  savvy::variant rec;
+  while (input_file.read(rec))
+  {
+    if (!stats.add(rec))
+      return false;
+  }
 
-    if (per_sample_stats.size())
-    {
-      if (!rec.get_format("GT", geno)) continue;
+  return !input_file.bad();
+}
+
+int stat_main(int argc, char** argv)
+{
+  stat_prog_args args;
+  if (!args.parse(argc, argv))
+  {
+    args.print_usage(std::cerr);
+    return EXIT_FAILURE;
+  }
 
-      savvy::stride_reduce(geno, geno.size() / per_sample_stats.size());
+  if (args.help_is_set())
+  {
+    args.print_usage(std::cout);
+    return EXIT_SUCCESS;
+  }
 
-      for (std::size_t i = 0; i < geno.size(); ++i)
+  savvy::reader input_file(args.input_path());
+  if (!input_file)
+  {
+    std::cerr << "Error: could not open " << args.input_path() << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  stat_accumulator stats(args, input_file.samples());
+
+  std::vector<std::vector<savvy::slice_bounds>> shards;
+  if (args.threads() > 1 && plan_stat_shards(args, args.threads() * 4, shards))
+  {
+    // Shards are handed out dynamically so that threads finishing early pick up remaining work.
+    std::atomic<std::size_t> next_shard(0);
+    std::atomic<bool> failed(false);
+    std::vector<stat_accumulator> thread_stats(std::min(args.threads(), std::max<std::size_t>(1, shards.size())), stats);
+    std::vector<std::thread> threads;
+    threads.reserve(thread_stats.size());
+    for (std::size_t t = 0; t < thread_stats.size(); ++t)
+    {
+      threads.emplace_back([&args, &shards, &next_shard, &failed, &thread_stats, t]()
       {
-        int8_t g = geno[i];
-        if (g < 0) continue;
-        if (g)
+        savvy::reader rdr(args.input_path());
+        rdr.set_site_filter(std::cref(args.filter_functor()));
+        savvy::variant rec;
+        std::size_t s;
+        while (!failed && (s = next_shard++) < shards.size())
         {
-          if (is_snp)
-            per_sample_stats[i].n_snp += g;
-          else
-            per_sample_stats[i].n_indel += g;
-
-          if (g == 1)
-            ++per_sample_stats[i].n_het;
-          else // assuming  g == 2
-            ++per_sample_stats[i].n_hom;
-
-          if (is_syn)
-            per_sample_stats[i].n_syn += g;
-          if (is_nonsyn)
-            per_sample_stats[i].n_nonsyn += g;
+          for (auto it = shards[s].begin(); it != shards[s].end() && !failed; ++it)
+          {
+            rdr.reset_bounds(*it);
+            while (rdr.read(rec))
+            {
+              if (args.reg() && !savvy::region_compare(savvy::bounding_point::beg, rec, *args.reg())) continue;
+              if (!thread_stats[t].add(rec))
+              {
+                failed = true;
+                break;
+              }
+            }
+
+            if (rdr.bad())
+            {
+              std::cerr << "Error: failed reading records " << it->from() << "-" << it->to() << std::endl;
+              failed = true;
+            }
+          }
         }
-      }
+      });
     }
+
+    for (auto it = threads.begin(); it != threads.end(); ++it)
+      it->join();
+
+    if (failed)
+      return EXIT_FAILURE;
+
+    for (auto it = thread_stats.begin(); it != thread_stats.end(); ++it)
+      stats.merge(*it);
   }
+  else
+  {
+    if (args.reg())
+    {
+      input_file.reset_bounds(*args.reg());
+      if (!input_file)
+      {
+        std::cerr << "Error: could not load region " << args.reg()->chromosome() << ":" << args.reg()->from() << "-" << args.reg()->to() << std::endl;
+        return EXIT_FAILURE;
+      }
+    }
+
+    input_file.set_block_filter([&args](const savvy::zone_map::block& b) { return args.filter_functor().may_match(b); });
+    input_file.set_site_filter(std::cref(args.filter_functor()));
 
+    if (!stat_records(input_file, stats))
+      return EXIT_FAILURE;
+  }
 
-  std::ofstream summary_out(args.summary_path(), std::ios::binary);
-  std::cout << record_cnt << "\t" << variant_cnt << "\t" << multi_allelic << "\n";
+  std::ofstream summary_file;
+  if (args.summary_path() != "/dev/stdout")
+    summary_file.open(args.summary_path(), std::ios::binary);
+  std::ostream& summary_out = summary_file.is_open() ? summary_file : std::cout;
+  summary_out << stats.record_cnt << "\t" << stats.variant_cnt << "\t" << stats.multi_allelic << "\n";
 
   if (args.per_sample_path().size())
   {
     std::ofstream per_sample_out(args.per_sample_path(), std::ios::binary);
     per_sample_t::print_header(per_sample_out);
-    for (const per_sample_t& s : per_sample_stats)
+    for (const per_sample_t& s : stats.per_sample_stats)
     {
       s.print(per_sample_out);
     }
@@ -359,9 +619,9 @@ int stat_main(int argc, char** argv)
   {
     std::ofstream per_ac_out(args.per_ac_path(), std::ios::binary);
     per_ac_t::print_header(per_ac_out);
-    for (std::size_t i = 0; i < per_ac_stats.size(); ++i)
+    for (std::size_t i = 0; i < stats.per_ac_stats.size(); ++i)
     {
-      per_ac_stats[i].print(per_ac_out, i / bin_width);
+      stats.per_ac_stats[i].print(per_ac_out, i);
     }
   }
 
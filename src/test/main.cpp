@@ -15,11 +15,14 @@
 #include "savvy/writer.hpp"
 #include "savvy/site_info.hpp"
 #include "savvy/data_format.hpp"
+#include "savvy/haplotype_matcher.hpp"
+#include "savvy/zone_map.hpp"
 
 #include <iostream>
 #include <fstream>
 #include <algorithm>
 #include <numeric>
+#include <random>
 #include <chrono>
 #include <sstream>
 #include <tuple>
@@ -565,6 +568,174 @@ void convert_file_test(const std::string& fmt_field)
   //savvy::sav::writer::create_index(fmt_field == "HDS" ? SAVVYT_SAV_FILE_DOSE : SAVVYT_SAV_FILE_HARD);
 }
 
+void pbwt_test()
+{
+  {
+    savvy::reader input(SAVVYT_VCF_FILE);
+    savvy::variant var;
+
+    savvy::writer output(SAVVYT_SAV_FILE_PBWT, savvy::file::format::sav2, input.headers(), input.samples());
+    output.set_block_size(5); // exercise PBWT resets
+    output.set_pbwt({"GT"});
+
+    std::size_t cnt = 0;
+    while (input.read(var))
+    {
+      output.write(var);
+      ++cnt;
+    }
+
+    assert(output.good() && !input.bad());
+    assert(cnt == SAVVYT_MARKER_COUNT_HARD);
+  }
+
+  run_file_checksum_test(SAVVYT_VCF_FILE, SAVVYT_SAV_FILE_PBWT, "GT");
+
+  // Larger sample size so that sorted columns are run-length encoded.
+  std::vector<std::string> ids(500);
+  for (std::size_t i = 0; i < ids.size(); ++i)
+    ids[i] = "ID" + std::to_string(i);
+
+  std::vector<std::vector<std::int8_t>> expected(SAVVYT_MARKER_COUNT_HARD, std::vector<std::int8_t>(ids.size() * 2));
+  for (std::size_t i = 0; i < expected.size(); ++i)
+  {
+    for (std::size_t j = 0; j < expected[i].size(); ++j)
+      expected[i][j] = std::int8_t((j * 7 + i * 3) % 11 < 2 + i % 5);
+  }
+
+  auto write_panel = [&](bool rle)
+  {
+    std::vector<std::pair<std::string, std::string>> headers = {{"contig","<ID=1>"},{"FORMAT","<ID=GT,Number=1,Type=String>"},{"phasing","full"}};
+    if (rle)
+      headers.emplace_back("pbwt_encoding", "rle");
+    savvy::writer output(SAVVYT_SAV_FILE_PBWT, savvy::file::format::sav2, headers, ids);
+    output.set_block_size(5);
+    output.set_pbwt({"GT"});
+    output.set_pbwt_rle(rle);
+    for (std::size_t i = 0; i < expected.size(); ++i)
+    {
+      savvy::variant var("1", 100 + i, "A", {"C"});
+      var.set_format("GT", expected[i]);
+      output.write(var);
+    }
+    assert(output.good());
+  };
+
+  auto gt_is_sparse = [](const savvy::variant& v)
+  {
+    auto it = std::find_if(v.format_fields().begin(), v.format_fields().end(), [](const std::pair<std::string, savvy::typed_value>& f) { return f.first == "GT"; });
+    assert(it != v.format_fields().end());
+    return it->second.is_sparse();
+  };
+
+  // Run-length encoding must be declared in the header.
+  {
+    savvy::writer output(SAVVYT_SAV_FILE_PBWT, savvy::file::format::sav2, {{"contig","<ID=1>"},{"FORMAT","<ID=GT,Number=1,Type=String>"},{"phasing","full"}}, ids);
+    output.set_pbwt_rle(true);
+    assert(!output.good());
+  }
+
+  // Without run-length encoding, sorted columns are stored as is.
+  write_panel(false);
+  {
+    savvy::reader unordered(SAVVYT_SAV_FILE_PBWT);
+    unordered.restore_pbwt_order(false);
+    savvy::variant var;
+    std::size_t cnt = 0;
+    for ( ; unordered.read(var); ++cnt)
+      assert(!gt_is_sparse(var));
+    assert(!unordered.bad());
+    assert(cnt == SAVVYT_MARKER_COUNT_HARD);
+  }
+
+  write_panel(true);
+
+  savvy::reader ordered(SAVVYT_SAV_FILE_PBWT);
+  savvy::reader unordered(SAVVYT_SAV_FILE_PBWT);
+  unordered.restore_pbwt_order(false);
+  savvy::reader runs(SAVVYT_SAV_FILE_PBWT);
+  runs.restore_pbwt_order(false);
+  runs.expand_pbwt_runs(false);
+
+  savvy::variant var1, var2, var3;
+  std::vector<std::int8_t> gt1;
+  savvy::compressed_vector<std::int8_t> gt2;
+  std::size_t cnt = 0;
+  bool rle_used = false;
+  while (ordered.read(var1) && unordered.read(var2) && runs.read(var3))
+  {
+    // Allele counts computed from runs must match those computed from decoded genotypes.
+    auto gt_field = std::find_if(var3.format_fields().begin(), var3.format_fields().end(), [](const std::pair<std::string, savvy::typed_value>& f) { return f.first == "GT"; });
+    assert(gt_field != var3.format_fields().end());
+    assert(gt_field->second.pbwt_runs() == gt_is_sparse(var3));
+    if (gt_field->second.pbwt_runs())
+    {
+      std::size_t ac = 0, n = 0;
+      assert(gt_field->second.for_each_pbwt_run([&](std::int64_t v, std::size_t len) { ac += v > 0 ? len : 0; n += len; }));
+      assert(n == expected[cnt].size());
+      assert(ac == std::size_t(std::count_if(expected[cnt].begin(), expected[cnt].end(), [](std::int8_t v) { return v > 0; })));
+      assert(!var3.get_format("GT", gt1));
+    }
+
+    assert(var1.get_format("GT", gt1));
+    assert(gt1 == expected[cnt]);
+
+    // Order-independent sums must match when sample order is not restored.
+    assert(var2.get_format("GT", gt2));
+    assert(gt2.size() == gt1.size());
+    assert(std::accumulate(gt2.begin(), gt2.end(), 0) == std::accumulate(gt1.begin(), gt1.end(), 0));
+    rle_used = rle_used || gt_is_sparse(var2);
+    ++cnt;
+  }
+
+  assert(!ordered.bad() && !unordered.bad() && !runs.bad());
+  assert(cnt == SAVVYT_MARKER_COUNT_HARD);
+  assert(rle_used);
+
+  // Rejected records must still advance the PBWT sort state.
+  savvy::reader filtered(SAVVYT_SAV_FILE_PBWT);
+  filtered.set_site_filter([](const savvy::site_info& s) { return s.pos() % 3 == 0; });
+  cnt = 0;
+  while (filtered.read(var1))
+  {
+    assert(var1.pos() % 3 == 0);
+    assert(var1.get_format("GT", gt1));
+    assert(gt1 == expected[var1.pos() - 100]);
+    ++cnt;
+  }
+
+  assert(!filtered.bad());
+  assert(cnt == (SAVVYT_MARKER_COUNT_HARD + 2) / 3);
+
+  // Sites-only reads skip individual data, and full reads can resume at the start of any block.
+  savvy::reader sites(SAVVYT_SAV_FILE_PBWT);
+  sites.sites_only(true);
+  std::vector<std::int64_t> block_positions;
+  std::int64_t pos = sites.tellg();
+  cnt = 0;
+  while (sites.read(var1))
+  {
+    assert(var1.format_fields().empty());
+    assert(var1.pos() == 100 + cnt);
+    if (cnt % 5 == 0)
+      block_positions.push_back(pos);
+    pos = sites.tellg();
+    ++cnt;
+  }
+
+  assert(!sites.bad());
+  assert(cnt == SAVVYT_MARKER_COUNT_HARD);
+
+  savvy::reader seeking(SAVVYT_SAV_FILE_PBWT);
+  for (std::size_t i = block_positions.size(); i-- > 0; )
+  {
+    assert(seeking.seekg(block_positions[i]).read(var1));
+    assert(var1.pos() == 100 + i * 5);
+    assert(var1.get_format("GT", gt1));
+    assert(gt1 == expected[i * 5]);
+  }
+}
+
 //class marker_counter
 //{
 //public:
@@ -606,6 +777,223 @@ void convert_file_test(const std::string& fmt_field)
 //};
 
 
+void haplotype_matching_test()
+{
+  std::vector<std::vector<std::int8_t>> panel = {
+    {0, 1, 0, 1},
+    {0, 1, 0, 1},
+    {0, 1, 1, 0},
+    {0, 1, 1, 0},
+    {0, 1, 1, 0},
+    {0, 1, 1, 0}};
+  std::vector<std::vector<std::int8_t>> query = {{0}, {0}, {0}, {1}, {1}, {1}};
+
+  for (auto m : {savvy::haplotype_matcher::mode::set_maximal, savvy::haplotype_matcher::mode::longest})
+  {
+    savvy::haplotype_matcher matcher(4, 1, m);
+    bool success = true;
+    for (std::size_t i = 0; i < panel.size(); ++i)
+      success = matcher.add_marker(panel[i], query[i]) && success;
+    matcher.finalize();
+    assert(success);
+    success = matcher.add_marker(panel[0], query[0]);
+    assert(!success);
+
+    std::vector<std::tuple<std::size_t, std::size_t, std::size_t>> res;
+    for (auto it = matcher.matches().begin(); it != matcher.matches().end(); ++it)
+      res.emplace_back(it->haplotype, it->begin, it->end);
+    std::sort(res.begin(), res.end());
+
+    std::vector<std::tuple<std::size_t, std::size_t, std::size_t>> expected = {
+      std::make_tuple(0, 0, 3), std::make_tuple(1, 3, 6), std::make_tuple(2, 3, 6)};
+    assert(res == expected);
+  }
+
+  savvy::haplotype_matcher matcher(4, 1, savvy::haplotype_matcher::mode::set_maximal, 4);
+  for (std::size_t i = 0; i < panel.size(); ++i)
+    matcher.add_marker(panel[i], query[i]);
+  matcher.finalize();
+  assert(matcher.matches().empty());
+
+  // A query marker that is absent from the panel must not cause the panel to be read past the next contig.
+  {
+    savvy::writer output("test_file_match_panel.sav", savvy::file::format::sav2, {{"contig","<ID=chr1>"},{"contig","<ID=chr2>"},{"FORMAT","<ID=GT,Number=1,Type=String>"},{"phasing","full"}}, {"A", "B"});
+    for (std::string chrom : {"chr1", "chr2"})
+    {
+      for (std::uint32_t pos = 10; pos <= 100; pos += 10)
+      {
+        savvy::variant var(chrom, pos, "A", {"C"});
+        var.set_format("GT", std::vector<std::int8_t>{0, 1, std::int8_t(pos / 10 % 2), 1});
+        output.write(var);
+      }
+    }
+    assert(output.good());
+  }
+
+  std::vector<savvy::site_info> query_sites = {
+    savvy::site_info("chr1", 20, "A", {"C"}),
+    savvy::site_info("chr1", 5000, "A", {"C"}),
+    savvy::site_info("chr2", 30, "A", {"C"}),
+    savvy::site_info("chr2", 40, "A", {"G"}),
+    savvy::site_info("chr2", 50, "A", {"C"})};
+  std::vector<bool> expected_found = {true, false, true, false, true};
+
+  // Contig order comes from the headers or, without contig headers, from the order contigs are first encountered.
+  for (bool use_headers : {true, false})
+  {
+    savvy::reader panel_file("test_file_match_panel.sav");
+    std::vector<std::pair<std::string, std::string>> headers;
+    if (use_headers)
+      headers = panel_file.headers();
+    savvy::marker_cursor<savvy::reader, savvy::variant> cursor(panel_file, headers);
+    for (std::size_t i = 0; i < query_sites.size(); ++i)
+    {
+      assert(cursor.seek(query_sites[i]) == expected_found[i]);
+      if (expected_found[i])
+      {
+        assert(cursor.record().chrom() == query_sites[i].chrom() && cursor.record().pos() == query_sites[i].pos());
+        cursor.next();
+      }
+    }
+    assert(cursor.good());
+  }
+}
+
+void zone_map_test()
+{
+  std::vector<std::vector<std::pair<std::int32_t, bool>>> blocks; // DP and whether record is expected to be read
+  {
+    savvy::reader input(SAVVYT_VCF_FILE);
+    savvy::variant var;
+
+    savvy::writer output(SAVVYT_SAV_FILE_ZONE_MAP, savvy::file::format::sav2, input.headers(), input.samples());
+    output.set_block_size(2);
+    output.set_zone_map_fields({"DP", "AA", "DB"});
+
+    std::string chrom;
+    while (input.read(var))
+    {
+      if (blocks.empty() || blocks.back().size() == 2 || var.chrom() != chrom)
+        blocks.emplace_back();
+      chrom = var.chrom();
+
+      std::int32_t dp = 0;
+      var.get_info("DP", dp);
+      blocks.back().emplace_back(dp, false);
+      output.write(var);
+    }
+
+    assert(output.good() && !input.bad());
+  }
+
+  std::vector<std::int32_t> expected;
+  for (auto it = blocks.begin(); it != blocks.end(); ++it)
+  {
+    if (std::any_of(it->begin(), it->end(), [](const std::pair<std::int32_t, bool>& p) { return p.first >= 14; }))
+    {
+      for (auto jt = it->begin(); jt != it->end(); ++jt)
+        expected.push_back(jt->first);
+    }
+  }
+  assert(expected.size() < SAVVYT_MARKER_COUNT_HARD);
+
+  savvy::reader input(SAVVYT_SAV_FILE_ZONE_MAP);
+  std::size_t block_cnt = 0;
+  bool success = input.set_block_filter([&block_cnt](const savvy::zone_map::block& b)
+  {
+    ++block_cnt;
+    assert(b.get("AA") && (!b.get("AA")->bounded || b.get("AA")->has_missing)); // String field
+    assert(b.get("DB") && b.get("DB")->has_missing);
+    assert(!b.get("AF"));
+    return b.get("DP")->max >= 14;
+  });
+  assert(success);
+
+  std::vector<std::int32_t> observed;
+  savvy::variant var;
+  while (input.read(var))
+  {
+    std::int32_t dp = 0;
+    var.get_info("DP", dp);
+    observed.push_back(dp);
+  }
+
+  assert(!input.bad());
+  assert(block_cnt == blocks.size());
+  assert(observed == expected);
+}
+
+void id_index_test()
+{
+  const std::vector<std::string> query = {"microsat1", "rs6040355", "rs0"};
+  std::vector<std::uint32_t> expected;
+  {
+    savvy::reader input(SAVVYT_VCF_FILE);
+    savvy::variant var;
+
+    savvy::writer output(SAVVYT_SAV_FILE_ID_INDEX, savvy::file::format::sav2, input.headers(), input.samples());
+    output.set_block_size(2);
+    output.set_id_index(true);
+    output.set_zone_map_fields({"DP"});
+
+    while (input.read(var))
+    {
+      if (std::find(query.begin(), query.end(), var.id()) != query.end())
+        expected.push_back(var.pos());
+      output.write(var);
+    }
+
+    assert(output.good() && !input.bad());
+  }
+  assert(expected.size() == 5);
+
+  savvy::reader input(SAVVYT_SAV_FILE_ID_INDEX);
+  assert(input.reset_bounds(query));
+
+  std::vector<std::uint32_t> observed;
+  savvy::variant var;
+  while (input.read(var))
+    observed.push_back(var.pos());
+  assert(!input.bad());
+  assert(observed == expected);
+
+  // Zone map frame should still be found with ID index frame between it and the S1R index.
+  assert(input.set_block_filter([](const savvy::zone_map::block&) { return true; }));
+
+  assert(input.reset_bounds(std::vector<std::string>{"rs0"}));
+  assert(!input.read(var) && !input.bad());
+
+  savvy::reader vcf_input(SAVVYT_VCF_FILE);
+  assert(!vcf_input.reset_bounds(query));
+
+  // Footer frames with another file's UUID (e.g., left behind by a tool that rewrote the header) are ignored.
+  {
+    std::ifstream src(SAVVYT_SAV_FILE_ID_INDEX, std::ios::binary);
+    std::ofstream dest("test_file_stale_frames.sav", std::ios::binary);
+    dest << src.rdbuf();
+  }
+  {
+    std::int64_t s1r_offset = savvy::s1r::reader("test_file_stale_frames.sav").file_offset();
+    std::fstream fs("test_file_stale_frames.sav", std::ios::binary | std::ios::in | std::ios::out);
+    std::string version;
+    std::array<std::uint8_t, 16> uuid;
+    std::size_t frame_cnt = 0;
+    for (std::int64_t end_pos = s1r_offset - 8, frame_pos; (frame_pos = savvy::detail::find_footer_frame(fs, end_pos, version, uuid)) >= 0; end_pos = frame_pos)
+    {
+      uuid[0] ^= 0xFF;
+      fs.seekp(end_pos - std::int64_t(savvy::detail::footer_frame_footer_size) + 4);
+      fs.write((const char*)uuid.data(), uuid.size());
+      ++frame_cnt;
+    }
+    assert(frame_cnt == 2 && fs.good());
+  }
+
+  savvy::reader stale_input("test_file_stale_frames.sav");
+  assert(stale_input.good());
+  assert(!stale_input.set_block_filter([](const savvy::zone_map::block&) { return true; }));
+  assert(!stale_input.reset_bounds(query));
+}
+
 void sav_random_access_test(const std::string& fmt_field)
 {
   savvy::reader rdr(fmt_field == "GT" ? SAVVYT_SAV_FILE_HARD : SAVVYT_SAV_FILE_DOSE);
@@ -827,6 +1215,824 @@ void missing_headers_test()
   assert(!input.bad());
 }
 
+void concat_samples_test()
+{
+  std::vector<std::int8_t> a = {0, 1, 0, 0, 1, 1};
+  std::vector<std::int16_t> b = {0, 0, 300, 0};
+  std::int16_t m = savvy::typed_value::missing_value<std::int16_t>();
+  std::vector<std::int16_t> expected = {0, 1, 0, 0, 1, 1, m, m, 0, 0, 300, 0};
+
+  savvy::typed_value sp_a(savvy::compressed_vector<std::int8_t>(a.begin(), a.end()));
+  savvy::typed_value sp_b(savvy::compressed_vector<std::int16_t>(b.begin(), b.end()));
+  savvy::typed_value dense_b(b);
+  std::vector<std::size_t> sample_counts = {3, 1, 2};
+
+  savvy::typed_value res;
+  std::vector<std::int16_t> res_vec;
+  assert(savvy::typed_value::concat_samples({&sp_a, nullptr, &sp_b}, sample_counts, res));
+  assert(res.is_sparse() && res.size() == expected.size() && res.non_zero_size() == 6);
+  assert(res.get(res_vec) && res_vec == expected);
+
+  assert(savvy::typed_value::concat_samples({&sp_a, nullptr, &dense_b}, sample_counts, res));
+  assert(!res.is_sparse());
+  assert(res.get(res_vec) && res_vec == expected);
+
+  // Haploid source is padded to ploidy of other sources.
+  std::vector<std::int8_t> haploid = {1, 0};
+  savvy::typed_value haploid_val(haploid);
+  assert(savvy::typed_value::concat_samples({&sp_a, &haploid_val}, {3, 2}, res));
+  assert(res.get(res_vec) && res_vec.size() == 10);
+  assert(res_vec[6] == 1 && res_vec[8] == 0 && savvy::typed_value::is_end_of_vector(res_vec[7]) && savvy::typed_value::is_end_of_vector(res_vec[9]));
+
+  assert(!savvy::typed_value::concat_samples({&sp_a}, {4}, res));
+}
+
+void reorder_samples_test()
+{
+  std::vector<std::int8_t> gt = {0, 1, 0, 0, 1, 1, 2, 0};
+  std::vector<std::size_t> new_index = {3, 0, 2, 1};
+  std::vector<std::int8_t> expected = {0, 0, 2, 0, 1, 1, 0, 1};
+
+  savvy::typed_value sp_gt(savvy::compressed_vector<std::int8_t>(gt.begin(), gt.end()));
+  savvy::typed_value dense_gt(gt);
+  savvy::typed_value res;
+  std::vector<std::int8_t> res_vec;
+
+  assert(sp_gt.copy_subset(res, new_index, new_index.size()));
+  assert(res.is_sparse() && res.size() == gt.size() && res.non_zero_size() == 4);
+  assert(res.get(res_vec) && res_vec == expected);
+
+  assert(dense_gt.copy_subset(res, new_index, new_index.size()));
+  assert(!res.is_sparse());
+  assert(res.get(res_vec) && res_vec == expected);
+
+  // Reordering can be combined with dropping samples.
+  new_index = {1, std::numeric_limits<std::size_t>::max(), 0, std::numeric_limits<std::size_t>::max()};
+  assert(sp_gt.copy_subset(res, new_index, 2));
+  assert(res.get(res_vec) && res_vec == std::vector<std::int8_t>({1, 1, 0, 1}));
+}
+
+template <typename T>
+void check_sparse_conversion(const std::vector<T>& dense)
+{
+  std::vector<std::size_t> expected_idx;
+  for (std::size_t i = 0; i < dense.size(); ++i)
+  {
+    if (dense[i])
+      expected_idx.push_back(i);
+  }
+
+  std::vector<std::size_t> idx;
+  auto push_fn = [&idx](std::size_t i) { idx.push_back(i); };
+  savvy::detail::simd::for_each_nonzero(dense.data(), dense.size(), push_fn);
+  assert(idx == expected_idx);
+
+#ifdef SAVVY_SIMD_X86
+  idx.clear();
+  std::size_t i = savvy::detail::simd::for_each_nonzero_sse2(dense.data(), dense.size(), push_fn);
+  for ( ; i < dense.size(); ++i)
+  {
+    if (dense[i])
+      push_fn(i);
+  }
+  assert(idx == expected_idx);
+#endif
+
+  savvy::typed_value dense_val(dense), sparse_val, dense_copy;
+  assert(dense_val.copy_as_sparse(sparse_val));
+  assert(sparse_val.is_sparse() && sparse_val.non_zero_size() == expected_idx.size());
+
+  std::vector<T> res;
+  assert(sparse_val.get(res) && res.size() == dense.size());
+  for (std::size_t j = 0; j < dense.size(); ++j)
+    assert(std::memcmp(&res[j], &dense[j], sizeof(T)) == 0 || (!dense[j] && !res[j]));
+
+  assert(sparse_val.copy_as_dense(dense_copy) && !dense_copy.is_sparse());
+  assert(dense_copy.get(res));
+  for (std::size_t j = 0; j < dense.size(); ++j)
+    assert(std::memcmp(&res[j], &dense[j], sizeof(T)) == 0 || (!dense[j] && !res[j]));
+}
+
+void sparse_conversion_test()
+{
+  std::mt19937_64 rng(7);
+  for (std::size_t sz : {0, 1, 15, 16, 31, 33, 100, 1000, 4099})
+  {
+    for (double rate : {0.0, 0.01, 0.3, 1.0})
+    {
+      std::bernoulli_distribution nz(rate);
+      std::vector<std::int8_t> v8(sz);
+      std::vector<std::int16_t> v16(sz);
+      std::vector<float> vf(sz);
+      for (std::size_t i = 0; i < sz; ++i)
+      {
+        if (nz(rng))
+        {
+          v8[i] = std::int8_t(1 + rng() % 100) * (rng() % 2 ? -1 : 1);
+          v16[i] = rng() % 4 ? std::int16_t(0x100 * (1 + rng() % 100)) : savvy::typed_value::missing_value<std::int16_t>(); // zero low byte
+          vf[i] = rng() % 4 ? float(rng() % 100 + 1) / 8.f : savvy::typed_value::missing_value<float>();
+        }
+        else if (rng() % 2)
+        {
+          vf[i] = -0.f;
+        }
+      }
+
+      check_sparse_conversion(v8);
+      check_sparse_conversion(v16);
+      check_sparse_conversion(vf);
+    }
+  }
+}
+
+template <typename T>
+std::size_t expected_min_width(const std::vector<T>& vec)
+{
+  std::int64_t min_val = 0, max_val = 0;
+  for (auto it = vec.begin(); it != vec.end(); ++it)
+  {
+    if (*it > savvy::typed_value::max_reserved_value<T>())
+    {
+      min_val = std::min<std::int64_t>(min_val, *it);
+      max_val = std::max<std::int64_t>(max_val, *it);
+    }
+  }
+
+  if (min_val > savvy::typed_value::max_reserved_value<std::int8_t>() && max_val <= std::numeric_limits<std::int8_t>::max())
+    return 1;
+  if (min_val > savvy::typed_value::max_reserved_value<std::int16_t>() && max_val <= std::numeric_limits<std::int16_t>::max())
+    return 2;
+  if (min_val > savvy::typed_value::max_reserved_value<std::int32_t>() && max_val <= std::numeric_limits<std::int32_t>::max())
+    return 4;
+  return 8;
+}
+
+template <typename T>
+void check_minimized_values(const savvy::typed_value& val, const std::vector<T>& vec)
+{
+  assert(val.val_width() == expected_min_width(vec));
+
+  std::vector<std::int64_t> res;
+  assert(val.get(res) && res.size() == vec.size());
+  for (std::size_t i = 0; i < vec.size(); ++i)
+  {
+    if (savvy::typed_value::is_end_of_vector(vec[i]))
+      assert(savvy::typed_value::is_end_of_vector(res[i]));
+    else if (vec[i] <= savvy::typed_value::max_reserved_value<T>())
+      assert(savvy::typed_value::is_missing(res[i]));
+    else
+      assert(res[i] == vec[i]);
+  }
+}
+
+template <typename T>
+void check_type_minimization(std::mt19937_64& rng)
+{
+  const T reserved[] = {savvy::typed_value::missing_value<T>(), savvy::typed_value::end_of_vector_value<T>(), T(savvy::typed_value::max_reserved_value<T>() - 1)};
+  for (std::size_t sz : {0, 1, 7, 8, 15, 16, 17, 33, 1000})
+  {
+    for (std::int64_t range : {std::int64_t(100), std::int64_t(30000), std::int64_t(2000000000)})
+    {
+      range = std::min<std::int64_t>(range, std::numeric_limits<T>::max() - 1);
+      std::vector<T> vec(sz);
+      for (std::size_t i = 0; i < sz; ++i)
+        vec[i] = rng() % 8 == 0 ? reserved[rng() % 3] : T(std::int64_t(rng() % (2 * range + 1)) - range);
+
+      savvy::typed_value val(vec);
+      check_minimized_values(val, vec);
+
+      // Subsetting out a sample with a large value should narrow the remaining values in minimize().
+      std::vector<T> wide_vec(vec);
+      wide_vec.insert(wide_vec.begin(), std::numeric_limits<T>::max());
+      std::vector<std::size_t> subset_map(wide_vec.size());
+      subset_map[0] = std::numeric_limits<std::size_t>::max();
+      std::iota(subset_map.begin() + 1, subset_map.end(), 0);
+
+      savvy::typed_value subset_val;
+      assert(savvy::typed_value(wide_vec).copy_subset(subset_val, subset_map, vec.size()));
+      check_minimized_values(subset_val, vec);
+    }
+  }
+}
+
+void type_minimization_test()
+{
+  std::mt19937_64 rng(11);
+  check_type_minimization<std::int16_t>(rng);
+  check_type_minimization<std::int32_t>(rng);
+  check_type_minimization<std::int64_t>(rng);
+}
+
+void packed_genotypes_test()
+{
+  // Packing must be declared in the header.
+  {
+    savvy::writer output("test_file_packed.sav", savvy::file::format::sav2, {{"contig","<ID=1>"},{"FORMAT","<ID=GT,Number=1,Type=String>"},{"phasing","full"}}, {"ID1"});
+    output.set_packed_fields({"GT"});
+    assert(!output.good());
+  }
+
+  {
+    savvy::reader input(SAVVYT_VCF_FILE);
+    savvy::variant var;
+
+    auto headers = input.headers();
+    headers.emplace_back("packed_encoding", "bits");
+    savvy::writer output("test_file_packed.sav", savvy::file::format::sav2, headers, input.samples());
+    output.set_packed_fields({"GT"});
+
+    std::size_t cnt = 0;
+    while (input.read(var))
+    {
+      output.write(var);
+      ++cnt;
+    }
+
+    assert(output.good() && !input.bad());
+    assert(cnt == SAVVYT_MARKER_COUNT_HARD);
+  }
+
+  run_file_checksum_test(SAVVYT_VCF_FILE, "test_file_packed.sav", "GT");
+
+  // Odd sample count so that packed vectors end in partial bytes and partial SIMD blocks.
+  std::vector<std::string> ids(333);
+  for (std::size_t i = 0; i < ids.size(); ++i)
+    ids[i] = "ID" + std::to_string(i);
+
+  std::mt19937_64 rng(46);
+  std::vector<std::vector<std::int8_t>> expected;
+  std::vector<bool> sparse;
+  for (std::int8_t max_allele : {1, 1, 5, 13, 20})
+  {
+    for (int missing_rate : {0, 10})
+    {
+      for (bool make_sparse : {false, true})
+      {
+        std::vector<std::int8_t> gt(ids.size() * 2);
+        for (std::size_t j = 0; j < gt.size(); ++j)
+        {
+          gt[j] = std::int8_t(rng() % 4 ? 0 : rng() % (max_allele + 1));
+          if (missing_rate && int(rng() % 100) < missing_rate)
+            gt[j] = j % 2 ? savvy::typed_value::end_of_vector_value<std::int8_t>() : savvy::typed_value::missing_value<std::int8_t>();
+        }
+        expected.emplace_back(std::move(gt));
+        sparse.push_back(make_sparse);
+      }
+    }
+  }
+  expected.emplace_back(ids.size() * 2, 0); // sparse vector with no non-zero values is smaller than packed
+  sparse.push_back(true);
+
+  {
+    savvy::writer output("test_file_packed.sav", savvy::file::format::sav2, {{"contig","<ID=1>"},{"FORMAT","<ID=GT,Number=1,Type=String>"},{"FORMAT","<ID=DS,Number=1,Type=Float>"},{"phasing","full"},{"packed_encoding","bits"}}, ids);
+    output.set_packed_fields({"GT", "DS"});
+    for (std::size_t i = 0; i < expected.size(); ++i)
+    {
+      savvy::variant var("1", 100 + i, "A", {"C"});
+      if (sparse[i])
+        var.set_format("GT", savvy::compressed_vector<std::int8_t>(expected[i].begin(), expected[i].end()));
+      else
+        var.set_format("GT", expected[i]);
+      var.set_format("DS", std::vector<float>(ids.size(), 0.5f)); // not an int8 field, so never packed
+      output.write(var);
+    }
+    assert(output.good());
+  }
+
+  savvy::reader input("test_file_packed.sav");
+  savvy::variant var;
+  std::vector<std::int8_t> gt;
+  std::vector<float> ds;
+  std::size_t cnt = 0;
+  while (input.read(var))
+  {
+    assert(var.get_format("GT", gt));
+    assert(gt == expected[cnt]);
+    assert(var.get_format("DS", ds));
+    assert(ds == std::vector<float>(ids.size(), 0.5f));
+    ++cnt;
+  }
+
+  assert(!input.bad());
+  assert(cnt == expected.size());
+}
+
+void check_view_matches(const savvy::typed_value& val)
+{
+  savvy::typed_value_view view(val);
+  assert(view.size() == val.size());
+  assert(view.is_sparse() == val.is_sparse());
+
+  std::string str1, str2;
+  if (val.get(str1))
+  {
+    assert(view.get(str2) && str1 == str2);
+    return;
+  }
+
+  std::vector<std::int32_t> dense1, dense2;
+  assert(val.get(dense1) && view.get(dense2));
+  assert(dense1 == dense2);
+
+  savvy::compressed_vector<std::int32_t> sparse1, sparse2;
+  assert(val.get(sparse1) && view.get(sparse2));
+  assert(std::equal(sparse1.begin(), sparse1.end(), sparse2.begin()) && sparse1.size() == sparse2.size());
+
+  savvy::typed_value dense_copy;
+  assert(view.copy_as_dense(dense_copy) && !dense_copy.is_sparse());
+  assert(dense_copy.get(dense2) && dense1 == dense2);
+
+  std::int32_t scalar = 0;
+  assert(view.get(scalar) == (val.size() > 0));
+  if (val.size())
+    assert(scalar == dense1[0]);
+}
+
+void typed_value_view_test()
+{
+  std::size_t cnt = 0;
+  {
+    savvy::reader input(SAVVYT_VCF_FILE);
+    savvy::writer copy_output("test_file_view_copy.sav", savvy::file::format::sav2, input.headers(), input.samples());
+    savvy::writer view_output("test_file_view.sav", savvy::file::format::sav2, input.headers(), input.samples());
+    view_output.set_pbwt({"HDS"});
+
+    savvy::variant var, sparse_var;
+    std::vector<std::pair<std::string, savvy::typed_value_view>> views;
+    savvy::typed_value tmp;
+    while (input >> var)
+    {
+      sparse_var = var;
+      for (auto it = sparse_var.format_fields().begin(); it != sparse_var.format_fields().end(); ++it)
+      {
+        check_view_matches(it->second);
+        if (it->first != "HDS")
+        {
+          it->second.copy_as_sparse(tmp);
+          sparse_var.set_format(it->first, std::move(tmp));
+          check_view_matches(it->second);
+        }
+      }
+
+      views.clear();
+      for (auto it = sparse_var.format_fields().begin(); it != sparse_var.format_fields().end(); ++it)
+        views.emplace_back(it->first, it->second);
+
+      copy_output.write(sparse_var);
+      view_output.write(sparse_var, views);
+      ++cnt;
+    }
+    assert(copy_output.good() && view_output.good() && !input.bad());
+  }
+
+  savvy::reader copy_input("test_file_view_copy.sav");
+  savvy::reader view_input("test_file_view.sav");
+  savvy::variant var1, var2;
+  std::vector<std::int32_t> vec1, vec2;
+  std::size_t read_cnt = 0;
+  while (copy_input >> var1 && view_input >> var2)
+  {
+    assert(var1.pos() == var2.pos() && var1.ref() == var2.ref() && var1.alts() == var2.alts());
+    assert(var1.format_fields().size() == var2.format_fields().size());
+    for (std::size_t i = 0; i < var1.format_fields().size(); ++i)
+    {
+      assert(var1.format_fields()[i].first == var2.format_fields()[i].first);
+      assert(var1.format_fields()[i].second.get(vec1) == var2.format_fields()[i].second.get(vec2));
+      assert(vec1 == vec2);
+    }
+    ++read_cnt;
+  }
+  assert(read_cnt == cnt && !copy_input.bad() && !view_input.bad());
+
+  // Views of external buffers
+  std::vector<std::string> ids = {"A", "B", "C", "D"};
+  std::vector<std::int8_t> gt = {0, 1, 1, 0, savvy::typed_value::missing_value<std::int8_t>(), 0, 0, 1};
+  std::vector<std::int16_t> ec_vals = {300, -2};
+  std::vector<std::uint8_t> ec_offs = {1, 1};
+  {
+    savvy::writer output("test_file_view.sav", savvy::file::format::sav2, {{"contig","<ID=1>"},{"FORMAT","<ID=GT,Number=1,Type=String>"},{"FORMAT","<ID=EC,Number=1,Type=Integer>"},{"phasing","full"}}, ids);
+    savvy::site_info site("1", 100, "A", {"C"});
+    output.write(site, {{"GT", savvy::typed_value_view(savvy::typed_value::int8, gt.size(), gt.data())},
+      {"EC", savvy::typed_value_view(savvy::typed_value::int16, ids.size(), savvy::typed_value::int8, ec_vals.size(), ec_vals.data(), ec_offs.data())}});
+    assert(output.good());
+  }
+
+  savvy::reader input("test_file_view.sav");
+  savvy::variant var;
+  std::vector<std::int8_t> gt_out;
+  std::vector<std::int16_t> ec_out;
+  assert(input >> var);
+  assert(var.pos() == 100);
+  assert(var.get_format("GT", gt_out) && gt_out == gt);
+  assert(var.get_format("EC", ec_out) && ec_out == std::vector<std::int16_t>({0, 300, 0, -2}));
+  assert(!(input >> var));
+}
+
+typedef savvy::detail::small_buffer<16> test_small_buffer;
+
+test_small_buffer make_small_buffer(std::size_t sz, char seed)
+{
+  test_small_buffer ret;
+  ret.resize(sz);
+  for (std::size_t i = 0; i < sz; ++i)
+    ret[i] = char(seed + i);
+  return ret;
+}
+
+bool check_small_buffer(const test_small_buffer& buf, std::size_t sz, char seed)
+{
+  if (buf.size() != sz || buf.capacity() < sz)
+    return false;
+  for (std::size_t i = 0; i < sz; ++i)
+  {
+    if (buf[i] != char(seed + i))
+      return false;
+  }
+  return true;
+}
+
+bool is_inline(const test_small_buffer& buf) { return buf.capacity() == 16; } // heap capacity is always larger
+
+// Site-level codec is protected since it is only used by reader and writer.
+struct site_info_codec : public savvy::site_info
+{
+  using savvy::site_info::serialize;
+  using savvy::site_info::deserialize_shared;
+};
+
+void small_buffer_test()
+{
+  const std::size_t small = 12, large = 40;
+
+  // Move construction
+  for (std::size_t sz : {small, large})
+  {
+    test_small_buffer src = make_small_buffer(sz, 'a');
+    test_small_buffer dest(std::move(src));
+    assert(check_small_buffer(dest, sz, 'a'));
+    assert(is_inline(dest) == (sz == small));
+    assert(src.empty() && is_inline(src));
+    src.resize(3); // moved-from buffer is reusable
+    assert(src.size() == 3 && src[0] == 0 && src[2] == 0);
+  }
+
+  // Move assignment (inline -> inline, inline -> heap, heap -> inline, heap -> heap)
+  for (std::size_t src_sz : {small, large})
+  {
+    for (std::size_t dest_sz : {small, large})
+    {
+      test_small_buffer src = make_small_buffer(src_sz, 'a');
+      test_small_buffer dest = make_small_buffer(dest_sz, 'A');
+      dest = std::move(src);
+      assert(check_small_buffer(dest, src_sz, 'a'));
+      assert(is_inline(dest) == (src_sz == small));
+      assert(src.empty() && is_inline(src));
+    }
+  }
+
+  // Copies
+  {
+    test_small_buffer heap = make_small_buffer(large, 'a');
+    test_small_buffer inl = make_small_buffer(small, 'A');
+    test_small_buffer copy(heap);
+    assert(check_small_buffer(copy, large, 'a') && check_small_buffer(heap, large, 'a'));
+    copy = inl;
+    assert(check_small_buffer(copy, small, 'A') && check_small_buffer(inl, small, 'A'));
+  }
+
+  // Swap
+  for (std::size_t a_sz : {small, large})
+  {
+    for (std::size_t b_sz : {small, large})
+    {
+      test_small_buffer a = make_small_buffer(a_sz, 'a');
+      test_small_buffer b = make_small_buffer(b_sz, 'A');
+      a.swap(b);
+      assert(check_small_buffer(a, b_sz, 'A') && is_inline(a) == (b_sz == small));
+      assert(check_small_buffer(b, a_sz, 'a') && is_inline(b) == (a_sz == small));
+    }
+  }
+
+  // Growth keeps contents and zero-fills, shrinking keeps capacity.
+  {
+    test_small_buffer buf = make_small_buffer(small, 'a');
+    buf.resize(large);
+    assert(!is_inline(buf) && buf.size() == large);
+    for (std::size_t i = 0; i < large; ++i)
+      assert(buf[i] == (i < small ? char('a' + i) : 0));
+    std::size_t cap = buf.capacity();
+    buf.resize(4);
+    assert(check_small_buffer(buf, 4, 'a') && buf.capacity() == cap);
+    buf.resize(8);
+    assert(buf[3] == char('a' + 3) && buf[4] == 0 && buf[7] == 0);
+    buf.clear();
+    assert(buf.empty() && buf.capacity() == cap);
+  }
+
+  // typed_value round trip through INFO encoding, with entries reused between records of different sizes.
+  savvy::dictionary dict;
+  dict.entries[savvy::dictionary::contig].push_back({"1", "", 0});
+  dict.str_to_int[savvy::dictionary::contig]["1"] = 0;
+  for (std::string key : {"PASS", "AC", "AF", "NAME", "LIST"})
+  {
+    dict.str_to_int[savvy::dictionary::id][key] = std::uint32_t(dict.entries[savvy::dictionary::id].size());
+    dict.entries[savvy::dictionary::id].push_back({key, "1", 0});
+  }
+
+  std::vector<std::int32_t> long_list(10);
+  std::iota(long_list.begin(), long_list.end(), 100000);
+  std::vector<std::vector<std::int32_t>> lists = {long_list, {1, 2, 3}, long_list};
+  std::vector<std::string> names = {"short", "a much longer name than sixteen bytes", "x"};
+
+  site_info_codec decoded;
+  for (std::size_t i = 0; i < lists.size(); ++i)
+  {
+    savvy::site_info site("1", 100 + i, "A", {"C"});
+    site.set_info("AC", std::int32_t(i + 1));
+    site.set_info("AF", 0.25f * float(i));
+    site.set_info("NAME", names[i]);
+    site.set_info("LIST", lists[i]);
+
+    std::vector<char> buf;
+    assert(site_info_codec::serialize(site, std::back_inserter(buf), dict, 0, 0));
+    std::istringstream is(std::string(buf.begin(), buf.end()));
+    std::uint32_t n_sample = 0;
+    assert(site_info_codec::deserialize_shared(decoded, is, dict, n_sample) > 0);
+
+    std::int32_t ac = 0;
+    float af = -1.f;
+    std::string name;
+    std::vector<std::int32_t> list;
+    assert(decoded.get_info("AC", ac) && ac == std::int32_t(i + 1));
+    assert(decoded.get_info("AF", af) && af == 0.25f * float(i));
+    assert(decoded.get_info("NAME", name) && name == names[i]);
+    assert(decoded.get_info("LIST", list) && list == lists[i]);
+
+    savvy::site_info copy(decoded);
+    assert(copy.get_info("LIST", list) && list == lists[i]);
+  }
+}
+
+template <typename T>
+std::vector<T> subset_expected(const std::vector<T>& full, const std::vector<bool>& keep)
+{
+  std::size_t stride = full.size() / keep.size();
+  std::vector<T> ret;
+  for (std::size_t i = 0; i < full.size(); ++i)
+  {
+    if (keep[i / stride])
+      ret.push_back(full[i]);
+  }
+  return ret;
+}
+
+void subset_kernels_test()
+{
+  std::vector<std::string> ids(700);
+  for (std::size_t i = 0; i < ids.size(); ++i)
+    ids[i] = "ID" + std::to_string(i);
+
+  // Leading run of kept samples is left in place, the rest are gathered.
+  std::vector<bool> keep(ids.size());
+  std::unordered_set<std::string> subset;
+  for (std::size_t i = 0; i < ids.size(); ++i)
+  {
+    keep[i] = i < 10 || i % 3 == 1;
+    if (keep[i])
+      subset.insert(ids[i]);
+  }
+
+  std::mt19937_64 rng(49);
+  std::vector<std::vector<std::int16_t>> gt_expected;
+  std::vector<std::vector<float>> ds_expected, gp_expected;
+  {
+    savvy::writer output("test_file_subset.sav", savvy::file::format::sav2, {{"contig","<ID=1>"},{"FORMAT","<ID=GT,Number=1,Type=String>"},{"FORMAT","<ID=DS,Number=1,Type=Float>"},{"FORMAT","<ID=GP,Number=G,Type=Float>"}}, ids);
+    for (std::size_t i = 0; i < 12; ++i)
+    {
+      bool make_sparse = i % 2;
+      std::vector<std::int16_t> gt(ids.size() * 2);
+      std::vector<float> ds(ids.size()), gp(ids.size() * 3);
+      for (std::size_t j = 0; j < gt.size(); ++j)
+        gt[j] = std::int16_t(rng() % 8 ? 0 : (i >= 8 ? 1000 : 1)); // wide values in last records
+      for (std::size_t j = 0; j < ds.size(); ++j)
+        ds[j] = rng() % 8 ? 0.f : float(rng() % 100) / 50.f;
+      for (std::size_t j = 0; j < gp.size(); ++j)
+        gp[j] = rng() % 8 ? 0.f : 0.5f;
+      if (i >= 10)
+      {
+        // Only first and last values set, so subset offsets exceed the range of the original offset type.
+        std::fill(gp.begin(), gp.end(), 0.f);
+        gp.front() = gp.back() = 1.f;
+      }
+
+      savvy::variant var("1", 100 + i, "A", {"C"});
+      if (make_sparse)
+      {
+        var.set_format("GT", savvy::compressed_vector<std::int16_t>(gt.begin(), gt.end()));
+        var.set_format("DS", savvy::compressed_vector<float>(ds.begin(), ds.end()));
+        var.set_format("GP", savvy::compressed_vector<float>(gp.begin(), gp.end()));
+      }
+      else
+      {
+        var.set_format("GT", gt);
+        var.set_format("DS", ds);
+        var.set_format("GP", gp);
+      }
+      output.write(var);
+
+      gt_expected.emplace_back(subset_expected(gt, keep));
+      ds_expected.emplace_back(subset_expected(ds, keep));
+      gp_expected.emplace_back(subset_expected(gp, keep));
+    }
+    assert(output.good());
+  }
+
+  savvy::reader input("test_file_subset.sav");
+  assert(input.subset_samples(subset).size() == subset.size());
+  savvy::variant var;
+  std::vector<std::int16_t> gt;
+  std::vector<float> ds, gp;
+  std::size_t cnt = 0;
+  while (input.read(var))
+  {
+    assert(var.get_format("GT", gt) && gt == gt_expected[cnt]);
+    assert(var.get_format("DS", ds) && ds == ds_expected[cnt]);
+    assert(var.get_format("GP", gp) && gp == gp_expected[cnt]);
+    ++cnt;
+  }
+
+  assert(!input.bad());
+  assert(cnt == gt_expected.size());
+}
+
+struct test_csc_matrix
+{
+  typedef std::uint32_t index_type;
+  typedef float value_type;
+
+  std::size_t rows = 0;
+  std::size_t cols = 0;
+  std::vector<index_type> col_ptrs;
+  std::vector<index_type> row_idx;
+  std::vector<value_type> vals;
+
+  void begin() { col_ptrs.assign(1, 0); }
+  void reserve(std::size_t nnz) { if (nnz > row_idx.size()) { row_idx.resize(nnz); vals.resize(nnz); } }
+  index_type* row_indices() { return row_idx.data(); }
+  value_type* values() { return vals.data(); }
+  void end_column(std::size_t, std::size_t nnz) { col_ptrs.push_back(index_type(nnz)); }
+  void end(std::size_t r, std::size_t c, std::size_t nnz) { rows = r; cols = c; row_idx.resize(nnz); vals.resize(nnz); }
+
+  std::vector<float> column(std::size_t c) const
+  {
+    std::vector<float> ret(rows);
+    for (std::size_t i = col_ptrs[c]; i < col_ptrs[c + 1]; ++i)
+      ret[row_idx[i]] = vals[i];
+    return ret;
+  }
+};
+
+bool same_values(const std::vector<float>& a, const std::vector<float>& b)
+{
+  if (a.size() != b.size())
+    return false;
+  for (std::size_t i = 0; i < a.size(); ++i)
+  {
+    if (!(a[i] == b[i] || (std::isnan(a[i]) && std::isnan(b[i]))))
+      return false;
+  }
+  return true;
+}
+
+void csc_matrix_test()
+{
+  std::vector<std::string> ids(150);
+  for (std::size_t i = 0; i < ids.size(); ++i)
+    ids[i] = "ID" + std::to_string(i);
+
+  std::mt19937_64 rng(50);
+  std::vector<std::vector<float>> ds_expected, ds_imputed;
+  std::vector<std::vector<std::int8_t>> gt_expected;
+  {
+    savvy::writer output("test_file_csc.sav", savvy::file::format::sav2, {{"contig","<ID=1>"},{"FORMAT","<ID=GT,Number=1,Type=String>"},{"FORMAT","<ID=DS,Number=1,Type=Float>"}}, ids);
+    for (std::size_t i = 0; i < 9; ++i)
+    {
+      std::vector<float> ds(ids.size());
+      std::vector<std::int8_t> gt(ids.size() * 2);
+      for (std::size_t j = 0; j < ds.size(); ++j)
+        ds[j] = rng() % 6 ? 0.f : (rng() % 4 ? float(rng() % 20) / 10.f : savvy::typed_value::missing_value<float>());
+      for (std::size_t j = 0; j < gt.size(); ++j)
+        gt[j] = std::int8_t(rng() % 5 ? 0 : (rng() % 3 ? 1 : savvy::typed_value::missing_value<std::int8_t>()));
+
+      double sum = 0.;
+      std::size_t cnt = 0;
+      std::vector<float> imputed(ds);
+      for (float v : ds)
+      {
+        if (!savvy::typed_value::is_missing(v))
+        {
+          sum += v;
+          ++cnt;
+        }
+      }
+      for (float& v : imputed)
+      {
+        if (savvy::typed_value::is_missing(v))
+          v = float(sum / cnt);
+      }
+
+      savvy::variant var("1", 100 + i, "A", {"C"});
+      if (i % 2)
+        var.set_format("DS", savvy::compressed_vector<float>(ds.begin(), ds.end()));
+      else
+        var.set_format("DS", ds);
+      if (i != 4) // record without GT is stored as empty column
+        var.set_format("GT", savvy::compressed_vector<std::int8_t>(gt.begin(), gt.end()));
+      else
+        gt.assign(gt.size(), 0);
+      output.write(var);
+
+      ds_expected.emplace_back(std::move(ds));
+      ds_imputed.emplace_back(std::move(imputed));
+      gt_expected.emplace_back(std::move(gt));
+    }
+    assert(output.good());
+  }
+
+  {
+    savvy::reader input("test_file_csc.sav");
+    test_csc_matrix ds_mat;
+    assert(input.read_csc_matrix("DS", 5, ds_mat) == 5);
+    assert(ds_mat.rows == ids.size() && ds_mat.cols == 5);
+    for (std::size_t c = 0; c < ds_mat.cols; ++c)
+      assert(same_values(ds_mat.column(c), ds_expected[c]));
+
+    assert(input.read_csc_matrix("DS", 100, ds_mat, true) == 4);
+    for (std::size_t c = 0; c < ds_mat.cols; ++c)
+      assert(same_values(ds_mat.column(c), ds_imputed[c + 5]));
+    assert(std::find(ds_mat.vals.begin(), ds_mat.vals.end(), 0.f) == ds_mat.vals.end());
+  }
+
+  {
+    savvy::reader input("test_file_csc.sav");
+    test_csc_matrix gt_mat;
+    assert(input.read_csc_matrix("GT", 100, gt_mat) == gt_expected.size());
+    assert(gt_mat.rows == ids.size() * 2);
+    for (std::size_t c = 0; c < gt_mat.cols; ++c)
+    {
+      std::vector<float> expected(gt_expected[c].begin(), gt_expected[c].end());
+      for (float& v : expected)
+      {
+        if (v < 0)
+          v = std::numeric_limits<float>::quiet_NaN();
+      }
+      assert(same_values(gt_mat.column(c), expected));
+    }
+  }
+}
+
+void stage_stats_test()
+{
+  typedef savvy::stage_stats::stage stage;
+  std::size_t cnt = 0;
+  savvy::stage_stats write_stats;
+  {
+    savvy::reader input(SAVVYT_VCF_FILE);
+    savvy::writer output("test_file_stage_stats.sav", savvy::file::format::sav2, input.headers(), input.samples());
+    savvy::variant var;
+    while (input >> var)
+    {
+      output << var;
+      ++cnt;
+    }
+    assert(output.good());
+    write_stats = output.stats();
+
+    assert(input.stats()[stage::vcf_parse].calls == (savvy::stage_stats::enabled() ? cnt + 1 : 0)); // includes EOF check
+  }
+
+  assert(write_stats[stage::serialize].calls == (savvy::stage_stats::enabled() ? cnt : 0));
+
+  savvy::reader opened("test_file_stage_stats.sav");
+  savvy::reader input(std::move(opened)); // Read counters must follow the reader when it is moved.
+  input.subset_samples({input.samples().front()});
+  savvy::variant var;
+  while (input >> var) {}
+
+  const savvy::stage_stats& s = input.stats();
+  if (savvy::stage_stats::enabled())
+  {
+    assert(s[stage::deserialize_shared].calls == cnt);
+    assert(s[stage::deserialize_indiv].calls == cnt);
+    assert(s[stage::subset].calls == cnt);
+    assert(s[stage::read].bytes > 0);
+  }
+  else
+  {
+    assert(s.empty());
+  }
+}
+
 int main(int argc, char** argv)
 {
   std::string cmd = (argc < 2) ? "" : argv[1];
@@ -841,6 +2047,10 @@ int main(int argc, char** argv)
     std::cout << "- varint" << std::endl;
     std::cout << "- stride-reduce" << std::endl;
     std::cout << "- missing-headers" << std::endl;
+    std::cout << "- pbwt" << std::endl;
+    std::cout << "- haplotype-matching" << std::endl;
+    std::cout << "- zone-map" << std::endl;
+    std::cout << "- id-index" << std::endl;
     std::cin >> cmd;
   }
 
@@ -891,6 +2101,62 @@ int main(int argc, char** argv)
   {
     missing_headers_test();
   }
+  else if (cmd == "pbwt")
+  {
+    pbwt_test();
+  }
+  else if (cmd == "haplotype-matching")
+  {
+    haplotype_matching_test();
+  }
+  else if (cmd == "zone-map")
+  {
+    zone_map_test();
+  }
+  else if (cmd == "id-index")
+  {
+    id_index_test();
+  }
+  else if (cmd == "concat-samples")
+  {
+    concat_samples_test();
+  }
+  else if (cmd == "reorder-samples")
+  {
+    reorder_samples_test();
+  }
+  else if (cmd == "sparse-conversion")
+  {
+    sparse_conversion_test();
+  }
+  else if (cmd == "type-minimization")
+  {
+    type_minimization_test();
+  }
+  else if (cmd == "stage-stats")
+  {
+    stage_stats_test();
+  }
+  else if (cmd == "packed-genotypes")
+  {
+    packed_genotypes_test();
+  }
+  else if (cmd == "typed-value-view")
+  {
+    typed_value_view_test();
+  }
+  else if (cmd == "small-buffer")
+  {
+    small_buffer_test();
+  }
+  else if (cmd == "subset-kernels")
+  {
+    subset_kernels_test();
+  }
+  else if (cmd == "csc-matrix")
+  {
+    csc_matrix_test();
+  }
   else
   {
     std::cerr << "Invalid Command" << std::endl;